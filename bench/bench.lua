@@ -0,0 +1,648 @@
+-- Benchmarks for the editor's hot paths, run headless by `make bench`.
+-- Every benchmark times a number of iterations of the same operation
+-- over generated corpora and reports throughput along with the p50/p99
+-- iteration latency. Results go to stdout as JSON, progress to stderr.
+--
+-- Arguments are Lua patterns, only benchmarks whose name matches one of
+-- them are run.
+
+local core = require "core"
+local common = require "core.common"
+local tokenizer = require "core.tokenizer"
+local syntax = require "core.syntax"
+local Doc = require "core.doc"
+local search = require "core.doc.search"
+
+require "plugins.language_c"
+require "plugins.language_js"
+require "plugins.language_lua"
+
+-- the highlighters register their threads here, they never run
+core.threads = setmetatable({}, { __mode = "k" })
+core.redraw = false
+
+
+local filters = { table.unpack(ARGS, 2) }
+local results = {}
+
+
+local function log(fmt, ...)
+  io.stderr:write(string.format(fmt, ...), "\n")
+end
+
+
+local function selected(name)
+  if #filters == 0 then return true end
+  for _, pattern in ipairs(filters) do
+    if name:find(pattern) then return true end
+  end
+  return false
+end
+
+
+local function percentile(sorted, p)
+  local idx = math.max(1, math.ceil(#sorted * p))
+  return sorted[idx]
+end
+
+
+-- Runs `fn(i)` `iterations` times. `fn` returns the amount of work the
+-- iteration did in `unit`s (bytes, lines...), 1 if it returns nothing.
+local function bench(name, unit, iterations, fn, setup)
+  if not selected(name) then return end
+  if setup then setup() end
+  collectgarbage()
+
+  local times, work = {}, 0
+  local start = system.get_time()
+  for i = 1, iterations do
+    local t = system.get_time()
+    work = work + (fn(i) or 1)
+    times[i] = system.get_time() - t
+  end
+  local total = system.get_time() - start
+
+  table.sort(times)
+  local result = {
+    name = name,
+    iterations = iterations,
+    total_ms = total * 1000,
+    p50_ms = percentile(times, 0.50) * 1000,
+    p99_ms = percentile(times, 0.99) * 1000,
+    max_ms = times[#times] * 1000,
+    throughput = work / total,
+    unit = unit .. "/s",
+  }
+  table.insert(results, result)
+  log("%-28s %10.3fms p50 %10.3fms p99 %14.1f %s",
+    name, result.p50_ms, result.p99_ms, result.throughput, result.unit)
+end
+
+
+-------------------------------------------------------------------------------
+-- corpora
+-------------------------------------------------------------------------------
+
+-- Park-Miller, so every run works on the same corpora
+local seed = 1
+local function rand(n)
+  seed = (seed * 16807) % 2147483647
+  return seed % n + 1
+end
+
+local words = {
+  "buffer", "count", "index", "value", "node", "state", "line", "text",
+  "result", "size", "next", "prev", "data", "len", "flags", "item",
+}
+
+local function ident()
+  return words[rand(#words)] .. "_" .. words[rand(#words)]
+end
+
+local function fill(template)
+  return (template:gsub("%$(%a)", function(c)
+    if c == "I" then return ident() end
+    if c == "N" then return tostring(rand(100000)) end
+  end))
+end
+
+local templates = {
+  c = [[
+/* compute $I for the given $I */
+static int $I(struct $I *$I, int $I) {
+    int $I = $N;
+    for (int i = 0; i < $I; i++) {
+        if ($I[i] == 'x') { $I += 0x$N; }
+        printf("$I %d\n", $I);
+    }
+    return $I;
+}
+
+]],
+  js = [[
+// compute $I for the given $I
+function $I($I, $I) {
+  const $I = $N;
+  for (let i = 0; i < $I.length; i++) {
+    if ($I[i] === 'x') { $I += $N.5; }
+    console.log(`$I ${$I}`, "$I");
+  }
+  return $I;
+}
+
+]],
+  lua = [[
+-- compute $I for the given $I
+local function $I($I, $I)
+  local $I = $N
+  for i = 1, #$I do
+    if $I[i] == 'x' then $I = $I + 0x$N end
+    print(string.format("$I %d", $I))
+  end
+  return $I
+end
+
+]],
+}
+
+local function generate(kind, lines)
+  local t, n = {}, 0
+  while n < lines do
+    local chunk = fill(templates[kind])
+    table.insert(t, chunk)
+    n = n + select(2, chunk:gsub("\n", ""))
+  end
+  return table.concat(t)
+end
+
+local function split_lines(text)
+  local lines = {}
+  for line in text:gmatch("[^\n]*\n") do
+    table.insert(lines, line)
+  end
+  return lines
+end
+
+local root = os.tmpname()
+os.remove(root)
+
+local function shell(fmt, ...)
+  local cmd = string.format(fmt, ...)
+  if PATHSEP == "\\" then cmd = cmd:gsub("mkdir %-p", "mkdir") end
+  assert(os.execute(cmd), cmd)
+end
+
+local function write_file(filename, text)
+  local fp = assert(io.open(filename, "wb"))
+  fp:write(text)
+  fp:close()
+end
+
+local function cleanup()
+  if PATHSEP == "\\" then
+    os.execute(string.format('rmdir /s /q "%s"', root))
+  else
+    os.execute(string.format("rm -rf %q", root))
+  end
+end
+
+shell("mkdir -p %q", root)
+
+log("generating corpora in %s", root)
+local corpus = {}
+for _, kind in ipairs { "c", "js", "lua" } do
+  local text = generate(kind, 100000)
+  local filename = root .. PATHSEP .. "corpus." .. kind
+  write_file(filename, text)
+  corpus[kind] = { text = text, lines = split_lines(text), filename = filename }
+end
+
+-- 2MB of code on a single line, and an unterminated string as long
+local long_line = generate("c", 50000):gsub("\n", " "):sub(1, 2 * 1024 * 1024) .. "\n"
+local long_string = '"' .. long_line:gsub('"', "'")
+local long_filename = root .. PATHSEP .. "long.c"
+write_file(long_filename, long_line)
+
+
+-------------------------------------------------------------------------------
+-- tokenizer
+-------------------------------------------------------------------------------
+
+for _, kind in ipairs { "c", "js", "lua" } do
+  local c = corpus[kind]
+  local syn = syntax.get(c.filename, "")
+  local chunk = 1000
+  bench("tokenize/" .. kind, "bytes", math.floor(#c.lines / chunk), function(i)
+    local state, bytes = nil, 0
+    for j = (i - 1) * chunk + 1, i * chunk do
+      local line = c.lines[j]
+      local _
+      _, state = tokenizer.tokenize(syn, line, state)
+      bytes = bytes + #line
+    end
+    return bytes
+  end)
+end
+
+local c_syntax = syntax.get(corpus.c.filename, "")
+
+bench("tokenize/long_line", "bytes", 5, function()
+  tokenizer.tokenize(c_syntax, long_line)
+  return #long_line
+end)
+
+bench("tokenize/long_string", "bytes", 5, function()
+  tokenizer.tokenize(c_syntax, long_string)
+  return #long_string
+end)
+
+
+-------------------------------------------------------------------------------
+-- doc
+-------------------------------------------------------------------------------
+
+local doc
+
+local function load_doc(filename)
+  return function()
+    doc = Doc(filename)
+    seed = 1
+  end
+end
+
+local function random_position()
+  local line = rand(#doc.lines)
+  return line, rand(#doc.lines[line])
+end
+
+bench("doc/raw_insert_char", "ops", 20000, function()
+  local line, col = random_position()
+  doc:raw_insert(line, col, "x", doc.undo_stack, system.get_time())
+end, load_doc(corpus.c.filename))
+
+local paste = table.concat(corpus.lua.lines, "", 1, 50)
+bench("doc/raw_insert_paste", "bytes", 500, function()
+  local line, col = random_position()
+  doc:raw_insert(line, col, paste, doc.undo_stack, system.get_time())
+  return #paste
+end, load_doc(corpus.c.filename))
+
+bench("doc/raw_remove_char", "ops", 2000, function()
+  local line, col = random_position()
+  doc:raw_remove(line, col, line, col + 1, doc.undo_stack, system.get_time())
+end, load_doc(corpus.c.filename))
+
+bench("doc/raw_insert_long_line", "ops", 2000, function()
+  local col = rand(#doc.lines[1])
+  doc:raw_insert(1, col, "x", doc.undo_stack, system.get_time())
+end, load_doc(long_filename))
+
+-- edits every 100th line, only those go through the undo history
+bench("doc/replace_lines", "bytes", 5, function(i)
+  doc:replace(function(text)
+    local n = i
+    return (text:gsub("\n", function()
+      n = n + 1
+      if n % 100 == 0 then return " \n" end
+    end))
+  end)
+  return #corpus.c.text
+end, load_doc(corpus.c.filename))
+
+-- edited first, so the save gathers many pieces
+bench("doc/save", "bytes", 10, function()
+  doc:save(root .. PATHSEP .. "saved.c", true)
+  return doc.lines:get_size()
+end, function()
+  load_doc(corpus.c.filename)()
+  for _ = 1, 1000 do
+    local line, col = random_position()
+    doc:insert(line, col, "x")
+  end
+end)
+
+bench("doc/save_crlf", "bytes", 10, function()
+  doc:save(root .. PATHSEP .. "saved.c", true)
+  return doc.lines:get_size()
+end, function()
+  load_doc(corpus.c.filename)()
+  doc.crlf = true
+end)
+
+
+-------------------------------------------------------------------------------
+-- highlight
+-------------------------------------------------------------------------------
+
+-- runs the highlighter's jobs over the whole doc, the way its thread
+-- would if nothing else was going on
+local function highlight_doc()
+  local h = doc.highlighter
+  h.max_wanted_line = #doc.lines
+  while h:update() do end
+end
+
+bench("highlight/full", "lines", 5, function()
+  doc.highlighter:reset()
+  highlight_doc()
+  return #doc.lines
+end, load_doc(corpus.c.filename))
+
+-- an edit in a highlighted doc, the lines past it keep their states
+bench("highlight/edit_char", "ops", 500, function()
+  local line, col = random_position()
+  doc:raw_insert(line, col, "x", doc.undo_stack, system.get_time())
+  highlight_doc()
+end, function()
+  load_doc(corpus.c.filename)()
+  highlight_doc()
+end)
+
+bench("highlight/edit_newline", "ops", 500, function()
+  local line, col = random_position()
+  doc:raw_insert(line, col, "\n", doc.undo_stack, system.get_time())
+  highlight_doc()
+end, function()
+  load_doc(corpus.c.filename)()
+  highlight_doc()
+end)
+
+-- opens and closes a comment at the top of a doc whose comment ends past
+-- the lines applied by a poll, every line has to change state; the
+-- states are checked against tokenizing the whole doc
+local comment_filename = root .. PATHSEP .. "comment.c"
+local comment_lines = {}
+for i = 1, 6000 do
+  comment_lines[i] = i == 4050 and "x */ y;" or "int x;"
+end
+write_file(comment_filename, table.concat(comment_lines, "\n") .. "\n")
+
+bench("highlight/edit_comment", "lines", 20, function(i)
+  if i % 2 == 1 then
+    doc:raw_insert(1, 1, "/*\n", doc.undo_stack, system.get_time())
+  else
+    doc:raw_remove(1, 1, 2, 1, doc.undo_stack, system.get_time())
+  end
+  highlight_doc()
+  local syn, state = syntax.get(comment_filename, ""), nil
+  for n = 1, #doc.lines do
+    local _
+    _, state = tokenizer.tokenize(syn, doc.lines[n], state)
+    assert((doc.highlighter.lines[n].state or 0) == (state or 0),
+      "wrong highlighting state at line " .. n)
+  end
+  return #doc.lines
+end, function()
+  load_doc(comment_filename)()
+  highlight_doc()
+end)
+
+
+-------------------------------------------------------------------------------
+-- search
+-------------------------------------------------------------------------------
+
+-- the needles don't occur, every find goes through the whole document
+-- literal finds drop the doc's match sets first, so the whole doc is
+-- searched every time
+bench("search/find", "bytes", 20, function()
+  doc.matches = {}
+  search.find(doc, 1, 1, "missing_word")
+  return #corpus.c.text
+end, load_doc(corpus.c.filename))
+
+bench("search/find_no_case", "bytes", 20, function()
+  doc.matches = {}
+  search.find(doc, 1, 1, "Missing_Word", { no_case = true })
+  return #corpus.c.text
+end, load_doc(corpus.c.filename))
+
+bench("search/find_next", "ops", 20000, function()
+  local line, col = random_position()
+  search.find(doc, line, col, "return", { wrap = true })
+end, load_doc(corpus.c.filename))
+
+bench("search/update_char", "ops", 20000, function()
+  local line, col = random_position()
+  doc:raw_insert(line, col, "x", doc.undo_stack, system.get_time())
+end, function()
+  load_doc(corpus.c.filename)()
+  search.get_matches(doc, "return")
+end)
+
+bench("search/find_pattern", "bytes", 20, function()
+  search.find(doc, 1, 1, "missing_%w+%(", { pattern = true })
+  return #corpus.c.text
+end, load_doc(corpus.c.filename))
+
+bench("search/find_regex", "bytes", 20, function()
+  search.find(doc, 1, 1, "missing_\\w+\\(", { regex = true })
+  return #corpus.c.text
+end, load_doc(corpus.c.filename))
+
+bench("search/find_regex_no_case", "bytes", 20, function()
+  search.find(doc, 1, 1, "\\bMissing_(\\w+|\\d+)\\b", { regex = true, no_case = true })
+  return #corpus.c.text
+end, load_doc(corpus.c.filename))
+
+bench("search/replace_regex", "bytes", 10, function()
+  local re = regex.compile("(\\w+)\\(")
+  re:gsub(corpus.c.text, "\\1 (")
+  return #corpus.c.text
+end)
+
+bench("search/find_long_line", "bytes", 20, function()
+  doc.matches = {}
+  search.find(doc, 1, 1, "missing_word")
+  return #long_line
+end, load_doc(long_filename))
+
+doc = nil
+
+
+-------------------------------------------------------------------------------
+-- diff
+-------------------------------------------------------------------------------
+
+local line_diff
+
+local function load_diff()
+  load_doc(corpus.c.filename)()
+  line_diff = diff.new(corpus.c.text)
+end
+
+bench("diff/reset", "lines", 5, function()
+  line_diff:reset(doc.lines)
+  return #doc.lines
+end, function()
+  load_diff()
+  -- one change every 50 lines to diff against
+  for i = 1, 2000 do
+    local line, col = random_position()
+    doc:raw_insert(line, col, "x", doc.undo_stack, system.get_time())
+  end
+end)
+
+bench("diff/update_char", "ops", 20000, function()
+  local line, col = random_position()
+  doc:raw_insert(line, col, "x", doc.undo_stack, system.get_time())
+  line_diff:update(doc.lines, line, 1, 1)
+end, function()
+  load_diff()
+  line_diff:reset(doc.lines)
+end)
+
+bench("diff/update_paste", "ops", 500, function()
+  local line, col = random_position()
+  doc:raw_insert(line, col, paste, doc.undo_stack, system.get_time())
+  line_diff:update(doc.lines, line, 1, 51)
+end, function()
+  load_diff()
+  line_diff:reset(doc.lines)
+end)
+
+doc, line_diff = nil, nil
+
+
+-------------------------------------------------------------------------------
+-- symbols
+-------------------------------------------------------------------------------
+
+local index, doc_symbols
+
+local function load_index()
+  load_doc(corpus.c.filename)()
+  index = symbols.new("[%a_][%w_]*")
+  doc_symbols = index:add_doc()
+  doc_symbols:reset(doc.lines)
+end
+
+bench("symbols/scan", "lines", 1, function()
+  doc_symbols:scan(doc.lines, #doc.lines)
+  return #doc.lines
+end, load_index)
+
+bench("symbols/update_char", "ops", 20000, function()
+  local line, col = random_position()
+  doc:raw_insert(line, col, "x", doc.undo_stack, system.get_time())
+  doc_symbols:update(doc.lines, line, 1, 1)
+end, function()
+  load_index()
+  doc_symbols:scan(doc.lines, #doc.lines)
+end)
+
+-- an identifier typed one character at a time
+local partial = "index_value"
+bench("symbols/match", "ops", #partial, function(i)
+  index:match(partial:sub(1, i), 6)
+end, function()
+  load_index()
+  doc_symbols:scan(doc.lines, #doc.lines)
+end)
+
+doc, index, doc_symbols = nil, nil, nil
+
+
+-------------------------------------------------------------------------------
+-- project
+-------------------------------------------------------------------------------
+
+-- 10 x 100 directories of 100 files
+local tree = root .. PATHSEP .. "tree"
+local tree_files = {}
+
+local function make_tree()
+  if #tree_files > 0 then return end
+  log("generating 100k files tree")
+  for i = 1, 10 do
+    local dirs = {}
+    for j = 1, 100 do
+      table.insert(dirs, string.format("%q", table.concat({ tree, ident() .. i, ident() .. j }, PATHSEP)))
+    end
+    shell("mkdir -p %s", table.concat(dirs, " "))
+    for _, dir in ipairs(dirs) do
+      dir = dir:sub(2, -2)
+      for k = 1, 100 do
+        local filename = string.format("%s%s%s_%d.%s", dir, PATHSEP, ident(), k, ({ "c", "h", "lua", "js" })[rand(4)])
+        local fp = assert(io.open(filename, "wb"))
+        fp:close()
+        table.insert(tree_files, filename:sub(#tree + 2))
+      end
+    end
+  end
+end
+
+bench("project/scan", "files", 3, function()
+  local scanner = system.scan_project(tree, {}, 1)
+  local files = {}
+  repeat
+    system.sleep(0.001)
+  until scanner:poll(files)
+  return #files
+end, make_tree)
+
+-- the names are typed one character at a time, like in the find file
+-- command view
+local needles = { "buffer/node", "statecount", "lua", "index_value_12" }
+local keystrokes = {}
+for _, needle in ipairs(needles) do
+  for i = 1, #needle do
+    table.insert(keystrokes, needle:sub(1, i))
+  end
+end
+
+-- the corpus is kept per list, every iteration gets a new one
+local copies = {}
+bench("fuzzy/cold", "files", 5, function(i)
+  common.fuzzy_match(copies[i], "node", 10)
+  return #tree_files
+end, function()
+  make_tree()
+  for i = 1, 5 do
+    copies[i] = {}
+    for j, filename in ipairs(tree_files) do copies[i][j] = filename end
+  end
+end)
+copies = nil
+
+bench("fuzzy/keystroke", "ops", #keystrokes, function(i)
+  common.fuzzy_match(tree_files, keystrokes[i], 10)
+end, function()
+  make_tree()
+  common.fuzzy_match(tree_files, "", 10)
+end)
+
+cleanup()
+
+
+-------------------------------------------------------------------------------
+-- startup
+-------------------------------------------------------------------------------
+
+-- every module the editor embeds, loaded without running it: from the
+-- sources as with TSUNADE_DEV set, then from the bytecode
+local modnames = embedded.list("")
+
+bench("startup/load_source", "modules", 20, function()
+  for _, modname in ipairs(modnames) do
+    assert(loadfile(assert(package.searchpath(modname, package.path))))
+  end
+  return #modnames
+end)
+
+bench("startup/load_embedded", "modules", 20, function()
+  for _, modname in ipairs(modnames) do
+    assert(embedded.load(modname))
+  end
+  return #modnames
+end)
+
+
+-------------------------------------------------------------------------------
+-- output
+-------------------------------------------------------------------------------
+
+local function encode(v)
+  if type(v) == "table" then
+    local t = {}
+    if #v > 0 then
+      for _, x in ipairs(v) do table.insert(t, encode(x)) end
+      return "[\n" .. table.concat(t, ",\n") .. "\n]"
+    end
+    local keys = {}
+    for k in pairs(v) do table.insert(keys, k) end
+    table.sort(keys)
+    for _, k in ipairs(keys) do
+      table.insert(t, string.format("%q: %s", k, encode(v[k])))
+    end
+    return "{ " .. table.concat(t, ", ") .. " }"
+  elseif type(v) == "number" then
+    return string.format("%.6g", v)
+  end
+  return string.format("%q", tostring(v))
+end
+
+print(encode {
+  version = VERSION,
+  benchmarks = results,
+})
@@ -0,0 +1,45 @@
+// Headless bench runner. Runs bench/bench.lua with the editor's Lua API
+// built from the same sources, on top of the window and GPU stubs in
+// bench/stubs.c. Results are printed to stdout as JSON.
+
+#include "../src/api/api.h"
+
+#include <stdio.h>
+
+int main(int argc, char **argv) {
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    api_load_libs(L);
+
+    lua_newtable(L);
+    for (int i = 0; i < argc; i++) {
+        lua_pushstring(L, argv[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setglobal(L, "ARGS");
+
+    lua_pushstring(L, "1.11");
+    lua_setglobal(L, "VERSION");
+
+    lua_pushstring(L, "Bench");
+    lua_setglobal(L, "PLATFORM");
+
+    lua_pushnumber(L, 1);
+    lua_setglobal(L, "SCALE");
+
+    lua_pushstring(L, argv[0]);
+    lua_setglobal(L, "EXEFILE");
+
+    int err = luaL_dostring(L,
+        "PATHSEP = package.config:sub(1, 1)\n"
+        "EXEDIR = EXEFILE:match(\"^(.+)[/\\\\].*$\") or \".\"\n"
+        "package.path = EXEDIR .. '/data/?.lua;' .. package.path\n"
+        "package.path = EXEDIR .. '/data/?/init.lua;' .. package.path\n"
+        "dofile(EXEDIR .. '/bench/bench.lua')\n");
+    if (err) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    }
+
+    lua_close(L);
+    return err ? 1 : 0;
+}
@@ -0,0 +1,111 @@
+// Window and GPU stand-ins for the bench runner. Fonts measure every
+// codepoint as 7 pixels wide and drawing does nothing, the rest of the
+// editor runs for real.
+
+#include <sokol_app.h>
+#include "../src/renderer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CHAR_WIDTH 7
+#define LINE_HEIGHT 14
+
+static char clipboard[4096];
+
+int sapp_width(void) { return 1280; }
+int sapp_height(void) { return 720; }
+void sapp_set_mouse_cursor(sapp_mouse_cursor cursor) { (void)cursor; }
+void sapp_set_window_title(const char *title) { (void)title; }
+const char* sapp_get_clipboard_string(void) { return clipboard; }
+
+void sapp_set_clipboard_string(const char *str) {
+    strncpy(clipboard, str, sizeof(clipboard) - 1);
+}
+
+void ren_init(void) {}
+void ren_shutdown(void) {}
+void ren_begin_frame(void) {}
+void ren_end_frame(void) {}
+void ren_present(void) {}
+void ren_invalidate(void) {}
+void ren_show_debug(bool show) { (void)show; }
+void ren_set_clip_rect(RenRect rect) { (void)rect; }
+
+void ren_get_size(int *x, int *y) {
+    *x = sapp_width();
+    *y = sapp_height();
+}
+
+RenFont* ren_load_font(const char *filename, float size) {
+    (void)filename;
+    RenFont *font = calloc(1, sizeof(RenFont));
+    if (!font) return NULL;
+    font->size = size;
+    font->tab_width = 4;
+    return font;
+}
+
+void ren_free_font(RenFont *font) { free(font); }
+void ren_set_font_tab_width(RenFont *font, int n) { font->tab_width = n; }
+int ren_get_font_tab_width(RenFont *font) { return font->tab_width; }
+int ren_get_font_height(RenFont *font) { (void)font; return LINE_HEIGHT; }
+
+static bool is_cont(char c) {
+    return (c & 0xc0) == 0x80;
+}
+
+static int text_width(const char *text, int len) {
+    int width = 0;
+    for (int i = 0; i < len; i++) {
+        if (!is_cont(text[i])) { width += CHAR_WIDTH; }
+    }
+    return width;
+}
+
+int ren_get_font_width(RenFont *font, const char *text) {
+    (void)font;
+    return text_width(text, strlen(text));
+}
+
+void ren_get_font_offsets(RenFont *font, const char *text, int len, int *offsets) {
+    (void)font;
+    int x = 0;
+    for (int i = 0; i < len; i++) {
+        offsets[i] = x;
+        if (!is_cont(text[i])) { x += CHAR_WIDTH; }
+    }
+    offsets[len] = x;
+}
+
+int ren_get_font_col(RenFont *font, const char *text, int len, float x) {
+    (void)font;
+    int col = (int)(x / CHAR_WIDTH + 0.5f);
+    int i = 0;
+    while (i < len && col > 0) {
+        i++;
+        while (i < len && is_cont(text[i])) { i++; }
+        col--;
+    }
+    return i < len ? i + 1 : len;
+}
+
+void ren_draw_rect(RenRect rect, RenColor color) {
+    (void)rect;
+    (void)color;
+}
+
+int ren_draw_text(RenFont *font, const char *text, int x, int y, RenColor color) {
+    (void)y;
+    (void)color;
+    return x + ren_get_font_width(font, text);
+}
+
+int ren_draw_tokens(RenFont *font, const RenToken *tokens, int count, int x, int y) {
+    (void)font;
+    (void)y;
+    for (int i = 0; i < count; i++) {
+        x += text_width(tokens[i].text, tokens[i].len);
+    }
+    return x;
+}
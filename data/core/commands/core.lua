@@ -6,6 +6,23 @@ local LogView = require "core.logview"
 
 
 local fullscreen = false
+local show_debug = false
+
+-- the names are kept for as long as the project files don't change, so
+-- the fuzzy matcher can keep its corpus between keystrokes
+local filenames, filenames_version
+
+local function get_project_filenames()
+  if filenames_version ~= core.project_files_version then
+    filenames, filenames_version = {}, core.project_files_version
+    for _, item in ipairs(core.project_files) do
+      if item.type == "file" then
+        table.insert(filenames, item.filename)
+      end
+    end
+  end
+  return filenames
+end
 
 command.add(nil, {
   ["core:quit"] = function()
@@ -59,13 +76,8 @@ command.add(nil, {
       text = item and item.text or text
       core.root_view:open_doc(core.open_doc(text))
     end, function(text)
-      local files = {}
-      for _, item in pairs(core.project_files) do
-        if item.type == "file" then
-          table.insert(files, item.filename)
-        end
-      end
-      return common.fuzzy_match(files, text)
+      return common.fuzzy_match(get_project_filenames(), text,
+        core.command_view.max_suggestions)
     end)
   end,
 
@@ -79,6 +91,23 @@ command.add(nil, {
     end, common.path_suggest)
   end,
 
+  ["core:toggle-debug-overlay"] = function()
+    show_debug = not show_debug
+    renderer.show_debug(show_debug)
+  end,
+
+  ["core:save-trace"] = function()
+    core.command_view:enter("Save Trace To", function(filename)
+      local ok, err = profiler.save_trace(filename)
+      if ok then
+        core.log("Saved trace to %q", filename)
+      else
+        core.error("Couldn't save trace: %s", err)
+      end
+    end, common.path_suggest)
+    core.command_view:set_text("trace.json")
+  end,
+
   ["core:open-log"] = function()
     local node = core.root_view:get_active_node()
     node:add_view(LogView())
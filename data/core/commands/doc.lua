@@ -58,8 +58,10 @@ end
 
 
 local function save(filename)
-  doc():save(filename)
-  core.log("Saved \"%s\"", doc().filename)
+  -- big docs log it once saved
+  if doc():save(filename) then
+    core.log("Saved \"%s\"", doc().filename)
+  end
 end
 
 
@@ -29,7 +29,8 @@ local function push_previous_find(doc, sel)
 end
 
 
-local function find(label, search_fn)
+-- `count_fn`, if any, tells how many matches there are once found.
+local function find(label, search_fn, count_fn)
   local dv = core.active_view
   local sel = { dv.doc:get_selection() }
   local text = dv.doc:get_text(table.unpack(sel))
@@ -42,6 +43,9 @@ local function find(label, search_fn)
       last_fn, last_text = search_fn, text
       previous_finds = {}
       push_previous_find(dv.doc, sel)
+      if count_fn then
+        core.log("Found %d match(es) of %q", count_fn(dv.doc, text), text)
+      end
     else
       core.error("Couldn't find %q", text)
       dv.doc:set_selection(table.unpack(sel))
@@ -96,20 +100,30 @@ command.add(has_selection, {
     local text = doc():get_text(l1, c1, l2, c2)
     local l1, c1, l2, c2 = search.find(doc(), l2, c2, text, { wrap = true })
     if l2 then doc():set_selection(l2, c2, l1, c1) end
-  end
+  end,
+
+  ["find-replace:select-previous"] = function()
+    local l1, c1, l2, c2 = doc():get_selection(true)
+    local text = doc():get_text(l1, c1, l2, c2)
+    local opt = { wrap = true, reverse = true }
+    local l1, c1, l2, c2 = search.find(doc(), l1, c1, text, opt)
+    if l2 then doc():set_selection(l2, c2, l1, c1) end
+  end,
 })
 
 command.add("core.docview", {
   ["find-replace:find"] = function()
+    local opt = { wrap = true, no_case = true }
     find("Find Text", function(doc, line, col, text)
-      local opt = { wrap = true, no_case = true }
       return search.find(doc, line, col, text, opt)
+    end, function(doc, text)
+      return search.count(doc, text, opt)
     end)
   end,
 
   ["find-replace:find-pattern"] = function()
     find("Find Text Pattern", function(doc, line, col, text)
-      local opt = { wrap = true, no_case = true, pattern = true }
+      local opt = { wrap = true, no_case = true, regex = true }
       return search.find(doc, line, col, text, opt)
     end)
   end,
@@ -139,14 +153,14 @@ command.add("core.docview", {
   end,
 
   ["find-replace:replace"] = function()
-    replace("Text", "", function(text, old, new)
-      return text:gsub(old:gsub("%W", "%%%1"), new:gsub("%%", "%%%%"), nil)
+    replace("Text", "", function(_, old, new)
+      return search.replace(doc(), old, new)
     end)
   end,
 
   ["find-replace:replace-pattern"] = function()
     replace("Pattern", "", function(text, old, new)
-      return text:gsub(old, new)
+      return assert(regex.compile(old)):gsub(text, new)
     end)
   end,
 
@@ -15,7 +15,7 @@ end
 
 local CommandView = DocView:extend()
 
-local max_suggestions = 10
+CommandView.max_suggestions = 10
 
 local noop = function() end
 
@@ -178,7 +178,7 @@ function CommandView:update_suggestions()
   local t = self.state.suggest(self:get_text()) or {}
   local res = {}
   for i, item in ipairs(t) do
-    if i == max_suggestions then
+    if i == self.max_suggestions then
       break
     end
     if type(item) == "string" then
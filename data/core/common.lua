@@ -54,29 +54,13 @@ function common.color(str)
 end
 
 
-local function compare_score(a, b)
-  return a.score > b.score
-end
-
-local function fuzzy_match_items(items, needle)
-  local res = {}
-  for _, item in ipairs(items) do
-    local score = system.fuzzy_match(tostring(item), needle)
-    if score then
-      table.insert(res, { text = item, score = score })
-    end
-  end
-  table.sort(res, compare_score)
-  for i, item in ipairs(res) do
-    res[i] = item.text
-  end
-  return res
-end
-
-
-function common.fuzzy_match(haystack, needle)
+-- When `haystack` is an array, returns its `k` best matching items,
+-- best first, or all of them when `k` is nil. The array is indexed once
+-- and the index reused while its length stays the same, so pass a new
+-- array whenever any of its items change.
+function common.fuzzy_match(haystack, needle, k)
   if type(haystack) == "table" then
-    return fuzzy_match_items(haystack, needle)
+    return system.fuzzy_rank(haystack, needle, k)
   end
   return system.fuzzy_match(haystack, needle)
 end
@@ -128,7 +112,9 @@ end
 
 function common.bench(name, fn, ...)
   local start = system.get_time()
+  profiler.begin_zone(name)
   local res = fn(...)
+  profiler.end_zone()
   local t = system.get_time() - start
   local ms = t * 1000
   local per = (t / (1 / 60)) * 100
@@ -1,56 +1,135 @@
 local core = require "core"
-local config = require "core.config"
 local tokenizer = require "core.tokenizer"
 local Object = require "core.object"
 
 
 local Highlighter = Object:extend()
 
+-- lines applied from the worker threads' results per step
+local POLL_LINES = 4000
+
+-- lines past an edit a job compares with the last pass, to stop once
+-- the edit no longer changes their states
+local CONVERGE_LINES = 4096
+
 
 function Highlighter:new(doc)
   self.doc = doc
+  self.visible_first = 0
+  self.visible_last = 0
   self:reset()
 
-  -- init incremental syntax highlighting
+  -- init incremental syntax highlighting, the lines are tokenized on
+  -- worker threads and the results applied here as they come in. With
+  -- nothing left to do the thread sleeps until there is again
   core.add_thread(function()
     while true do
-      if self.first_invalid_line > self.max_wanted_line then
-        self.max_wanted_line = 0
-        coroutine.yield(1 / config.fps)
-
-      else
-        local max = math.min(self.first_invalid_line + 40, self.max_wanted_line)
-
-        for i = self.first_invalid_line, max do
-          local state = (i > 1) and self.lines[i - 1].state
-          local line = self.lines[i]
-          if not (line and line.init_state == state) then
-            self.lines[i] = self:tokenize_line(i, state)
-          end
-        end
-
-        self.first_invalid_line = max + 1
-        core.redraw = true
+      if self:update() then
         coroutine.yield()
+      else
+        coroutine.yield(math.huge)
       end
     end
   end, self)
 end
 
 
+-- Returns true while there is a job running.
+function Highlighter:update()
+  if self.job then
+    local line, done, converged = self.job:poll(self.lines, POLL_LINES)
+    if line then
+      self.first_invalid_line = line + 1
+      self.resume_line = math.max(self.resume_line, line + 1)
+      core.redraw = true
+    end
+    if done then
+      self.job = nil
+      if converged then
+        self.first_invalid_line = self.resume_line
+        self.edit_last = 0
+      end
+    end
+    return true
+  end
+
+  local first = self.first_invalid_line
+  local last = math.min(self.max_wanted_line, #self.doc.lines)
+  if first > last then
+    self.max_wanted_line = 0
+    return false
+  end
+
+  -- the lines past the edited ones and before `resume_line` have the
+  -- states of the last pass
+  local prev = self.lines[first - 1]
+  local state = first > 1 and prev and prev.state or nil
+  local cached_first = math.max(first, self.edit_last + 1)
+  local cached_last = math.min(last, self.resume_line - 1, cached_first + CONVERGE_LINES - 1)
+  self.job = tokenizer.compile(self.doc.syntax):highlight(self.doc.lines,
+    first, last, state, self.visible_first, self.visible_last,
+    self.lines, cached_first, cached_last)
+  return true
+end
+
+
+function Highlighter:cancel()
+  if self.job then
+    self.job:cancel()
+    self.job = nil
+  end
+end
+
+
 function Highlighter:reset()
+  self:cancel()
+  core.wake_thread(self)
+  core.redraw = true
   self.lines = {}
   self.first_invalid_line = 1
+  self.resume_line = 1
+  self.edit_last = 0
   self.max_wanted_line = 0
 end
 
 
-function Highlighter:invalidate(idx)
+-- Called after lines `idx` to `idx + removed - 1` were replaced by
+-- `added` lines. The lines highlighted past them move along, so a job
+-- can stop where they are highlighted as before.
+function Highlighter:invalidate(idx, removed, added)
+  self:cancel()
+  core.wake_thread(self)
+  core.redraw = true
+  local lines, delta = self.lines, added - removed
+  local resume = self.resume_line
+  if resume > idx + removed then
+    if delta > 0 then
+      for i = resume - 1, idx + removed, -1 do lines[i + delta] = lines[i] end
+    elseif delta < 0 then
+      for i = idx + removed, resume - 1 do lines[i + delta] = lines[i] end
+      for i = resume + delta, resume - 1 do lines[i] = nil end
+    end
+    self.resume_line = resume + delta
+  else
+    self.resume_line = math.min(resume, idx)
+  end
+  if self.edit_last >= idx + removed then
+    self.edit_last = self.edit_last + delta
+  end
+  self.edit_last = math.max(self.edit_last, idx + added - 1)
   self.first_invalid_line = math.min(self.first_invalid_line, idx)
   self.max_wanted_line = math.min(self.max_wanted_line, #self.doc.lines)
 end
 
 
+function Highlighter:set_visible(first, last)
+  self.visible_first, self.visible_last = first, last
+  if self.job then
+    self.job:set_visible(first, last)
+  end
+end
+
+
 function Highlighter:tokenize_line(idx, state)
   local res = {}
   res.init_state = state
@@ -60,13 +139,25 @@ function Highlighter:tokenize_line(idx, state)
 end
 
 
+-- Lines the workers only computed the state of have no text, so they
+-- get tokenized here when they are first drawn.
 function Highlighter:get_line(idx)
   local line = self.lines[idx]
   if not line or line.text ~= self.doc.lines[idx] then
     local prev = self.lines[idx - 1]
-    line = self:tokenize_line(idx, prev and prev.state)
+    local res = self:tokenize_line(idx, prev and prev.state)
+    -- a line not yet highlighted again starting with another state than
+    -- in the last pass breaks the lines after it off from that pass
+    if idx >= self.first_invalid_line
+    and (not line or (line.init_state or 0) ~= (res.init_state or 0)) then
+      self.edit_last = math.max(self.edit_last, idx)
+    end
+    line = res
     self.lines[idx] = line
   end
+  if idx > self.max_wanted_line and idx >= self.first_invalid_line then
+    core.wake_thread(self)
+  end
   self.max_wanted_line = math.max(self.max_wanted_line, idx)
   return line
 end
@@ -1,41 +1,15 @@
+local core = require "core"
 local Object = require "core.object"
 local Highlighter = require "core.doc.highlighter"
 local syntax = require "core.syntax"
 local config = require "core.config"
 local common = require "core.common"
+local style = require "core.style"
 
 
 local Doc = Object:extend()
 
 
-local function split_lines(text)
-  local res = {}
-  for line in (text .. "\n"):gmatch("(.-)\n") do
-    table.insert(res, line)
-  end
-  return res
-end
-
-
-local function splice(t, at, remove, insert)
-  insert = insert or {}
-  local offset = #insert - remove
-  local old_len = #t
-  if offset < 0 then
-    for i = at - offset, old_len - offset do
-      t[i + offset] = t[i]
-    end
-  elseif offset > 0 then
-    for i = old_len, at, -1 do
-      t[i + offset] = t[i]
-    end
-  end
-  for i, item in ipairs(insert) do
-    t[at + i - 1] = item
-  end
-end
-
-
 function Doc:new(filename)
   self:reset()
   if filename then
@@ -44,12 +18,19 @@ function Doc:new(filename)
 end
 
 
+local function new_undo_stack()
+  return undo.new(config.max_undos, config.undo_memory_limit, config.undo_merge_timeout)
+end
+
+
 function Doc:reset()
-  self.lines = { "\n" }
+  self.lines = buffer.new("\n")
   self.selection = { a = { line=1, col=1 }, b = { line=1, col=1 } }
-  self.undo_stack = { idx = 1 }
-  self.redo_stack = { idx = 1 }
-  self.clean_change_id = 1
+  self.undo_stack = new_undo_stack()
+  self.redo_stack = new_undo_stack()
+  self.clean_change_id = self:get_change_id()
+  self.saving = nil
+  self.matches = {}
   self.highlighter = Highlighter(self)
   self:reset_syntax()
 end
@@ -66,36 +47,72 @@ end
 
 
 function Doc:load(filename)
-  local fp = assert( io.open(filename, "rb") )
+  local lines, crlf = assert( buffer.load(filename) )
   self:reset()
   self.filename = filename
-  self.lines = {}
-  for line in fp:lines() do
-    if line:byte(-1) == 13 then
-      line = line:sub(1, -2)
-      self.crlf = true
-    end
-    table.insert(self.lines, line .. "\n")
-  end
-  if #self.lines == 0 then
-    table.insert(self.lines, "\n")
-  end
-  fp:close()
+  self.lines = lines
+  self.crlf = crlf
   self:reset_syntax()
 end
 
 
-function Doc:save(filename)
+-- Waits for the doc's save in progress, if any, and cleans the doc as it
+-- was when the save started. Returns the error if it failed.
+local function finish_save(self)
+  local saving = self.saving
+  if not saving then return end
+  self.saving = nil
+  local ok, err = saving.job:wait()
+  if not ok then return err end
+  self.clean_change_id = saving.change_id
+  self:on_saved(saving.filename)
+end
+
+
+-- Saves the doc on a worker thread, it can be edited meanwhile. Docs
+-- under `config.background_save_size`, or any when `wait` is set, are
+-- waited for; the bigger ones show their progress and are cleaned once
+-- saved. Returns true if the doc was saved by the time it returns.
+function Doc:save(filename, wait)
   filename = filename or assert(self.filename, "no filename set to default to")
-  local fp = assert( io.open(filename, "wb") )
-  for _, line in ipairs(self.lines) do
-    if self.crlf then line = line:gsub("\n", "\r\n") end
-    fp:write(line)
-  end
-  fp:close()
-  self.filename = filename or self.filename
+  local err = finish_save(self)
+  if err then core.error("%s", err) end
+
+  local job = assert( self.lines:save(filename, self.crlf) )
+  local saving = { job = job, filename = filename, change_id = self:get_change_id() }
+  self.saving = saving
+  self.filename = filename
   self:reset_syntax()
-  self:clean()
+
+  if wait or self.lines:get_size() < config.background_save_size then
+    err = finish_save(self)
+    if err then error(err) end
+    return true
+  end
+
+  core.add_thread(function()
+    while self.saving == saving do
+      local done, written, total = job:poll()
+      if done then break end
+      core.status_view:show_message("i", style.text, string.format(
+        "Saving \"%s\" %d%%", filename, written / math.max(total, 1) * 100))
+      coroutine.yield(0.05)
+    end
+    if self.saving == saving then
+      err = finish_save(self)
+      if err then
+        core.error("%s", err)
+      else
+        core.log("Saved \"%s\"", filename)
+      end
+    end
+  end)
+  return false
+end
+
+
+-- Called once the doc was saved to `filename`.
+function Doc:on_saved(filename)
 end
 
 
@@ -115,7 +132,7 @@ end
 
 
 function Doc:get_change_id()
-  return self.undo_stack.idx
+  return self.undo_stack:get_change_id()
 end
 
 
@@ -160,7 +177,7 @@ end
 
 function Doc:sanitize_position(line, col)
   line = common.clamp(line, 1, #self.lines)
-  col = common.clamp(col, 1, #self.lines[line])
+  col = common.clamp(col, 1, self.lines:get_line_length(line))
   return line, col
 end
 
@@ -173,16 +190,9 @@ end
 
 local function position_offset_byte(self, line, col, offset)
   line, col = self:sanitize_position(line, col)
-  col = col + offset
-  while line > 1 and col < 1 do
-    line = line - 1
-    col = col + #self.lines[line]
-  end
-  while line < #self.lines and col > #self.lines[line] do
-    col = col - #self.lines[line]
-    line = line + 1
-  end
-  return self:sanitize_position(line, col)
+  offset = self.lines:get_offset(line, col) + offset
+  offset = common.clamp(offset, 1, self.lines:get_size())
+  return self.lines:get_position(offset)
 end
 
 
@@ -208,81 +218,70 @@ function Doc:get_text(line1, col1, line2, col2)
   line1, col1 = self:sanitize_position(line1, col1)
   line2, col2 = self:sanitize_position(line2, col2)
   line1, col1, line2, col2 = sort_positions(line1, col1, line2, col2)
-  if line1 == line2 then
-    return self.lines[line1]:sub(col1, col2 - 1)
-  end
-  local lines = { self.lines[line1]:sub(col1) }
-  for i = line1 + 1, line2 - 1 do
-    table.insert(lines, self.lines[i])
-  end
-  table.insert(lines, self.lines[line2]:sub(1, col2 - 1))
-  return table.concat(lines)
+  return self.lines:get_text(line1, col1, line2, col2)
 end
 
 
 function Doc:get_char(line, col)
   line, col = self:sanitize_position(line, col)
-  return self.lines[line]:sub(col, col)
-end
-
-
-local function push_undo(undo_stack, time, type, ...)
-  undo_stack[undo_stack.idx] = { type = type, time = time, ... }
-  undo_stack[undo_stack.idx - config.max_undos] = nil
-  undo_stack.idx = undo_stack.idx + 1
+  return self.lines:get_text(line, col, line, col + 1)
 end
 
 
 local function pop_undo(self, undo_stack, redo_stack)
   -- pop command
-  local cmd = undo_stack[undo_stack.idx - 1]
-  if not cmd then return end
-  undo_stack.idx = undo_stack.idx - 1
+  local change_id = undo_stack:get_change_id()
+  local type, time, a, b, c, d = undo_stack:pop()
+  if not type then return end
 
   -- handle command
-  if cmd.type == "insert" then
-    local line, col, text = table.unpack(cmd)
-    self:raw_insert(line, col, text, redo_stack, cmd.time)
+  if type == "insert" then
+    self:raw_insert(a, b, c, redo_stack, time)
+
+  elseif type == "remove" then
+    self:raw_remove(a, b, c, d, redo_stack, time)
 
-  elseif cmd.type == "remove" then
-    local line1, col1, line2, col2 = table.unpack(cmd)
-    self:raw_remove(line1, col1, line2, col2, redo_stack, cmd.time)
+  elseif type == "selection" then
+    self.selection.a.line, self.selection.a.col = a, b
+    self.selection.b.line, self.selection.b.col = c, d
+  end
 
-  elseif cmd.type == "selection" then
-    self.selection.a.line, self.selection.a.col = cmd[1], cmd[2]
-    self.selection.b.line, self.selection.b.col = cmd[3], cmd[4]
+  -- the command pushed on the other stack takes the change id of this one,
+  -- so that redoing it gets the doc back to the same change id
+  if type ~= "selection" then
+    redo_stack:set_change_id(change_id)
   end
 
   -- if next undo command is within the merge timeout then treat as a single
   -- command and continue to execute it
-  local next = undo_stack[undo_stack.idx - 1]
-  if next and math.abs(cmd.time - next.time) < config.undo_merge_timeout then
+  local next_time = undo_stack:get_end_time()
+  if next_time and math.abs(time - next_time) < config.undo_merge_timeout then
     return pop_undo(self, undo_stack, redo_stack)
   end
 end
 
 
-function Doc:raw_insert(line, col, text, undo_stack, time)
-  -- split text into lines and merge with line at insertion point
-  local lines = split_lines(text)
-  local before = self.lines[line]:sub(1, col - 1)
-  local after = self.lines[line]:sub(col)
-  for i = 1, #lines - 1 do
-    lines[i] = lines[i] .. "\n"
+-- Keeps the doc's match sets, see `core.doc.search`, up to date.
+local function update_matches(self, line, removed, added)
+  for _, set in ipairs(self.matches) do
+    set:update(self.lines, line, removed, added)
   end
-  lines[1] = before .. lines[1]
-  lines[#lines] = lines[#lines] .. after
+end
+
 
-  -- splice lines into line array
-  splice(self.lines, line, 1, lines)
+function Doc:raw_insert(line, col, text, undo_stack, time)
+  -- insert text into the buffer
+  self.lines:insert(line, col, text)
 
   -- push undo
   local line2, col2 = self:position_offset(line, col, #text)
-  push_undo(undo_stack, time, "selection", self:get_selection())
-  push_undo(undo_stack, time, "remove", line, col, line2, col2)
+  undo_stack:push(time, "selection", self:get_selection())
+  undo_stack:push(time, "remove", line, col, line2, col2)
 
-  -- update highlighter and assure selection is in bounds
-  self.highlighter:invalidate(line)
+  -- update highlighter and matches and assure selection is in bounds
+  self.highlighter:invalidate(line, 1, line2 - line + 1)
+  update_matches(self, line, 1, line2 - line + 1)
+  self:on_lines_changed(line, 1, line2 - line + 1)
   self:sanitize_selection()
 end
 
@@ -290,31 +289,35 @@ end
 function Doc:raw_remove(line1, col1, line2, col2, undo_stack, time)
   -- push undo
   local text = self:get_text(line1, col1, line2, col2)
-  push_undo(undo_stack, time, "selection", self:get_selection())
-  push_undo(undo_stack, time, "insert", line1, col1, text)
-
-  -- get line content before/after removed text
-  local before = self.lines[line1]:sub(1, col1 - 1)
-  local after = self.lines[line2]:sub(col2)
+  undo_stack:push(time, "selection", self:get_selection())
+  undo_stack:push(time, "insert", line1, col1, text)
 
-  -- splice line into line array
-  splice(self.lines, line1, line2 - line1 + 1, { before .. after })
+  -- remove text from the buffer
+  self.lines:remove(line1, col1, line2, col2)
 
-  -- update highlighter and assure selection is in bounds
-  self.highlighter:invalidate(line1)
+  -- update highlighter and matches and assure selection is in bounds
+  self.highlighter:invalidate(line1, line2 - line1 + 1, 1)
+  update_matches(self, line1, line2 - line1 + 1, 1)
+  self:on_lines_changed(line1, line2 - line1 + 1, 1)
   self:sanitize_selection()
 end
 
 
+-- Called after lines `line` to `line + removed - 1` were replaced by
+-- `added` lines, for the plugins keeping state per line.
+function Doc:on_lines_changed(line, removed, added)
+end
+
+
 function Doc:insert(line, col, text)
-  self.redo_stack = { idx = 1 }
+  self.redo_stack:clear()
   line, col = self:sanitize_position(line, col)
   self:raw_insert(line, col, text, self.undo_stack, system.get_time())
 end
 
 
 function Doc:remove(line1, col1, line2, col2)
-  self.redo_stack = { idx = 1 }
+  self.redo_stack:clear()
   line1, col1 = self:sanitize_position(line1, col1)
   line2, col2 = self:sanitize_position(line2, col2)
   line1, col1, line2, col2 = sort_positions(line1, col1, line2, col2)
@@ -342,6 +345,57 @@ function Doc:text_input(text)
 end
 
 
+-- Replaces the text between the positions, `old_text`, by `new_text`,
+-- editing only the lines that differ so the undo history keeps only them.
+local function replace_changed_lines(self, line1, col1, line2, col2, old_text, new_text)
+  -- with a "\n" added to both texts, every line of the diff ends with one
+  local d = diff.new(old_text .. "\n")
+  local lines = buffer.new(new_text .. "\n")
+  d:reset(lines)
+  local hunks = d:get_hunks()
+  local old_count = line2 - line1 + 1
+
+  -- the diff leaves "\r" out of the lines it compares; every hunk, 4 items
+  -- of `hunks`, takes up to 4 undo records and they must fit in the history
+  if old_text:find("\r", 1, true) or new_text:find("\r", 1, true)
+  or #hunks > config.max_undos / 2 then
+    self:insert(line2, col2, new_text)
+    self:remove(line1, col1, line2, col2)
+    return
+  end
+
+  -- position of the end of an old line, before its "\n"
+  local function line_end(i)
+    if i == old_count then return line2, col2 end
+    return line1 + i - 1, #self.lines[line1 + i - 1]
+  end
+
+  -- bottom up, so the hunks above keep their positions
+  for i = #hunks - 3, 1, -4 do
+    local a, n, b, m = hunks[i], hunks[i + 1], hunks[i + 2], hunks[i + 3]
+    local l1, c1, l2, c2, text
+    if a + n <= old_count then
+      l1, c1 = line1 + a - 1, a == 1 and col1 or 1
+      l2, c2 = line1 + a + n - 1, a + n == 1 and col1 or 1
+      text = m > 0 and lines:get_text(b, 1, b + m, 1) or ""
+    else
+      -- the last old line has no "\n" of its own, the hunk takes the one
+      -- of the line before it instead
+      l2, c2 = line2, col2
+      text = m > 0 and lines:get_text(b, 1, #lines, #lines[#lines]) or ""
+      if a == 1 then
+        l1, c1 = line1, col1
+      else
+        l1, c1 = line_end(a - 1)
+        if m > 0 then text = "\n" .. text end
+      end
+    end
+    if text ~= "" then self:insert(l2, c2, text) end
+    if l1 ~= l2 or c1 ~= c2 then self:remove(l1, c1, l2, c2) end
+  end
+end
+
+
 function Doc:replace(fn)
   local line1, col1, line2, col2, swap
   local had_selection = self:has_selection()
@@ -353,8 +407,7 @@ function Doc:replace(fn)
   local old_text = self:get_text(line1, col1, line2, col2)
   local new_text, n = fn(old_text)
   if old_text ~= new_text then
-    self:insert(line2, col2, new_text)
-    self:remove(line1, col1, line2, col2)
+    replace_changed_lines(self, line1, col1, line2, col2, old_text, new_text)
     if had_selection then
       line2, col2 = self:position_offset(line1, col1, #new_text)
       self:set_selection(line1, col1, line2, col2, swap)
@@ -2,6 +2,9 @@ local search = {}
 
 local default_opt = {}
 
+-- match sets kept per doc, the least recently used is dropped past it
+local max_match_sets = 4
+
 
 local function pattern_lower(str)
   if str:sub(1, 1) == "%" then
@@ -27,25 +30,148 @@ local function init_args(doc, line, col, text, opt)
 end
 
 
-function search.find(doc, line, col, text, opt)
-  doc, line, col, text, opt = init_args(doc, line, col, text, opt)
+-- Returns the set of every match of the literal `text` in the doc. It's
+-- made on first use and then kept up to date by the doc as it's edited.
+function search.get_matches(doc, text, no_case)
+  local query = no_case and text:lower() or text
+  no_case = not not no_case
+  for i, set in ipairs(doc.matches) do
+    local q, nc = set:get_query()
+    if q == query and nc == no_case then
+      table.insert(doc.matches, 1, table.remove(doc.matches, i))
+      return set
+    end
+  end
+  local set = matches.new(text, no_case)
+  set:reset(doc.lines)
+  table.insert(doc.matches, 1, set)
+  doc.matches[max_match_sets + 1] = nil
+  return set
+end
+
 
+local function find_pattern(doc, line, col, text, opt)
   for line = line, #doc.lines do
     local line_text = doc.lines[line]
     if opt.no_case then
       line_text = line_text:lower()
     end
-    local s, e = line_text:find(text, col, not opt.pattern)
+    local s, e = line_text:find(text, col)
     if s then
       return line, s, line, e + 1
     end
     col = 1
   end
+end
+
+
+-- The last match starting before `col` on a line, or on a line before.
+local function find_pattern_reverse(doc, line, col, text, opt)
+  for line = line, 1, -1 do
+    local line_text = doc.lines[line]
+    if opt.no_case then
+      line_text = line_text:lower()
+    end
+    local found_s, found_e
+    local init = 1
+    while true do
+      local s, e = line_text:find(text, init)
+      if not s or s >= col then break end
+      found_s, found_e = s, e
+      init = s + 1
+    end
+    if found_s then
+      return line, found_s, line, found_e + 1
+    end
+    col = math.huge
+  end
+end
+
+
+-- The last regex compiled, finding the next match as the query is typed
+-- compiles it once.
+local last_regex = {}
+
+local function get_regex(text, no_case)
+  no_case = not not no_case
+  if last_regex.text ~= text or last_regex.no_case ~= no_case then
+    local re, err = regex.compile(text, no_case)
+    if not re then error(err) end
+    last_regex = { text = text, no_case = no_case, re = re }
+  end
+  return last_regex.re
+end
+
+
+local function find_regex(doc, line, col, text, opt)
+  local re = get_regex(text, opt.no_case)
+  local line1, col1, col2 = re:find_lines(doc.lines, line, col, opt.reverse)
+  if not line1 and opt.wrap then
+    if opt.reverse then
+      local last = #doc.lines
+      line1, col1, col2 = re:find_lines(doc.lines, last, #doc.lines[last] + 1, true)
+    else
+      line1, col1, col2 = re:find_lines(doc.lines, 1, 1, false)
+    end
+  end
+  if line1 then
+    return line1, col1, line1, col2
+  end
+end
+
+
+function search.find(doc, line, col, text, opt)
+  opt = opt or default_opt
+  if opt.regex then
+    line, col = doc:sanitize_position(line, col)
+    return find_regex(doc, line, col, text, opt)
+  end
+  if not opt.pattern then
+    line, col = doc:sanitize_position(line, col)
+    local set = search.get_matches(doc, text, opt.no_case)
+    local line1, col1, line2, col2 = set:find(line, col, opt.reverse, opt.wrap)
+    -- a match of the last line's "\n" ends past the last line
+    if line2 and line2 > #doc.lines then
+      line2, col2 = #doc.lines, #doc.lines[#doc.lines] + 1
+    end
+    return line1, col1, line2, col2
+  end
+
+  doc, line, col, text, opt = init_args(doc, line, col, text, opt)
+  local fn = opt.reverse and find_pattern_reverse or find_pattern
+  local line1, col1, line2, col2 = fn(doc, line, col, text, opt)
+  if line1 then
+    return line1, col1, line2, col2
+  end
 
   if opt.wrap then
-    opt = { no_case = opt.no_case, pattern = opt.pattern }
-    return search.find(doc, 1, 1, text, opt)
+    local from_line = opt.reverse and #doc.lines or 1
+    local from_col = opt.reverse and math.huge or 1
+    return fn(doc, from_line, from_col, text, opt)
+  end
+end
+
+
+-- Returns the number of matches of the literal `text` in the doc.
+function search.count(doc, text, opt)
+  opt = opt or default_opt
+  return search.get_matches(doc, text, opt.no_case):get_count()
+end
+
+
+-- Returns the text of the doc's selection, or of the whole doc without
+-- one, with every literal `text` in it replaced by `new`, and how many
+-- were replaced. Meant to be passed to `Doc:replace()`.
+function search.replace(doc, text, new, opt)
+  opt = opt or default_opt
+  local line1, col1, line2, col2
+  if doc:has_selection() then
+    line1, col1, line2, col2 = doc:get_selection(true)
+  else
+    line1, col1, line2, col2 = 1, 1, #doc.lines, #doc.lines[#doc.lines]
   end
+  local set = search.get_matches(doc, text, opt.no_case)
+  return set:replace(doc.lines, line1, col1, line2, col2, new)
 end
 
 
@@ -134,28 +134,29 @@ function DocView:get_visible_line_range()
 end
 
 
-function DocView:get_col_x_offset(line, col)
+function DocView:get_col_offsets(line)
   local text = self.doc.lines[line]
-  if not text then return 0 end
-  return self:get_font():get_width(text:sub(1, col - 1))
+  if not text then return nil end
+  local font = self:get_font()
+  local cache = self.col_offsets_cache
+  if not cache or cache.text ~= text or cache.font ~= font then
+    cache = { text = text, font = font, offsets = font:get_col_offsets(text) }
+    self.col_offsets_cache = cache
+  end
+  return cache.offsets
 end
 
 
-function DocView:get_x_offset_col(line, x)
-  local text = self.doc.lines[line]
+function DocView:get_col_x_offset(line, col)
+  local offsets = self:get_col_offsets(line)
+  if not offsets then return 0 end
+  return offsets[common.clamp(col, 1, #offsets)]
+end
 
-  local xoffset, last_i, i = 0, 1, 1
-  for char in common.utf8_chars(text) do
-    local w = self:get_font():get_width(char)
-    if xoffset >= x then
-      return (xoffset - x > w / 2) and last_i or i
-    end
-    xoffset = xoffset + w
-    last_i = i
-    i = i + #char
-  end
 
-  return #text
+function DocView:get_x_offset_col(line, x)
+  local text = self.doc.lines[line]
+  return self:get_font():x_to_col(text, x)
 end
 
 
@@ -277,10 +278,17 @@ function DocView:update()
   if self == core.active_view and not self.mouse_selecting then
     local n = blink_period / 2
     local prev = self.blink_timer
-    self.blink_timer = (self.blink_timer + 1 / config.fps) % blink_period
+    local now = system.get_time()
+    local elapsed = now - (self.blink_updated or now)
+    self.blink_timer = (self.blink_timer + elapsed) % blink_period
+    self.blink_updated = now
     if (self.blink_timer > n) ~= (prev > n) then
       core.redraw = true
     end
+    -- frames don't come when idle, wake up for the next toggle
+    core.wake_after(n - self.blink_timer % n)
+  else
+    self.blink_updated = nil
   end
 
   DocView.super.update(self)
@@ -293,13 +301,23 @@ function DocView:draw_line_highlight(x, y)
 end
 
 
-function DocView:draw_line_text(idx, x, y)
-  local tx, ty = x, y + self:get_line_text_y_offset()
-  local font = self:get_font()
-  for _, type, text in self.doc.highlighter:each_token(idx) do
-    local color = style.syntax[type]
-    tx = renderer.draw_text(font, text, tx, ty, color)
+-- themes replace the colors of `style.syntax` in place, so the palette
+-- is resolved again once per frame rather than once per token
+local palette, palette_frame
+
+local function get_palette()
+  if not palette or palette_frame ~= core.frame_start then
+    palette = renderer.new_palette(style.syntax)
+    palette_frame = core.frame_start
   end
+  return palette
+end
+
+
+function DocView:draw_line_text(idx, x, y)
+  local ty = y + self:get_line_text_y_offset()
+  local tokens = self.doc.highlighter:get_line(idx).tokens
+  renderer.draw_tokens(self:get_font(), tokens, x, ty, get_palette())
 end
 
 
@@ -357,6 +375,7 @@ function DocView:draw()
   font:set_tab_width(font:get_width(" ") * config.indent_size)
 
   local minline, maxline = self:get_visible_line_range()
+  self.doc.highlighter:set_visible(minline, maxline)
   local lh = self:get_line_height()
 
   local _, y = self:get_line_screen_position(minline)
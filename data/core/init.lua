@@ -1,5 +1,4 @@
 require "core.strict"
-local common = require "core.common"
 local config = require "core.config"
 local style = require "core.style"
 local command
@@ -13,63 +12,19 @@ local core = {}
 
 
 local function project_scan_thread()
-  local function diff_files(a, b)
-    if #a ~= #b then return true end
-    for i, v in ipairs(a) do
-      if b[i].filename ~= v.filename
-      or b[i].modified ~= v.modified then
-        return true
-      end
-    end
-  end
-
-  local function compare_file(a, b)
-    return a.filename < b.filename
-  end
-
-  local function get_files(path, t)
-    coroutine.yield()
-    t = t or {}
-    local size_limit = config.file_size_limit * 10e5
-    local all = system.list_dir(path) or {}
-    local dirs, files = {}, {}
-
-    for _, file in ipairs(all) do
-      if not common.match_pattern(file, config.ignore_files) then
-        local file = (path ~= "." and path .. PATHSEP or "") .. file
-        local info = system.get_file_info(file)
-        if info and info.size < size_limit then
-          info.filename = file
-          table.insert(info.type == "dir" and dirs or files, info)
-        end
-      end
-    end
-
-    table.sort(dirs, compare_file)
-    for _, f in ipairs(dirs) do
-      table.insert(t, f)
-      get_files(f.filename, t)
-    end
-
-    table.sort(files, compare_file)
-    for _, f in ipairs(files) do
-      table.insert(t, f)
-    end
-
-    return t
-  end
+  -- the project is walked once on a worker thread, after that the
+  -- scanner follows the changes made to it and the thread sleeps until
+  -- there are some
+  local scanner = system.scan_project(".", config.ignore_files,
+    config.project_scan_rate)
 
   while true do
-    -- get project files and replace previous table if the new table is
-    -- different
-    local t = get_files(".")
-    if diff_files(core.project_files, t) then
-      core.project_files = t
+    -- the list is changed in place, the version tells it apart
+    if scanner:poll(core.project_files) then
+      core.project_files_version = core.project_files_version + 1
       core.redraw = true
     end
-
-    -- wait for next scan
-    coroutine.yield(config.project_scan_rate)
+    coroutine.yield(scanner:is_native() and scanner or 0.25)
   end
 end
 
@@ -101,7 +56,9 @@ function core.init()
   core.docs = {}
   core.threads = setmetatable({}, { __mode = "k" })
   core.project_files = {}
+  core.project_files_version = 0
   core.redraw = true
+  core.next_wakeup = math.huge
 
   core.root_view = RootView()
   core.command_view = CommandView()
@@ -174,9 +131,25 @@ end
 
 function core.load_plugins()
   local no_errors = true
-  local files = system.list_dir(EXEDIR .. "/data/plugins")
+  local modnames, seen = {}, {}
+  local files = system.list_dir(EXEDIR .. "/data/plugins") or {}
   for _, filename in ipairs(files) do
     local modname = "plugins." .. filename:gsub(".lua$", "")
+    if not seen[modname] then
+      seen[modname] = true
+      table.insert(modnames, modname)
+    end
+  end
+  -- the plugins built into the executable load even without the directory
+  if embedded.enabled then
+    for _, modname in ipairs(embedded.list("plugins.")) do
+      if not seen[modname] then
+        seen[modname] = true
+        table.insert(modnames, modname)
+      end
+    end
+  end
+  for _, modname in ipairs(modnames) do
     local ok = core.try(require, modname)
     if ok then
       core.log_quiet("Loaded plugin %q", modname)
@@ -222,10 +195,57 @@ function core.set_active_view(view)
 end
 
 
+-- Makes the main loop wake up within `delay` seconds, for the views
+-- that change on a timer.
+function core.wake_after(delay)
+  core.next_wakeup = math.min(core.next_wakeup, system.get_time() + delay)
+end
+
+
 function core.add_thread(f, weak_ref)
   local key = weak_ref or #core.threads + 1
   local fn = function() return core.try(f) end
-  core.threads[key] = { cr = coroutine.create(fn), wake = 0 }
+  local info = debug.getinfo(f, "S")
+  local name = string.format("%s:%d", info.short_src, info.linedefined)
+  core.threads[key] = { cr = coroutine.create(fn), wake = 0, name = name }
+end
+
+
+-- Runs the thread added with `weak_ref` on the next frame, however long
+-- it asked to sleep for.
+function core.wake_thread(weak_ref)
+  local thread = core.threads[weak_ref]
+  if thread then
+    thread.process, thread.wake = nil, 0
+  end
+end
+
+
+-- Runs a process from a core thread, which sleeps until it's done.
+-- Returns the process' output and exit code, or nil and an error. Its
+-- stderr is discarded unless `opts.stderr` says otherwise, a piped
+-- stderr is read and dropped so the process never blocks on it.
+function core.read_process(argv, opts)
+  local spawn_opts = { stderr = "discard" }
+  for k, v in pairs(opts or {}) do spawn_opts[k] = v end
+  local proc, err = system.spawn(argv, spawn_opts)
+  if not proc then return nil, err end
+  local output = {}
+  local stdout_open, stderr_open = true, spawn_opts.stderr == "pipe"
+  while stdout_open or stderr_open do
+    local chunk = stdout_open and proc:read_stdout()
+    local errors = stderr_open and proc:read_stderr()
+    stdout_open, stderr_open = chunk and true, errors and true
+    if chunk and chunk ~= "" then
+      table.insert(output, chunk)
+    elseif (stdout_open or stderr_open) and (not errors or errors == "") then
+      coroutine.yield(proc)
+    end
+  end
+  while proc:running() do
+    coroutine.yield(proc)
+  end
+  return table.concat(output), proc:returncode()
 end
 
 
@@ -266,6 +286,12 @@ function core.open_doc(filename)
 end
 
 
+-- Called after a doc no view references anymore is closed, for the
+-- plugins keeping state per doc.
+function core.on_doc_closed(doc)
+end
+
+
 function core.get_views_referencing_doc(doc)
   local res = {}
   local views = core.root_view.root_node:get_children()
@@ -282,6 +308,8 @@ local function log(icon, icon_color, fmt, ...)
     core.status_view:show_message(icon, icon_color, text)
   end
 
+  core.redraw = true
+
   local info = debug.getinfo(2, "Sl")
   local at = string.format("%s:%d", info.short_src, info.currentline)
   local item = { text = text, time = os.time(), at = at }
@@ -365,9 +393,10 @@ function core.step()
   local mouse_moved = false
   local mouse = { x = 0, y = 0, dx = 0, dy = 0 }
 
-  core.redraw = system.window_has_focus()
-
-  for type, a,b,c,d in system.poll_event do
+  profiler.begin_zone("events")
+  for _, event in ipairs(system.poll_events()) do
+    local type, a,b,c,d = table.unpack(event)
+    core.redraw = true
     -- Only process events if focused
     if type == "mousemoved" then
       mouse_moved = true
@@ -383,12 +412,15 @@ function core.step()
   if mouse_moved then
     core.try(core.on_event, "mousemoved", mouse.x, mouse.y, mouse.dx, mouse.dy)
   end
+  profiler.end_zone()
 
   local width, height = renderer.get_size()
 
   -- update
+  profiler.begin_zone("update")
   core.root_view.size.x, core.root_view.size.y = width, height
   core.root_view:update()
+  profiler.end_zone()
   if not core.redraw then return false end
   core.redraw = false
 
@@ -397,6 +429,7 @@ function core.step()
     local doc = core.docs[i]
     if #core.get_views_referencing_doc(doc) == 0 then
       table.remove(core.docs, i)
+      core.on_doc_closed(doc)
       core.log_quiet("Closed doc \"%s\"", doc:get_name())
     end
   end
@@ -413,7 +446,9 @@ function core.step()
   renderer.begin_frame()
   core.clip_rect_stack[1] = { 0, 0, width, height }
   renderer.set_clip_rect(table.unpack(core.clip_rect_stack[1]))
+  profiler.begin_zone("draw")
   core.root_view:draw()
+  profiler.end_zone()
   renderer.end_frame()
   return true
 end
@@ -425,17 +460,32 @@ local run_threads = coroutine.wrap(function()
     local ran_any_threads = false
 
     for k, thread in pairs(core.threads) do
+      -- wake up the threads waiting for a process, a file watcher or
+      -- the project scanner
+      if thread.process and thread.process:ready() then
+        thread.process, thread.wake = nil, 0
+      end
+
       -- run thread
       if thread.wake < system.get_time() then
+        profiler.begin_zone(thread.name)
         local _, wait = assert(coroutine.resume(thread.cr))
+        profiler.end_zone()
         if coroutine.status(thread.cr) == "dead" then
           if type(k) == "number" then
             table.remove(core.threads, k)
           else
             core.threads[k] = nil
           end
-        elseif wait then
+        elseif type(wait) == "number" then
           thread.wake = system.get_time() + wait
+        elseif wait then
+          -- a process, a file watcher or the project scanner, the thread
+          -- sleeps until it's ready
+          thread.process, thread.wake = wait, math.huge
+          if wait:ready() then
+            thread.process, thread.wake = nil, 0
+          end
         end
         ran_any_threads = true
       end
@@ -451,10 +501,22 @@ local run_threads = coroutine.wrap(function()
 end)
 
 
+-- Returns how long the main loop can sleep before the next frame, 0 if
+-- there is something to draw or a thread to run.
 function core.run()
-    core.frame_start = system.get_time()
-    core.step()
-    run_threads()
+  core.frame_start = system.get_time()
+  core.next_wakeup = math.huge
+  local did_redraw = core.step()
+  profiler.begin_zone("threads")
+  run_threads()
+  profiler.end_zone()
+  if did_redraw or core.redraw then return 0 end
+
+  local wake = core.next_wakeup
+  for _, thread in pairs(core.threads) do
+    wake = math.min(wake, thread.wake)
+  end
+  return math.max(0, wake - system.get_time())
 end
 
 
@@ -467,7 +529,7 @@ function core.on_error(err)
   -- save copy of all unsaved documents
   for _, doc in ipairs(core.docs) do
     if doc:is_dirty() and doc.filename then
-      doc:save(doc.filename .. "~")
+      doc:save(doc.filename .. "~", true)
     end
   end
 end
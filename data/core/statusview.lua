@@ -38,9 +38,19 @@ function StatusView:update()
   self.size.y = style.font:get_height() + style.padding.y * 2
   if system.get_time() < self.message_timeout then
     self.scroll.to.y = self.size.y
+    core.wake_after(self.message_timeout - system.get_time())
   else
     self.scroll.to.y = 0
   end
+
+  -- keep the clock current
+  local minute = os.date("%H:%M")
+  if minute ~= self.last_minute then
+    self.last_minute = minute
+    core.redraw = true
+  end
+  core.wake_after(60 - os.time() % 60)
+
   StatusView.super.update(self)
 end
 
@@ -6,6 +6,7 @@ local style = require "core.style"
 local keymap = require "core.keymap"
 local translate = require "core.doc.translate"
 local RootView = require "core.rootview"
+local Doc = require "core.doc"
 local DocView = require "core.docview"
 
 config.autocomplete_max_suggestions = 6
@@ -26,62 +27,95 @@ function autocomplete.add(t)
 end
 
 
-core.add_thread(function()
-  local cache = setmetatable({}, { __mode = "k" })
-
-  local function get_symbols(doc)
-    local i = 1
-    local s = {}
-    while i < #doc.lines do
-      for sym in doc.lines[i]:gmatch(config.symbol_pattern) do
-        s[sym] = true
-      end
-      i = i + 1
-      if i % 100 == 0 then coroutine.yield() end
+-- the symbols of the open docs, each doc updates the symbols of the
+-- lines it changes as it's edited
+local index, index_pattern
+local indexed = setmetatable({}, { __mode = "k" })
+
+local function index_doc(doc)
+  if index_pattern ~= config.symbol_pattern then
+    for d, doc_symbols in pairs(indexed) do
+      doc_symbols:close()
+      indexed[d] = nil
     end
-    return s
+    index = symbols.new(config.symbol_pattern)
+    index_pattern = config.symbol_pattern
   end
-
-  local function cache_is_valid(doc)
-    local c = cache[doc]
-    return c and c.last_change_id == doc:get_change_id()
+  -- big docs are left out
+  if doc.lines:get_size() > config.file_size_limit * 10e5 then
+    return
   end
+  local doc_symbols = indexed[doc] or index:add_doc()
+  doc_symbols:reset(doc.lines)
+  indexed[doc] = doc_symbols
+end
 
-  while true do
-    local symbols = {}
 
-    -- lift all symbols from all docs
+-- the docs are indexed when they are opened and dropped when they are
+-- closed, in between the thread sleeps
+core.add_thread(function()
+  while true do
+    local open = {}
     for _, doc in ipairs(core.docs) do
-      -- update the cache if the doc has changed since the last iteration
-      if not cache_is_valid(doc) then
-        cache[doc] = {
-          last_change_id = doc:get_change_id(),
-          symbols = get_symbols(doc)
-        }
+      open[doc] = true
+      if not indexed[doc] or index_pattern ~= config.symbol_pattern then
+        index_doc(doc)
       end
-      -- update symbol set with doc's symbol set
-      for sym in pairs(cache[doc].symbols) do
-        symbols[sym] = true
+    end
+    for doc, doc_symbols in pairs(indexed) do
+      if not open[doc] then
+        doc_symbols:close()
+        indexed[doc] = nil
       end
-      coroutine.yield()
     end
 
-    -- update symbols list
-    autocomplete.add { name = "open-docs", items = symbols }
-
-    -- wait for next scan
-    local valid = true
-    while valid do
-      coroutine.yield(1)
-      for _, doc in ipairs(core.docs) do
-        if not cache_is_valid(doc) then
-          valid = false
-        end
+    -- the lines of the docs just indexed are scanned a chunk at a time
+    for doc, doc_symbols in pairs(indexed) do
+      while indexed[doc] == doc_symbols and not doc_symbols:scan(doc.lines, 1000) do
+        coroutine.yield()
       end
     end
 
+    coroutine.yield(math.huge)
+  end
+end, autocomplete)
+
+
+local open_doc = core.open_doc
+
+function core.open_doc(...)
+  local doc = open_doc(...)
+  if not indexed[doc] then core.wake_thread(autocomplete) end
+  return doc
+end
+
+
+local on_doc_closed = core.on_doc_closed
+
+function core.on_doc_closed(doc)
+  on_doc_closed(doc)
+  if indexed[doc] then core.wake_thread(autocomplete) end
+end
+
+
+local load = Doc.load
+
+function Doc:load(...)
+  local res = load(self, ...)
+  if indexed[self] then index_doc(self) end
+  return res
+end
+
+
+local on_lines_changed = Doc.on_lines_changed
+
+function Doc:on_lines_changed(line, removed, added)
+  on_lines_changed(self, line, removed, added)
+  local doc_symbols = indexed[self]
+  if doc_symbols then
+    doc_symbols:update(self.lines, line, removed, added)
   end
-end)
+end
 
 
 local partial = ""
@@ -99,26 +133,42 @@ end
 local function update_suggestions()
   local doc = core.active_view.doc
   local filename = doc and doc.filename or ""
+  local max = config.autocomplete_max_suggestions
+
+  -- the best symbols of the open docs and of the lists relevant to the
+  -- filename, the duplicates merged
+  local items, seen = {}, {}
+  local function add(text, score, info)
+    local item = seen[text]
+    if not item then
+      item = { text = text, score = score }
+      seen[text] = item
+      table.insert(items, item)
+    end
+    item.info = item.info or info
+  end
 
-  -- get all relevant suggestions for given filename
-  local items = {}
+  if index then
+    local texts, scores = index:match(partial, max)
+    for i, text in ipairs(texts) do
+      add(text, scores[i])
+    end
+  end
   for _, v in pairs(autocomplete.map) do
     if common.match_pattern(filename, v.files) then
-      for _, item in pairs(v.items) do
-        table.insert(items, item)
+      for _, item in ipairs(common.fuzzy_match(v.items, partial, max)) do
+        add(item.text, common.fuzzy_match(item.text, partial), item.info)
       end
     end
   end
 
-  -- fuzzy match, remove duplicates and store
-  items = common.fuzzy_match(items, partial)
-  local j = 1
-  for i = 1, config.autocomplete_max_suggestions do
-    suggestions[i] = items[j]
-    while items[j] and items[i].text == items[j].text do
-      items[i].info = items[i].info or items[j].info
-      j = j + 1
-    end
+  table.sort(items, function(a, b)
+    if a.score ~= b.score then return a.score > b.score end
+    if #a.text ~= #b.text then return #a.text < #b.text end
+    return a.text < b.text
+  end)
+  for i = 1, max do
+    suggestions[i] = items[i]
   end
 end
 
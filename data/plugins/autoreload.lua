@@ -3,59 +3,142 @@ local config = require "core.config"
 local Doc = require "core.doc"
 
 
-local times = setmetatable({}, { __mode = "k" })
+local watcher = system.watch_files()
 
-local function update_time(doc)
+-- only the end of a file is compared to tell it was appended to
+local tail_size = 256
+
+-- doc -> the file as it was when the doc last matched it, { path,
+-- modified, size, tail = its last bytes }
+local synced = {}
+
+
+local function read_tail(filename, size)
+  local fp = io.open(filename, "rb")
+  if not fp then return "" end
+  fp:seek("set", math.max(0, size - tail_size))
+  local tail = fp:read("*a")
+  fp:close()
+  return tail
+end
+
+
+local function sync(doc)
+  local old = synced[doc]
+  local path = system.absolute_path(doc.filename) or doc.filename
+  if not old or old.path ~= path then
+    if old then watcher:remove(old.path) end
+    watcher:add(path)
+  end
   local info = system.get_file_info(doc.filename)
-  times[doc] = info.modified
+  local size = info and info.size or 0
+  synced[doc] = {
+    path = path,
+    modified = info and info.modified,
+    size = size,
+    tail = info and read_tail(doc.filename, size) or "",
+  }
 end
 
 
-local function reload_doc(doc)
-  local fp = io.open(doc.filename, "r")
-  local text = fp:read("*a")
+-- stops watching the files of the docs that were closed
+local function prune()
+  local open = {}
+  for _, doc in ipairs(core.docs) do open[doc] = true end
+  for doc, s in pairs(synced) do
+    if not open[doc] then
+      watcher:remove(s.path)
+      synced[doc] = nil
+    end
+  end
+end
+
+
+-- Returns what was appended to the file since it was synced, or nil if
+-- it changed otherwise.
+local function read_appended(doc, info)
+  local s = synced[doc]
+  if doc.crlf or info.size <= s.size then return end
+  local fp = io.open(doc.filename, "rb")
+  if not fp then return end
+  fp:seek("set", s.size - #s.tail)
+  local text = fp:read(#s.tail) == s.tail and fp:read("*a")
   fp:close()
+  return text or nil
+end
+
+
+local function reload_doc(doc)
+  local s = synced[doc]
+  local info = system.get_file_info(doc.filename)
+  if not info or info.modified == s.modified and info.size == s.size then
+    return
+  end
+
+  local appended = read_appended(doc, info)
+  if appended then
+    -- the doc leaves out the file's last "\n", it goes before the text
+    -- when the file had one
+    local text = appended:gsub("\r", ""):gsub("\n$", "")
+    if s.tail:sub(-1) == "\n" then text = "\n" .. text end
+    local was_dirty = doc:is_dirty()
+    local line = #doc.lines
+    doc:insert(line, #doc.lines[line], text)
+    if not was_dirty then doc:clean() end
+
+  else
+    local fp = io.open(doc.filename, "rb")
+    if not fp then return end
+    local text = fp:read("*a"):gsub("\r", ""):gsub("\n$", "")
+    fp:close()
 
-  local sel = { doc:get_selection() }
-  doc:remove(1, 1, math.huge, math.huge)
-  doc:insert(1, 1, text:gsub("\r", ""):gsub("\n$", ""))
-  doc:set_selection(table.unpack(sel))
+    -- only the lines that differ are edited, the rest keep their
+    -- highlighting and stay out of the undo history
+    local sel = { doc:get_selection() }
+    doc:set_selection(1, 1)
+    doc:replace(function() return text end)
+    doc:set_selection(table.unpack(sel))
+    doc:clean()
+    core.log_quiet("Auto-reloaded doc \"%s\"", doc.filename)
+  end
 
-  update_time(doc)
-  doc:clean()
-  core.log_quiet("Auto-reloaded doc \"%s\"", doc.filename)
+  sync(doc)
 end
 
 
 core.add_thread(function()
   while true do
-    -- check all doc modified times
+    prune()
+    local changed = {}
+    for _, path in ipairs(watcher:poll()) do
+      changed[path] = true
+    end
     for _, doc in ipairs(core.docs) do
-      local info = system.get_file_info(doc.filename or "")
-      if info and times[doc] ~= info.modified then
+      local s = synced[doc]
+      -- a doc being saved is synced once saved
+      if s and changed[s.path] and not doc.saving then
         reload_doc(doc)
       end
-      coroutine.yield()
     end
 
-    -- wait for next scan
-    coroutine.yield(config.project_scan_rate)
+    -- with inotify the thread sleeps until a file changes, elsewhere the
+    -- files are checked every project_scan_rate
+    coroutine.yield(watcher:is_native() and watcher or config.project_scan_rate)
   end
 end)
 
 
--- patch `Doc.save|load` to store modified time
+-- patch `Doc.load|on_saved` to sync the file they read or wrote
 local load = Doc.load
-local save = Doc.save
+local on_saved = Doc.on_saved
 
 Doc.load = function(self, ...)
   local res = load(self, ...)
-  update_time(self)
+  sync(self)
   return res
 end
 
-Doc.save = function(self, ...)
-  local res = save(self, ...)
-  update_time(self)
-  return res
+Doc.on_saved = function(self, ...)
+  on_saved(self, ...)
+  sync(self)
 end
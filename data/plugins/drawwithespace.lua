@@ -16,17 +16,19 @@ function DocView:draw_line_text(idx, x, y)
   if not config.draw_whitespace then return end
 
   local text = self.doc.lines[idx]
-  local tx, ty = x, y + self:get_line_text_y_offset()
+  local offsets = self:get_col_offsets(idx)
+  local ty = y + self:get_line_text_y_offset()
   local font = self:get_font()
   local color = style.whitespace or style.syntax.comment
   local map = config.whitespace_map
 
+  local i = 1
   for chr in common.utf8_chars(text) do
     local rep = map[chr]
     if rep then
-      renderer.draw_text(font, rep, tx, ty, color)
+      renderer.draw_text(font, rep, x + offsets[i], ty, color)
     end
-    tx = tx + font:get_width(chr)
+    i = i + #chr
   end
 end
 
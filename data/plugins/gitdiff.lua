@@ -0,0 +1,122 @@
+local core = require "core"
+local common = require "core.common"
+local config = require "core.config"
+local style = require "core.style"
+local Doc = require "core.doc"
+local DocView = require "core.docview"
+
+style.gitdiff_added = { common.color "#73c991" }
+style.gitdiff_modified = { common.color "#93DDFA" }
+style.gitdiff_deleted = { common.color "#F77483" }
+
+
+-- doc -> { diff = Diff, filename = filename the diff is for }
+local diffs = setmetatable({}, { __mode = "k" })
+
+
+-- fetches the doc's file from HEAD in a thread and diffs the doc against
+-- it, the edits then update the diff as they go
+local function load_base(doc)
+  diffs[doc] = nil
+  local filename = doc.filename
+  if not filename then return end
+
+  core.add_thread(function()
+    local path = system.absolute_path(filename) or filename
+    local dir, name = path:match("^(.*)[/\\]([^/\\]+)$")
+    if not dir then return end
+    local text, code = core.read_process({ "git", "-C", dir, "show", "HEAD:./" .. name })
+    if code ~= 0 or doc.filename ~= filename then return end
+    local d = diff.new(text)
+    d:reset(doc.lines)
+    diffs[doc] = { diff = d, filename = filename }
+    core.redraw = true
+  end)
+end
+
+
+-- diff the docs again when HEAD moves
+core.add_thread(function()
+  local head
+  while true do
+    if system.get_file_info(".git") then
+      local h = core.read_process({ "git", "rev-parse", "HEAD" })
+      if head and h ~= head then
+        for _, doc in ipairs(core.docs) do
+          load_base(doc)
+        end
+      end
+      head = h
+    end
+    coroutine.yield(config.project_scan_rate)
+  end
+end)
+
+
+local load = Doc.load
+
+function Doc:load(filename, ...)
+  local res = load(self, filename, ...)
+  local entry = diffs[self]
+  if entry and entry.filename == filename then
+    entry.diff:reset(self.lines)
+  else
+    load_base(self)
+  end
+  return res
+end
+
+
+local save = Doc.save
+
+function Doc:save(filename, ...)
+  local res = save(self, filename, ...)
+  local entry = diffs[self]
+  if not entry or entry.filename ~= self.filename then
+    load_base(self)
+  end
+  return res
+end
+
+
+local on_lines_changed = Doc.on_lines_changed
+
+function Doc:on_lines_changed(line, removed, added)
+  on_lines_changed(self, line, removed, added)
+  local entry = diffs[self]
+  if entry then
+    entry.diff:update(self.lines, line, removed, added)
+  end
+end
+
+
+local draw = DocView.draw
+
+function DocView:draw()
+  local entry = diffs[self.doc]
+  if entry then
+    self.gitdiff_marks = entry.diff:get_marks(self:get_visible_line_range())
+  else
+    self.gitdiff_marks = nil
+  end
+  draw(self)
+end
+
+
+local draw_line_gutter = DocView.draw_line_gutter
+
+function DocView:draw_line_gutter(idx, x, y)
+  draw_line_gutter(self, idx, x, y)
+  local mark = self.gitdiff_marks and self.gitdiff_marks[idx]
+  if not mark then return end
+
+  local w = style.divider_size
+  local lh = self:get_line_height()
+  if mark == "added" or mark == "modified" then
+    renderer.draw_rect(x, y, w, lh, style["gitdiff_" .. mark])
+  elseif mark == "deleted" then
+    renderer.draw_rect(x, y - w / 2, w * 3, w, style.gitdiff_deleted)
+  else
+    renderer.draw_rect(x, y + lh - w / 2, w * 3, w, style.gitdiff_deleted)
+  end
+end
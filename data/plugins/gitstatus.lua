@@ -11,15 +11,8 @@ local git = {
 }
 
 
-local function exec(cmd, wait)
-  local tempfile = core.temp_filename()
-  system.exec(string.format("%s > %q", cmd, tempfile))
-  coroutine.yield(wait)
-  local fp = io.open(tempfile)
-  local res = fp:read("*a")
-  fp:close()
-  os.remove(tempfile)
-  return res
+local function exec(argv)
+  return core.read_process(argv) or ""
 end
 
 
@@ -27,12 +20,13 @@ core.add_thread(function()
   while true do
     if system.get_file_info(".git") then
       -- get branch name
-      git.branch = exec("git rev-parse --abbrev-ref HEAD", 1):match("[^\n]*")
+      git.branch = exec({ "git", "rev-parse", "--abbrev-ref", "HEAD" }):match("[^\n]*")
 
       -- get diff
-      local line = exec("git diff --stat", 1):match("[^\n]*%s*$")
+      local line = exec({ "git", "diff", "--stat" }):match("[^\n]*%s*$")
       git.inserts = tonumber(line:match("(%d+) ins")) or 0
       git.deletes = tonumber(line:match("(%d+) del")) or 0
+      core.redraw = true
 
     else
       git.branch = nil
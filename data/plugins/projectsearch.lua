@@ -9,11 +9,11 @@ local View = require "core.view"
 local ResultsView = View:extend()
 
 
-function ResultsView:new(text, fn)
+function ResultsView:new(text, fn, opts)
   ResultsView.super.new(self)
   self.scrollable = true
   self.brightness = 0
-  self:begin_search(text, fn)
+  self:begin_search(text, fn, opts)
 end
 
 
@@ -40,25 +40,70 @@ local function find_all_matches_in_file(t, filename, fn)
 end
 
 
-function ResultsView:begin_search(text, fn)
-  self.search_args = { text, fn }
+-- Literal and regex searches run natively on worker threads, the
+-- matches are moved into `results` a batch at a time. Returns false if
+-- another search was begun meanwhile, the view is left to that one.
+local function search_files(self, text, opts, results)
+  local files = {}
+  for _, file in ipairs(core.project_files) do
+    if file.type == "file" then
+      table.insert(files, file.filename)
+    end
+  end
+  self.file_count = #files
+
+  local job, err = system.search_files(files, text, opts)
+  if not job then
+    core.error("%s", err)
+    return true
+  end
+  self.search_job = job
+  while true do
+    local files_done, done = job:poll(results, 1000)
+    self.last_file_idx = files_done
+    core.redraw = true
+    if done then return true end
+    coroutine.yield()
+    if self.search_job ~= job then return false end
+  end
+end
+
+
+function ResultsView:begin_search(text, fn, opts)
+  if self.search_job then
+    self.search_job:cancel()
+    self.search_job = nil
+  end
+  self.search_args = { text, fn, opts }
   self.results = {}
   self.last_file_idx = 1
+  self.file_count = #core.project_files
   self.query = text
   self.searching = true
   self.selected_idx = 0
 
+  -- the thread only touches the view while its search is the current one
+  local results = self.results
   core.add_thread(function()
-    for i, file in ipairs(core.project_files) do
-      if file.type == "file" then
-        find_all_matches_in_file(self.results, file.filename, fn)
+    if self.results ~= results then return end
+    if opts then
+      if not search_files(self, text, opts, results) then return end
+    else
+      -- the scanner changes the list in place while this yields
+      local files = {}
+      for i, file in ipairs(core.project_files) do files[i] = file end
+      for i, file in ipairs(files) do
+        if file.type == "file" then
+          find_all_matches_in_file(results, file.filename, fn)
+        end
+        if self.results ~= results then return end
+        self.last_file_idx = i
       end
-      self.last_file_idx = i
     end
     self.searching = false
     self.brightness = 100
     core.redraw = true
-  end, self.results)
+  end, results)
 
   self.scroll.to.y = 0
 end
@@ -162,11 +207,11 @@ function ResultsView:draw()
   -- status
   local ox, oy = self:get_content_offset()
   local x, y = ox + style.padding.x, oy + style.padding.y
-  local per = self.last_file_idx / #core.project_files
+  local per = self.last_file_idx / math.max(self.file_count, 1)
   local text
   if self.searching then
     text = string.format("Searching %d%% (%d of %d files, %d matches) for %q...",
-      per * 100, self.last_file_idx, #core.project_files,
+      per * 100, self.last_file_idx, self.file_count,
       #self.results, self.query)
   else
     text = string.format("Found %d matches for %q",
@@ -204,12 +249,12 @@ function ResultsView:draw()
 end
 
 
-local function begin_search(text, fn)
+local function begin_search(text, fn, opts)
   if text == "" then
     core.error("Expected non-empty string")
     return
   end
-  local rv = ResultsView(text, fn)
+  local rv = ResultsView(text, fn, opts)
   core.root_view:get_active_node():add_view(rv)
 end
 
@@ -217,16 +262,18 @@ end
 command.add(nil, {
   ["project-search:find"] = function()
     core.command_view:enter("Find Text In Project", function(text)
-      text = text:lower()
-      begin_search(text, function(line_text)
-        return line_text:lower():find(text, nil, true)
-      end)
+      begin_search(text:lower(), nil, { no_case = true })
     end)
   end,
 
   ["project-search:find-pattern"] = function()
     core.command_view:enter("Find Pattern In Project", function(text)
-      begin_search(text, function(line_text) return line_text:find(text) end)
+      local ok, err = regex.compile(text)
+      if not ok then
+        core.error("Bad pattern %q: %s", text, err)
+        return
+      end
+      begin_search(text, nil, { regex = true })
     end)
   end,
 
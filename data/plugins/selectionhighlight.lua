@@ -1,5 +1,6 @@
 local style = require "core.style"
 local DocView = require "core.docview"
+local search = require "core.doc.search"
 
 -- originally written by luveti
 
@@ -20,16 +21,18 @@ function DocView:draw_line_body(idx, x, y)
   if line1 == line2 and col1 ~= col2 then
     local lh = self:get_line_height()
     local selected_text = self.doc.lines[line1]:sub(col1, col2 - 1)
-    local current_line_text = self.doc.lines[idx]
+    local set = search.get_matches(self.doc, selected_text)
     local last_col = 1
-    while true do
-      local start_col, end_col = current_line_text:find(selected_text, last_col, true)
-      if start_col == nil then break end
-      local x1 = x + self:get_col_x_offset(idx, start_col)
-      local x2 = x + self:get_col_x_offset(idx, end_col + 1)
-      local color = style.selectionhighlight or style.syntax.comment
-      draw_box(x1, y, x2 - x1, lh, color)
-      last_col = end_col + 1
+    for _, start_col in ipairs(set:get_line(idx)) do
+      -- overlapping matches are skipped, like string.find would
+      if start_col >= last_col then
+        local end_col = start_col + #selected_text
+        local x1 = x + self:get_col_x_offset(idx, start_col)
+        local x2 = x + self:get_col_x_offset(idx, end_col)
+        local color = style.selectionhighlight or style.syntax.comment
+        draw_box(x1, y, x2 - x1, lh, color)
+        last_col = end_col
+      end
     end
   end
   draw_line_body(self, idx, x, y)
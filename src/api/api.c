@@ -3,11 +3,29 @@
 
 int luaopen_system(lua_State *L);
 int luaopen_renderer(lua_State *L);
+int luaopen_buffer(lua_State *L);
+int luaopen_tokenizer(lua_State *L);
+int luaopen_profiler(lua_State *L);
+int luaopen_diff(lua_State *L);
+int luaopen_symbols(lua_State *L);
+int luaopen_undo(lua_State *L);
+int luaopen_matches(lua_State *L);
+int luaopen_regex(lua_State *L);
+int luaopen_embedded(lua_State *L);
 
 
 static const luaL_Reg libs[] = {
   { "system",    luaopen_system     },
   { "renderer",  luaopen_renderer   },
+  { "buffer",    luaopen_buffer     },
+  { "tokenizer", luaopen_tokenizer  },
+  { "profiler",  luaopen_profiler   },
+  { "diff",      luaopen_diff       },
+  { "symbols",   luaopen_symbols    },
+  { "undo",      luaopen_undo       },
+  { "matches",   luaopen_matches    },
+  { "regex",     luaopen_regex      },
+  { "embedded",  luaopen_embedded   },
   { NULL, NULL }
 };
 
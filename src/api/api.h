@@ -4,6 +4,7 @@
 #include <lua/lua.h>
 #include <lua/lauxlib.h>
 #include <lua/lualib.h>
+#include <stdbool.h>
 
 #define LUA_MODULE_CALL(L, module, func) \
 do { \
@@ -25,8 +26,26 @@ do { \
 typedef struct sapp_event sapp_event;
 
 #define API_TYPE_FONT "Font"
+#define API_TYPE_BUFFER "Buffer"
+#define API_TYPE_PALETTE "Palette"
+#define API_TYPE_TOKENIZER "Tokenizer"
+#define API_TYPE_HIGHLIGHT_JOB "HighlightJob"
+#define API_TYPE_SEARCH_JOB "SearchJob"
+#define API_TYPE_SCANNER "Scanner"
+#define API_TYPE_FUZZY_CORPUS "FuzzyCorpus"
+#define API_TYPE_PROCESS "Process"
+#define API_TYPE_WATCHER "Watcher"
+#define API_TYPE_DIFF "Diff"
+#define API_TYPE_SYMBOL_INDEX "SymbolIndex"
+#define API_TYPE_SYMBOL_DOC "SymbolDoc"
+#define API_TYPE_UNDO_STACK "UndoStack"
+#define API_TYPE_SAVE_JOB "SaveJob"
+#define API_TYPE_MATCH_SET "MatchSet"
+#define API_TYPE_REGEX "Regex"
 
 void api_load_libs(lua_State *L);
+void api_profile_gc(lua_State *L);
 void enqueue_event(const sapp_event* e);
+bool has_queued_events(void);
 
 #endif
@@ -0,0 +1,289 @@
+#include "api.h"
+#include "../buffer.h"
+#include "../save.h"
+
+#include <errno.h>
+#include <string.h>
+
+
+static Buffer* checkbuffer(lua_State *L, int idx) {
+  Buffer **self = luaL_checkudata(L, idx, API_TYPE_BUFFER);
+  return *self;
+}
+
+
+static void pushbuffer(lua_State *L, Buffer *buf) {
+  Buffer **self = lua_newuserdata(L, sizeof(*self));
+  *self = buf;
+  luaL_setmetatable(L, API_TYPE_BUFFER);
+}
+
+
+// Converts the `line, col` pair at `idx` to a 0-based byte offset.
+static size_t checkoffset(lua_State *L, Buffer *buf, int idx) {
+  size_t line = luaL_checkinteger(L, idx);
+  size_t col = luaL_checkinteger(L, idx + 1);
+  size_t count = buffer_get_line_count(buf);
+  luaL_argcheck(L, line >= 1 && line <= count, idx, "line out of range");
+  luaL_argcheck(L, col >= 1 && col <= buffer_get_line_length(buf, line) + 1,
+    idx + 1, "column out of range");
+  return buffer_get_line_offset(buf, line) + col - 1;
+}
+
+
+static void pushrange(lua_State *L, Buffer *buf, size_t offset, size_t len) {
+  luaL_Buffer b;
+  char *dst = luaL_buffinitsize(L, &b, len);
+  buffer_read(buf, offset, len, dst);
+  luaL_pushresultsize(&b, len);
+}
+
+
+static int pushline(lua_State *L, Buffer *buf, lua_Integer line) {
+  if (line < 1 || (size_t)line > buffer_get_line_count(buf)) {
+    lua_pushnil(L);
+    return 1;
+  }
+  size_t offset = buffer_get_line_offset(buf, line);
+  pushrange(L, buf, offset, buffer_get_line_length(buf, line));
+  return 1;
+}
+
+
+static int f_new(lua_State *L) {
+  size_t len;
+  const char *text = luaL_optlstring(L, 1, "", &len);
+  pushbuffer(L, buffer_new(text, len));
+  return 1;
+}
+
+
+static int f_load(lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  bool crlf;
+  Buffer *buf = buffer_load(filename, &crlf);
+  if (!buf) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", filename, strerror(errno));
+    return 2;
+  }
+  pushbuffer(L, buf);
+  lua_pushboolean(L, crlf);
+  return 2;
+}
+
+
+static int f_gc(lua_State *L) {
+  Buffer **self = luaL_checkudata(L, 1, API_TYPE_BUFFER);
+  if (*self) { buffer_free(*self); }
+  return 0;
+}
+
+
+static int f_index(lua_State *L) {
+  Buffer *buf = checkbuffer(L, 1);
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    return pushline(L, buf, lua_tointeger(L, 2));
+  }
+  lua_getmetatable(L, 1);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  return 1;
+}
+
+
+static int f_len(lua_State *L) {
+  Buffer *buf = checkbuffer(L, 1);
+  lua_pushnumber(L, buffer_get_line_count(buf));
+  return 1;
+}
+
+
+static int ipairs_iter(lua_State *L) {
+  Buffer *buf = checkbuffer(L, 1);
+  lua_Integer i = luaL_checkinteger(L, 2) + 1;
+  if ((size_t)i > buffer_get_line_count(buf)) { return 0; }
+  lua_pushinteger(L, i);
+  pushline(L, buf, i);
+  return 2;
+}
+
+
+static int f_ipairs(lua_State *L) {
+  checkbuffer(L, 1);
+  lua_pushcfunction(L, ipairs_iter);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  return 3;
+}
+
+
+static int f_get_line(lua_State *L) {
+  Buffer *buf = checkbuffer(L, 1);
+  return pushline(L, buf, luaL_checkinteger(L, 2));
+}
+
+
+static int f_get_line_length(lua_State *L) {
+  Buffer *buf = checkbuffer(L, 1);
+  lua_Integer line = luaL_checkinteger(L, 2);
+  if (line < 1 || (size_t)line > buffer_get_line_count(buf)) {
+    lua_pushnumber(L, 0);
+  } else {
+    lua_pushnumber(L, buffer_get_line_length(buf, line));
+  }
+  return 1;
+}
+
+
+static int f_get_size(lua_State *L) {
+  Buffer *buf = checkbuffer(L, 1);
+  lua_pushnumber(L, buffer_get_size(buf));
+  return 1;
+}
+
+
+static int f_get_offset(lua_State *L) {
+  Buffer *buf = checkbuffer(L, 1);
+  lua_pushnumber(L, checkoffset(L, buf, 2) + 1);
+  return 1;
+}
+
+
+static int f_get_position(lua_State *L) {
+  Buffer *buf = checkbuffer(L, 1);
+  lua_Integer offset = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, offset >= 1 && (size_t)offset <= buffer_get_size(buf) + 1,
+    2, "offset out of range");
+  size_t line = buffer_get_offset_line(buf, offset - 1);
+  lua_pushnumber(L, line);
+  lua_pushnumber(L, offset - buffer_get_line_offset(buf, line));
+  return 2;
+}
+
+
+static int f_get_text(lua_State *L) {
+  Buffer *buf = checkbuffer(L, 1);
+  size_t a = checkoffset(L, buf, 2);
+  size_t b = checkoffset(L, buf, 4);
+  luaL_argcheck(L, a <= b, 4, "end position before start position");
+  pushrange(L, buf, a, b - a);
+  return 1;
+}
+
+
+static int f_insert(lua_State *L) {
+  Buffer *buf = checkbuffer(L, 1);
+  size_t offset = checkoffset(L, buf, 2);
+  size_t len;
+  const char *text = luaL_checklstring(L, 4, &len);
+  buffer_insert(buf, offset, text, len);
+  return 0;
+}
+
+
+static int f_remove(lua_State *L) {
+  Buffer *buf = checkbuffer(L, 1);
+  size_t a = checkoffset(L, buf, 2);
+  size_t b = checkoffset(L, buf, 4);
+  luaL_argcheck(L, a <= b, 4, "end position before start position");
+  buffer_remove(buf, a, b - a);
+  return 0;
+}
+
+
+// Starts saving the buffer to `filename`, returns a SaveJob or nil and
+// an error. The buffer can be edited and freed while it saves.
+static int f_save(lua_State *L) {
+  Buffer *buf = checkbuffer(L, 1);
+  const char *filename = luaL_checkstring(L, 2);
+  bool crlf = lua_toboolean(L, 3);
+  const char *error;
+  SaveJob *job = save_job_new(buf, filename, crlf, &error);
+  if (!job) {
+    lua_pushnil(L);
+    lua_pushstring(L, error);
+    return 2;
+  }
+  SaveJob **self = lua_newuserdata(L, sizeof(*self));
+  *self = job;
+  luaL_setmetatable(L, API_TYPE_SAVE_JOB);
+  return 1;
+}
+
+
+static int f_save_job_gc(lua_State *L) {
+  SaveJob **self = luaL_checkudata(L, 1, API_TYPE_SAVE_JOB);
+  if (*self) { save_job_free(*self); }
+  *self = NULL;
+  return 0;
+}
+
+
+// Returns whether it's done, the bytes written and the total, and the
+// error if it failed.
+static int f_save_job_poll(lua_State *L) {
+  SaveJob **self = luaL_checkudata(L, 1, API_TYPE_SAVE_JOB);
+  size_t written, total;
+  const char *error;
+  bool done = save_job_poll(*self, &written, &total, &error);
+  lua_pushboolean(L, done);
+  lua_pushnumber(L, written);
+  lua_pushnumber(L, total);
+  if (!error) { return 3; }
+  lua_pushstring(L, error);
+  return 4;
+}
+
+
+static int f_save_job_wait(lua_State *L) {
+  SaveJob **self = luaL_checkudata(L, 1, API_TYPE_SAVE_JOB);
+  const char *error = save_job_wait(*self);
+  if (error) {
+    lua_pushnil(L);
+    lua_pushstring(L, error);
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+static const luaL_Reg save_job_lib[] = {
+  { "__gc", f_save_job_gc   },
+  { "poll", f_save_job_poll },
+  { "wait", f_save_job_wait },
+  { NULL, NULL }
+};
+
+
+static const luaL_Reg lib[] = {
+  { "__gc",            f_gc              },
+  { "__index",         f_index           },
+  { "__len",           f_len             },
+  { "__ipairs",        f_ipairs          },
+  { "new",             f_new             },
+  { "load",            f_load            },
+  { "save",            f_save            },
+  { "get_line",        f_get_line        },
+  { "get_line_length", f_get_line_length },
+  { "get_size",        f_get_size        },
+  { "get_offset",      f_get_offset      },
+  { "get_position",    f_get_position    },
+  { "get_text",        f_get_text        },
+  { "insert",          f_insert          },
+  { "remove",          f_remove          },
+  { NULL, NULL }
+};
+
+int luaopen_buffer(lua_State *L) {
+  luaL_newmetatable(L, API_TYPE_SAVE_JOB);
+  luaL_setfuncs(L, save_job_lib, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, API_TYPE_BUFFER);
+  luaL_setfuncs(L, lib, 0);
+  return 1;
+}
@@ -0,0 +1,126 @@
+#include "api.h"
+#include "../diff.h"
+
+
+static const char *mark_names[] = {
+  NULL, "added", "modified", "deleted", "deleted_below"
+};
+
+
+static Diff* checkdiff(lua_State *L, int idx) {
+  Diff **self = luaL_checkudata(L, idx, API_TYPE_DIFF);
+  return *self;
+}
+
+
+static int f_new(lua_State *L) {
+  size_t len;
+  const char *base = luaL_checklstring(L, 1, &len);
+  Diff **self = lua_newuserdata(L, sizeof(*self));
+  *self = diff_new(base, len);
+  luaL_setmetatable(L, API_TYPE_DIFF);
+  return 1;
+}
+
+
+static int f_gc(lua_State *L) {
+  Diff **self = luaL_checkudata(L, 1, API_TYPE_DIFF);
+  if (*self) { diff_free(*self); }
+  *self = NULL;
+  return 0;
+}
+
+
+static int f_reset(lua_State *L) {
+  Diff *diff = checkdiff(L, 1);
+  Buffer **buf = luaL_checkudata(L, 2, API_TYPE_BUFFER);
+  diff_reset(diff, *buf);
+  return 0;
+}
+
+
+static int f_update(lua_State *L) {
+  Diff *diff = checkdiff(L, 1);
+  Buffer **buf = luaL_checkudata(L, 2, API_TYPE_BUFFER);
+  int line = luaL_checkinteger(L, 3);
+  int removed = luaL_checkinteger(L, 4);
+  int added = luaL_checkinteger(L, 5);
+  luaL_argcheck(L, line >= 1, 3, "line out of range");
+  diff_update(diff, *buf, line, removed, added);
+  return 0;
+}
+
+
+// Returns a table of the marks of lines `first` to `last`, indexed by
+// line, unchanged lines are left out.
+static int f_get_marks(lua_State *L) {
+  Diff *diff = checkdiff(L, 1);
+  int first = luaL_checkinteger(L, 2);
+  int last = luaL_checkinteger(L, 3);
+  if (first < 1) { first = 1; }
+  lua_newtable(L);
+  if (last < first) { return 1; }
+
+  int count = last - first + 1;
+  unsigned char *marks = lua_newuserdata(L, count);
+  diff_get_marks(diff, first, count, marks);
+  for (int i = 0; i < count; i++) {
+    if (marks[i] == DIFF_NONE) { continue; }
+    lua_pushstring(L, mark_names[marks[i]]);
+    lua_rawseti(L, -3, first + i);
+  }
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+static int f_get_stats(lua_State *L) {
+  Diff *diff = checkdiff(L, 1);
+  int inserts, deletes;
+  diff_get_stats(diff, &inserts, &deletes);
+  lua_pushnumber(L, inserts);
+  lua_pushnumber(L, deletes);
+  return 2;
+}
+
+
+// Returns the hunks as a flat table of their base line, base line count,
+// line and line count.
+static int f_get_hunks(lua_State *L) {
+  Diff *diff = checkdiff(L, 1);
+  int n = diff_get_hunks(diff, NULL);
+  DiffHunk *hunks = lua_newuserdata(L, (n ? n : 1) * sizeof(DiffHunk));
+  diff_get_hunks(diff, hunks);
+  lua_createtable(L, n * 4, 0);
+  for (int i = 0; i < n; i++) {
+    lua_pushnumber(L, hunks[i].base_line);
+    lua_rawseti(L, -2, i * 4 + 1);
+    lua_pushnumber(L, hunks[i].base_count);
+    lua_rawseti(L, -2, i * 4 + 2);
+    lua_pushnumber(L, hunks[i].line);
+    lua_rawseti(L, -2, i * 4 + 3);
+    lua_pushnumber(L, hunks[i].count);
+    lua_rawseti(L, -2, i * 4 + 4);
+  }
+  return 1;
+}
+
+
+static const luaL_Reg lib[] = {
+  { "__gc",      f_gc        },
+  { "new",       f_new       },
+  { "reset",     f_reset     },
+  { "update",    f_update    },
+  { "get_marks", f_get_marks },
+  { "get_stats", f_get_stats },
+  { "get_hunks", f_get_hunks },
+  { NULL, NULL }
+};
+
+int luaopen_diff(lua_State *L) {
+  luaL_newmetatable(L, API_TYPE_DIFF);
+  luaL_setfuncs(L, lib, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  return 1;
+}
@@ -0,0 +1,94 @@
+#include "api.h"
+#include "../embedded.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+static int compare_module(const void *key, const void *mod) {
+  return strcmp(key, ((const EmbeddedModule*)mod)->name);
+}
+
+
+// Pushes the chunk of the module and its filename, returns false if it
+// isn't embedded.
+static bool load_module(lua_State *L, const char *name) {
+  const EmbeddedModule *mod = bsearch(name, embedded_modules, embedded_modules_count,
+                                      sizeof(EmbeddedModule), compare_module);
+  if (!mod) { return false; }
+  lua_pushfstring(L, "@%s", mod->filename);
+  if (luaL_loadbuffer(L, (const char*)mod->data, mod->size, lua_tostring(L, -1)) != LUA_OK) {
+    luaL_error(L, "error loading embedded module '%s':\n\t%s", name, lua_tostring(L, -1));
+  }
+  lua_remove(L, -2);
+  lua_pushstring(L, mod->filename);
+  return true;
+}
+
+
+// The entry of package.searchers, require hands the filename to the
+// chunk like it does for the files it finds.
+static int searcher(lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  if (!load_module(L, name)) {
+    lua_pushfstring(L, "\n\tno embedded module '%s'", name);
+    return 1;
+  }
+  return 2;
+}
+
+
+// load(name), returns the chunk of the module without running it, or
+// nil if it isn't embedded.
+static int f_load(lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  if (!load_module(L, name)) { return 0; }
+  return 2;
+}
+
+
+// list(prefix), returns the names of the modules starting with
+// `prefix`, sorted.
+static int f_list(lua_State *L) {
+  size_t len;
+  const char *prefix = luaL_optlstring(L, 1, "", &len);
+  lua_newtable(L);
+  int n = 0;
+  for (int i = 0; i < embedded_modules_count; i++) {
+    if (strncmp(embedded_modules[i].name, prefix, len) == 0) {
+      lua_pushstring(L, embedded_modules[i].name);
+      lua_rawseti(L, -2, ++n);
+    }
+  }
+  return 1;
+}
+
+
+static const luaL_Reg lib[] = {
+  { "load", f_load },
+  { "list", f_list },
+  { NULL, NULL }
+};
+
+// Puts the embedded modules ahead of the files on disk, right after
+// package.preload, unless TSUNADE_DEV is set to work on the sources.
+// Modules that aren't embedded are still found on disk.
+int luaopen_embedded(lua_State *L) {
+  luaL_newlib(L, lib);
+  const char *dev = getenv("TSUNADE_DEV");
+  bool enabled = !dev || !*dev;
+  lua_pushboolean(L, enabled);
+  lua_setfield(L, -2, "enabled");
+  if (!enabled) { return 1; }
+
+  lua_getglobal(L, "package");
+  lua_getfield(L, -1, "searchers");
+  for (int i = lua_rawlen(L, -1); i >= 2; i--) {
+    lua_rawgeti(L, -1, i);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_pushcfunction(L, searcher);
+  lua_rawseti(L, -2, 2);
+  lua_pop(L, 2);
+  return 1;
+}
@@ -0,0 +1,147 @@
+#include "api.h"
+#include "../matches.h"
+
+#include <stdlib.h>
+
+
+static MatchSet* checkset(lua_State *L, int idx) {
+  MatchSet **self = luaL_checkudata(L, idx, API_TYPE_MATCH_SET);
+  return *self;
+}
+
+
+static Buffer* checkbuffer(lua_State *L, int idx) {
+  Buffer **buf = luaL_checkudata(L, idx, API_TYPE_BUFFER);
+  return *buf;
+}
+
+
+static int f_new(lua_State *L) {
+  size_t len;
+  const char *query = luaL_checklstring(L, 1, &len);
+  bool no_case = lua_toboolean(L, 2);
+  MatchSet **self = lua_newuserdata(L, sizeof(*self));
+  *self = match_set_new(query, len, no_case);
+  luaL_setmetatable(L, API_TYPE_MATCH_SET);
+  return 1;
+}
+
+
+static int f_gc(lua_State *L) {
+  MatchSet **self = luaL_checkudata(L, 1, API_TYPE_MATCH_SET);
+  if (*self) { match_set_free(*self); }
+  *self = NULL;
+  return 0;
+}
+
+
+// Returns the query, lower case if the set is case insensitive, and
+// whether it is.
+static int f_get_query(lua_State *L) {
+  size_t len;
+  bool no_case;
+  const char *query = match_set_get_query(checkset(L, 1), &len, &no_case);
+  lua_pushlstring(L, query, len);
+  lua_pushboolean(L, no_case);
+  return 2;
+}
+
+
+static int f_reset(lua_State *L) {
+  match_set_reset(checkset(L, 1), checkbuffer(L, 2));
+  return 0;
+}
+
+
+static int f_update(lua_State *L) {
+  MatchSet *set = checkset(L, 1);
+  Buffer *buf = checkbuffer(L, 2);
+  int line = luaL_checkinteger(L, 3);
+  int removed = luaL_checkinteger(L, 4);
+  int added = luaL_checkinteger(L, 5);
+  luaL_argcheck(L, line >= 1, 3, "line out of range");
+  match_set_update(set, buf, line, removed, added);
+  return 0;
+}
+
+
+static int f_get_count(lua_State *L) {
+  lua_pushnumber(L, match_set_get_count(checkset(L, 1)));
+  return 1;
+}
+
+
+// Returns the columns of the matches starting at the line.
+static int f_get_line(lua_State *L) {
+  int count;
+  const int *cols = match_set_get_line(checkset(L, 1), luaL_checkinteger(L, 2), &count);
+  lua_createtable(L, count, 0);
+  for (int i = 0; i < count; i++) {
+    lua_pushnumber(L, cols[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+
+// find(line, col, reverse, wrap), returns the range of the match found.
+static int f_find(lua_State *L) {
+  MatchSet *set = checkset(L, 1);
+  int line = luaL_checkinteger(L, 2);
+  int col = luaL_checkinteger(L, 3);
+  bool reverse = lua_toboolean(L, 4);
+  bool wrap = lua_toboolean(L, 5);
+  int line1, col1, line2, col2;
+  if (!match_set_find(set, line, col, reverse, wrap, &line1, &col1)) { return 0; }
+  match_set_get_end(set, line1, col1, &line2, &col2);
+  lua_pushnumber(L, line1);
+  lua_pushnumber(L, col1);
+  lua_pushnumber(L, line2);
+  lua_pushnumber(L, col2);
+  return 4;
+}
+
+
+// replace(lines, line1, col1, line2, col2, text), returns the text of
+// the range with its matches replaced and how many were.
+static int f_replace(lua_State *L) {
+  MatchSet *set = checkset(L, 1);
+  Buffer *buf = checkbuffer(L, 2);
+  int line1 = luaL_checkinteger(L, 3);
+  int col1 = luaL_checkinteger(L, 4);
+  int line2 = luaL_checkinteger(L, 5);
+  int col2 = luaL_checkinteger(L, 6);
+  size_t text_len, len;
+  const char *text = luaL_checklstring(L, 7, &text_len);
+  int count = (int)buffer_get_line_count(buf);
+  luaL_argcheck(L, line1 >= 1 && line1 <= count, 3, "line out of range");
+  luaL_argcheck(L, line2 >= line1 && line2 <= count, 5, "line out of range");
+  int n;
+  char *res = match_set_replace(set, buf, line1, col1, line2, col2, text, text_len, &len, &n);
+  lua_pushlstring(L, res, len);
+  free(res);
+  lua_pushnumber(L, n);
+  return 2;
+}
+
+
+static const luaL_Reg lib[] = {
+  { "__gc",      f_gc        },
+  { "new",       f_new       },
+  { "get_query", f_get_query },
+  { "reset",     f_reset     },
+  { "update",    f_update    },
+  { "get_count", f_get_count },
+  { "get_line",  f_get_line  },
+  { "find",      f_find      },
+  { "replace",   f_replace   },
+  { NULL, NULL }
+};
+
+int luaopen_matches(lua_State *L) {
+  luaL_newmetatable(L, API_TYPE_MATCH_SET);
+  luaL_setfuncs(L, lib, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  return 1;
+}
@@ -0,0 +1,115 @@
+#include "api.h"
+#include "../profiler.h"
+
+#include <string.h>
+#include <errno.h>
+
+
+static int gc_cycles;
+
+
+static int f_begin_zone(lua_State *L) {
+  profiler_begin(profiler_intern(luaL_checkstring(L, 1)));
+  return 0;
+}
+
+
+static int f_end_zone(lua_State *L) {
+  (void)L;
+  profiler_end();
+  return 0;
+}
+
+
+static int f_counter(lua_State *L) {
+  const char *name = luaL_checkstring(L, 1);
+  profiler_counter(profiler_intern(name), luaL_checknumber(L, 2));
+  return 0;
+}
+
+
+static void push_stats(lua_State *L, const ProfilerStat *stats, int count, double scale) {
+  lua_createtable(L, 0, count);
+  for (int i = 0; i < count; i++) {
+    lua_pushnumber(L, stats[i].value * scale);
+    lua_setfield(L, -2, stats[i].name);
+  }
+}
+
+
+// Returns `{ time, max_time, zones = { [name] = time }, counters = {...} }`
+// over the last `frames` frames, times in milliseconds.
+static int f_get_stats(lua_State *L) {
+  ProfilerStats stats;
+  profiler_get_stats(luaL_optint(L, 1, 60), &stats);
+  lua_createtable(L, 0, 4);
+  lua_pushnumber(L, stats.time * 1000);
+  lua_setfield(L, -2, "time");
+  lua_pushnumber(L, stats.max_time * 1000);
+  lua_setfield(L, -2, "max_time");
+  push_stats(L, stats.zones, stats.zone_count, 1000);
+  lua_setfield(L, -2, "zones");
+  push_stats(L, stats.counters, stats.counter_count, 1);
+  lua_setfield(L, -2, "counters");
+  return 1;
+}
+
+
+static int f_save_trace(lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  if (!profiler_save_trace(filename)) {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+// Lua 5.2 doesn't tell when the collector runs, so a sentinel object is
+// kept around: every cycle collects it, and its finalizer counts the
+// cycle and makes a new one.
+static void new_gc_sentinel(lua_State *L);
+
+static int f_sentinel_gc(lua_State *L) {
+  gc_cycles++;
+  new_gc_sentinel(L);
+  return 0;
+}
+
+
+static void new_gc_sentinel(lua_State *L) {
+  lua_newuserdata(L, 1);
+  lua_createtable(L, 0, 1);
+  lua_pushcfunction(L, f_sentinel_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  lua_pop(L, 1);
+}
+
+
+// Samples the Lua heap into the frame's counters.
+void api_profile_gc(lua_State *L) {
+  double kb = lua_gc(L, LUA_GCCOUNT, 0) + lua_gc(L, LUA_GCCOUNTB, 0) / 1024.0;
+  profiler_counter("gc kb", kb);
+  profiler_counter("gc cycles", gc_cycles);
+  gc_cycles = 0;
+}
+
+
+static const luaL_Reg lib[] = {
+  { "begin_zone", f_begin_zone },
+  { "end_zone",   f_end_zone   },
+  { "counter",    f_counter    },
+  { "get_stats",  f_get_stats  },
+  { "save_trace", f_save_trace },
+  { NULL,         NULL         }
+};
+
+
+int luaopen_profiler(lua_State *L) {
+  new_gc_sentinel(L);
+  luaL_newlib(L, lib);
+  return 1;
+}
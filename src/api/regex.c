@@ -0,0 +1,156 @@
+#include "api.h"
+#include "../regex.h"
+
+
+static Regex* checkregex(lua_State *L, int idx) {
+  Regex **self = luaL_checkudata(L, idx, API_TYPE_REGEX);
+  return *self;
+}
+
+
+// compile(pattern, no_case), returns nil and the error on a bad pattern.
+static int f_compile(lua_State *L) {
+  size_t len;
+  const char *pattern = luaL_checklstring(L, 1, &len);
+  int flags = lua_toboolean(L, 2) ? REGEX_NO_CASE : 0;
+  const char *error;
+  Regex *re = regex_new(pattern, len, flags, &error);
+  if (!re) {
+    lua_pushnil(L);
+    lua_pushstring(L, error);
+    return 2;
+  }
+  Regex **self = lua_newuserdata(L, sizeof(*self));
+  *self = re;
+  luaL_setmetatable(L, API_TYPE_REGEX);
+  return 1;
+}
+
+
+static int f_gc(lua_State *L) {
+  Regex **self = luaL_checkudata(L, 1, API_TYPE_REGEX);
+  if (*self) { regex_free(*self); }
+  *self = NULL;
+  return 0;
+}
+
+
+static int f_get_group_count(lua_State *L) {
+  lua_pushnumber(L, regex_get_group_count(checkregex(L, 1)));
+  return 1;
+}
+
+
+// find(text, init), returns the start and end of the match like
+// string.find, and the text of every group, nil for unset ones.
+static int f_find(lua_State *L) {
+  Regex *re = checkregex(L, 1);
+  size_t len;
+  const char *text = luaL_checklstring(L, 2, &len);
+  lua_Integer init = luaL_optinteger(L, 3, 1);
+  if (init < 1) { init = 1; }
+  ptrdiff_t caps[(REGEX_MAX_GROUPS + 1) * 2];
+  if (!regex_find(re, text, len, init - 1, caps)) { return 0; }
+  int groups = regex_get_group_count(re);
+  lua_pushnumber(L, caps[0] + 1);
+  lua_pushnumber(L, caps[1]);
+  for (int i = 1; i <= groups; i++) {
+    if (caps[i * 2] < 0 || caps[i * 2 + 1] < 0) {
+      lua_pushnil(L);
+    } else {
+      lua_pushlstring(L, text + caps[i * 2], caps[i * 2 + 1] - caps[i * 2]);
+    }
+  }
+  return 2 + groups;
+}
+
+
+// Adds `repl` for the match in `caps`, \0 to \9 stand for the match and
+// its groups, \\ for a backslash.
+static void add_replacement(lua_State *L, luaL_Buffer *b, Regex *re, const char *text,
+                            ptrdiff_t *caps, const char *repl, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (repl[i] != '\\' || i + 1 == len) {
+      luaL_addchar(b, repl[i]);
+      continue;
+    }
+    char c = repl[++i];
+    if (c < '0' || c > '9') {
+      luaL_addchar(b, c);
+      continue;
+    }
+    int group = c - '0';
+    if (group > regex_get_group_count(re)) {
+      luaL_error(L, "invalid group reference \\%d in replacement", group);
+    }
+    if (caps[group * 2] >= 0 && caps[group * 2 + 1] >= 0) {
+      luaL_addlstring(b, text + caps[group * 2], caps[group * 2 + 1] - caps[group * 2]);
+    }
+  }
+}
+
+
+// gsub(text, repl), returns the text with every match replaced and how
+// many were.
+static int f_gsub(lua_State *L) {
+  Regex *re = checkregex(L, 1);
+  size_t len, repl_len;
+  const char *text = luaL_checklstring(L, 2, &len);
+  const char *repl = luaL_checklstring(L, 3, &repl_len);
+  ptrdiff_t caps[(REGEX_MAX_GROUPS + 1) * 2];
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  size_t pos = 0;
+  int count = 0;
+  while (pos <= len && regex_find(re, text, len, pos, caps)) {
+    luaL_addlstring(&b, text + pos, caps[0] - pos);
+    add_replacement(L, &b, re, text, caps, repl, repl_len);
+    count++;
+    pos = caps[1];
+    // an empty match keeps the character after it
+    if (caps[1] == caps[0]) {
+      if (pos < len) { luaL_addchar(&b, text[pos]); }
+      pos++;
+    }
+  }
+  if (pos < len) { luaL_addlstring(&b, text + pos, len - pos); }
+  luaL_pushresult(&b);
+  lua_pushnumber(L, count);
+  return 2;
+}
+
+
+// find_lines(lines, line, col, reverse), returns the line and the range
+// of the columns of the match found.
+static int f_find_lines(lua_State *L) {
+  Regex *re = checkregex(L, 1);
+  Buffer **buf = luaL_checkudata(L, 2, API_TYPE_BUFFER);
+  int line = luaL_checkinteger(L, 3);
+  int col = luaL_checkinteger(L, 4);
+  bool reverse = lua_toboolean(L, 5);
+  int line1, col1, col2;
+  if (!regex_find_lines(re, *buf, line, col, reverse, &line1, &col1, &col2)) { return 0; }
+  lua_pushnumber(L, line1);
+  lua_pushnumber(L, col1);
+  lua_pushnumber(L, col2);
+  return 3;
+}
+
+
+static const luaL_Reg lib[] = {
+  { "__gc",            f_gc              },
+  { "compile",         f_compile         },
+  { "get_group_count", f_get_group_count },
+  { "find",            f_find            },
+  { "gsub",            f_gsub            },
+  { "find_lines",      f_find_lines      },
+  { NULL, NULL }
+};
+
+int luaopen_regex(lua_State *L) {
+  luaL_newmetatable(L, API_TYPE_REGEX);
+  luaL_setfuncs(L, lib, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  return 1;
+}
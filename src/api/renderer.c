@@ -20,7 +20,45 @@ static RenColor checkcolor(lua_State *L, int idx, int def) {
 }
 
 
+// A palette maps token types to colors resolved once, so drawing a
+// line doesn't go through `checkcolor` for every token. The type names
+// live in the uservalue table, pointing to the index of their color.
+typedef struct {
+  int count;
+  RenColor colors[];
+} Palette;
+
+
+static int f_new_palette(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int count = 0;
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    count++;
+    lua_pop(L, 1);
+  }
+
+  Palette *palette = lua_newuserdata(L, sizeof(Palette) + count * sizeof(RenColor));
+  luaL_setmetatable(L, API_TYPE_PALETTE);
+  palette->count = 0;
+  lua_createtable(L, 0, count);
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    if (lua_type(L, -2) == LUA_TSTRING && lua_istable(L, -1)) {
+      palette->colors[palette->count++] = checkcolor(L, lua_gettop(L), 255);
+      lua_pushvalue(L, -2);
+      lua_pushinteger(L, palette->count);
+      lua_rawset(L, -5);
+    }
+    lua_pop(L, 1);
+  }
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+
 static int f_show_debug(lua_State *L) {
+  ren_show_debug(lua_toboolean(L, 1));
   return 0;
 }
 
@@ -81,6 +119,39 @@ static int f_draw_text(lua_State *L) {
 }
 
 
+// Takes the highlighter's flat `{ type, text, type, text, ... }` array
+// and draws the whole line as a single command.
+static int f_draw_tokens(lua_State *L) {
+  RenFont **font = luaL_checkudata(L, 1, API_TYPE_FONT);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  int x = luaL_checknumber(L, 3);
+  int y = luaL_checknumber(L, 4);
+  Palette *palette = luaL_checkudata(L, 5, API_TYPE_PALETTE);
+  lua_getuservalue(L, 5);
+  int types = lua_gettop(L);
+
+  int count = lua_rawlen(L, 2) / 2;
+  RenToken *tokens = lua_newuserdata(L, count * sizeof(RenToken) + 1);
+  for (int i = 0; i < count; i++) {
+    RenToken *t = &tokens[i];
+    size_t len;
+    lua_rawgeti(L, 2, i * 2 + 1);
+    lua_rawget(L, types);
+    int idx = lua_tointeger(L, -1);
+    t->color = (idx > 0) ? palette->colors[idx - 1] : (RenColor) { 255, 255, 255, 255 };
+    lua_rawgeti(L, 2, i * 2 + 2);
+    // the strings stay referenced by the tokens table during the call
+    t->text = luaL_checklstring(L, -1, &len);
+    t->len = len;
+    lua_pop(L, 2);
+  }
+
+  x = ren_draw_tokens(*font, tokens, count, x, y);
+  lua_pushnumber(L, x);
+  return 1;
+}
+
+
 static const luaL_Reg lib[] = {
   { "show_debug",    f_show_debug    },
   { "get_size",      f_get_size      },
@@ -89,6 +160,8 @@ static const luaL_Reg lib[] = {
   { "set_clip_rect", f_set_clip_rect },
   { "draw_rect",     f_draw_rect     },
   { "draw_text",     f_draw_text     },
+  { "draw_tokens",   f_draw_tokens   },
+  { "new_palette",   f_new_palette   },
   { NULL,            NULL            }
 };
 
@@ -97,6 +170,8 @@ int luaopen_renderer_font(lua_State *L);
 
 int luaopen_renderer(lua_State *L) {
   luaL_newlib(L, lib);
+  luaL_newmetatable(L, API_TYPE_PALETTE);
+  lua_pop(L, 1);
   luaopen_renderer_font(L);
   lua_setfield(L, -2, "font");
   return 1;
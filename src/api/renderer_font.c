@@ -36,6 +36,31 @@ static int f_get_width(lua_State *L) {
 }
 
 
+static int f_get_col_offsets(lua_State *L) {
+  RenFont **self = luaL_checkudata(L, 1, API_TYPE_FONT);
+  size_t len;
+  const char *text = luaL_checklstring(L, 2, &len);
+  int *offsets = lua_newuserdata(L, (len + 1) * sizeof(int));
+  ren_get_font_offsets(*self, text, len, offsets);
+  lua_createtable(L, len + 1, 0);
+  for (size_t i = 0; i <= len; i++) {
+    lua_pushnumber(L, offsets[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 1;
+}
+
+
+static int f_x_to_col(lua_State *L) {
+  RenFont **self = luaL_checkudata(L, 1, API_TYPE_FONT);
+  size_t len;
+  const char *text = luaL_checklstring(L, 2, &len);
+  float x = luaL_checknumber(L, 3);
+  lua_pushnumber(L, ren_get_font_col(*self, text, len, x) );
+  return 1;
+}
+
+
 static int f_get_height(lua_State *L) {
   RenFont **self = luaL_checkudata(L, 1, API_TYPE_FONT);
   lua_pushnumber(L, ren_get_font_height(*self) );
@@ -44,11 +69,13 @@ static int f_get_height(lua_State *L) {
 
 
 static const luaL_Reg lib[] = {
-  { "__gc",          f_gc            },
-  { "load",          f_load          },
-  { "set_tab_width", f_set_tab_width },
-  { "get_width",     f_get_width     },
-  { "get_height",    f_get_height    },
+  { "__gc",            f_gc              },
+  { "load",            f_load            },
+  { "set_tab_width",   f_set_tab_width   },
+  { "get_width",       f_get_width       },
+  { "get_height",      f_get_height      },
+  { "get_col_offsets", f_get_col_offsets },
+  { "x_to_col",        f_x_to_col        },
   { NULL, NULL }
 };
 
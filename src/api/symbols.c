@@ -0,0 +1,146 @@
+#include "api.h"
+#include "../symbols.h"
+
+
+static int f_new(lua_State *L) {
+  const char *pattern = luaL_checkstring(L, 1);
+  SymbolIndex **self = lua_newuserdata(L, sizeof(*self));
+  *self = symbol_index_new(pattern);
+  luaL_setmetatable(L, API_TYPE_SYMBOL_INDEX);
+  return 1;
+}
+
+
+static int f_gc(lua_State *L) {
+  SymbolIndex **self = luaL_checkudata(L, 1, API_TYPE_SYMBOL_INDEX);
+  if (*self) { symbol_index_free(*self); }
+  *self = NULL;
+  return 0;
+}
+
+
+static int f_get_count(lua_State *L) {
+  SymbolIndex **self = luaL_checkudata(L, 1, API_TYPE_SYMBOL_INDEX);
+  lua_pushnumber(L, symbol_index_get_count(*self));
+  return 1;
+}
+
+
+// Returns the best `k` symbols for the needle, best first, and their
+// scores. The needle is a prefix if `prefix` is true, fuzzy otherwise.
+static int f_match(lua_State *L) {
+  SymbolIndex **self = luaL_checkudata(L, 1, API_TYPE_SYMBOL_INDEX);
+  size_t len;
+  const char *needle = luaL_checklstring(L, 2, &len);
+  int k = luaL_checkinteger(L, 3);
+  bool prefix = lua_toboolean(L, 4);
+  if (k < 0) { k = 0; }
+
+  const char **texts = lua_newuserdata(L, (k ? k : 1) * sizeof(char*));
+  size_t *lens = lua_newuserdata(L, (k ? k : 1) * sizeof(size_t));
+  int *scores = lua_newuserdata(L, (k ? k : 1) * sizeof(int));
+  int n = symbol_index_match(*self, needle, len, prefix, k, texts, lens, scores);
+
+  lua_createtable(L, n, 0);
+  lua_createtable(L, n, 0);
+  for (int i = 0; i < n; i++) {
+    lua_pushlstring(L, texts[i], lens[i]);
+    lua_rawseti(L, -3, i + 1);
+    lua_pushnumber(L, scores[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  return 2;
+}
+
+
+// The doc keeps its index alive in its uservalue.
+static int f_add_doc(lua_State *L) {
+  SymbolIndex **self = luaL_checkudata(L, 1, API_TYPE_SYMBOL_INDEX);
+  SymbolDoc **doc = lua_newuserdata(L, sizeof(*doc));
+  *doc = symbol_doc_new(*self);
+  luaL_setmetatable(L, API_TYPE_SYMBOL_DOC);
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+
+// Also called to remove the doc's symbols from the index right away.
+static int f_doc_gc(lua_State *L) {
+  SymbolDoc **self = luaL_checkudata(L, 1, API_TYPE_SYMBOL_DOC);
+  if (*self) { symbol_doc_free(*self); }
+  *self = NULL;
+  return 0;
+}
+
+
+static SymbolDoc* checkdoc(lua_State *L, int idx) {
+  SymbolDoc **self = luaL_checkudata(L, idx, API_TYPE_SYMBOL_DOC);
+  luaL_argcheck(L, *self, idx, "doc is closed");
+  return *self;
+}
+
+
+static int f_doc_reset(lua_State *L) {
+  SymbolDoc *doc = checkdoc(L, 1);
+  Buffer **buf = luaL_checkudata(L, 2, API_TYPE_BUFFER);
+  symbol_doc_reset(doc, *buf);
+  return 0;
+}
+
+
+static int f_doc_scan(lua_State *L) {
+  SymbolDoc *doc = checkdoc(L, 1);
+  Buffer **buf = luaL_checkudata(L, 2, API_TYPE_BUFFER);
+  int max_lines = luaL_checkinteger(L, 3);
+  lua_pushboolean(L, symbol_doc_scan(doc, *buf, max_lines));
+  return 1;
+}
+
+
+static int f_doc_update(lua_State *L) {
+  SymbolDoc *doc = checkdoc(L, 1);
+  Buffer **buf = luaL_checkudata(L, 2, API_TYPE_BUFFER);
+  int line = luaL_checkinteger(L, 3);
+  int removed = luaL_checkinteger(L, 4);
+  int added = luaL_checkinteger(L, 5);
+  luaL_argcheck(L, line >= 1, 3, "line out of range");
+  symbol_doc_update(doc, *buf, line, removed, added);
+  return 0;
+}
+
+
+static const luaL_Reg lib[] = {
+  { "__gc",      f_gc        },
+  { "new",       f_new       },
+  { "get_count", f_get_count },
+  { "match",     f_match     },
+  { "add_doc",   f_add_doc   },
+  { NULL, NULL }
+};
+
+
+static const luaL_Reg doc_lib[] = {
+  { "__gc",   f_doc_gc     },
+  { "close",  f_doc_gc     },
+  { "reset",  f_doc_reset  },
+  { "scan",   f_doc_scan   },
+  { "update", f_doc_update },
+  { NULL, NULL }
+};
+
+int luaopen_symbols(lua_State *L) {
+  luaL_newmetatable(L, API_TYPE_SYMBOL_DOC);
+  luaL_setfuncs(L, doc_lib, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, API_TYPE_SYMBOL_INDEX);
+  luaL_setfuncs(L, lib, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  return 1;
+}
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <limits.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -17,15 +18,31 @@
 #endif
 
 #include "api.h"
+#include "../util.h"
 #include "uftf8.h"
-
-#define MAX_EVENTS 128
+#include "../search.h"
+#include "../regex.h"
+#include "../scanner.h"
+#include "../fuzzy.h"
+#include "../process.h"
+#include "../watcher.h"
+
+typedef struct
+{
+    sapp_event e;
+    // time_now() when sokol delivered the event
+    double time;
+}
+QueuedEvent;
 
 static struct
 {
-    sapp_event event_queue[MAX_EVENTS];
+    // pending events are queue[queue_head..queue_tail), the queue grows
+    // instead of dropping input when a frame is slow
+    QueuedEvent *queue;
     int queue_head;
     int queue_tail;
+    int queue_cap;
 
     double last_click_time;
     float last_click_x;
@@ -46,29 +63,70 @@ state = {
 #endif
 };
 
-static double time_now(void) {
-    return (double)clock() / (double)CLOCKS_PER_SEC;
+// Merges a mouse move or scroll into the last queued event when it is
+// of the same kind, so a burst of them reaches Lua as a single event.
+static bool coalesce_event(const sapp_event* e, double time) {
+    if (state.queue_tail == state.queue_head) return false;
+    QueuedEvent *last = &state.queue[state.queue_tail - 1];
+    if (last->e.type != e->type || last->e.modifiers != e->modifiers) return false;
+
+    if (e->type == SAPP_EVENTTYPE_MOUSE_MOVE) {
+        last->e.mouse_x = e->mouse_x;
+        last->e.mouse_y = e->mouse_y;
+        last->e.mouse_dx += e->mouse_dx;
+        last->e.mouse_dy += e->mouse_dy;
+    } else if (e->type == SAPP_EVENTTYPE_MOUSE_SCROLL) {
+        last->e.scroll_x += e->scroll_x;
+        last->e.scroll_y += e->scroll_y;
+    } else {
+        return false;
+    }
+    last->time = time;
+    return true;
 }
 
 void enqueue_event(const sapp_event* e) {
-    int next = (state.queue_tail + 1) % MAX_EVENTS;
-    if (next != state.queue_head) {
-        state.event_queue[state.queue_tail] = *e;
-        state.queue_tail = next;
+    double now = time_now();
+    if (coalesce_event(e, now)) return;
+
+    if (state.queue_tail == state.queue_cap) {
+        int count = state.queue_tail - state.queue_head;
+        if (state.queue_head > 0) {
+            memmove(state.queue, state.queue + state.queue_head, count * sizeof(QueuedEvent));
+        } else {
+            int cap = state.queue_cap ? state.queue_cap * 2 : 128;
+            QueuedEvent *queue = realloc(state.queue, cap * sizeof(QueuedEvent));
+            if (!queue) {
+                fprintf(stderr, "Fatal error: out of memory queueing events\n");
+                abort();
+            }
+            state.queue = queue;
+            state.queue_cap = cap;
+        }
+        state.queue_head = 0;
+        state.queue_tail = count;
     }
+    state.queue[state.queue_tail++] = (QueuedEvent) { *e, now };
+}
+
+bool has_queued_events(void) {
+    return state.queue_head != state.queue_tail;
 }
 
-static bool dequeue_event(sapp_event* out) {
+static bool dequeue_event(QueuedEvent* out) {
     if (state.queue_head == state.queue_tail) return false;
-    *out = state.event_queue[state.queue_head];
-    state.queue_head = (state.queue_head + 1) % MAX_EVENTS;
+    *out = state.queue[state.queue_head++];
+    if (state.queue_head == state.queue_tail) {
+        state.queue_head = state.queue_tail = 0;
+    }
     return true;
 }
 
-static int get_click_count(const sapp_event* e) {
+static int get_click_count(const QueuedEvent* qe) {
+    const sapp_event* e = &qe->e;
     if (e->type != SAPP_EVENTTYPE_MOUSE_DOWN) return 0;
 
-    double now = time_now();
+    double now = qe->time;
     double dt = now - state.last_click_time;
 
     bool same_button = (e->mouse_button == state.last_click_button);
@@ -273,38 +331,21 @@ static int f_get_file_info(lua_State* L) {
     return 1;
 }
 
-static int f_poll_event(lua_State* L) {
-    sapp_event e;
+// Pushes the Lua values for an event and returns how many there are,
+// 0 for events Lua doesn't handle.
+static int push_event(lua_State* L, const QueuedEvent* qe) {
+    const sapp_event* e = &qe->e;
     char buf[16];
 
-    if (!dequeue_event(&e)) {
-        // @note(ellora): Sokol does not have maximized event, so we
-        // need to do that for now \_(ツ)_/
-        {
-            int width = sapp_width();
-            int height = sapp_height();
-            if (width != state.last_width || height != state.last_height) {
-                lua_pushstring(L, "maximized");
-                lua_pushnumber(L, width);
-                lua_pushnumber(L, height);
-                state.last_width = width;
-                state.last_height = height;
-                return 3;
-            }
-        }
-
-        return 0;
-    }
-
-    switch (e.type) {
+    switch (e->type) {
     case SAPP_EVENTTYPE_QUIT_REQUESTED:
         lua_pushstring(L, "quit");
         return 1;
 
     case SAPP_EVENTTYPE_RESIZED:
         lua_pushstring(L, "resized");
-        lua_pushnumber(L, e.framebuffer_width);
-        lua_pushnumber(L, e.framebuffer_height);
+        lua_pushnumber(L, e->framebuffer_width);
+        lua_pushnumber(L, e->framebuffer_height);
         return 3;
 
     case SAPP_EVENTTYPE_FOCUSED:
@@ -338,17 +379,17 @@ static int f_poll_event(lua_State* L) {
 
     case SAPP_EVENTTYPE_KEY_DOWN:
         lua_pushstring(L, "keypressed");
-        lua_pushstring(L, key_name(buf, e.key_code));
+        lua_pushstring(L, key_name(buf, e->key_code));
         return 2;
 
     case SAPP_EVENTTYPE_KEY_UP:
         lua_pushstring(L, "keyreleased");
-        lua_pushstring(L, key_name(buf, e.key_code));
+        lua_pushstring(L, key_name(buf, e->key_code));
         return 2;
 
     case SAPP_EVENTTYPE_CHAR: {
         char utf8_buffer[5] = {0};
-        int bytes_written = utf8_encode(e.char_code, utf8_buffer);
+        int bytes_written = utf8_encode(e->char_code, utf8_buffer);
 
         if (bytes_written > 0) {
             lua_pushstring(L, "textinput");
@@ -359,33 +400,33 @@ static int f_poll_event(lua_State* L) {
     }
 
     case SAPP_EVENTTYPE_MOUSE_DOWN: {
-        int clicks = get_click_count(&e);
+        int clicks = get_click_count(qe);
         lua_pushstring(L, "mousepressed");
-        lua_pushstring(L, button_name(e.mouse_button));
-        lua_pushnumber(L, e.mouse_x);
-        lua_pushnumber(L, e.mouse_y);
+        lua_pushstring(L, button_name(e->mouse_button));
+        lua_pushnumber(L, e->mouse_x);
+        lua_pushnumber(L, e->mouse_y);
         lua_pushnumber(L, clicks);
         return 5;
     }
 
     case SAPP_EVENTTYPE_MOUSE_UP:
         lua_pushstring(L, "mousereleased");
-        lua_pushstring(L, button_name(e.mouse_button));
-        lua_pushnumber(L, e.mouse_x);
-        lua_pushnumber(L, e.mouse_y);
+        lua_pushstring(L, button_name(e->mouse_button));
+        lua_pushnumber(L, e->mouse_x);
+        lua_pushnumber(L, e->mouse_y);
         return 4;
 
     case SAPP_EVENTTYPE_MOUSE_MOVE:
         lua_pushstring(L, "mousemoved");
-        lua_pushnumber(L, e.mouse_x);
-        lua_pushnumber(L, e.mouse_y);
-        lua_pushnumber(L, e.mouse_dx);
-        lua_pushnumber(L, e.mouse_dy);
+        lua_pushnumber(L, e->mouse_x);
+        lua_pushnumber(L, e->mouse_y);
+        lua_pushnumber(L, e->mouse_dx);
+        lua_pushnumber(L, e->mouse_dy);
         return 5;
 
     case SAPP_EVENTTYPE_MOUSE_SCROLL:
         lua_pushstring(L, "mousewheel");
-        lua_pushnumber(L, e.scroll_y);
+        lua_pushnumber(L, e->scroll_y);
         return 2;
 
     default:
@@ -393,6 +434,62 @@ static int f_poll_event(lua_State* L) {
     }
 }
 
+// @note(ellora): Sokol does not have maximized event, so we
+// need to do that for now \_(ツ)_/
+static int push_size_change(lua_State* L) {
+    int width = sapp_width();
+    int height = sapp_height();
+    if (width == state.last_width && height == state.last_height) {
+        return 0;
+    }
+    lua_pushstring(L, "maximized");
+    lua_pushnumber(L, width);
+    lua_pushnumber(L, height);
+    state.last_width = width;
+    state.last_height = height;
+    return 3;
+}
+
+static int f_poll_event(lua_State* L) {
+    QueuedEvent qe;
+    while (dequeue_event(&qe)) {
+        int n = push_event(L, &qe);
+        if (n > 0) { return n; }
+    }
+    return push_size_change(L);
+}
+
+// Returns every pending event as a list of { type, a, b, c, d, time = t }
+// tables, `time` being when the event arrived in system.get_time() terms.
+static int f_poll_events(lua_State* L) {
+    lua_newtable(L);
+    int count = 0;
+    QueuedEvent qe;
+    for (;;) {
+        int n;
+        double time;
+        if (dequeue_event(&qe)) {
+            n = push_event(L, &qe);
+            time = qe.time;
+        } else {
+            n = push_size_change(L);
+            time = time_now();
+            if (n == 0) { break; }
+        }
+        if (n == 0) { continue; }
+
+        lua_createtable(L, n, 1);
+        lua_insert(L, -n - 1);
+        for (int i = n; i >= 1; i--) {
+            lua_rawseti(L, -i - 1, i);
+        }
+        lua_pushnumber(L, time);
+        lua_setfield(L, -2, "time");
+        lua_rawseti(L, -2, ++count);
+    }
+    return 1;
+}
+
 static int f_sleep(lua_State* L) {
     double n = luaL_checknumber(L, 1); // seconds
 #ifdef _WIN32
@@ -432,27 +529,84 @@ static int f_set_clipboard(lua_State* L) {
     return 0;
 }
 
-// @TODO(ellora): Support utf8 instead?
 static int f_fuzzy_match(lua_State* L) {
-    const char* str = luaL_checkstring(L, 1);
-    const char* ptn = luaL_checkstring(L, 2);
-    int score = 0;
-    int run = 0;
-    while (*str && *ptn) {
-        while (*str == ' ') { str++; }
-        while (*ptn == ' ') { ptn++; }
-        if (tolower(*str) == tolower(*ptn)) {
-            score += run * 10 - (*str != *ptn);
-            run++;
-            ptn++;
-        } else {
-            score -= 10;
-            run = 0;
-        }
-        str++;
+    size_t len, ptn_len;
+    const char* str = luaL_checklstring(L, 1, &len);
+    const char* ptn = luaL_checklstring(L, 2, &ptn_len);
+    int score;
+    if (!fuzzy_score(str, len, ptn, ptn_len, &score)) { return 0; }
+    lua_pushnumber(L, score);
+    return 1;
+}
+
+static int f_fuzzy_corpus_gc(lua_State* L) {
+    FuzzyCorpus** corpus = luaL_checkudata(L, 1, API_TYPE_FUZZY_CORPUS);
+    fuzzy_corpus_free(*corpus);
+    return 0;
+}
+
+// The corpus of an items table is kept until the table is collected
+// and is only rebuilt when the item count changes. An item replaced in
+// place isn't seen, callers pass a new table whenever an item changes.
+static FuzzyCorpus* get_corpus(lua_State* L, int items) {
+    int count = lua_rawlen(L, items);
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, "fuzzy_corpora");
+    if (!lua_getmetatable(L, -1)) {
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "k");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+    } else {
+        lua_pop(L, 1);
+    }
+    lua_pushvalue(L, items);
+    lua_rawget(L, -2);
+    FuzzyCorpus** corpus = lua_touserdata(L, -1);
+    if (corpus && fuzzy_corpus_get_count(*corpus) == count) {
+        lua_pop(L, 2);
+        return *corpus;
+    }
+    lua_pop(L, 1);
+
+    // the strings are kept in a table until they are copied
+    lua_createtable(L, count, 0);
+    int strings = lua_gettop(L);
+    const char** texts = lua_newuserdata(L, count * sizeof(char*));
+    size_t* lens = lua_newuserdata(L, count * sizeof(size_t));
+    for (int i = 0; i < count; i++) {
+        lua_rawgeti(L, items, i + 1);
+        texts[i] = luaL_tolstring(L, -1, &lens[i]);
+        lua_rawseti(L, strings, i + 1);
+        lua_pop(L, 1);
+    }
+    corpus = lua_newuserdata(L, sizeof(FuzzyCorpus*));
+    *corpus = fuzzy_corpus_new(texts, lens, count);
+    luaL_setmetatable(L, API_TYPE_FUZZY_CORPUS);
+    lua_pushvalue(L, items);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, strings - 1);
+    lua_pop(L, 5);
+    return *corpus;
+}
+
+// Returns the `k` items of the array that best match the needle, best
+// first.
+static int f_fuzzy_rank(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    size_t len;
+    const char* needle = luaL_checklstring(L, 2, &len);
+    int k = luaL_optinteger(L, 3, INT_MAX);
+    FuzzyCorpus* corpus = get_corpus(L, 1);
+    int count = fuzzy_corpus_get_count(corpus);
+    if (k > count) { k = count; }
+
+    int* indices = lua_newuserdata(L, (k > 0 ? k : 1) * sizeof(int));
+    int n = fuzzy_rank(corpus, needle, len, k, indices);
+    lua_createtable(L, n, 0);
+    for (int i = 0; i < n; i++) {
+        lua_rawgeti(L, 1, indices[i] + 1);
+        lua_rawseti(L, -2, i + 1);
     }
-    if (*ptn) { return 0; }
-    lua_pushnumber(L, score - (int)strlen(str));
     return 1;
 }
 
@@ -473,8 +627,493 @@ static int f_exec(lua_State* L) {
     return 0;
 }
 
+static int f_search_files(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    size_t len;
+    const char* query = luaL_checklstring(L, 2, &len);
+    int flags = 0;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "no_case");
+        if (lua_toboolean(L, -1)) { flags |= SEARCH_NO_CASE; }
+        lua_getfield(L, 3, "regex");
+        if (lua_toboolean(L, -1)) { flags |= SEARCH_REGEX; }
+        lua_pop(L, 2);
+    }
+
+    // the workers compile their own, a bad pattern is reported here
+    if (flags & SEARCH_REGEX) {
+        const char* error;
+        Regex* re = regex_new(query, len, 0, &error);
+        if (!re) {
+            lua_pushnil(L);
+            lua_pushstring(L, error);
+            return 2;
+        }
+        regex_free(re);
+    }
+
+    // the strings stay alive in the files table
+    int count = lua_rawlen(L, 1);
+    const char** files = lua_newuserdata(L, count * sizeof(char*));
+    for (int i = 0; i < count; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        files[i] = luaL_checkstring(L, -1);
+        lua_pop(L, 1);
+    }
+
+    SearchJob** job = lua_newuserdata(L, sizeof(SearchJob*));
+    *job = search_job_new(files, count, query, len, flags);
+    luaL_setmetatable(L, API_TYPE_SEARCH_JOB);
+    lua_pushvalue(L, 1);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+static int f_search_job_gc(lua_State* L) {
+    SearchJob** job = luaL_checkudata(L, 1, API_TYPE_SEARCH_JOB);
+    search_job_free(*job);
+    return 0;
+}
+
+static int f_search_job_cancel(lua_State* L) {
+    SearchJob** job = luaL_checkudata(L, 1, API_TYPE_SEARCH_JOB);
+    search_job_cancel(*job);
+    return 0;
+}
+
+// Appends up to `max` matches to the `results` table, returns the
+// number of files searched so far and whether the search is done.
+static int f_search_job_poll(lua_State* L) {
+    SearchJob** job = luaL_checkudata(L, 1, API_TYPE_SEARCH_JOB);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int max = luaL_optinteger(L, 3, 1000);
+    lua_getuservalue(L, 1);
+    int files = lua_gettop(L);
+
+    SearchMatch matches[256];
+    int files_done = 0;
+    bool done = false;
+    int n = lua_rawlen(L, 2);
+    while (max > 0) {
+        int count = search_job_poll(*job, matches, max < 256 ? max : 256, &files_done, &done);
+        for (int i = 0; i < count; i++) {
+            SearchMatch* m = &matches[i];
+            lua_createtable(L, 0, 4);
+            lua_rawgeti(L, files, m->file + 1);
+            lua_setfield(L, -2, "file");
+            lua_pushlstring(L, m->text, m->len);
+            lua_setfield(L, -2, "text");
+            lua_pushinteger(L, m->line);
+            lua_setfield(L, -2, "line");
+            lua_pushinteger(L, m->col);
+            lua_setfield(L, -2, "col");
+            lua_rawseti(L, 2, ++n);
+            free(m->text);
+        }
+        max -= count;
+        if (count < 256) { break; }
+    }
+
+    lua_pushinteger(L, files_done);
+    lua_pushboolean(L, done);
+    return 2;
+}
+
+static const luaL_Reg search_job_lib[] = {
+    {"__gc", f_search_job_gc},
+    {"cancel", f_search_job_cancel},
+    {"poll", f_search_job_poll},
+    {NULL, NULL}
+};
+
+// `ignore` is a Lua pattern or a table of them, like config.ignore_files.
+static int f_scan_project(lua_State* L) {
+    const char* root = luaL_checkstring(L, 1);
+    double rate = luaL_optnumber(L, 3, 5);
+    const char* ignore[64];
+    int ignore_count = 0;
+    if (lua_istable(L, 2)) {
+        int count = lua_rawlen(L, 2);
+        for (int i = 1; i <= count && ignore_count < 64; i++) {
+            lua_rawgeti(L, 2, i);
+            ignore[ignore_count++] = luaL_checkstring(L, -1);
+            lua_pop(L, 1);
+        }
+    } else if (!lua_isnoneornil(L, 2)) {
+        ignore[ignore_count++] = luaL_checkstring(L, 2);
+    }
+
+    Scanner** sc = lua_newuserdata(L, sizeof(Scanner*));
+    *sc = scanner_new(root, ignore, ignore_count, rate);
+    luaL_setmetatable(L, API_TYPE_SCANNER);
+    return 1;
+}
+
+static int f_scanner_gc(lua_State* L) {
+    Scanner** sc = luaL_checkudata(L, 1, API_TYPE_SCANNER);
+    scanner_free(*sc);
+    return 0;
+}
+
+static void push_scan_entry(lua_State* L, ScanEntry* e) {
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, e->filename);
+    lua_setfield(L, -2, "filename");
+    lua_pushstring(L, e->dir ? "dir" : "file");
+    lua_setfield(L, -2, "type");
+    lua_pushnumber(L, e->modified);
+    lua_setfield(L, -2, "modified");
+    lua_pushnumber(L, e->size);
+    lua_setfield(L, -2, "size");
+}
+
+// A run of the final list, either `len` entries of the old list from
+// `start` on, or one changed entry.
+typedef struct
+{
+    int start;
+    int len;
+    ScanEntry* entry;
+}
+ScanPiece;
+
+// Splits the piece at position `pos` of the final list so that one
+// begins there, returns its index.
+static int split_piece(ScanPiece* pieces, int* count, int pos) {
+    int offset = 0;
+    for (int i = 0; i < *count; i++) {
+        if (offset == pos) { return i; }
+        int skip = pos - offset;
+        if (skip < pieces[i].len) {
+            memmove(pieces + i + 2, pieces + i + 1, (*count - i - 1) * sizeof(ScanPiece));
+            pieces[i + 1] = (ScanPiece){ pieces[i].start + skip, pieces[i].len - skip, NULL };
+            pieces[i].len = skip;
+            (*count)++;
+            return i + 1;
+        }
+        offset += pieces[i].len;
+    }
+    return *count;
+}
+
+// Applies the changes since the last poll to the `files` list in place
+// and returns true, or returns nil if there were none. The changes are
+// folded into runs of the old list first, so that every entry is moved
+// once, straight to its final index.
+static int f_scanner_poll(lua_State* L) {
+    Scanner** sc = luaL_checkudata(L, 1, API_TYPE_SCANNER);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    ScanUpdate update;
+    if (!scanner_poll(*sc, 64, &update)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    int n = lua_rawlen(L, 2);
+    if (update.snapshot) {
+        for (int i = 0; i < update.snapshot_count; i++) {
+            push_scan_entry(L, &update.snapshot[i]);
+            lua_rawseti(L, 2, i + 1);
+        }
+        for (int i = n; i > update.snapshot_count; i--) {
+            lua_pushnil(L);
+            lua_rawseti(L, 2, i);
+        }
+        scan_update_free(&update);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+
+    // each change splits at most one piece and adds at most one
+    ScanPiece* pieces = lua_newuserdata(L, (2 * update.count + 1) * sizeof(ScanPiece));
+    int count = 0;
+    if (n > 0) { pieces[count++] = (ScanPiece){ 0, n, NULL }; }
+    for (int c = 0; c < update.count; c++) {
+        ScanChange* change = &update.changes[c];
+        int i = split_piece(pieces, &count, change->index);
+        switch (change->op) {
+        case SCAN_INSERT:
+            memmove(pieces + i + 1, pieces + i, (count - i) * sizeof(ScanPiece));
+            pieces[i] = (ScanPiece){ 0, 1, &change->entry };
+            count++;
+            break;
+        case SCAN_REMOVE: {
+            int end = split_piece(pieces, &count, change->index + change->count);
+            memmove(pieces + i, pieces + end, (count - end) * sizeof(ScanPiece));
+            count -= end - i;
+            break;
+        }
+        case SCAN_UPDATE:
+            split_piece(pieces, &count, change->index + 1);
+            pieces[i] = (ScanPiece){ 0, 1, &change->entry };
+            break;
+        }
+    }
+
+    // The old entries keep their order, so the runs moving down never
+    // overwrite the runs moving up and the other way around.
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        ScanPiece* p = &pieces[i];
+        if (!p->entry && total < p->start) {
+            for (int k = 0; k < p->len; k++) {
+                lua_rawgeti(L, 2, p->start + k + 1);
+                lua_rawseti(L, 2, total + k + 1);
+            }
+        }
+        total += p->len;
+    }
+    int offset = total;
+    for (int i = count - 1; i >= 0; i--) {
+        ScanPiece* p = &pieces[i];
+        offset -= p->len;
+        if (!p->entry && offset > p->start) {
+            for (int k = p->len - 1; k >= 0; k--) {
+                lua_rawgeti(L, 2, p->start + k + 1);
+                lua_rawseti(L, 2, offset + k + 1);
+            }
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (pieces[i].entry) {
+            push_scan_entry(L, pieces[i].entry);
+            lua_rawseti(L, 2, offset + 1);
+        }
+        offset += pieces[i].len;
+    }
+    for (int i = n; i > total; i--) {
+        lua_pushnil(L);
+        lua_rawseti(L, 2, i);
+    }
+    scan_update_free(&update);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int f_scanner_ready(lua_State* L) {
+    Scanner** sc = luaL_checkudata(L, 1, API_TYPE_SCANNER);
+    lua_pushboolean(L, scanner_ready(*sc));
+    return 1;
+}
+
+static int f_scanner_is_native(lua_State* L) {
+    Scanner** sc = luaL_checkudata(L, 1, API_TYPE_SCANNER);
+    lua_pushboolean(L, scanner_is_native(*sc));
+    return 1;
+}
+
+static const luaL_Reg scanner_lib[] = {
+    {"__gc", f_scanner_gc},
+    {"poll", f_scanner_poll},
+    {"ready", f_scanner_ready},
+    {"is_native", f_scanner_is_native},
+    {NULL, NULL}
+};
+
+static const char* stderr_opts[] = { "pipe", "stdout", "discard", NULL };
+
+// Starts `argv[1]` with the arguments that follow it, looked up in the
+// PATH. `opts.stdin` keeps a pipe to its input, `opts.stderr` is one of
+// "pipe", "stdout" or "discard". Returns a Process or nil and an error.
+static int f_spawn(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int argc = lua_rawlen(L, 1);
+    luaL_argcheck(L, argc > 0, 1, "empty argument list");
+
+    bool pipe_stdin = false;
+    ProcessStderr err = PROCESS_STDERR_PIPE;
+    if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "stdin");
+        pipe_stdin = lua_toboolean(L, -1);
+        lua_getfield(L, 2, "stderr");
+        err = (ProcessStderr)luaL_checkoption(L, -1, "pipe", stderr_opts);
+        lua_pop(L, 2);
+    }
+
+    // the strings stay referenced by the argv table during the call
+    const char** argv = lua_newuserdata(L, (argc + 1) * sizeof(char*));
+    for (int i = 0; i < argc; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        argv[i] = luaL_checkstring(L, -1);
+        lua_pop(L, 1);
+    }
+    argv[argc] = NULL;
+
+    Process** proc = lua_newuserdata(L, sizeof(Process*));
+    const char* error = NULL;
+    *proc = process_spawn(argv, pipe_stdin, err, &error);
+    if (!*proc) {
+        lua_pushnil(L);
+        lua_pushstring(L, error);
+        return 2;
+    }
+    luaL_setmetatable(L, API_TYPE_PROCESS);
+    return 1;
+}
+
+static Process* check_process(lua_State* L) {
+    return *(Process**)luaL_checkudata(L, 1, API_TYPE_PROCESS);
+}
+
+static int f_process_gc(lua_State* L) {
+    process_free(check_process(L));
+    return 0;
+}
+
+// Returns the output available, "" if there's none yet, nil once the
+// stream is closed.
+static int read_stream(lua_State* L, ProcessStream stream) {
+    Process* proc = check_process(L);
+    size_t max = luaL_optinteger(L, 2, 65536);
+    luaL_Buffer b;
+    char* buf = luaL_buffinitsize(L, &b, max);
+    long n = process_read(proc, stream, buf, max);
+    if (n < 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    luaL_pushresultsize(&b, n);
+    return 1;
+}
+
+static int f_process_read_stdout(lua_State* L) {
+    return read_stream(L, PROCESS_STDOUT);
+}
+
+static int f_process_read_stderr(lua_State* L) {
+    return read_stream(L, PROCESS_STDERR);
+}
+
+// Returns how many bytes went into the pipe, or nil if it's closed.
+static int f_process_write(lua_State* L) {
+    Process* proc = check_process(L);
+    size_t len;
+    const char* data = luaL_checklstring(L, 2, &len);
+    long n = process_write(proc, data, len);
+    if (n < 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushnumber(L, n);
+    return 1;
+}
+
+static int f_process_close_stdin(lua_State* L) {
+    process_close_stdin(check_process(L));
+    return 0;
+}
+
+// A core thread that yields a process is resumed once this is true.
+static int f_process_ready(lua_State* L) {
+    lua_pushboolean(L, process_ready(check_process(L)));
+    return 1;
+}
+
+static int f_process_running(lua_State* L) {
+    lua_pushboolean(L, !process_exited(check_process(L), NULL));
+    return 1;
+}
+
+static int f_process_returncode(lua_State* L) {
+    int code;
+    if (!process_exited(check_process(L), &code)) {
+        return 0;
+    }
+    lua_pushnumber(L, code);
+    return 1;
+}
+
+static int f_process_kill(lua_State* L) {
+    lua_pushboolean(L, process_kill(check_process(L), lua_toboolean(L, 2)));
+    return 1;
+}
+
+static int f_process_pid(lua_State* L) {
+    lua_pushnumber(L, process_get_pid(check_process(L)));
+    return 1;
+}
+
+static const luaL_Reg process_lib[] = {
+    {"__gc", f_process_gc},
+    {"read_stdout", f_process_read_stdout},
+    {"read_stderr", f_process_read_stderr},
+    {"write", f_process_write},
+    {"close_stdin", f_process_close_stdin},
+    {"ready", f_process_ready},
+    {"running", f_process_running},
+    {"returncode", f_process_returncode},
+    {"kill", f_process_kill},
+    {"pid", f_process_pid},
+    {NULL, NULL}
+};
+
+static int f_watch_files(lua_State* L) {
+    Watcher** w = lua_newuserdata(L, sizeof(Watcher*));
+    *w = watcher_new();
+    luaL_setmetatable(L, API_TYPE_WATCHER);
+    return 1;
+}
+
+static Watcher* check_watcher(lua_State* L) {
+    return *(Watcher**)luaL_checkudata(L, 1, API_TYPE_WATCHER);
+}
+
+static int f_watcher_gc(lua_State* L) {
+    watcher_free(check_watcher(L));
+    return 0;
+}
+
+static int f_watcher_add(lua_State* L) {
+    watcher_add(check_watcher(L), luaL_checkstring(L, 2));
+    return 0;
+}
+
+static int f_watcher_remove(lua_State* L) {
+    watcher_remove(check_watcher(L), luaL_checkstring(L, 2));
+    return 0;
+}
+
+// Returns the list of the files that changed since the last poll.
+static int f_watcher_poll(lua_State* L) {
+    Watcher* w = check_watcher(L);
+    const char* files[64];
+    int n = 0, count;
+    lua_newtable(L);
+    do {
+        count = watcher_poll(w, files, 64);
+        for (int i = 0; i < count; i++) {
+            lua_pushstring(L, files[i]);
+            lua_rawseti(L, -2, ++n);
+        }
+    } while (count == 64);
+    return 1;
+}
+
+// A core thread that yields a native watcher is resumed once this is
+// true, one that isn't native has to poll it.
+static int f_watcher_ready(lua_State* L) {
+    lua_pushboolean(L, watcher_ready(check_watcher(L)));
+    return 1;
+}
+
+static int f_watcher_is_native(lua_State* L) {
+    lua_pushboolean(L, watcher_is_native(check_watcher(L)));
+    return 1;
+}
+
+static const luaL_Reg watcher_lib[] = {
+    {"__gc", f_watcher_gc},
+    {"add", f_watcher_add},
+    {"remove", f_watcher_remove},
+    {"poll", f_watcher_poll},
+    {"ready", f_watcher_ready},
+    {"is_native", f_watcher_is_native},
+    {NULL, NULL}
+};
+
 static const luaL_Reg lib[] = {
     {"poll_event", f_poll_event},
+    {"poll_events", f_poll_events},
     {"set_cursor", f_set_cursor},
     {"set_window_title", f_set_window_title},
     {"set_window_mode", f_set_window_mode},
@@ -490,10 +1129,44 @@ static const luaL_Reg lib[] = {
     {"sleep", f_sleep},
     {"exec", f_exec},
     {"fuzzy_match", f_fuzzy_match},
+    {"fuzzy_rank", f_fuzzy_rank},
+    {"search_files", f_search_files},
+    {"scan_project", f_scan_project},
+    {"spawn", f_spawn},
+    {"watch_files", f_watch_files},
     {NULL, NULL}
 };
 
 int luaopen_system(lua_State* L) {
+    luaL_newmetatable(L, API_TYPE_SEARCH_JOB);
+    luaL_setfuncs(L, search_job_lib, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, API_TYPE_FUZZY_CORPUS);
+    lua_pushcfunction(L, f_fuzzy_corpus_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, API_TYPE_SCANNER);
+    luaL_setfuncs(L, scanner_lib, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, API_TYPE_PROCESS);
+    luaL_setfuncs(L, process_lib, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, API_TYPE_WATCHER);
+    luaL_setfuncs(L, watcher_lib, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
     luaL_newlib(L, lib);
     return 1;
 }
@@ -0,0 +1,374 @@
+#include "api.h"
+#include "../tokenizer.h"
+#include "../highlighter.h"
+
+#include <limits.h>
+#include <string.h>
+
+
+// Reused by every call, only the main thread tokenizes from Lua.
+static TokenList list;
+
+
+// The type names are kept in the uservalue, type `n` at index `n + 1`.
+static int intern_type(lua_State *L, int names, int ids, int idx) {
+  lua_pushvalue(L, idx);
+  lua_rawget(L, ids);
+  if (!lua_isnil(L, -1)) {
+    int type = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    return type;
+  }
+  lua_pop(L, 1);
+  int type = lua_rawlen(L, names);
+  lua_pushvalue(L, idx);
+  lua_rawseti(L, names, type + 1);
+  lua_pushvalue(L, idx);
+  lua_pushinteger(L, type);
+  lua_rawset(L, ids);
+  return type;
+}
+
+
+static const char* checkfield(lua_State *L, int idx, int n, size_t *len) {
+  lua_rawgeti(L, idx, n);
+  const char *s = lua_tolstring(L, -1, len);
+  lua_pop(L, 1);
+  return s;
+}
+
+
+static int f_new(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  Tokenizer **self = lua_newuserdata(L, sizeof(*self));
+  *self = NULL;
+  luaL_setmetatable(L, API_TYPE_TOKENIZER);
+  int ud = lua_gettop(L);
+  lua_getfield(L, 1, "patterns");
+  luaL_argcheck(L, lua_istable(L, -1), 1, "syntax has no patterns table");
+  int patterns = lua_gettop(L);
+  lua_newtable(L);
+  int names = lua_gettop(L);
+  lua_newtable(L);
+  int ids = lua_gettop(L);
+  lua_pushstring(L, "normal");
+  intern_type(L, names, ids, -1);
+  lua_pop(L, 1);
+
+  // the strings stay referenced by the syntax table, they are only
+  // copied by tokenizer_new
+  int count = lua_rawlen(L, patterns);
+  TokenizerPattern *p = lua_newuserdata(L, count * sizeof(TokenizerPattern) + 1);
+  for (int i = 0; i < count; i++) {
+    lua_rawgeti(L, patterns, i + 1);
+    luaL_argcheck(L, lua_istable(L, -1), 1, "pattern is not a table");
+    lua_getfield(L, -1, "pattern");
+    if (lua_istable(L, -1)) {
+      size_t len;
+      int idx = lua_gettop(L);
+      p[i].open = checkfield(L, idx, 1, &p[i].open_len);
+      p[i].close = checkfield(L, idx, 2, &p[i].close_len);
+      const char *esc = checkfield(L, idx, 3, &len);
+      p[i].escape = (esc && len > 0) ? esc[0] : 0;
+      if (!p[i].open || !p[i].close) {
+        luaL_error(L, "pattern %d: start and end patterns expected", i + 1);
+      }
+    } else {
+      p[i].open = lua_tolstring(L, -1, &p[i].open_len);
+      p[i].close = NULL;
+      p[i].escape = 0;
+      if (!p[i].open) { luaL_error(L, "pattern %d: string expected", i + 1); }
+    }
+    lua_getfield(L, -2, "type");
+    p[i].type = (lua_type(L, -1) == LUA_TSTRING) ? intern_type(L, names, ids, -1) : 0;
+    lua_pop(L, 3);
+  }
+  *self = tokenizer_new(p, count);
+
+  lua_getfield(L, 1, "symbols");
+  if (lua_istable(L, -1)) {
+    int symbols = lua_gettop(L);
+    lua_pushnil(L);
+    while (lua_next(L, symbols)) {
+      if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TSTRING) {
+        size_t len;
+        const char *text = lua_tolstring(L, -2, &len);
+        tokenizer_add_symbol(*self, text, len, intern_type(L, names, ids, -1));
+      }
+      lua_pop(L, 1);
+    }
+  }
+
+  lua_pushvalue(L, names);
+  lua_setuservalue(L, ud);
+  lua_pushvalue(L, ud);
+  return 1;
+}
+
+
+static int f_gc(lua_State *L) {
+  Tokenizer **self = luaL_checkudata(L, 1, API_TYPE_TOKENIZER);
+  if (*self) { tokenizer_free(*self); }
+  return 0;
+}
+
+
+static int f_tokenize(lua_State *L) {
+  Tokenizer **self = luaL_checkudata(L, 1, API_TYPE_TOKENIZER);
+  size_t len;
+  const char *text = luaL_checklstring(L, 2, &len);
+  int state = luaL_optinteger(L, 3, 0);
+  const char *error;
+  state = tokenizer_tokenize(*self, text, len, state, &list, &error);
+  if (state < 0) { return luaL_error(L, "%s", error); }
+
+  lua_getuservalue(L, 1);
+  int names = lua_gettop(L);
+  lua_createtable(L, list.count * 2, 0);
+  for (int i = 0; i < list.count; i++) {
+    Token *t = &list.tokens[i];
+    lua_rawgeti(L, names, t->type + 1);
+    lua_rawseti(L, -2, i * 2 + 1);
+    lua_pushlstring(L, text + t->offset, t->len);
+    lua_rawseti(L, -2, i * 2 + 2);
+  }
+  if (state) {
+    lua_pushinteger(L, state);
+  } else {
+    lua_pushnil(L);
+  }
+  return 2;
+}
+
+
+// A job keeps the batch it is in the middle of applying, so polling
+// can stop after any number of lines. The job is only reported done
+// once that batch is applied.
+typedef struct {
+  HighlightJob *job;
+  HighlightBatch *batch;
+  int index;
+  bool done;
+  bool converged;
+} Job;
+
+
+// Reads the states of lines `first` to `last` of a highlighter's
+// `lines` table, -1 for the lines it has no entry for.
+static void read_states(lua_State *L, int lines, int first, int last, int *init, int *end) {
+  for (int n = first; n <= last; n++) {
+    lua_rawgeti(L, lines, n);
+    if (lua_istable(L, -1)) {
+      lua_getfield(L, -1, "init_state");
+      lua_getfield(L, -2, "state");
+      init[n - first] = lua_tointeger(L, -2);
+      end[n - first] = lua_tointeger(L, -1);
+      lua_pop(L, 2);
+    } else {
+      init[n - first] = end[n - first] = -1;
+    }
+    lua_pop(L, 1);
+  }
+}
+
+
+// highlight(buf, first, last, state, visible_first, visible_last,
+// lines, cached_first, cached_last), the job stops early at a line
+// from `cached_first` to `cached_last` starting and ending with the
+// states it has in `lines`.
+static int f_highlight(lua_State *L) {
+  Tokenizer **self = luaL_checkudata(L, 1, API_TYPE_TOKENIZER);
+  Buffer **buf = luaL_checkudata(L, 2, API_TYPE_BUFFER);
+  int first = luaL_checkinteger(L, 3);
+  int last = luaL_checkinteger(L, 4);
+  int state = luaL_optinteger(L, 5, 0);
+  int visible_first = luaL_optinteger(L, 6, 0);
+  int visible_last = luaL_optinteger(L, 7, 0);
+  int cached_first = luaL_optinteger(L, 9, 0);
+  int cached_last = luaL_optinteger(L, 10, -1);
+  luaL_argcheck(L, first >= 1, 3, "line out of range");
+  luaL_argcheck(L, last >= first - 1 && (size_t)last <= buffer_get_line_count(*buf),
+    4, "line out of range");
+  int cached_count = cached_last >= cached_first ? cached_last - cached_first + 1 : 0;
+  if (cached_count > 0) { luaL_checktype(L, 8, LUA_TTABLE); }
+
+  int *cached = lua_newuserdata(L, cached_count * 2 * sizeof(int) + 1);
+  read_states(L, 8, cached_first, cached_last, cached, cached + cached_count);
+
+  Job *job = lua_newuserdata(L, sizeof(Job));
+  job->job = NULL;
+  job->batch = NULL;
+  job->index = 0;
+  job->done = job->converged = false;
+  luaL_setmetatable(L, API_TYPE_HIGHLIGHT_JOB);
+  job->job = highlight_job_new(*self, *buf, first, last, state,
+                               visible_first, visible_last,
+                               cached_first, cached_count, cached, cached + cached_count);
+  if (!job->job) { return luaL_error(L, "failed to start highlighting threads"); }
+  lua_getuservalue(L, 1);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+
+static Job* checkjob(lua_State *L, int idx) {
+  Job *job = luaL_checkudata(L, idx, API_TYPE_HIGHLIGHT_JOB);
+  if (!job->job) { luaL_error(L, "highlighting job was cancelled"); }
+  return job;
+}
+
+
+static void cancel_job(Job *job) {
+  if (job->batch) { highlight_batch_free(job->batch); }
+  if (job->job) { highlight_job_free(job->job); }
+  job->batch = NULL;
+  job->job = NULL;
+}
+
+
+static int f_job_gc(lua_State *L) {
+  cancel_job(luaL_checkudata(L, 1, API_TYPE_HIGHLIGHT_JOB));
+  return 0;
+}
+
+
+static int f_job_cancel(lua_State *L) {
+  cancel_job(luaL_checkudata(L, 1, API_TYPE_HIGHLIGHT_JOB));
+  return 0;
+}
+
+
+static int f_job_set_visible(lua_State *L) {
+  Job *job = checkjob(L, 1);
+  highlight_job_set_visible(job->job, luaL_checkinteger(L, 2), luaL_checkinteger(L, 3));
+  return 0;
+}
+
+
+// Stores the result for a line in the highlighter's `lines`, unless
+// the line there already starts and ends with the same states.
+static void apply_line(lua_State *L, int lines, int names, Job *job, int i) {
+  HighlightBatch *b = job->batch;
+  int n = b->line + i;
+  int init = b->states[i];
+  int state = b->states[i + 1];
+  int t1 = b->first_token[i];
+  int t2 = b->first_token[i + 1];
+  size_t len;
+  const char *text = highlight_batch_get_line(b, i, &len);
+
+  lua_rawgeti(L, lines, n);
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "init_state");
+    lua_getfield(L, -2, "state");
+    bool same = lua_tointeger(L, -2) == init && lua_tointeger(L, -1) == state;
+    lua_pop(L, 2);
+    if (same && t1 < t2) {
+      size_t l;
+      lua_getfield(L, -1, "text");
+      const char *s = lua_tolstring(L, -1, &l);
+      same = s && l == len && memcmp(s, text, len) == 0;
+      lua_pop(L, 1);
+    }
+    if (same) {
+      lua_pop(L, 1);
+      return;
+    }
+  }
+  lua_pop(L, 1);
+
+  lua_createtable(L, 0, 4);
+  if (init) {
+    lua_pushinteger(L, init);
+    lua_setfield(L, -2, "init_state");
+  }
+  if (state) {
+    lua_pushinteger(L, state);
+    lua_setfield(L, -2, "state");
+  }
+  if (t1 < t2) {
+    lua_pushlstring(L, text, len);
+    lua_setfield(L, -2, "text");
+    lua_createtable(L, (t2 - t1) * 2, 0);
+    for (int k = t1; k < t2; k++) {
+      Token *t = &b->tokens[k];
+      lua_rawgeti(L, names, t->type + 1);
+      lua_rawseti(L, -2, (k - t1) * 2 + 1);
+      lua_pushlstring(L, text + t->offset, t->len);
+      lua_rawseti(L, -2, (k - t1) * 2 + 2);
+    }
+    lua_setfield(L, -2, "tokens");
+  }
+  lua_rawseti(L, lines, n);
+}
+
+
+// Applies up to `max` finished lines to the `lines` table, returns the
+// last line applied, whether the job is done and whether it stopped
+// early as the lines after are as they were.
+static int f_job_poll(lua_State *L) {
+  Job *job = checkjob(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  int max = luaL_optinteger(L, 3, INT_MAX);
+  lua_getuservalue(L, 1);
+  int names = lua_gettop(L);
+
+  int last = 0;
+  for (int count = 0; count < max; count++) {
+    if (!job->batch) {
+      const char *error;
+      job->batch = highlight_job_poll(job->job, &job->done, &job->converged, &error);
+      job->index = 0;
+      if (error) { return luaL_error(L, "%s", error); }
+      if (!job->batch) { break; }
+    }
+    apply_line(L, 2, names, job, job->index);
+    last = job->batch->line + job->index;
+    if (++job->index == job->batch->count) {
+      highlight_batch_free(job->batch);
+      job->batch = NULL;
+    }
+  }
+
+  if (last > 0) {
+    lua_pushinteger(L, last);
+  } else {
+    lua_pushnil(L);
+  }
+  bool done = job->done && !job->batch;
+  lua_pushboolean(L, done);
+  lua_pushboolean(L, done && job->converged);
+  return 3;
+}
+
+
+static const luaL_Reg lib[] = {
+  { "__gc",      f_gc        },
+  { "new",       f_new       },
+  { "tokenize",  f_tokenize  },
+  { "highlight", f_highlight },
+  { NULL, NULL }
+};
+
+
+static const luaL_Reg job_lib[] = {
+  { "__gc",        f_job_gc          },
+  { "cancel",      f_job_cancel      },
+  { "set_visible", f_job_set_visible },
+  { "poll",        f_job_poll        },
+  { NULL, NULL }
+};
+
+int luaopen_tokenizer(lua_State *L) {
+  luaL_newmetatable(L, API_TYPE_HIGHLIGHT_JOB);
+  luaL_setfuncs(L, job_lib, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, API_TYPE_TOKENIZER);
+  luaL_setfuncs(L, lib, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  return 1;
+}
@@ -0,0 +1,134 @@
+#include "api.h"
+#include "../undo.h"
+
+#include <stdlib.h>
+
+
+static const char *type_names[] = { "insert", "remove", "selection", NULL };
+
+
+static UndoStack* checkstack(lua_State *L, int idx) {
+  UndoStack **self = luaL_checkudata(L, idx, API_TYPE_UNDO_STACK);
+  return *self;
+}
+
+
+static int f_new(lua_State *L) {
+  int max_records = luaL_checkinteger(L, 1);
+  lua_Number memory_limit = luaL_checknumber(L, 2);
+  double merge_timeout = luaL_checknumber(L, 3);
+  UndoStack **self = lua_newuserdata(L, sizeof(*self));
+  *self = undo_new(max_records, memory_limit > 0 ? (size_t)memory_limit : 0, merge_timeout);
+  luaL_setmetatable(L, API_TYPE_UNDO_STACK);
+  return 1;
+}
+
+
+static int f_gc(lua_State *L) {
+  UndoStack **self = luaL_checkudata(L, 1, API_TYPE_UNDO_STACK);
+  if (*self) { undo_free(*self); }
+  *self = NULL;
+  return 0;
+}
+
+
+static int f_clear(lua_State *L) {
+  undo_clear(checkstack(L, 1));
+  return 0;
+}
+
+
+// push(time, "insert", line, col, text)
+// push(time, "remove" | "selection", line1, col1, line2, col2)
+static int f_push(lua_State *L) {
+  UndoStack *stack = checkstack(L, 1);
+  UndoRecord r = { 0 };
+  r.time = luaL_checknumber(L, 2);
+  r.type = luaL_checkoption(L, 3, NULL, type_names);
+  r.line1 = luaL_checkinteger(L, 4);
+  r.col1 = luaL_checkinteger(L, 5);
+  if (r.type == UNDO_INSERT) {
+    r.text = (char*) luaL_checklstring(L, 6, &r.len);
+  } else {
+    r.line2 = luaL_checkinteger(L, 6);
+    r.col2 = luaL_checkinteger(L, 7);
+  }
+  undo_push(stack, &r);
+  return 0;
+}
+
+
+// Returns the type, time and arguments of the last record, as pushed.
+static int f_pop(lua_State *L) {
+  UndoStack *stack = checkstack(L, 1);
+  UndoRecord r;
+  if (!undo_pop(stack, &r)) { return 0; }
+  lua_pushstring(L, type_names[r.type]);
+  lua_pushnumber(L, r.time);
+  lua_pushnumber(L, r.line1);
+  lua_pushnumber(L, r.col1);
+  if (r.type == UNDO_INSERT) {
+    lua_pushlstring(L, r.text, r.len);
+    free(r.text);
+    return 5;
+  }
+  lua_pushnumber(L, r.line2);
+  lua_pushnumber(L, r.col2);
+  return 6;
+}
+
+
+static int f_get_end_time(lua_State *L) {
+  double time = undo_get_end_time(checkstack(L, 1));
+  if (time < 0) { return 0; }
+  lua_pushnumber(L, time);
+  return 1;
+}
+
+
+static int f_get_change_id(lua_State *L) {
+  lua_pushnumber(L, undo_get_change_id(checkstack(L, 1)));
+  return 1;
+}
+
+
+static int f_set_change_id(lua_State *L) {
+  UndoStack *stack = checkstack(L, 1);
+  undo_set_change_id(stack, (unsigned) luaL_checknumber(L, 2));
+  return 0;
+}
+
+
+// Returns the number of records, the bytes of text in memory and the
+// bytes spilled to the temp file.
+static int f_get_stats(lua_State *L) {
+  int records;
+  size_t memory, spilled;
+  undo_get_stats(checkstack(L, 1), &records, &memory, &spilled);
+  lua_pushnumber(L, records);
+  lua_pushnumber(L, memory);
+  lua_pushnumber(L, spilled);
+  return 3;
+}
+
+
+static const luaL_Reg lib[] = {
+  { "__gc",          f_gc            },
+  { "new",           f_new           },
+  { "clear",         f_clear         },
+  { "push",          f_push          },
+  { "pop",           f_pop           },
+  { "get_end_time",  f_get_end_time  },
+  { "get_change_id", f_get_change_id },
+  { "set_change_id", f_set_change_id },
+  { "get_stats",     f_get_stats     },
+  { NULL, NULL }
+};
+
+int luaopen_undo(lua_State *L) {
+  luaL_newmetatable(L, API_TYPE_UNDO_STACK);
+  luaL_setfuncs(L, lib, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  return 1;
+}
@@ -0,0 +1,234 @@
+#include "atlas.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_PAGES 64
+#define LUT_SIZE 4096
+
+typedef struct
+{
+    int y;
+    int x;
+    int height;
+} Shelf;
+
+typedef struct
+{
+    unsigned char *pixels;
+    Shelf *shelves;
+    int shelves_count;
+    int shelves_capacity;
+    // where the next shelf starts
+    int bottom;
+    // glyphs placed in the page
+    int *glyphs;
+    int glyphs_count;
+    int glyphs_capacity;
+    unsigned last_used;
+    bool dirty;
+} Page;
+
+typedef struct
+{
+    AtlasGlyph glyph;
+    int next;
+} Entry;
+
+struct GlyphAtlas
+{
+    int page_size;
+    int max_pages;
+    Page pages[MAX_PAGES];
+    int pages_count;
+    unsigned frame;
+
+    // glyphs, chained per bucket of the lookup table; the free ones are
+    // chained from `free_entry`
+    Entry *entries;
+    int entries_count;
+    int entries_capacity;
+    int free_entry;
+    int glyph_count;
+    int lut[LUT_SIZE];
+};
+
+static unsigned hash_key(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return (unsigned)key & (LUT_SIZE - 1);
+}
+
+GlyphAtlas* atlas_new(int page_size, int max_pages) {
+    GlyphAtlas *atlas = xrealloc(NULL, sizeof(GlyphAtlas));
+    memset(atlas, 0, sizeof(GlyphAtlas));
+    atlas->page_size = page_size;
+    atlas->max_pages = max_pages < 1 ? 1 : max_pages > MAX_PAGES ? MAX_PAGES : max_pages;
+    atlas->free_entry = -1;
+    // the first frame is 1, so a page never used is older than any
+    atlas->frame = 1;
+    for (int i = 0; i < LUT_SIZE; i++) { atlas->lut[i] = -1; }
+    return atlas;
+}
+
+void atlas_free(GlyphAtlas *atlas) {
+    for (int i = 0; i < atlas->pages_count; i++) {
+        free(atlas->pages[i].pixels);
+        free(atlas->pages[i].shelves);
+        free(atlas->pages[i].glyphs);
+    }
+    free(atlas->entries);
+    free(atlas);
+}
+
+void atlas_next_frame(GlyphAtlas *atlas) {
+    atlas->frame++;
+}
+
+AtlasGlyph* atlas_get(GlyphAtlas *atlas, uint64_t key) {
+    for (int i = atlas->lut[hash_key(key)]; i != -1; i = atlas->entries[i].next) {
+        if (atlas->entries[i].glyph.key == key) {
+            atlas->pages[atlas->entries[i].glyph.page].last_used = atlas->frame;
+            return &atlas->entries[i].glyph;
+        }
+    }
+    return NULL;
+}
+
+// Finds a spot in the page, in the lowest shelf tall enough that
+// doesn't waste more than a third of its height.
+static bool place(GlyphAtlas *atlas, Page *page, int width, int height, int *x, int *y) {
+    int size = atlas->page_size;
+    if (width > size || height > size) { return false; }
+    Shelf *best = NULL;
+    for (int i = 0; i < page->shelves_count; i++) {
+        Shelf *s = &page->shelves[i];
+        if (s->height >= height && s->height * 2 <= height * 3 && size - s->x >= width) {
+            if (!best || s->height < best->height) { best = s; }
+        }
+    }
+    if (!best) {
+        if (size - page->bottom < height) { return false; }
+        if (page->shelves_count == page->shelves_capacity) {
+            page->shelves_capacity = page->shelves_capacity ? page->shelves_capacity * 2 : 16;
+            page->shelves = xrealloc(page->shelves, page->shelves_capacity * sizeof(Shelf));
+        }
+        best = &page->shelves[page->shelves_count++];
+        best->y = page->bottom;
+        best->x = 0;
+        best->height = height;
+        page->bottom += height;
+    }
+    *x = best->x;
+    *y = best->y;
+    best->x += width;
+    return true;
+}
+
+static Page* add_page(GlyphAtlas *atlas) {
+    Page *page = &atlas->pages[atlas->pages_count++];
+    memset(page, 0, sizeof(Page));
+    size_t size = (size_t)atlas->page_size * atlas->page_size;
+    page->pixels = xrealloc(NULL, size);
+    memset(page->pixels, 0, size);
+    return page;
+}
+
+// Drops every glyph of the page and empties it.
+static void clear_page(GlyphAtlas *atlas, Page *page) {
+    for (int i = 0; i < page->glyphs_count; i++) {
+        int idx = page->glyphs[i];
+        int *link = &atlas->lut[hash_key(atlas->entries[idx].glyph.key)];
+        while (*link != idx) { link = &atlas->entries[*link].next; }
+        *link = atlas->entries[idx].next;
+        atlas->entries[idx].next = atlas->free_entry;
+        atlas->free_entry = idx;
+        atlas->glyph_count--;
+    }
+    page->glyphs_count = 0;
+    page->shelves_count = 0;
+    page->bottom = 0;
+    memset(page->pixels, 0, (size_t)atlas->page_size * atlas->page_size);
+    page->dirty = true;
+}
+
+AtlasGlyph* atlas_add(GlyphAtlas *atlas, uint64_t key, int width, int height) {
+    int x, y, p = -1;
+    // from the page added last, the likeliest to have room
+    for (int i = atlas->pages_count - 1; i >= 0 && p < 0; i--) {
+        if (place(atlas, &atlas->pages[i], width, height, &x, &y)) { p = i; }
+    }
+    if (p < 0 && atlas->pages_count < atlas->max_pages) {
+        p = atlas->pages_count;
+        if (!place(atlas, add_page(atlas), width, height, &x, &y)) { return NULL; }
+    }
+    if (p < 0) {
+        int lru = -1;
+        for (int i = 0; i < atlas->pages_count; i++) {
+            unsigned used = atlas->pages[i].last_used;
+            if (used != atlas->frame && (lru < 0 || used < atlas->pages[lru].last_used)) { lru = i; }
+        }
+        if (lru < 0) { return NULL; }
+        clear_page(atlas, &atlas->pages[lru]);
+        if (!place(atlas, &atlas->pages[lru], width, height, &x, &y)) { return NULL; }
+        p = lru;
+    }
+
+    int idx = atlas->free_entry;
+    if (idx >= 0) {
+        atlas->free_entry = atlas->entries[idx].next;
+    } else {
+        if (atlas->entries_count == atlas->entries_capacity) {
+            atlas->entries_capacity = atlas->entries_capacity ? atlas->entries_capacity * 2 : 256;
+            atlas->entries = xrealloc(atlas->entries, atlas->entries_capacity * sizeof(Entry));
+        }
+        idx = atlas->entries_count++;
+    }
+    Entry *e = &atlas->entries[idx];
+    memset(e, 0, sizeof(Entry));
+    e->glyph.key = key;
+    e->glyph.page = p;
+    e->glyph.x = x;
+    e->glyph.y = y;
+    e->glyph.width = width;
+    e->glyph.height = height;
+    unsigned h = hash_key(key);
+    e->next = atlas->lut[h];
+    atlas->lut[h] = idx;
+    atlas->glyph_count++;
+
+    Page *page = &atlas->pages[p];
+    if (page->glyphs_count == page->glyphs_capacity) {
+        page->glyphs_capacity = page->glyphs_capacity ? page->glyphs_capacity * 2 : 256;
+        page->glyphs = xrealloc(page->glyphs, page->glyphs_capacity * sizeof(int));
+    }
+    page->glyphs[page->glyphs_count++] = idx;
+    page->last_used = atlas->frame;
+    page->dirty = true;
+    return &e->glyph;
+}
+
+int atlas_get_page_size(GlyphAtlas *atlas) {
+    return atlas->page_size;
+}
+
+int atlas_get_page_count(GlyphAtlas *atlas) {
+    return atlas->pages_count;
+}
+
+int atlas_get_glyph_count(GlyphAtlas *atlas) {
+    return atlas->glyph_count;
+}
+
+unsigned char* atlas_get_pixels(GlyphAtlas *atlas, int page) {
+    return atlas->pages[page].pixels;
+}
+
+bool atlas_take_dirty(GlyphAtlas *atlas, int page) {
+    bool dirty = atlas->pages[page].dirty;
+    atlas->pages[page].dirty = false;
+    return dirty;
+}
@@ -0,0 +1,55 @@
+// Glyph bitmaps packed into square pages, in shelves. When the pages
+// are full a new one is added, up to a limit, past it the page drawn
+// from least recently is emptied and its glyphs are dropped, to be
+// rasterized again once needed. A page used in the current frame is
+// never emptied, the frame's draw calls may already point into it.
+//
+// The atlas only keeps the pixels and the glyphs' places, the renderer
+// rasterizes into the pages and uploads the ones marked dirty.
+
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct GlyphAtlas GlyphAtlas;
+
+typedef struct
+{
+    uint64_t key;
+    int page;
+    // the glyph's rect in the page, including its empty border
+    short x, y, width, height;
+    // set by the renderer
+    short xoff, yoff, xadv;
+    int index;
+} AtlasGlyph;
+
+GlyphAtlas* atlas_new(int page_size, int max_pages);
+void atlas_free(GlyphAtlas *atlas);
+
+// Glyphs are keyed by font, size and codepoint.
+static inline uint64_t atlas_key(int font, int isize, unsigned codepoint) {
+    return ((uint64_t)(uint16_t)font << 48) | ((uint64_t)(uint16_t)isize << 32) | codepoint;
+}
+
+// Starts a new frame, the pages used in the last one may be emptied.
+void atlas_next_frame(GlyphAtlas *atlas);
+
+// Returns the glyph, or NULL if it isn't in the atlas, and marks its
+// page as used. The pointers returned stay valid until the next add.
+AtlasGlyph* atlas_get(GlyphAtlas *atlas, uint64_t key);
+// Makes room for a `width` by `height` bitmap and marks the page dirty.
+// Returns NULL if every page is full and used in this frame.
+AtlasGlyph* atlas_add(GlyphAtlas *atlas, uint64_t key, int width, int height);
+
+int atlas_get_page_size(GlyphAtlas *atlas);
+int atlas_get_page_count(GlyphAtlas *atlas);
+int atlas_get_glyph_count(GlyphAtlas *atlas);
+// The 8-bit pixels of the page, a row is `page_size` bytes.
+unsigned char* atlas_get_pixels(GlyphAtlas *atlas, int page);
+// Returns whether the page changed since the last call.
+bool atlas_take_dirty(GlyphAtlas *atlas, int page);
+
+#endif
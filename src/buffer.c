@@ -0,0 +1,481 @@
+#include "buffer.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Inserted text is appended to chunks of this size, big pastes
+// get a chunk of their own.
+#define ADD_CHUNK_SIZE (64 * 1024)
+
+// Files are read this many bytes at a time, the newlines of a chunk are
+// indexed while it is still in cache. The file is copied rather than
+// mapped, a mapping would change under the doc, or fault, when another
+// program rewrites or truncates the file.
+#define READ_CHUNK (1024 * 1024)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// A source is an immutable (append-only for the add chunk) block of
+// text that pieces point into. It keeps the position of every '\n'
+// so the newline count of any range is two binary searches away.
+typedef struct Source
+{
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t *lf;
+    size_t lf_count;
+    size_t lf_capacity;
+    int refs;
+} Source;
+
+typedef struct Piece
+{
+    struct Piece *left;
+    struct Piece *right;
+    uint32_t priority;
+    Source *src;
+    size_t start;
+    size_t len;
+    size_t nl;
+    size_t sum_len;
+    size_t sum_nl;
+} Piece;
+
+struct Buffer
+{
+    Piece *root;
+    Source *add;
+    uint32_t seed;
+};
+
+struct BufferSnapshot
+{
+    BufferSpan *spans;
+    Source **sources;
+    int count;
+    int capacity;
+};
+
+static Source* source_new(size_t capacity) {
+    Source *src = xrealloc(NULL, sizeof(Source));
+    memset(src, 0, sizeof(Source));
+    src->data = xrealloc(NULL, capacity);
+    src->capacity = capacity;
+    return src;
+}
+
+static void source_release(Source *src) {
+    if (--src->refs > 0) return;
+    free(src->lf);
+    free(src->data);
+    free(src);
+}
+
+static inline void source_push_lf(Source *src, size_t pos) {
+    if (src->lf_count == src->lf_capacity) {
+        src->lf_capacity = MAX(64, src->lf_capacity * 2);
+        src->lf = xrealloc(src->lf, src->lf_capacity * sizeof(size_t));
+    }
+    src->lf[src->lf_count++] = pos;
+}
+
+static void source_index(Source *src, size_t from, size_t to) {
+    const char *p = src->data + from;
+    const char *end = src->data + to;
+#if defined(__SSE2__)
+    // Compare 16 bytes at a time and walk the bits of the match mask,
+    // this is what makes indexing a multi-gigabyte log bearable.
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, lf));
+        while (mask) {
+            source_push_lf(src, p - src->data + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+#endif
+    while ((p = memchr(p, '\n', end - p))) {
+        source_push_lf(src, p - src->data);
+        p++;
+    }
+}
+
+static size_t lf_lower_bound(const Source *src, size_t pos) {
+    size_t lo = 0, hi = src->lf_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (src->lf[mid] < pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static size_t count_newlines(const Source *src, size_t a, size_t b) {
+    return lf_lower_bound(src, b) - lf_lower_bound(src, a);
+}
+
+static uint32_t next_priority(Buffer *buf) {
+    // xorshift32
+    uint32_t x = buf->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buf->seed = x;
+    return x;
+}
+
+static size_t sum_len(const Piece *t) { return t ? t->sum_len : 0; }
+static size_t sum_nl(const Piece *t) { return t ? t->sum_nl : 0; }
+
+static void update(Piece *t) {
+    t->sum_len = sum_len(t->left) + t->len + sum_len(t->right);
+    t->sum_nl = sum_nl(t->left) + t->nl + sum_nl(t->right);
+}
+
+static Piece* piece_new(Buffer *buf, Source *src, size_t start, size_t len) {
+    Piece *p = xrealloc(NULL, sizeof(Piece));
+    p->left = p->right = NULL;
+    p->priority = next_priority(buf);
+    p->src = src;
+    p->start = start;
+    p->len = len;
+    p->nl = count_newlines(src, start, start + len);
+    src->refs++;
+    update(p);
+    return p;
+}
+
+static void free_tree(Piece *t) {
+    if (!t) return;
+    free_tree(t->left);
+    free_tree(t->right);
+    source_release(t->src);
+    free(t);
+}
+
+// Splits `t` so that `l` holds its first `off` bytes and `r` the rest,
+// cutting a piece in two if the offset falls inside of it.
+static void split(Buffer *buf, Piece *t, size_t off, Piece **l, Piece **r) {
+    if (!t) {
+        *l = *r = NULL;
+        return;
+    }
+    size_t left_len = sum_len(t->left);
+    if (off <= left_len) {
+        split(buf, t->left, off, l, &t->left);
+        update(t);
+        *r = t;
+    } else if (off >= left_len + t->len) {
+        split(buf, t->right, off - left_len - t->len, &t->right, r);
+        update(t);
+        *l = t;
+    } else {
+        size_t k = off - left_len;
+        Piece *tail = piece_new(buf, t->src, t->start + k, t->len - k);
+        // The tail takes over as root of the right half, so it must keep
+        // the heap order with the subtree it adopts.
+        tail->priority = t->priority;
+        tail->right = t->right;
+        t->right = NULL;
+        t->len = k;
+        t->nl -= tail->nl;
+        update(tail);
+        update(t);
+        *l = t;
+        *r = tail;
+    }
+}
+
+static Piece* merge(Piece *l, Piece *r) {
+    if (!l) return r;
+    if (!r) return l;
+    if (l->priority > r->priority) {
+        l->right = merge(l->right, r);
+        update(l);
+        return l;
+    }
+    r->left = merge(l, r->left);
+    update(r);
+    return r;
+}
+
+// Grows the last piece of `t` when the new text was appended right
+// after it in the same source, which is what happens while typing.
+static bool extend_last(Piece *t, Source *src, size_t start, size_t len, size_t nl) {
+    if (!t) return false;
+    if (t->right) {
+        if (!extend_last(t->right, src, start, len, nl)) return false;
+    } else {
+        if (t->src != src || t->start + t->len != start) return false;
+        t->len += len;
+        t->nl += nl;
+    }
+    update(t);
+    return true;
+}
+
+// Byte offset right after the n-th (1-based) newline of the tree.
+static size_t newline_end(const Piece *t, size_t n) {
+    size_t off = 0;
+    while (t) {
+        size_t left_nl = sum_nl(t->left);
+        if (n <= left_nl) {
+            t = t->left;
+            continue;
+        }
+        off += sum_len(t->left);
+        n -= left_nl;
+        if (n <= t->nl) {
+            size_t idx = lf_lower_bound(t->src, t->start) + n - 1;
+            return off + t->src->lf[idx] - t->start + 1;
+        }
+        off += t->len;
+        n -= t->nl;
+        t = t->right;
+    }
+    return off;
+}
+
+static size_t newlines_before(const Piece *t, size_t off) {
+    size_t n = 0;
+    while (t) {
+        size_t left_len = sum_len(t->left);
+        if (off <= left_len) {
+            t = t->left;
+            continue;
+        }
+        off -= left_len;
+        n += sum_nl(t->left);
+        if (off <= t->len) {
+            return n + count_newlines(t->src, t->start, t->start + off);
+        }
+        off -= t->len;
+        n += t->nl;
+        t = t->right;
+    }
+    return n;
+}
+
+static void read_tree(const Piece *t, size_t off, size_t len, char **dst) {
+    while (t && len > 0) {
+        size_t left_len = sum_len(t->left);
+        if (off < left_len) {
+            size_t n = MIN(len, left_len - off);
+            read_tree(t->left, off, n, dst);
+            len -= n;
+            off = 0;
+        } else {
+            off -= left_len;
+        }
+        if (len > 0 && off < t->len) {
+            size_t n = MIN(len, t->len - off);
+            memcpy(*dst, t->src->data + t->start + off, n);
+            *dst += n;
+            len -= n;
+            off = 0;
+        } else if (off >= t->len) {
+            off -= t->len;
+        }
+        t = t->right;
+    }
+}
+
+static Buffer* buffer_with_source(Source *src) {
+    Buffer *buf = xrealloc(NULL, sizeof(Buffer));
+    buf->root = NULL;
+    buf->add = NULL;
+    buf->seed = 0x9e3779b9;
+    if (src) {
+        src->refs++;
+        if (src->size > 0) {
+            buf->root = piece_new(buf, src, 0, src->size);
+        }
+        source_release(src);
+    }
+    return buf;
+}
+
+Buffer* buffer_new(const char *text, size_t len) {
+    Source *src = source_new(len);
+    memcpy(src->data, text, len);
+    src->size = len;
+    source_index(src, 0, len);
+    return buffer_with_source(src);
+}
+
+Buffer* buffer_load(const char *filename, bool *crlf) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return NULL;
+    // The size is taken as 64 bits, ftell() returns a long which is 32
+    // bits on Windows.
+#ifdef _WIN32
+    struct _stat64 st;
+    int err = _fstat64(_fileno(fp), &st);
+#else
+    struct stat st;
+    int err = fstat(fileno(fp), &st);
+#endif
+    if (err != 0 || st.st_size < 0 || (uint64_t)st.st_size >= SIZE_MAX) {
+        fclose(fp);
+        return NULL;
+    }
+    size_t file_size = (size_t)st.st_size;
+
+    // One spare byte for the trailing newline every document ends with.
+    // The line index starts empty and grows as newlines are found.
+    Source *src = source_new(file_size + 1);
+    char *data = src->data;
+    size_t size = 0;
+    bool has_cr = false;
+    while (size < file_size) {
+        size_t n = fread(data + size, 1, MIN(READ_CHUNK, file_size - size), fp);
+        if (n == 0) break;
+        // a file with '\r' in it is indexed once they are dropped
+        if (!has_cr && memchr(data + size, '\r', n)) {
+            has_cr = true;
+            src->lf_count = 0;
+        }
+        if (!has_cr) source_index(src, size, size + n);
+        size += n;
+    }
+    fclose(fp);
+
+    // Drop the '\r' of "\r\n" line endings, the document is kept with
+    // plain '\n' and converted back on save.
+    size_t j = size;
+    *crlf = false;
+    if (has_cr) {
+        j = 0;
+        for (size_t i = 0; i < size; i++) {
+            if (data[i] == '\r' && (i + 1 == size || data[i + 1] == '\n')) {
+                *crlf = true;
+                continue;
+            }
+            data[j++] = data[i];
+        }
+        source_index(src, 0, j);
+    }
+    if (j == 0 || data[j - 1] != '\n') {
+        data[j++] = '\n';
+        source_push_lf(src, j - 1);
+    }
+    src->size = j;
+    // Loaded text is never appended to, trim the doubling slack.
+    src->lf_capacity = src->lf_count;
+    src->lf = xrealloc(src->lf, src->lf_capacity * sizeof(size_t));
+    return buffer_with_source(src);
+}
+
+void buffer_free(Buffer *buf) {
+    free_tree(buf->root);
+    if (buf->add) source_release(buf->add);
+    free(buf);
+}
+
+size_t buffer_get_size(Buffer *buf) {
+    return sum_len(buf->root);
+}
+
+size_t buffer_get_line_count(Buffer *buf) {
+    size_t nl = sum_nl(buf->root);
+    size_t last = nl ? newline_end(buf->root, nl) : 0;
+    return (sum_len(buf->root) > last) ? nl + 1 : nl;
+}
+
+size_t buffer_get_line_offset(Buffer *buf, size_t line) {
+    if (line <= 1) return 0;
+    if (line - 1 > sum_nl(buf->root)) return sum_len(buf->root);
+    return newline_end(buf->root, line - 1);
+}
+
+size_t buffer_get_line_length(Buffer *buf, size_t line) {
+    return buffer_get_line_offset(buf, line + 1) - buffer_get_line_offset(buf, line);
+}
+
+size_t buffer_get_offset_line(Buffer *buf, size_t offset) {
+    return newlines_before(buf->root, offset) + 1;
+}
+
+void buffer_read(Buffer *buf, size_t offset, size_t len, char *dst) {
+    read_tree(buf->root, offset, len, &dst);
+}
+
+void buffer_insert(Buffer *buf, size_t offset, const char *text, size_t len) {
+    if (len == 0) return;
+
+    if (!buf->add || buf->add->capacity - buf->add->size < len) {
+        if (buf->add) source_release(buf->add);
+        buf->add = source_new(MAX(ADD_CHUNK_SIZE, len));
+        buf->add->refs++;
+    }
+    Source *add = buf->add;
+    size_t start = add->size;
+    size_t lf_count = add->lf_count;
+    memcpy(add->data + start, text, len);
+    add->size += len;
+    source_index(add, start, add->size);
+
+    Piece *l, *r;
+    split(buf, buf->root, offset, &l, &r);
+    if (!extend_last(l, add, start, len, add->lf_count - lf_count)) {
+        l = merge(l, piece_new(buf, add, start, len));
+    }
+    buf->root = merge(l, r);
+}
+
+void buffer_remove(Buffer *buf, size_t offset, size_t len) {
+    if (len == 0) return;
+    Piece *l, *m, *r;
+    split(buf, buf->root, offset, &l, &m);
+    split(buf, m, len, &m, &r);
+    free_tree(m);
+    buf->root = merge(l, r);
+}
+
+static void snapshot_tree(BufferSnapshot *snap, Piece *t) {
+    while (t) {
+        snapshot_tree(snap, t->left);
+        if (snap->count == snap->capacity) {
+            snap->capacity = MAX(64, snap->capacity * 2);
+            snap->spans = xrealloc(snap->spans, snap->capacity * sizeof(BufferSpan));
+            snap->sources = xrealloc(snap->sources, snap->capacity * sizeof(Source*));
+        }
+        snap->spans[snap->count] = (BufferSpan) { t->src->data + t->start, t->len };
+        snap->sources[snap->count] = t->src;
+        snap->count++;
+        t->src->refs++;
+        t = t->right;
+    }
+}
+
+BufferSnapshot* buffer_snapshot_new(Buffer *buf) {
+    BufferSnapshot *snap = xrealloc(NULL, sizeof(BufferSnapshot));
+    memset(snap, 0, sizeof(BufferSnapshot));
+    snapshot_tree(snap, buf->root);
+    return snap;
+}
+
+void buffer_snapshot_free(BufferSnapshot *snap) {
+    for (int i = 0; i < snap->count; i++) {
+        source_release(snap->sources[i]);
+    }
+    free(snap->spans);
+    free(snap->sources);
+    free(snap);
+}
+
+const BufferSpan* buffer_snapshot_get_spans(BufferSnapshot *snap, int *count) {
+    *count = snap->count;
+    return snap->spans;
+}
@@ -0,0 +1,43 @@
+// Piece table used as the document text storage. The pieces live
+// in a treap ordered by document position, every node caches the
+// byte and newline count of its subtree, so line lookups, inserts
+// and removes are O(log n) on the number of pieces.
+
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct Buffer Buffer;
+typedef struct BufferSnapshot BufferSnapshot;
+
+typedef struct
+{
+    const char *text;
+    size_t len;
+} BufferSpan;
+
+Buffer* buffer_new(const char *text, size_t len);
+Buffer* buffer_load(const char *filename, bool *crlf);
+void buffer_free(Buffer *buf);
+
+size_t buffer_get_size(Buffer *buf);
+size_t buffer_get_line_count(Buffer *buf);
+size_t buffer_get_line_offset(Buffer *buf, size_t line);
+size_t buffer_get_line_length(Buffer *buf, size_t line);
+size_t buffer_get_offset_line(Buffer *buf, size_t offset);
+
+void buffer_read(Buffer *buf, size_t offset, size_t len, char *dst);
+void buffer_insert(Buffer *buf, size_t offset, const char *text, size_t len);
+void buffer_remove(Buffer *buf, size_t offset, size_t len);
+
+// The text of the buffer as spans of the text it points into, which
+// stays as it is until the snapshot is freed, even if the buffer is
+// edited or freed meanwhile. Another thread may read the spans,
+// but only the buffer's thread may create and free the snapshot.
+BufferSnapshot* buffer_snapshot_new(Buffer *buf);
+void buffer_snapshot_free(BufferSnapshot *snap);
+const BufferSpan* buffer_snapshot_get_spans(BufferSnapshot *snap, int *count);
+
+#endif
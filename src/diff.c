@@ -0,0 +1,371 @@
+#include "diff.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Past this many inserted plus deleted lines in one region Myers' search
+// gives up, and the lines left in the region are all taken as changed.
+// Its trace takes MAX_EDITS^2 ints. Bigger regions are first split on
+// their unique lines.
+#define MAX_EDITS 1024
+
+struct Diff
+{
+    uint64_t *base;
+    int base_count;
+
+    // hashes of the buffer lines, and the base line each of them is
+    // matched to, -1 for the changed ones
+    uint64_t *lines;
+    int *match;
+    int count;
+    int capacity;
+    int matched;
+
+    char *scratch;
+    size_t scratch_size;
+    // Myers' furthest points per diagonal, and their copy for each edit
+    int *v;
+    int *trace;
+    size_t trace_size;
+};
+
+// FNV-1a of the line without its "\n" or "\r\n", so a file checked out
+// with CRLF endings doesn't differ on every line.
+static uint64_t hash_line(const char *text, size_t len) {
+    if (len > 0 && text[len - 1] == '\n') { len--; }
+    if (len > 0 && text[len - 1] == '\r') { len--; }
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)text[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+// Hashes `count` lines of `buf` starting at `line` into `out`, reading
+// them in one go rather than looking up every line in the piece table.
+static void hash_buffer_lines(Diff *diff, Buffer *buf, int line, int count, uint64_t *out) {
+    if (count == 0) { return; }
+    size_t start = buffer_get_line_offset(buf, line);
+    int last = line + count - 1;
+    size_t len = buffer_get_line_offset(buf, last) + buffer_get_line_length(buf, last) - start;
+    if (len > diff->scratch_size) {
+        diff->scratch_size = len * 2;
+        diff->scratch = xrealloc(diff->scratch, diff->scratch_size);
+    }
+    buffer_read(buf, start, len, diff->scratch);
+
+    const char *text = diff->scratch;
+    const char *end = text + len;
+    for (int i = 0; i < count; i++) {
+        const char *nl = memchr(text, '\n', end - text);
+        const char *next = nl ? nl + 1 : end;
+        out[i] = hash_line(text, next - text);
+        text = next;
+    }
+}
+
+Diff* diff_new(const char *base, size_t len) {
+    Diff *diff = xrealloc(NULL, sizeof(Diff));
+    memset(diff, 0, sizeof(Diff));
+
+    int capacity = 0;
+    size_t start = 0;
+    while (start < len) {
+        const char *nl = memchr(base + start, '\n', len - start);
+        size_t end = nl ? (size_t)(nl - base) + 1 : len;
+        if (diff->base_count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            diff->base = xrealloc(diff->base, capacity * sizeof(uint64_t));
+        }
+        diff->base[diff->base_count++] = hash_line(base + start, end - start);
+        start = end;
+    }
+
+    diff->v = xrealloc(NULL, (2 * MAX_EDITS + 3) * sizeof(int));
+    return diff;
+}
+
+void diff_free(Diff *diff) {
+    free(diff->base);
+    free(diff->lines);
+    free(diff->match);
+    free(diff->scratch);
+    free(diff->v);
+    free(diff->trace);
+    free(diff);
+}
+
+static void set_match(Diff *diff, int line, int base_line) {
+    diff->match[line] = base_line;
+    diff->matched++;
+}
+
+// Matches buffer lines `b` to `b + m - 1` to base lines `a` to `a + n - 1`
+// along the shortest edit script between them. Returns false when there
+// are more than MAX_EDITS edits, leaving the lines unmatched.
+static bool myers(Diff *diff, int a, int n, int b, int m) {
+    const uint64_t *x_lines = diff->base + a;
+    const uint64_t *y_lines = diff->lines + b;
+    int *v = diff->v + MAX_EDITS + 1;
+    int max = n + m < MAX_EDITS ? n + m : MAX_EDITS;
+    memset(v - max - 1, 0xff, (2 * max + 3) * sizeof(int));
+
+    int d, k, x, y;
+    for (d = 0; d <= max; d++) {
+        size_t size = (size_t)(d + 1) * (d + 1) * sizeof(int);
+        if (size > diff->trace_size) {
+            diff->trace_size = size * 2;
+            diff->trace = xrealloc(diff->trace, diff->trace_size);
+        }
+        for (k = -d; k <= d; k += 2) {
+            // furthest point of the diagonal reached with a deletion
+            // from diagonal k + 1, or an insertion from k - 1, without
+            // leaving the edit graph; -1 when neither is possible
+            x = d == 0 ? 0 : -1;
+            if (k < d && v[k + 1] >= 0 && v[k + 1] - k <= m) { x = v[k + 1]; }
+            if (k > -d && v[k - 1] >= 0 && v[k - 1] < n && v[k - 1] + 1 > x) { x = v[k - 1] + 1; }
+            if (x < 0) { v[k] = -1; continue; }
+            y = x - k;
+            while (x < n && y < m && x_lines[x] == y_lines[y]) { x++; y++; }
+            v[k] = x;
+            if (x == n && y == m) { goto found; }
+        }
+        memcpy(diff->trace + d * d, v - d, (2 * d + 1) * sizeof(int));
+    }
+    return false;
+
+found:
+    // walk the edits back, matching the lines of the snakes between them
+    x = n; y = m;
+    for (; d > 0; d--) {
+        int *prev = diff->trace + (d - 1) * (d - 1) + (d - 1);
+        k = x - y;
+        int down = -1, right = -1;
+        if (k < d && prev[k + 1] >= 0 && prev[k + 1] - k <= m) { down = prev[k + 1]; }
+        if (k > -d && prev[k - 1] >= 0 && prev[k - 1] < n) { right = prev[k - 1] + 1; }
+        int snake_x = right > down ? right : down;
+        while (x > snake_x) {
+            x--; y--;
+            set_match(diff, b + y, a + x);
+        }
+        if (right > down) {
+            x = right - 1;
+            y = x - (k - 1);
+        } else {
+            y = x - k - 1;
+        }
+    }
+    while (x > 0) {
+        x--; y--;
+        set_match(diff, b + y, a + x);
+    }
+    return true;
+}
+
+static void diff_range(Diff *diff, int a, int ae, int b, int be);
+
+typedef struct
+{
+    uint64_t hash;
+    int count_a, count_b;
+    int line_a;
+} Slot;
+
+static Slot* find_slot(Slot *slots, size_t capacity, uint64_t hash) {
+    size_t i = (hash ^ (hash >> 32)) & (capacity - 1);
+    while ((slots[i].count_a || slots[i].count_b) && slots[i].hash != hash) {
+        i = (i + 1) & (capacity - 1);
+    }
+    slots[i].hash = hash;
+    return &slots[i];
+}
+
+// Patience diff step for the big ranges Myers' search would be too slow
+// on: the lines found once on each side are matched, keeping the longest
+// run of them that is in the same order on both, then the lines between
+// them are diffed. Returns false when there is no such line.
+static bool diff_anchors(Diff *diff, int a, int ae, int b, int be) {
+    size_t capacity = 16;
+    while (capacity < (size_t)(ae - a + be - b) * 2) { capacity *= 2; }
+    Slot *slots = xrealloc(NULL, capacity * sizeof(Slot));
+    memset(slots, 0, capacity * sizeof(Slot));
+    for (int i = a; i < ae; i++) {
+        Slot *slot = find_slot(slots, capacity, diff->base[i]);
+        slot->count_a++;
+        slot->line_a = i;
+    }
+    for (int i = b; i < be; i++) {
+        Slot *slot = find_slot(slots, capacity, diff->lines[i]);
+        slot->count_b++;
+    }
+
+    // the unique lines in buffer order, and the longest increasing run
+    // of their base lines, `tails[j]` ending the best run of length j + 1
+    int m = be - b;
+    int *line_a = xrealloc(NULL, m * 4 * sizeof(int));
+    int *line_b = line_a + m;
+    int *tails = line_b + m;
+    int *prev = tails + m;
+    int count = 0, length = 0;
+    for (int i = b; i < be; i++) {
+        Slot *slot = find_slot(slots, capacity, diff->lines[i]);
+        if (slot->count_a != 1 || slot->count_b != 1) { continue; }
+        int lo = 0, hi = length;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (line_a[tails[mid]] < slot->line_a) { lo = mid + 1; } else { hi = mid; }
+        }
+        line_a[count] = slot->line_a;
+        line_b[count] = i;
+        prev[count] = lo > 0 ? tails[lo - 1] : -1;
+        tails[lo] = count;
+        if (lo == length) { length++; }
+        count++;
+    }
+    free(slots);
+
+    // match the run back to front, diffing the lines after each match
+    int next_a = ae, next_b = be;
+    for (int i = length > 0 ? tails[length - 1] : -1; i >= 0; i = prev[i]) {
+        set_match(diff, line_b[i], line_a[i]);
+        diff_range(diff, line_a[i] + 1, next_a, line_b[i] + 1, next_b);
+        next_a = line_a[i];
+        next_b = line_b[i];
+    }
+    if (length > 0) {
+        diff_range(diff, a, next_a, b, next_b);
+    }
+    free(line_a);
+    return length > 0;
+}
+
+// Matches buffer lines `b` to `be - 1` to base lines `a` to `ae - 1`,
+// every line of the range being unmatched.
+static void diff_range(Diff *diff, int a, int ae, int b, int be) {
+    while (a < ae && b < be && diff->base[a] == diff->lines[b]) {
+        set_match(diff, b++, a++);
+    }
+    while (a < ae && b < be && diff->base[ae - 1] == diff->lines[be - 1]) {
+        set_match(diff, --be, --ae);
+    }
+    if (a == ae || b == be) { return; }
+    if (ae - a + be - b > MAX_EDITS && diff_anchors(diff, a, ae, b, be)) { return; }
+    myers(diff, a, ae - a, b, be - b);
+}
+
+// Replaces `removed` buffer lines at `start` with `added` unmatched ones.
+static void splice(Diff *diff, int start, int removed, int added) {
+    for (int i = start; i < start + removed; i++) {
+        if (diff->match[i] >= 0) { diff->matched--; }
+    }
+    int count = diff->count - removed + added;
+    if (count > diff->capacity) {
+        diff->capacity = count * 2;
+        diff->lines = xrealloc(diff->lines, diff->capacity * sizeof(uint64_t));
+        diff->match = xrealloc(diff->match, diff->capacity * sizeof(int));
+    }
+    int tail = diff->count - start - removed;
+    memmove(diff->lines + start + added, diff->lines + start + removed, tail * sizeof(uint64_t));
+    memmove(diff->match + start + added, diff->match + start + removed, tail * sizeof(int));
+    for (int i = start; i < start + added; i++) {
+        diff->match[i] = -1;
+    }
+    diff->count = count;
+}
+
+void diff_update(Diff *diff, Buffer *buf, int line, int removed, int added) {
+    int start = line - 1;
+    if (start < 0) { start = 0; }
+    if (start > diff->count) { start = diff->count; }
+    if (removed > diff->count - start) { removed = diff->count - start; }
+    int buf_count = (int)buffer_get_line_count(buf);
+    if (added > buf_count - start) { added = buf_count - start; }
+    if (removed < 0) { removed = 0; }
+    if (added < 0) { added = 0; }
+
+    splice(diff, start, removed, added);
+    hash_buffer_lines(diff, buf, start + 1, added, diff->lines + start);
+
+    // the lines outside of the nearest matched lines around the edit keep
+    // their match, only the ones in between are diffed again
+    int first = start - 1;
+    while (first >= 0 && diff->match[first] < 0) { first--; }
+    int last = start + added;
+    while (last < diff->count && diff->match[last] < 0) { last++; }
+    int base_first = first >= 0 ? diff->match[first] + 1 : 0;
+    int base_last = last < diff->count ? diff->match[last] : diff->base_count;
+    diff_range(diff, base_first, base_last, first + 1, last);
+}
+
+void diff_reset(Diff *diff, Buffer *buf) {
+    diff_update(diff, buf, 1, diff->count, (int)buffer_get_line_count(buf));
+}
+
+void diff_get_marks(Diff *diff, int line, int count, unsigned char *out) {
+    memset(out, DIFF_NONE, count);
+    int first = line - 1;
+    int last = first + count;
+    if (last > diff->count) { last = diff->count; }
+    if (first >= last) { return; }
+
+    // start from the first line of the change `first` is in
+    int i = first;
+    while (i > 0 && diff->match[i - 1] < 0) { i--; }
+
+    while (i < last) {
+        int base_prev = i > 0 ? diff->match[i - 1] : -1;
+        if (diff->match[i] >= 0) {
+            bool after_match = i == 0 || base_prev >= 0;
+            if (i >= first && after_match && diff->match[i] > base_prev + 1) {
+                out[i - first] = DIFF_DELETED;
+            }
+            i++;
+            continue;
+        }
+
+        // as many changed lines as there are removed base lines are
+        // modified ones, the others are added
+        int end = i;
+        while (end < diff->count && diff->match[end] < 0) { end++; }
+        int base_next = end < diff->count ? diff->match[end] : diff->base_count;
+        int removed = base_next - base_prev - 1;
+        for (int j = i > first ? i : first; j < end && j < last; j++) {
+            out[j - first] =
+                j - i < removed ? DIFF_MODIFIED : DIFF_ADDED;
+        }
+        i = end;
+    }
+
+    int tail = diff->count - 1;
+    if (last == diff->count && tail >= first && diff->match[tail] >= 0 && diff->match[tail] < diff->base_count - 1) {
+        out[tail - first] = DIFF_DELETED_BELOW;
+    }
+}
+
+void diff_get_stats(Diff *diff, int *inserts, int *deletes) {
+    *inserts = diff->count - diff->matched;
+    *deletes = diff->base_count - diff->matched;
+}
+
+int diff_get_hunks(Diff *diff, DiffHunk *out) {
+    int n = 0;
+    int start = 0;
+    int base_prev = -1;
+    for (int i = 0; i <= diff->count; i++) {
+        if (i < diff->count && diff->match[i] < 0) { continue; }
+        int base_next = i < diff->count ? diff->match[i] : diff->base_count;
+        if (i > start || base_next > base_prev + 1) {
+            if (out) {
+                out[n] = (DiffHunk) { base_prev + 2, base_next - base_prev - 1, start + 1, i - start };
+            }
+            n++;
+        }
+        base_prev = base_next;
+        start = i + 1;
+    }
+    return n;
+}
@@ -0,0 +1,52 @@
+// Line diff of a Buffer against a fixed base text (the file as it is in
+// git's HEAD). Lines are compared by a hash of their text, line endings
+// left out. The diff is kept as the base line each buffer line is
+// matched to, so an edit only re-diffs, with Myers' algorithm, the lines
+// between the nearest matched lines around the edited ones. Ranges too
+// big for it are first split on the lines they have once on each side,
+// as patience diff does.
+
+#ifndef DIFF_H
+#define DIFF_H
+
+#include "buffer.h"
+
+typedef struct Diff Diff;
+
+typedef enum
+{
+    DIFF_NONE,
+    DIFF_ADDED,
+    DIFF_MODIFIED,
+    // base lines were removed above the line
+    DIFF_DELETED,
+    // base lines were removed below the last line
+    DIFF_DELETED_BELOW,
+} DiffMark;
+
+typedef struct
+{
+    // 1-based first line and count of the base lines the hunk replaces,
+    // and of the buffer lines replacing them
+    int base_line, base_count;
+    int line, count;
+} DiffHunk;
+
+Diff* diff_new(const char *base, size_t len);
+void diff_free(Diff *diff);
+
+// Diffs every line of `buf` against the base.
+void diff_reset(Diff *diff, Buffer *buf);
+// Lines `line` to `line + removed - 1` were replaced by `added` lines of
+// `buf` starting at `line`. Lines are 1-based, like the Buffer's.
+void diff_update(Diff *diff, Buffer *buf, int line, int removed, int added);
+
+// Writes the marks of `count` lines starting at `line`, at least 1, to
+// `out`.
+void diff_get_marks(Diff *diff, int line, int count, unsigned char *out);
+void diff_get_stats(Diff *diff, int *inserts, int *deletes);
+// Writes the runs of changed lines to `out`, top to bottom, and returns
+// how many there are. With a NULL `out` only counts them.
+int diff_get_hunks(Diff *diff, DiffHunk *out);
+
+#endif
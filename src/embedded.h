@@ -0,0 +1,24 @@
+// The editor's Lua modules, compiled to bytecode at build time by
+// tools/embed.c and linked into the executable. The table is generated
+// into src/embedded_modules.c, the `embedded` Lua API loads from it.
+
+#ifndef EMBEDDED_H
+#define EMBEDDED_H
+
+#include <stddef.h>
+
+typedef struct
+{
+    // the name given to require
+    const char *name;
+    // the source it was compiled from, relative to the executable
+    const char *filename;
+    const unsigned char *data;
+    size_t size;
+} EmbeddedModule;
+
+// Sorted by name.
+extern const EmbeddedModule embedded_modules[];
+extern const int embedded_modules_count;
+
+#endif
@@ -0,0 +1,341 @@
+#include "fuzzy.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#define SCORE_MATCH 16
+#define SCORE_GAP_START (-3)
+#define SCORE_GAP_EXTENSION (-1)
+#define BONUS_BOUNDARY (SCORE_MATCH / 2)
+#define BONUS_BOUNDARY_WHITE (BONUS_BOUNDARY + 2)
+#define BONUS_BOUNDARY_DELIMITER (BONUS_BOUNDARY + 1)
+#define BONUS_NON_WORD (SCORE_MATCH / 2)
+#define BONUS_CAMEL_123 (BONUS_BOUNDARY + SCORE_GAP_EXTENSION)
+#define BONUS_CONSECUTIVE (-(SCORE_GAP_START + SCORE_GAP_EXTENSION))
+#define BONUS_FIRST_CHAR_MULTIPLIER 2
+
+// Ordered like in fzf, the classes after CHAR_NON_WORD are words.
+enum
+{
+    CHAR_WHITE,
+    CHAR_NON_WORD,
+    CHAR_DELIMITER,
+    CHAR_LOWER,
+    CHAR_UPPER,
+    CHAR_LETTER,
+    CHAR_NUMBER,
+};
+
+typedef struct
+{
+    int score;
+    int index;
+} Match;
+
+struct FuzzyCorpus
+{
+    int count;
+    // items are packed one after the other
+    char *text;
+    size_t *offsets;
+    uint64_t *masks;
+
+    // items matched by the last needle
+    int *candidates;
+    int candidates_count;
+    uint32_t *needle;
+    int needle_len;
+    bool ranked;
+
+    uint32_t *scratch;
+    Match *matches;
+};
+
+// Invalid bytes decode as themselves.
+static const char* decode(const char *p, const char *end, uint32_t *cp) {
+    unsigned char c = *p;
+    int n = (c >= 0xf0) ? 3 : (c >= 0xe0) ? 2 : (c >= 0xc0) ? 1 : 0;
+    if (n == 0 || end - p <= n) {
+        *cp = c;
+        return p + 1;
+    }
+    uint32_t res = c & (0x3f >> n);
+    for (int i = 1; i <= n; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            *cp = c;
+            return p + 1;
+        }
+        res = (res << 6) | (p[i] & 0x3f);
+    }
+    *cp = res;
+    return p + n + 1;
+}
+
+// Lowercases ASCII, Latin-1, Greek and Cyrillic.
+static uint32_t fold(uint32_t c) {
+    if (c < 0x80) { return (c >= 'A' && c <= 'Z') ? c + 32 : c; }
+    if ((c >= 0xc0 && c <= 0xde && c != 0xd7) || (c >= 0x391 && c <= 0x3a9) || (c >= 0x410 && c <= 0x42f)) {
+        return c + 32;
+    }
+    if (c >= 0x400 && c <= 0x40f) { return c + 80; }
+    return c;
+}
+
+static int char_class(uint32_t c) {
+    if (c >= 'a' && c <= 'z') { return CHAR_LOWER; }
+    if (c >= 'A' && c <= 'Z') { return CHAR_UPPER; }
+    if (c >= '0' && c <= '9') { return CHAR_NUMBER; }
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') { return CHAR_WHITE; }
+    if (c == '/' || c == '\\' || c == ',' || c == ':' || c == ';' || c == '|') { return CHAR_DELIMITER; }
+    if (c < 0x80) { return CHAR_NON_WORD; }
+    return (fold(c) != c) ? CHAR_UPPER : CHAR_LETTER;
+}
+
+static int bonus_for(int prev, int class) {
+    if (class > CHAR_NON_WORD) {
+        if (prev == CHAR_WHITE) { return BONUS_BOUNDARY_WHITE; }
+        if (prev == CHAR_DELIMITER) { return BONUS_BOUNDARY_DELIMITER; }
+        if (prev == CHAR_NON_WORD) { return BONUS_BOUNDARY; }
+    }
+    if ((prev == CHAR_LOWER && class == CHAR_UPPER) || (prev != CHAR_NUMBER && class == CHAR_NUMBER)) {
+        return BONUS_CAMEL_123;
+    }
+    if (class == CHAR_NON_WORD || class == CHAR_DELIMITER) { return BONUS_NON_WORD; }
+    if (class == CHAR_WHITE) { return BONUS_BOUNDARY_WHITE; }
+    return 0;
+}
+
+// Letters and digits get a bit each, the rest share the others.
+static uint64_t char_bit(uint32_t c) {
+    if (c >= 'a' && c <= 'z') { return 1ull << (c - 'a'); }
+    if (c >= '0' && c <= '9') { return 1ull << (26 + c - '0'); }
+    if (c < 0x80) { return 1ull << (36 + c % 27); }
+    return 1ull << 63;
+}
+
+// Decodes a needle into folded codepoints, without its spaces.
+static int fold_needle(const char *needle, size_t len, uint32_t *out, uint64_t *mask) {
+    const char *end = needle + len;
+    int n = 0;
+    *mask = 0;
+    while (needle < end) {
+        uint32_t c;
+        needle = decode(needle, end, &c);
+        if (c == ' ') continue;
+        out[n++] = fold(c);
+        *mask |= char_bit(fold(c));
+    }
+    return n;
+}
+
+// Scores decoded text against a folded needle.
+static bool score_text(const uint32_t *text, int n, const uint32_t *needle, int m, int *score) {
+    if (m == 0) {
+        *score = 0;
+        return true;
+    }
+
+    // first window holding the needle, then its shortest suffix
+    int start = -1;
+    int end = -1;
+    for (int i = 0, k = 0; i < n; i++) {
+        if (fold(text[i]) == needle[k]) {
+            if (start < 0) { start = i; }
+            if (++k == m) {
+                end = i + 1;
+                break;
+            }
+        }
+    }
+    if (end < 0) { return false; }
+    for (int i = end - 1, k = m - 1; i >= start; i--) {
+        if (fold(text[i]) == needle[k] && --k < 0) {
+            start = i;
+            break;
+        }
+    }
+
+    int res = 0;
+    int k = 0;
+    int consecutive = 0;
+    int first_bonus = 0;
+    bool in_gap = false;
+    int prev = (start > 0) ? char_class(text[start - 1]) : CHAR_WHITE;
+    for (int i = start; i < end; i++) {
+        int class = char_class(text[i]);
+        if (k < m && fold(text[i]) == needle[k]) {
+            res += SCORE_MATCH;
+            int bonus = bonus_for(prev, class);
+            if (consecutive == 0) {
+                first_bonus = bonus;
+            } else {
+                // a run keeps the bonus of the boundary it started at
+                if (bonus >= BONUS_BOUNDARY && bonus > first_bonus) { first_bonus = bonus; }
+                if (first_bonus > bonus) { bonus = first_bonus; }
+                if (BONUS_CONSECUTIVE > bonus) { bonus = BONUS_CONSECUTIVE; }
+            }
+            res += (k == 0) ? bonus * BONUS_FIRST_CHAR_MULTIPLIER : bonus;
+            in_gap = false;
+            consecutive++;
+            k++;
+        } else {
+            res += in_gap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+            in_gap = true;
+            consecutive = 0;
+            first_bonus = 0;
+        }
+        prev = class;
+    }
+    *score = res;
+    return true;
+}
+
+static int decode_text(const char *text, size_t len, uint32_t *out) {
+    const char *end = text + len;
+    int n = 0;
+    while (text < end) { text = decode(text, end, &out[n++]); }
+    return n;
+}
+
+uint64_t fuzzy_mask(const char *text, size_t len) {
+    uint64_t mask = 0;
+    const char *end = text + len;
+    while (text < end) {
+        uint32_t c;
+        text = decode(text, end, &c);
+        mask |= char_bit(fold(c));
+    }
+    return mask;
+}
+
+bool fuzzy_score(const char *text, size_t len, const char *needle, size_t needle_len, int *score) {
+    uint32_t *buf = xrealloc(NULL, (len + needle_len) * sizeof(uint32_t));
+    uint64_t mask;
+    int m = fold_needle(needle, needle_len, buf, &mask);
+    int n = decode_text(text, len, buf + m);
+    bool res = score_text(buf + m, n, buf, m, score);
+    free(buf);
+    return res;
+}
+
+FuzzyCorpus* fuzzy_corpus_new(const char **items, const size_t *lens, int count) {
+    FuzzyCorpus *c = xrealloc(NULL, sizeof(FuzzyCorpus));
+    memset(c, 0, sizeof(FuzzyCorpus));
+    c->count = count;
+    c->offsets = xrealloc(NULL, (count + 1) * sizeof(size_t));
+    c->masks = xrealloc(NULL, count * sizeof(uint64_t));
+    c->candidates = xrealloc(NULL, count * sizeof(int));
+    c->matches = xrealloc(NULL, count * sizeof(Match));
+
+    size_t size = 0;
+    size_t longest = 0;
+    for (int i = 0; i < count; i++) {
+        c->offsets[i] = size;
+        size += lens[i];
+        if (lens[i] > longest) { longest = lens[i]; }
+    }
+    c->offsets[count] = size;
+    c->text = xrealloc(NULL, size);
+    c->scratch = xrealloc(NULL, longest * sizeof(uint32_t));
+
+    for (int i = 0; i < count; i++) {
+        char *text = c->text + c->offsets[i];
+        memcpy(text, items[i], lens[i]);
+        c->masks[i] = fuzzy_mask(text, lens[i]);
+    }
+    return c;
+}
+
+void fuzzy_corpus_free(FuzzyCorpus *c) {
+    free(c->text);
+    free(c->offsets);
+    free(c->masks);
+    free(c->candidates);
+    free(c->needle);
+    free(c->scratch);
+    free(c->matches);
+    free(c);
+}
+
+int fuzzy_corpus_get_count(FuzzyCorpus *c) {
+    return c->count;
+}
+
+static bool better(FuzzyCorpus *c, const Match *a, const Match *b) {
+    if (a->score != b->score) { return a->score > b->score; }
+    size_t la = c->offsets[a->index + 1] - c->offsets[a->index];
+    size_t lb = c->offsets[b->index + 1] - c->offsets[b->index];
+    if (la != lb) { return la < lb; }
+    int res = memcmp(c->text + c->offsets[a->index], c->text + c->offsets[b->index], la);
+    if (res != 0) { return res < 0; }
+    return a->index < b->index;
+}
+
+// Min-heap on `better`, the worst kept match sits on top.
+static void sift_down(FuzzyCorpus *c, Match *heap, int count, int i) {
+    for (;;) {
+        int worst = i;
+        int l = i * 2 + 1;
+        int r = l + 1;
+        if (l < count && better(c, &heap[worst], &heap[l])) { worst = l; }
+        if (r < count && better(c, &heap[worst], &heap[r])) { worst = r; }
+        if (worst == i) { return; }
+        Match tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+}
+
+int fuzzy_rank(FuzzyCorpus *c, const char *needle, size_t len, int k, int *out) {
+    uint32_t *folded = xrealloc(NULL, len * sizeof(uint32_t));
+    uint64_t mask;
+    int m = fold_needle(needle, len, folded, &mask);
+
+    // a needle extending the last one can only match a subset of it
+    bool narrow = c->ranked && m >= c->needle_len
+        && memcmp(folded, c->needle, c->needle_len * sizeof(uint32_t)) == 0;
+    int from = narrow ? c->candidates_count : c->count;
+
+    int matches = 0;
+    for (int i = 0; i < from; i++) {
+        int idx = narrow ? c->candidates[i] : i;
+        if (mask & ~c->masks[idx]) continue;
+        size_t start = c->offsets[idx];
+        int n = decode_text(c->text + start, c->offsets[idx + 1] - start, c->scratch);
+        int score;
+        if (score_text(c->scratch, n, folded, m, &score)) {
+            c->matches[matches].score = score;
+            c->matches[matches].index = idx;
+            matches++;
+        }
+    }
+
+    for (int i = 0; i < matches; i++) { c->candidates[i] = c->matches[i].index; }
+    c->candidates_count = matches;
+    free(c->needle);
+    c->needle = folded;
+    c->needle_len = m;
+    c->ranked = true;
+
+    // keep the best `k` in a heap, then pop them worst first
+    if (k > matches) { k = matches; }
+    if (k <= 0) { return 0; }
+    Match *heap = c->matches;
+    for (int i = k / 2 - 1; i >= 0; i--) { sift_down(c, heap, k, i); }
+    for (int i = k; i < matches; i++) {
+        if (better(c, &heap[i], &heap[0])) {
+            heap[0] = heap[i];
+            sift_down(c, heap, k, 0);
+        }
+    }
+    for (int n = k; n > 0; n--) {
+        out[n - 1] = heap[0].index;
+        heap[0] = heap[n - 1];
+        sift_down(c, heap, n - 1, 0);
+    }
+    return k;
+}
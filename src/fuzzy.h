@@ -0,0 +1,36 @@
+// Fuzzy matching for the command view lists. Scores follow fzf's v1
+// algorithm: the shortest window holding the needle as a subsequence
+// is scored with bonuses for matches at word boundaries, camel case
+// humps and consecutive runs, and penalties for gaps. Matching is case
+// insensitive on UTF-8 codepoints, spaces in the needle are ignored.
+//
+// A FuzzyCorpus keeps a list of items packed together with a bitmask
+// of the characters they hold, so items missing a needle character are
+// rejected without being scanned. It also remembers which items the
+// last needle matched: a needle that extends it only rescans those.
+
+#ifndef FUZZY_H
+#define FUZZY_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct FuzzyCorpus FuzzyCorpus;
+
+// Bitmask of the characters in `text`, a needle can only match texts
+// that have all the bits of its own (spaces aside).
+uint64_t fuzzy_mask(const char *text, size_t len);
+// Scores a single text, returns false if the needle doesn't match.
+bool fuzzy_score(const char *text, size_t len, const char *needle, size_t needle_len, int *score);
+
+FuzzyCorpus* fuzzy_corpus_new(const char **items, const size_t *lens, int count);
+void fuzzy_corpus_free(FuzzyCorpus *corpus);
+int fuzzy_corpus_get_count(FuzzyCorpus *corpus);
+
+// Fills `out` with the 0-based indices of the best `k` items, best
+// first, and returns how many there are. Equal scores go to the shorter
+// item, then to the first one in byte order, then to the earlier one.
+int fuzzy_rank(FuzzyCorpus *corpus, const char *needle, size_t len, int k, int *out);
+
+#endif
@@ -0,0 +1,398 @@
+#include "highlighter.h"
+#include "thread.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_WORKERS 4
+
+// Lines tokenized between two checks for more urgent work.
+#define BATCH_LINES 2048
+// Lines tokenized between two checks for the job being cancelled.
+#define CANCEL_CHECK_LINES 256
+
+struct HighlightJob
+{
+    Tokenizer *tk;
+    BufferSnapshot *snap;
+    const BufferSpan *spans;
+    int span_count;
+    int first;
+    int last;
+    // the states the lines from `cached_first` had in the last pass,
+    // -1 for a line that had none; see highlight_job_new()
+    int cached_first;
+    int cached_count;
+    int *cached_init;
+    int *cached_end;
+
+    // only touched by the worker holding the job
+    int next;
+    int state;
+    TokenList list;
+    // where the text of line `next` starts in the spans
+    int span;
+    size_t span_offset;
+    // the line being tokenized, followed by a '\0' for the tokenizer
+    char *line;
+    size_t line_capacity;
+
+    // protected by the pool mutex
+    int visible_first;
+    int visible_last;
+    bool queued;
+    bool cancelled;
+    bool failed;
+    bool converged;
+    const char *error;
+    int refs;
+    HighlightBatch *batches;
+    HighlightBatch *batches_tail;
+    struct HighlightJob *queue_next;
+};
+
+static struct
+{
+    Mutex mutex;
+    Cond cond;
+    HighlightJob *queue;
+    // signaled when a worker lets go of a job
+    Cond released;
+    Thread threads[MAX_WORKERS];
+    int thread_count;
+}
+pool;
+
+void highlight_batch_free(HighlightBatch *batch) {
+    free(batch->states);
+    free(batch->first_token);
+    free(batch->tokens);
+    free(batch->text);
+    free(batch->text_start);
+    free(batch);
+}
+
+static void free_batches(HighlightJob *job) {
+    while (job->batches) {
+        HighlightBatch *next = job->batches->next;
+        highlight_batch_free(job->batches);
+        job->batches = next;
+    }
+    job->batches_tail = NULL;
+}
+
+// Called with the pool mutex held. The owner's reference is the last
+// one dropped, the snapshot must be freed on the buffer's thread.
+static void release_job(HighlightJob *job) {
+    if (--job->refs > 0) {
+        cond_broadcast(&pool.released);
+        return;
+    }
+    free_batches(job);
+    tokenizer_free(job->tk);
+    buffer_snapshot_free(job->snap);
+    free(job->list.tokens);
+    free(job->line);
+    free(job->cached_init);
+    free(job->cached_end);
+    free(job);
+}
+
+static bool is_urgent(HighlightJob *job) {
+    return job->next <= job->visible_last;
+}
+
+// Takes the first job with visible lines left, or the oldest one.
+static HighlightJob* take_job(void) {
+    HighlightJob **pick = &pool.queue;
+    for (HighlightJob **j = &pool.queue; *j; j = &(*j)->queue_next) {
+        if (is_urgent(*j)) {
+            pick = j;
+            break;
+        }
+    }
+    HighlightJob *job = *pick;
+    *pick = job->queue_next;
+    job->queue_next = NULL;
+    job->queued = false;
+    return job;
+}
+
+static void push_job(HighlightJob *job) {
+    HighlightJob **j = &pool.queue;
+    while (*j) { j = &(*j)->queue_next; }
+    *j = job;
+    job->queued = true;
+    cond_signal(&pool.cond);
+}
+
+// Copies line `next` out of the spans into `line`, returns its length
+// with the '\n'.
+static size_t read_line(HighlightJob *job) {
+    size_t len = 0;
+    while (job->span < job->span_count) {
+        const BufferSpan *sp = &job->spans[job->span];
+        const char *start = sp->text + job->span_offset;
+        size_t avail = sp->len - job->span_offset;
+        const char *nl = memchr(start, '\n', avail);
+        size_t n = nl ? (size_t)(nl - start) + 1 : avail;
+        if (len + n + 1 > job->line_capacity) {
+            job->line_capacity = (len + n + 1) * 2;
+            job->line = xrealloc(job->line, job->line_capacity);
+        }
+        memcpy(job->line + len, start, n);
+        len += n;
+        job->span_offset += n;
+        if (job->span_offset == sp->len) {
+            job->span++;
+            job->span_offset = 0;
+        }
+        if (nl) { break; }
+    }
+    if (!job->line) { job->line = xrealloc(NULL, job->line_capacity = 64); }
+    job->line[len] = '\0';
+    return len;
+}
+
+// The line starts and ends the way it did in the last pass, so do the
+// lines after it.
+static bool has_converged(HighlightJob *job, int line, int init, int state) {
+    int k = line - job->cached_first;
+    if (k < 0 || k >= job->cached_count) { return false; }
+    return job->cached_init[k] == init && job->cached_end[k] == state;
+}
+
+static bool is_cancelled(HighlightJob *job) {
+    mutex_lock(&pool.mutex);
+    bool cancelled = job->cancelled;
+    mutex_unlock(&pool.mutex);
+    return cancelled;
+}
+
+static HighlightBatch* run_batch(HighlightJob *job, int last, int visible_first, int visible_last,
+                                 bool *converged, const char **error) {
+    HighlightBatch *batch = xrealloc(NULL, sizeof(HighlightBatch));
+    int count = last - job->next + 1;
+    int capacity = 0;
+    size_t text_capacity = 0;
+    batch->next = NULL;
+    batch->line = job->next;
+    batch->count = count;
+    batch->states = xrealloc(NULL, (count + 1) * sizeof(int));
+    batch->first_token = xrealloc(NULL, (count + 1) * sizeof(int));
+    batch->tokens = NULL;
+    batch->text = NULL;
+    batch->text_start = xrealloc(NULL, (count + 1) * sizeof(size_t));
+    batch->states[0] = job->state;
+    batch->first_token[0] = 0;
+    batch->text_start[0] = 0;
+
+    int ntokens = 0;
+    size_t ntext = 0;
+    *converged = false;
+    for (int i = 0; i < count; i++) {
+        int n = job->next + i;
+        if (i > 0 && i % CANCEL_CHECK_LINES == 0 && is_cancelled(job)) {
+            highlight_batch_free(batch);
+            return NULL;
+        }
+        size_t len = read_line(job);
+        int state = tokenizer_tokenize(job->tk, job->line, len, batch->states[i], &job->list, error);
+        if (state < 0) {
+            highlight_batch_free(batch);
+            return NULL;
+        }
+        batch->states[i + 1] = state;
+
+        // the text of the lines given tokens goes with them
+        if (n >= visible_first && n <= visible_last) {
+            if (ntokens + job->list.count > capacity) {
+                capacity = (ntokens + job->list.count) * 2;
+                batch->tokens = xrealloc(batch->tokens, capacity * sizeof(Token));
+            }
+            memcpy(batch->tokens + ntokens, job->list.tokens, job->list.count * sizeof(Token));
+            ntokens += job->list.count;
+            if (ntext + len > text_capacity) {
+                text_capacity = (ntext + len) * 2;
+                batch->text = xrealloc(batch->text, text_capacity);
+            }
+            memcpy(batch->text + ntext, job->line, len);
+            ntext += len;
+        }
+        batch->first_token[i + 1] = ntokens;
+        batch->text_start[i + 1] = ntext;
+
+        if (has_converged(job, n, batch->states[i], state)) {
+            batch->count = count = i + 1;
+            *converged = true;
+            break;
+        }
+    }
+    job->state = batch->states[count];
+    job->next = *converged ? job->last + 1 : last + 1;
+    return batch;
+}
+
+static void worker(void *arg) {
+    (void)arg;
+    mutex_lock(&pool.mutex);
+    for (;;) {
+        while (!pool.queue) { cond_wait(&pool.cond, &pool.mutex); }
+        HighlightJob *job = take_job();
+
+        // the visible lines go in a single batch, so they show up
+        // together; the rest is split to let urgent jobs through
+        int visible_first = job->visible_first;
+        int visible_last = job->visible_last;
+        int last = job->next + BATCH_LINES - 1;
+        if (is_urgent(job) && visible_last > last) { last = visible_last; }
+        if (last > job->last) { last = job->last; }
+        mutex_unlock(&pool.mutex);
+
+        const char *error = NULL;
+        bool converged;
+        HighlightBatch *batch = run_batch(job, last, visible_first, visible_last, &converged, &error);
+
+        mutex_lock(&pool.mutex);
+        if (!batch && !job->cancelled) {
+            job->error = error;
+            job->failed = true;
+        }
+        if (converged) { job->converged = true; }
+        if (job->cancelled) {
+            if (batch) { highlight_batch_free(batch); }
+            release_job(job);
+            continue;
+        }
+        if (batch) {
+            if (job->batches_tail) {
+                job->batches_tail->next = batch;
+            } else {
+                job->batches = batch;
+            }
+            job->batches_tail = batch;
+        }
+        if (batch && job->next <= job->last) {
+            push_job(job);
+        } else {
+            release_job(job);
+        }
+    }
+}
+
+static void start_pool(void) {
+    if (pool.thread_count > 0) { return; }
+    mutex_init(&pool.mutex);
+    cond_init(&pool.cond);
+    cond_init(&pool.released);
+    int n = thread_cpu_count() - 1;
+    if (n > MAX_WORKERS) { n = MAX_WORKERS; }
+    if (n < 1) { n = 1; }
+    for (int i = 0; i < n; i++) {
+        if (thread_create(&pool.threads[pool.thread_count], worker, NULL)) {
+            pool.thread_count++;
+        }
+    }
+}
+
+HighlightJob* highlight_job_new(Tokenizer *tk, Buffer *buf, int first, int last, int state,
+                                int visible_first, int visible_last,
+                                int cached_first, int cached_count,
+                                const int *cached_init, const int *cached_end) {
+    start_pool();
+    if (pool.thread_count == 0) { return NULL; }
+
+    HighlightJob *job = xrealloc(NULL, sizeof(HighlightJob));
+    memset(job, 0, sizeof(HighlightJob));
+    job->tk = tokenizer_retain(tk);
+    job->first = first;
+    job->last = last;
+    job->next = first;
+    job->state = state;
+    job->visible_first = visible_first;
+    job->visible_last = visible_last;
+    job->cached_first = cached_first;
+    job->cached_count = cached_count;
+    job->cached_init = xrealloc(NULL, cached_count * sizeof(int));
+    job->cached_end = xrealloc(NULL, cached_count * sizeof(int));
+    memcpy(job->cached_init, cached_init, cached_count * sizeof(int));
+    memcpy(job->cached_end, cached_end, cached_count * sizeof(int));
+
+    // the spans of the pieces stay as they are while the document
+    // changes, the lines are read out of them by the workers
+    job->snap = buffer_snapshot_new(buf);
+    job->spans = buffer_snapshot_get_spans(job->snap, &job->span_count);
+    size_t offset = buffer_get_line_offset(buf, first);
+    while (job->span < job->span_count && offset >= job->spans[job->span].len) {
+        offset -= job->spans[job->span].len;
+        job->span++;
+    }
+    job->span_offset = offset;
+
+    mutex_lock(&pool.mutex);
+    // one reference for the owner, one for the workers
+    job->refs = 2;
+    if (last >= first) {
+        push_job(job);
+    } else {
+        job->refs--;
+    }
+    mutex_unlock(&pool.mutex);
+    return job;
+}
+
+void highlight_job_cancel(HighlightJob *job) {
+    mutex_lock(&pool.mutex);
+    if (!job->cancelled) {
+        job->cancelled = true;
+        free_batches(job);
+        if (job->queued) {
+            HighlightJob **j = &pool.queue;
+            while (*j != job) { j = &(*j)->queue_next; }
+            *j = job->queue_next;
+            job->queued = false;
+            release_job(job);
+        }
+    }
+    mutex_unlock(&pool.mutex);
+}
+
+void highlight_job_free(HighlightJob *job) {
+    highlight_job_cancel(job);
+    mutex_lock(&pool.mutex);
+    // a worker on the job stops at its next check, its reference goes
+    // before the snapshot the worker reads
+    while (job->refs > 1) { cond_wait(&pool.released, &pool.mutex); }
+    release_job(job);
+    mutex_unlock(&pool.mutex);
+}
+
+void highlight_job_set_visible(HighlightJob *job, int first, int last) {
+    mutex_lock(&pool.mutex);
+    job->visible_first = first;
+    job->visible_last = last;
+    mutex_unlock(&pool.mutex);
+}
+
+HighlightBatch* highlight_job_poll(HighlightJob *job, bool *done, bool *converged,
+                                   const char **error) {
+    mutex_lock(&pool.mutex);
+    HighlightBatch *batch = job->batches;
+    if (batch) {
+        job->batches = batch->next;
+        if (!job->batches) { job->batches_tail = NULL; }
+    }
+    // the workers drop their reference once the last batch is posted
+    *done = !job->batches && (job->refs == 1 || job->failed);
+    *converged = *done && job->converged;
+    *error = job->failed ? job->error : NULL;
+    mutex_unlock(&pool.mutex);
+    return batch;
+}
+
+const char* highlight_batch_get_line(HighlightBatch *batch, int i, size_t *len) {
+    *len = batch->text_start[i + 1] - batch->text_start[i];
+    return batch->text + batch->text_start[i];
+}
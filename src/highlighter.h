@@ -0,0 +1,57 @@
+// Background syntax highlighting. A job takes a snapshot of a Buffer and
+// tokenizes a range of its lines on a pool of worker threads, posting
+// the results back in batches. Jobs covering the visible lines run
+// before the others; lines outside of the visible range only get
+// their end state computed, their tokens are cheap to get on demand.
+// A job given the states of the last pass stops early once a line
+// starts and ends the way it did then.
+
+#ifndef HIGHLIGHTER_H
+#define HIGHLIGHTER_H
+
+#include "buffer.h"
+#include "tokenizer.h"
+
+typedef struct HighlightJob HighlightJob;
+
+typedef struct HighlightBatch
+{
+    struct HighlightBatch *next;
+    int line;
+    int count;
+    // `states[i]` is the state a line starts with, `states[i + 1]` the
+    // one it ends with
+    int *states;
+    // tokens of line `i` go from `first_token[i]` to `first_token[i + 1]`,
+    // lines that only have their state computed have no tokens
+    int *first_token;
+    Token *tokens;
+    // text of the lines with tokens, line `i` goes from `text_start[i]`
+    // to `text_start[i + 1]`
+    char *text;
+    size_t *text_start;
+} HighlightBatch;
+
+// `cached_init[i]` and `cached_end[i]` are the states line
+// `cached_first + i` started and ended with in the last pass, -1 when
+// unknown. The lines after one of them are taken to be as they were.
+HighlightJob* highlight_job_new(Tokenizer *tk, Buffer *buf, int first, int last, int state,
+                                int visible_first, int visible_last,
+                                int cached_first, int cached_count,
+                                const int *cached_init, const int *cached_end);
+void highlight_job_free(HighlightJob *job);
+void highlight_job_cancel(HighlightJob *job);
+void highlight_job_set_visible(HighlightJob *job, int first, int last);
+
+// Takes the oldest batch finished by the workers, NULL if there is none.
+// `done` is set once every line of the job has been posted, `converged`
+// when it stopped early as the lines after are as in the last pass.
+HighlightBatch* highlight_job_poll(HighlightJob *job, bool *done, bool *converged,
+                                   const char **error);
+void highlight_batch_free(HighlightBatch *batch);
+
+// Text of line `i` of a batch, token offsets are relative to it. Only
+// lines with tokens have their text.
+const char* highlight_batch_get_line(HighlightBatch *batch, int i, size_t *len);
+
+#endif
@@ -1,6 +1,11 @@
 #define SOKOL_APP_IMPL
 #include <sokol_app.h>
 #include "renderer.h"
+#include "profiler.h"
+#include "util.h"
+#include "process.h"
+#include "watcher.h"
+#include "scanner.h"
 #define SOKOL_LOG_IMPL
 #include <sokol_log.h>
 #define SOKOL_GLUE_IMPL
@@ -10,9 +15,13 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #if __linux__ || __APPLE__
 #include <unistd.h>
 #endif
+#if __linux__
+#include <sys/select.h>
+#endif
 #ifdef __APPLE__
 #include <mach-o/dyld.h>
 #endif
@@ -25,8 +34,13 @@ static struct
     int argc;
     char **argv;
     lua_State *L;
+    // registry refs to core.run and core.quit
+    int run_ref;
+    int quit_ref;
+    // time until which the main loop has nothing to do
+    double wake_time;
 }
-state;
+state = { .run_ref = LUA_NOREF, .quit_ref = LUA_NOREF };
 
 static void get_exe_filename(char *buf, int sz) {
 #if _WIN32
@@ -45,6 +59,74 @@ static void get_exe_filename(char *buf, int sz) {
 #endif
 }
 
+static int get_core_ref(lua_State *L, const char *name) {
+    lua_getglobal(L, "package");
+    lua_getfield(L, -1, "loaded");
+    lua_getfield(L, -1, "core");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 3);
+        return LUA_NOREF;
+    }
+    lua_getfield(L, -1, name);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 3);
+    return ref;
+}
+
+static bool call_core(int ref, const char *name, int nresults) {
+    lua_rawgeti(state.L, LUA_REGISTRYINDEX, ref);
+    if (lua_pcall(state.L, 0, nresults, 0) != LUA_OK) {
+        fprintf(stderr, "[Lua Error] core.%s(): %s\n", name, lua_tostring(state.L, -1));
+        lua_pop(state.L, 1);
+        return false;
+    }
+    return true;
+}
+
+// Blocks until there is input for the window, output from a process or
+// a change to a file a core thread waits on, or `timeout` seconds went
+// by. Returns true when a core thread may have something to do. Where
+// there's no way to wait for input the frame runs anyway.
+static bool wait_for_input(double timeout) {
+#if __linux__
+    Display *display = (Display*)sapp_x11_get_display();
+    if (XPending(display)) { return false; }
+    int max_fd = ConnectionNumber(display);
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(max_fd, &fds);
+    int watched[64];
+    int count = process_get_watched(watched, 64);
+    count += watcher_get_watched(watched + count, 64 - count);
+    count += scanner_get_watched(watched + count, 64 - count);
+    for (int i = 0; i < count; i++) {
+        if (watched[i] >= FD_SETSIZE) { continue; }
+        FD_SET(watched[i], &fds);
+        if (watched[i] > max_fd) { max_fd = watched[i]; }
+    }
+    struct timeval tv, *ptv = NULL;
+    if (isfinite(timeout)) {
+        tv.tv_sec = (long)timeout;
+        tv.tv_usec = (long)((timeout - tv.tv_sec) * 1e6);
+        ptv = &tv;
+    }
+    if (select(max_fd + 1, &fds, NULL, NULL, ptv) <= 0) { return false; }
+    for (int i = 0; i < count; i++) {
+        if (watched[i] < FD_SETSIZE && FD_ISSET(watched[i], &fds)) { return true; }
+    }
+    return false;
+#elif _WIN32
+    bool watched = process_any_watched();
+    if (watched && timeout > 0.01) { timeout = 0.01; }
+    DWORD ms = isfinite(timeout) ? (DWORD)(timeout * 1000) : INFINITE;
+    MsgWaitForMultipleObjectsEx(0, NULL, ms, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+    return watched;
+#else
+    (void)timeout;
+    return false;
+#endif
+}
+
 static void init(void) {
     ren_init();
 
@@ -81,6 +163,7 @@ static void init(void) {
     (void)luaL_dostring(state.L,
         "local core\n"
         "xpcall(function()\n"
+        "  local start = system.get_time()\n"
         "  SCALE = tonumber(os.getenv(\"LITE_SCALE\")) or SCALE\n"
         "  PATHSEP = package.config:sub(1, 1)\n"
         "  EXEDIR = EXEFILE:match(\"^(.+)[/\\\\].*$\")\n"
@@ -88,6 +171,7 @@ static void init(void) {
         "  package.path = EXEDIR .. '/data/?/init.lua;' .. package.path\n"
         "  core = require('core')\n"
         "  core.init()\n"
+        "  core.log_quiet(\"Started in %.1fms\", (system.get_time() - start) * 1000)\n"
         "end, function(err)\n"
         "  print('Error: ' .. tostring(err))\n"
         "  print(debug.traceback(nil, 2))\n"
@@ -96,16 +180,42 @@ static void init(void) {
         "  end\n"
         "  os.exit(1)\n"
         "end)");
+
+    // Looked up once instead of going through require every frame.
+    state.run_ref = get_core_ref(state.L, "run");
+    state.quit_ref = get_core_ref(state.L, "quit");
 }
 
 static void frame(void) {
-    LUA_MODULE_CALL(state.L, "core", "run");
+    // While idle the loop sleeps until input arrives or core asked to be
+    // woken up. Input is turned into events by sokol on the next frame,
+    // so waking up doesn't call into Lua yet. A ready process or watcher
+    // has no event, the next frame runs core for it.
+    if (!has_queued_events() && time_now() < state.wake_time) {
+        if (wait_for_input(state.wake_time - time_now())) {
+            state.wake_time = 0;
+        }
+        ren_present();
+        return;
+    }
+
+    // core.run returns how long there's nothing to do for
+    profiler_begin_frame();
+    double timeout = 0;
+    if (call_core(state.run_ref, "run", 1)) {
+        timeout = lua_tonumber(state.L, -1);
+        lua_pop(state.L, 1);
+    }
+    state.wake_time = time_now() + timeout;
+    ren_present();
+    api_profile_gc(state.L);
+    profiler_end_frame();
 }
 
 static void cleanup(void) {
     // @note(ellora): It should be processed by the event
     // queue, but for some reason, sokol does not process quit.
-    LUA_MODULE_CALL(state.L, "core", "quit");
+    call_core(state.quit_ref, "quit", 0);
     lua_close(state.L);
 }
 
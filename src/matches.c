@@ -0,0 +1,359 @@
+#include "matches.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Lines are read from the buffer and searched about this many bytes at
+// a time.
+#define SCAN_CHUNK (4 * 1024 * 1024)
+
+typedef struct
+{
+    int *cols;
+    int count;
+} Line;
+
+struct MatchSet
+{
+    // folded when no_case
+    char *query;
+    size_t len;
+    bool no_case;
+    // "\n" in the query, and the bytes after its last one
+    int query_lines;
+    size_t tail_len;
+
+    Line *lines;
+    int count;
+    int capacity;
+    int total;
+
+    char *scratch;
+    size_t scratch_size;
+    int *cols;
+    int cols_capacity;
+};
+
+static inline unsigned char fold(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static inline bool is_alpha(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+MatchSet* match_set_new(const char *query, size_t len, bool no_case) {
+    MatchSet *set = xrealloc(NULL, sizeof(MatchSet));
+    memset(set, 0, sizeof(MatchSet));
+    set->query = xrealloc(NULL, len + 1);
+    for (size_t i = 0; i < len; i++) {
+        set->query[i] = no_case ? fold(query[i]) : query[i];
+    }
+    set->query[len] = '\0';
+    set->len = len;
+    set->no_case = no_case;
+    set->tail_len = len;
+    for (size_t i = 0; i < len; i++) {
+        if (query[i] == '\n') {
+            set->query_lines++;
+            set->tail_len = len - i - 1;
+        }
+    }
+    return set;
+}
+
+static void release_lines(MatchSet *set, int start, int count) {
+    for (int i = start; i < start + count; i++) {
+        set->total -= set->lines[i].count;
+        free(set->lines[i].cols);
+        set->lines[i] = (Line) { NULL, 0 };
+    }
+}
+
+void match_set_free(MatchSet *set) {
+    release_lines(set, 0, set->count);
+    free(set->lines);
+    free(set->query);
+    free(set->scratch);
+    free(set->cols);
+    free(set);
+}
+
+const char* match_set_get_query(MatchSet *set, size_t *len, bool *no_case) {
+    *len = set->len;
+    *no_case = set->no_case;
+    return set->query;
+}
+
+static bool is_match(MatchSet *set, const char *p) {
+    const unsigned char *s = (const unsigned char*)p;
+    const unsigned char *q = (const unsigned char*)set->query;
+    if (!set->no_case) { return memcmp(s, q, set->len) == 0; }
+    for (size_t i = 0; i < set->len; i++) {
+        if (fold(s[i]) != q[i]) { return false; }
+    }
+    return true;
+}
+
+// Returns the first match starting in `p` to `end - len`, or NULL.
+static const char* find_literal(MatchSet *set, const char *p, const char *end) {
+    size_t len = set->len;
+    if (len == 0 || (size_t)(end - p) < len) { return NULL; }
+    const char *last = end - len;
+    unsigned char first = set->query[0];
+    unsigned char final = set->query[len - 1];
+
+#if defined(__SSE2__)
+    // A letter of a no_case query is matched with its 0x20 bit set, which
+    // is its lower case; the few other bytes it lets through fail the
+    // whole compare.
+    const __m128i first_v = _mm_set1_epi8(first);
+    const __m128i final_v = _mm_set1_epi8(final);
+    const __m128i first_m = _mm_set1_epi8(set->no_case && is_alpha(first) ? 0x20 : 0);
+    const __m128i final_m = _mm_set1_epi8(set->no_case && is_alpha(final) ? 0x20 : 0);
+    for (; last - p >= 15; p += 16) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)p), first_m);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + len - 1)), final_m);
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(a, first_v), _mm_cmpeq_epi8(b, final_v)));
+        while (mask) {
+            const char *at = p + __builtin_ctz(mask);
+            if (is_match(set, at)) { return at; }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; p <= last; p++) {
+        unsigned char c = *p;
+        if ((set->no_case ? fold(c) : c) == first && is_match(set, p)) { return p; }
+    }
+    return NULL;
+}
+
+static void store_line(MatchSet *set, int line, int count) {
+    Line *l = &set->lines[line];
+    l->count = count;
+    l->cols = count ? memcpy(xrealloc(NULL, count * sizeof(int)), set->cols, count * sizeof(int)) : NULL;
+    set->total += count;
+}
+
+// Searches `count` lines starting at the 0-based `start`, reading them
+// from `buf` in one go along with the lines their matches may reach.
+static void scan_block(MatchSet *set, Buffer *buf, int start, int count) {
+    release_lines(set, start, count);
+    size_t offset = buffer_get_line_offset(buf, start + 1);
+    size_t block_end = buffer_get_line_offset(buf, start + count + 1);
+    size_t read_end = buffer_get_line_offset(buf, start + count + 1 + set->query_lines);
+    // the "\n" ending the buffer is read too, the doc's last line ends
+    // with it like the others
+    size_t size = buffer_get_size(buf);
+    if (read_end > size) { read_end = size; }
+    if (read_end < offset) { read_end = offset; }
+    size_t len = read_end - offset;
+    if (len + 1 > set->scratch_size) {
+        set->scratch_size = (len + 1) * 2;
+        set->scratch = xrealloc(set->scratch, set->scratch_size);
+    }
+    buffer_read(buf, offset, len, set->scratch);
+
+    const char *text = set->scratch;
+    const char *end = text + len;
+    const char *limit = text + (block_end - offset);
+    const char *line_start = text;
+    const char *nl = memchr(text, '\n', len);
+    int line = start;
+    int found = 0;
+    for (const char *p = text; (p = find_literal(set, p, end)) && p < limit; p++) {
+        while (nl && nl < p) {
+            store_line(set, line++, found);
+            found = 0;
+            line_start = nl + 1;
+            nl = memchr(line_start, '\n', end - line_start);
+        }
+        if (found == set->cols_capacity) {
+            set->cols_capacity = set->cols_capacity ? set->cols_capacity * 2 : 64;
+            set->cols = xrealloc(set->cols, set->cols_capacity * sizeof(int));
+        }
+        set->cols[found++] = p - line_start + 1;
+    }
+    store_line(set, line++, found);
+    // the rest had none
+    for (; line < start + count; line++) { store_line(set, line, 0); }
+}
+
+// Searches `count` lines starting at the 0-based `start`, a chunk of
+// lines at a time.
+static void scan_lines(MatchSet *set, Buffer *buf, int start, int count) {
+    int end = start + count;
+    while (start < end) {
+        size_t offset = buffer_get_line_offset(buf, start + 1);
+        int n = (int)buffer_get_offset_line(buf, offset + SCAN_CHUNK) - start;
+        if (n < 1) { n = 1; }
+        if (n > end - start) { n = end - start; }
+        scan_block(set, buf, start, n);
+        start += n;
+    }
+}
+
+// Replaces `removed` lines at `start` with `added` empty ones.
+static void splice(MatchSet *set, int start, int removed, int added) {
+    release_lines(set, start, removed);
+    int count = set->count - removed + added;
+    if (count > set->capacity) {
+        set->capacity = count * 2;
+        set->lines = xrealloc(set->lines, set->capacity * sizeof(Line));
+    }
+    memmove(set->lines + start + added, set->lines + start + removed,
+            (set->count - start - removed) * sizeof(Line));
+    for (int i = start; i < start + added; i++) {
+        set->lines[i] = (Line) { NULL, 0 };
+    }
+    set->count = count;
+}
+
+void match_set_reset(MatchSet *set, Buffer *buf) {
+    splice(set, 0, set->count, (int)buffer_get_line_count(buf));
+    scan_lines(set, buf, 0, set->count);
+}
+
+void match_set_update(MatchSet *set, Buffer *buf, int line, int removed, int added) {
+    int start = line - 1;
+    if (start < 0) { start = 0; }
+    if (start > set->count) { start = set->count; }
+    if (removed > set->count - start) { removed = set->count - start; }
+    int buf_count = (int)buffer_get_line_count(buf);
+    if (added > buf_count - start) { added = buf_count - start; }
+    if (removed < 0) { removed = 0; }
+    if (added < 0) { added = 0; }
+
+    splice(set, start, removed, added);
+    // a match spanning lines may start before the edit and end in it
+    int from = start - set->query_lines;
+    if (from < 0) { from = 0; }
+    int to = start + added;
+    if (to > set->count) { to = set->count; }
+    scan_lines(set, buf, from, to - from);
+}
+
+int match_set_get_count(MatchSet *set) {
+    return set->total;
+}
+
+const int* match_set_get_line(MatchSet *set, int line, int *count) {
+    if (line < 1 || line > set->count) {
+        *count = 0;
+        return NULL;
+    }
+    *count = set->lines[line - 1].count;
+    return set->lines[line - 1].cols;
+}
+
+void match_set_get_end(MatchSet *set, int line, int col, int *end_line, int *end_col) {
+    *end_line = line + set->query_lines;
+    *end_col = set->query_lines ? (int)set->tail_len + 1 : col + (int)set->len;
+}
+
+// First match at or after the 0-based `line`, `col`.
+static bool find_forward(MatchSet *set, int line, int col, int *out_line, int *out_col) {
+    for (; line < set->count; line++, col = 1) {
+        Line *l = &set->lines[line];
+        for (int i = 0; i < l->count; i++) {
+            if (l->cols[i] >= col) {
+                *out_line = line + 1;
+                *out_col = l->cols[i];
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Last match before the 0-based `line`, `col`.
+static bool find_backward(MatchSet *set, int line, int col, int *out_line, int *out_col) {
+    if (line >= set->count) {
+        line = set->count - 1;
+        col = INT_MAX;
+    }
+    for (; line >= 0; line--, col = INT_MAX) {
+        Line *l = &set->lines[line];
+        for (int i = l->count - 1; i >= 0; i--) {
+            if (l->cols[i] < col) {
+                *out_line = line + 1;
+                *out_col = l->cols[i];
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool match_set_find(MatchSet *set, int line, int col, bool reverse, bool wrap,
+                    int *out_line, int *out_col) {
+    if (set->total == 0) { return false; }
+    if (line < 1) {
+        line = 1;
+        col = 1;
+    }
+    if (reverse) {
+        return find_backward(set, line - 1, col, out_line, out_col)
+            || (wrap && find_backward(set, set->count, 1, out_line, out_col));
+    }
+    return find_forward(set, line - 1, col, out_line, out_col)
+        || (wrap && find_forward(set, 0, 1, out_line, out_col));
+}
+
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t capacity;
+} Output;
+
+static char* output_reserve(Output *out, size_t len) {
+    if (out->len + len + 1 > out->capacity) {
+        out->capacity = (out->len + len + 1) * 2;
+        out->data = xrealloc(out->data, out->capacity);
+    }
+    char *res = out->data + out->len;
+    out->len += len;
+    return res;
+}
+
+char* match_set_replace(MatchSet *set, Buffer *buf, int line1, int col1, int line2, int col2,
+                        const char *text, size_t text_len, size_t *out_len, int *count) {
+    size_t a = buffer_get_line_offset(buf, line1) + col1 - 1;
+    size_t b = buffer_get_line_offset(buf, line2) + col2 - 1;
+    Output out = { 0 };
+    output_reserve(&out, 0);
+    size_t copied = a;
+    *count = 0;
+    if (line1 < 1) { line1 = 1; }
+    if (line2 > set->count) { line2 = set->count; }
+    for (int line = line1; line <= line2; line++) {
+        Line *l = &set->lines[line - 1];
+        if (l->count == 0) { continue; }
+        size_t line_offset = buffer_get_line_offset(buf, line);
+        for (int i = 0; i < l->count; i++) {
+            size_t pos = line_offset + l->cols[i] - 1;
+            if (pos < copied || pos < a) { continue; }
+            if (pos + set->len > b) { break; }
+            buffer_read(buf, copied, pos - copied, output_reserve(&out, pos - copied));
+            memcpy(output_reserve(&out, text_len), text, text_len);
+            copied = pos + set->len;
+            (*count)++;
+        }
+    }
+    if (b > copied) {
+        buffer_read(buf, copied, b - copied, output_reserve(&out, b - copied));
+    }
+    out.data[out.len] = '\0';
+    *out_len = out.len;
+    return out.data;
+}
@@ -0,0 +1,48 @@
+// Every occurrence of a literal query in a document. The columns where
+// a match starts are kept per line, so an edit only rescans the lines it
+// replaced, and the ones before them a query spanning several lines may
+// start in. Lines are searched 16 bytes at a time for the first and last
+// byte of the query, case folded for ASCII letters, and the candidates
+// are then compared whole. Overlapping occurrences are all kept, the
+// users of the set skip them when they need disjoint matches.
+
+#ifndef MATCHES_H
+#define MATCHES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "buffer.h"
+
+typedef struct MatchSet MatchSet;
+
+MatchSet* match_set_new(const char *query, size_t len, bool no_case);
+void match_set_free(MatchSet *set);
+const char* match_set_get_query(MatchSet *set, size_t *len, bool *no_case);
+
+// Drops the matches and searches every line of `buf`.
+void match_set_reset(MatchSet *set, Buffer *buf);
+// Lines `line` to `line + removed - 1` were replaced by `added` lines of
+// `buf` starting at `line`. Lines are 1-based, like the Buffer's.
+void match_set_update(MatchSet *set, Buffer *buf, int line, int removed, int added);
+
+int match_set_get_count(MatchSet *set);
+// The 1-based columns of the matches starting at `line`, in order.
+const int* match_set_get_line(MatchSet *set, int line, int *count);
+// Where the match starting at `line, col` ends, one past its last byte.
+void match_set_get_end(MatchSet *set, int line, int col, int *end_line, int *end_col);
+
+// Finds the first match starting at or after `line, col`, or the last
+// one starting before it when `reverse`. With `wrap` the search goes on
+// from the other end of the doc. Returns false if there is none.
+bool match_set_find(MatchSet *set, int line, int col, bool reverse, bool wrap,
+                    int *out_line, int *out_col);
+
+// Returns the text from `line1, col1` to `line2, col2` with the disjoint
+// matches within it, first to last, replaced by `text`. The result is
+// allocated, to be freed by the caller, `count` is set to how many were
+// replaced.
+char* match_set_replace(MatchSet *set, Buffer *buf, int line1, int col1, int line2, int col2,
+                        const char *text, size_t text_len, size_t *out_len, int *count);
+
+#endif
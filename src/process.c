@@ -0,0 +1,448 @@
+#include "process.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+#endif
+
+struct Process
+{
+#ifdef _WIN32
+    HANDLE handle;
+    DWORD pid;
+    HANDLE in;
+    HANDLE out[2];
+#else
+    pid_t pid;
+    int in;
+    int out[2];
+#endif
+    bool exited;
+    int exit_code;
+    bool watched;
+    Process *next;
+};
+
+// every live process, only touched from the main thread
+static Process *processes;
+
+static void unlink_process(Process *proc) {
+    for (Process **p = &processes; *p; p = &(*p)->next) {
+        if (*p == proc) {
+            *p = proc->next;
+            return;
+        }
+    }
+}
+
+#ifdef _WIN32
+
+static void close_handle(HANDLE *h) {
+    if (*h) {
+        CloseHandle(*h);
+        *h = NULL;
+    }
+}
+
+// Pipe whose `inherit` end (0 read, 1 write) goes to the child.
+static bool make_pipe(HANDLE h[2], int inherit) {
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+    if (!CreatePipe(&h[0], &h[1], &sa, 0)) { return false; }
+    SetHandleInformation(h[1 - inherit], HANDLE_FLAG_INHERIT, 0);
+    return true;
+}
+
+// Quotes the arguments the way CommandLineToArgvW splits them.
+static char* build_command_line(const char *const *argv) {
+    size_t cap = 256, len = 0;
+    char *cmd = xrealloc(NULL, cap);
+    for (int i = 0; argv[i]; i++) {
+        size_t need = len + strlen(argv[i]) * 2 + 4;
+        if (need > cap) {
+            cap = need * 2;
+            cmd = xrealloc(cmd, cap);
+        }
+        if (i > 0) { cmd[len++] = ' '; }
+        cmd[len++] = '"';
+        int slashes = 0;
+        for (const char *p = argv[i]; *p; p++) {
+            if (*p == '\\') {
+                slashes++;
+            } else {
+                if (*p == '"') {
+                    for (int j = 0; j < slashes + 1; j++) { cmd[len++] = '\\'; }
+                }
+                slashes = 0;
+            }
+            cmd[len++] = *p;
+        }
+        for (int j = 0; j < slashes; j++) { cmd[len++] = '\\'; }
+        cmd[len++] = '"';
+    }
+    cmd[len] = '\0';
+    return cmd;
+}
+
+Process* process_spawn(const char *const *argv, bool pipe_stdin, ProcessStderr err, const char **error) {
+    HANDLE in[2] = { NULL, NULL }, out[2] = { NULL, NULL }, errp[2] = { NULL, NULL };
+    HANDLE null_in = NULL, null_err = NULL;
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+    Process *proc = NULL;
+
+    if (pipe_stdin ? !make_pipe(in, 0) : (null_in = CreateFileA("NUL", GENERIC_READ, 0, &sa, OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE) { goto fail; }
+    if (!make_pipe(out, 1)) { goto fail; }
+    if (err == PROCESS_STDERR_PIPE && !make_pipe(errp, 1)) { goto fail; }
+    if (err == PROCESS_STDERR_DISCARD && (null_err = CreateFileA("NUL", GENERIC_WRITE, 0, &sa, OPEN_EXISTING, 0, NULL)) == INVALID_HANDLE_VALUE) { goto fail; }
+
+    STARTUPINFOA si;
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = pipe_stdin ? in[0] : null_in;
+    si.hStdOutput = out[1];
+    si.hStdError = err == PROCESS_STDERR_PIPE ? errp[1] : err == PROCESS_STDERR_STDOUT ? out[1] : null_err;
+
+    PROCESS_INFORMATION pi;
+    char *cmd = build_command_line(argv);
+    BOOL ok = CreateProcessA(NULL, cmd, NULL, NULL, TRUE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi);
+    free(cmd);
+    if (!ok) { goto fail; }
+    CloseHandle(pi.hThread);
+
+    proc = xrealloc(NULL, sizeof(Process));
+    memset(proc, 0, sizeof(Process));
+    proc->handle = pi.hProcess;
+    proc->pid = pi.dwProcessId;
+    proc->in = in[1];
+    proc->out[PROCESS_STDOUT] = out[0];
+    proc->out[PROCESS_STDERR] = errp[0];
+    in[1] = out[0] = errp[0] = NULL;
+    proc->next = processes;
+    processes = proc;
+
+fail:
+    if (!proc) { *error = "couldn't start process"; }
+    close_handle(&in[0]); close_handle(&in[1]);
+    close_handle(&out[0]); close_handle(&out[1]);
+    close_handle(&errp[0]); close_handle(&errp[1]);
+    if (null_in != INVALID_HANDLE_VALUE) { close_handle(&null_in); }
+    if (null_err != INVALID_HANDLE_VALUE) { close_handle(&null_err); }
+    return proc;
+}
+
+void process_free(Process *proc) {
+    if (!process_exited(proc, NULL)) {
+        TerminateProcess(proc->handle, 1);
+    }
+    close_handle(&proc->in);
+    close_handle(&proc->out[0]);
+    close_handle(&proc->out[1]);
+    CloseHandle(proc->handle);
+    unlink_process(proc);
+    free(proc);
+}
+
+long process_read(Process *proc, ProcessStream stream, char *buf, size_t len) {
+    HANDLE h = proc->out[stream];
+    if (!h) { return -1; }
+    DWORD avail, n;
+    if (!PeekNamedPipe(h, NULL, 0, NULL, &avail, NULL)) {
+        close_handle(&proc->out[stream]);
+        return -1;
+    }
+    if (avail == 0) { return 0; }
+    if (!ReadFile(h, buf, avail < len ? avail : (DWORD)len, &n, NULL)) {
+        close_handle(&proc->out[stream]);
+        return -1;
+    }
+    return n;
+}
+
+// anonymous pipes can't be made non-blocking, writes wait for the pipe
+long process_write(Process *proc, const char *data, size_t len) {
+    DWORD n;
+    if (!proc->in || !WriteFile(proc->in, data, (DWORD)len, &n, NULL)) { return -1; }
+    return n;
+}
+
+void process_close_stdin(Process *proc) {
+    close_handle(&proc->in);
+}
+
+bool process_ready(Process *proc) {
+    bool ready = false, open = false;
+    for (int i = 0; i < 2; i++) {
+        DWORD avail;
+        if (!proc->out[i]) { continue; }
+        open = true;
+        if (!PeekNamedPipe(proc->out[i], NULL, 0, NULL, &avail, NULL) || avail > 0) {
+            ready = true;
+        }
+    }
+    if (!open) { ready = process_exited(proc, NULL); }
+    proc->watched = !ready;
+    return ready;
+}
+
+bool process_exited(Process *proc, int *exit_code) {
+    if (!proc->exited) {
+        DWORD code;
+        if (!GetExitCodeProcess(proc->handle, &code) || code == STILL_ACTIVE) { return false; }
+        proc->exited = true;
+        proc->exit_code = (int)code;
+    }
+    if (exit_code) { *exit_code = proc->exit_code; }
+    return true;
+}
+
+bool process_kill(Process *proc, bool force) {
+    (void)force;
+    if (process_exited(proc, NULL)) { return false; }
+    return TerminateProcess(proc->handle, 1);
+}
+
+int process_get_pid(Process *proc) {
+    return (int)proc->pid;
+}
+
+// Windows can't wait on anonymous pipes, the main loop polls instead.
+bool process_any_watched(void) {
+    for (Process *p = processes; p; p = p->next) {
+        if (p->watched) { return true; }
+    }
+    return false;
+}
+
+#else
+
+// Written to by the SIGCHLD handler, so exits wake the main loop up
+// like output does.
+static int sigchld_pipe[2] = { -1, -1 };
+
+static void on_sigchld(int sig) {
+    (void)sig;
+    int saved = errno;
+    if (write(sigchld_pipe[1], "", 1) < 0) { /* pipe full, already woken */ }
+    errno = saved;
+}
+
+static void close_fd(int *fd) {
+    if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+static bool make_pipe(int fds[2]) {
+    if (pipe(fds) < 0) { return false; }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+}
+
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void init_signals(void) {
+    if (sigchld_pipe[0] >= 0) { return; }
+    if (!make_pipe(sigchld_pipe)) { return; }
+    set_nonblocking(sigchld_pipe[0]);
+    set_nonblocking(sigchld_pipe[1]);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // a child closing its stdin would otherwise kill the editor
+    signal(SIGPIPE, SIG_IGN);
+}
+
+static void drain_sigchld(void) {
+    char buf[64];
+    if (sigchld_pipe[0] < 0) { return; }
+    while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {}
+}
+
+Process* process_spawn(const char *const *argv, bool pipe_stdin, ProcessStderr err, const char **error) {
+    int in[2] = { -1, -1 }, out[2] = { -1, -1 }, errp[2] = { -1, -1 };
+    Process *proc = NULL;
+    posix_spawn_file_actions_t actions;
+    int rc = 0;
+
+    init_signals();
+    if ((pipe_stdin && !make_pipe(in)) || !make_pipe(out)
+    ||  (err == PROCESS_STDERR_PIPE && !make_pipe(errp))) {
+        *error = strerror(errno);
+        goto done;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    if (pipe_stdin) {
+        posix_spawn_file_actions_adddup2(&actions, in[0], 0);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    }
+    posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+    switch (err) {
+    case PROCESS_STDERR_PIPE:
+        posix_spawn_file_actions_adddup2(&actions, errp[1], 2);
+        break;
+    case PROCESS_STDERR_STDOUT:
+        posix_spawn_file_actions_adddup2(&actions, out[1], 2);
+        break;
+    case PROCESS_STDERR_DISCARD:
+        posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+        break;
+    }
+
+    pid_t pid;
+    rc = posix_spawnp(&pid, argv[0], &actions, NULL, (char *const*)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        *error = strerror(rc);
+        goto done;
+    }
+
+    proc = xrealloc(NULL, sizeof(Process));
+    memset(proc, 0, sizeof(Process));
+    proc->pid = pid;
+    proc->in = in[1];
+    proc->out[PROCESS_STDOUT] = out[0];
+    proc->out[PROCESS_STDERR] = errp[0];
+    in[1] = out[0] = errp[0] = -1;
+    for (int i = 0; i < 2; i++) {
+        if (proc->out[i] >= 0) { set_nonblocking(proc->out[i]); }
+    }
+    if (proc->in >= 0) { set_nonblocking(proc->in); }
+    proc->next = processes;
+    processes = proc;
+
+done:
+    close_fd(&in[0]); close_fd(&in[1]);
+    close_fd(&out[0]); close_fd(&out[1]);
+    close_fd(&errp[0]); close_fd(&errp[1]);
+    return proc;
+}
+
+void process_free(Process *proc) {
+    if (!process_exited(proc, NULL)) {
+        kill(proc->pid, SIGKILL);
+        waitpid(proc->pid, NULL, 0);
+    }
+    close_fd(&proc->in);
+    close_fd(&proc->out[0]);
+    close_fd(&proc->out[1]);
+    unlink_process(proc);
+    free(proc);
+}
+
+long process_read(Process *proc, ProcessStream stream, char *buf, size_t len) {
+    int fd = proc->out[stream];
+    if (fd < 0) { return -1; }
+    ssize_t n = read(fd, buf, len);
+    if (n > 0) { return n; }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) { return 0; }
+    close_fd(&proc->out[stream]);
+    return -1;
+}
+
+long process_write(Process *proc, const char *data, size_t len) {
+    if (proc->in < 0) { return -1; }
+    ssize_t n = write(proc->in, data, len);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) { return 0; }
+    return n;
+}
+
+void process_close_stdin(Process *proc) {
+    close_fd(&proc->in);
+}
+
+bool process_ready(Process *proc) {
+    struct pollfd fds[2];
+    int count = 0;
+    for (int i = 0; i < 2; i++) {
+        if (proc->out[i] >= 0) {
+            fds[count++] = (struct pollfd) { .fd = proc->out[i], .events = POLLIN };
+        }
+    }
+    bool ready = (count > 0) ? poll(fds, count, 0) > 0 : process_exited(proc, NULL);
+    proc->watched = !ready;
+    return ready;
+}
+
+bool process_exited(Process *proc, int *exit_code) {
+    if (!proc->exited) {
+        int status;
+        pid_t res = waitpid(proc->pid, &status, WNOHANG);
+        if (res == 0 || (res < 0 && errno == EINTR)) { return false; }
+        proc->exited = true;
+        if (res < 0) {
+            proc->exit_code = -1;
+        } else if (WIFSIGNALED(status)) {
+            proc->exit_code = -WTERMSIG(status);
+        } else {
+            proc->exit_code = WEXITSTATUS(status);
+        }
+    }
+    if (exit_code) { *exit_code = proc->exit_code; }
+    return true;
+}
+
+bool process_kill(Process *proc, bool force) {
+    if (process_exited(proc, NULL)) { return false; }
+    return kill(proc->pid, force ? SIGKILL : SIGTERM) == 0;
+}
+
+int process_get_pid(Process *proc) {
+    return (int)proc->pid;
+}
+
+// The SIGCHLD pipe is shared by every process, it's drained once per
+// wait of the main loop and then every watched process is reaped. An
+// exit signaled after the drain leaves the pipe readable.
+int process_get_watched(int *fds, int max) {
+    int count = 0;
+    bool wait_exit = false, exited = false;
+    drain_sigchld();
+    for (Process *p = processes; p; p = p->next) {
+        if (!p->watched) { continue; }
+        exited = exited || process_exited(p, NULL);
+        bool open = false;
+        for (int i = 0; i < 2; i++) {
+            if (p->out[i] >= 0 && count < max) {
+                fds[count++] = p->out[i];
+                open = true;
+            }
+        }
+        wait_exit = wait_exit || !open;
+    }
+    if ((wait_exit || exited) && count < max && sigchld_pipe[0] >= 0) {
+        // an exit already reaped wakes the main loop right away
+        if (exited) { on_sigchld(SIGCHLD); }
+        fds[count++] = sigchld_pipe[0];
+    }
+    return count;
+}
+
+#endif
@@ -0,0 +1,62 @@
+// Child processes with pipes. The parent ends of the pipes don't block:
+// reads return whatever output is there, and process_ready() tells if
+// there's anything to read without waiting. The processes waited on by
+// process_ready() are also reported by process_get_watched(), so the
+// main loop can sleep until one of them has something.
+
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct Process Process;
+
+typedef enum
+{
+    PROCESS_STDOUT,
+    PROCESS_STDERR,
+} ProcessStream;
+
+typedef enum
+{
+    // stderr gets a pipe of its own
+    PROCESS_STDERR_PIPE,
+    // stderr goes to the stdout pipe
+    PROCESS_STDERR_STDOUT,
+    // stderr goes nowhere
+    PROCESS_STDERR_DISCARD,
+} ProcessStderr;
+
+// `argv` is NULL terminated, argv[0] is looked up in the PATH. Without
+// `pipe_stdin` the process reads from the null device.
+Process* process_spawn(const char *const *argv, bool pipe_stdin, ProcessStderr err, const char **error);
+// Kills the process if it's still running.
+void process_free(Process *proc);
+
+// Returns the number of bytes read, 0 if there's nothing to read yet,
+// -1 once the stream is closed.
+long process_read(Process *proc, ProcessStream stream, char *buf, size_t len);
+// Returns the number of bytes written, which may be less than `len`
+// when the pipe is full, -1 on error.
+long process_write(Process *proc, const char *data, size_t len);
+void process_close_stdin(Process *proc);
+
+// True when there's output or the end of it to read, or the process has
+// exited. Until then the process is watched.
+bool process_ready(Process *proc);
+// Returns false while the process runs, then sets `exit_code`, negated
+// signal number if it was killed by one.
+bool process_exited(Process *proc, int *exit_code);
+bool process_kill(Process *proc, bool force);
+int process_get_pid(Process *proc);
+
+#ifndef _WIN32
+// Fills `fds` with the pipes of the watched processes, returns how many
+// there are.
+int process_get_watched(int *fds, int max);
+#else
+bool process_any_watched(void);
+#endif
+
+#endif
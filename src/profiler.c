@@ -0,0 +1,257 @@
+#include "profiler.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_SPANS (1 << 16)
+#define MAX_SAMPLES (1 << 14)
+#define MAX_FRAMES 128
+#define MAX_DEPTH 32
+
+typedef struct
+{
+    const char *name;
+    double start;
+    double duration;
+} Span;
+
+typedef struct
+{
+    const char *name;
+    double time;
+    double value;
+} Sample;
+
+typedef struct
+{
+    double duration;
+    ProfilerStat zones[PROFILER_MAX_STATS];
+    int zone_count;
+    ProfilerStat counters[PROFILER_MAX_STATS];
+    int counter_count;
+} Frame;
+
+static struct
+{
+    double epoch;
+
+    // rings, the totals count every entry ever written
+    Span *spans;
+    unsigned span_total;
+    Sample *samples;
+    unsigned sample_total;
+    Frame frames[MAX_FRAMES];
+    unsigned frame_total;
+
+    Frame current;
+    bool in_frame;
+    int frame_depth;
+
+    struct { const char *name; double start; } stack[MAX_DEPTH];
+    int depth;
+
+    // open addressing set of interned names
+    char **names;
+    int names_count;
+    int names_capacity;
+}
+state;
+
+static unsigned hash_name(const char *name) {
+    unsigned h = 2166136261u;
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619;
+    }
+    return h;
+}
+
+const char* profiler_intern(const char *name) {
+    if (state.names_count * 2 >= state.names_capacity) {
+        int capacity = state.names_capacity ? state.names_capacity * 2 : 256;
+        char **names = xrealloc(NULL, capacity * sizeof(char*));
+        memset(names, 0, capacity * sizeof(char*));
+        for (int i = 0; i < state.names_capacity; i++) {
+            if (!state.names[i]) { continue; }
+            unsigned j = hash_name(state.names[i]) & (capacity - 1);
+            while (names[j]) { j = (j + 1) & (capacity - 1); }
+            names[j] = state.names[i];
+        }
+        free(state.names);
+        state.names = names;
+        state.names_capacity = capacity;
+    }
+
+    unsigned i = hash_name(name) & (state.names_capacity - 1);
+    while (state.names[i]) {
+        if (strcmp(state.names[i], name) == 0) { return state.names[i]; }
+        i = (i + 1) & (state.names_capacity - 1);
+    }
+    size_t len = strlen(name);
+    state.names[i] = memcpy(xrealloc(NULL, len + 1), name, len + 1);
+    state.names_count++;
+    return state.names[i];
+}
+
+static bool same_name(const char *a, const char *b) {
+    return a == b || strcmp(a, b) == 0;
+}
+
+static void add_stat(ProfilerStat *stats, int *count, const char *name, double value, bool replace) {
+    for (int i = 0; i < *count; i++) {
+        if (same_name(stats[i].name, name)) {
+            stats[i].value = replace ? value : stats[i].value + value;
+            return;
+        }
+    }
+    if (*count < PROFILER_MAX_STATS) {
+        stats[(*count)++] = (ProfilerStat) { name, value };
+    }
+}
+
+static void init(void) {
+    if (state.spans) { return; }
+    state.epoch = time_now();
+    state.spans = xrealloc(NULL, MAX_SPANS * sizeof(Span));
+    state.samples = xrealloc(NULL, MAX_SAMPLES * sizeof(Sample));
+}
+
+void profiler_begin(const char *name) {
+    init();
+    if (state.depth < MAX_DEPTH) {
+        state.stack[state.depth].name = name;
+        state.stack[state.depth].start = time_now();
+    }
+    state.depth++;
+}
+
+void profiler_end(void) {
+    if (state.depth == 0) { return; }
+    state.depth--;
+    if (state.depth >= MAX_DEPTH) { return; }
+
+    const char *name = state.stack[state.depth].name;
+    double start = state.stack[state.depth].start;
+    double duration = time_now() - start;
+    state.spans[state.span_total++ % MAX_SPANS] = (Span) { name, start, duration };
+
+    if (state.in_frame && state.depth > state.frame_depth) {
+        Frame *f = &state.current;
+        add_stat(f->zones, &f->zone_count, name, duration, false);
+    }
+}
+
+void profiler_begin_frame(void) {
+    if (state.in_frame) { profiler_end_frame(); }
+    profiler_begin("frame");
+    memset(&state.current, 0, sizeof(state.current));
+    state.in_frame = true;
+    state.frame_depth = state.depth - 1;
+}
+
+void profiler_end_frame(void) {
+    if (!state.in_frame) { return; }
+    // zones left open by an error end with the frame
+    while (state.depth > state.frame_depth + 1) {
+        profiler_end();
+    }
+    state.in_frame = false;
+
+    Frame *f = &state.current;
+    f->duration = time_now() - state.stack[state.frame_depth].start;
+    profiler_end();
+
+    double now = time_now();
+    for (int i = 0; i < f->counter_count; i++) {
+        state.samples[state.sample_total++ % MAX_SAMPLES] =
+            (Sample) { f->counters[i].name, now, f->counters[i].value };
+    }
+    state.frames[state.frame_total++ % MAX_FRAMES] = *f;
+}
+
+void profiler_counter(const char *name, double value) {
+    Frame *f = &state.current;
+    add_stat(f->counters, &f->counter_count, name, value, true);
+}
+
+void profiler_count(const char *name, double value) {
+    Frame *f = &state.current;
+    add_stat(f->counters, &f->counter_count, name, value, false);
+}
+
+void profiler_get_stats(int frames, ProfilerStats *out) {
+    memset(out, 0, sizeof(*out));
+    unsigned total = state.frame_total;
+    unsigned n = (unsigned)frames;
+    if (n > total) { n = total; }
+    if (n > MAX_FRAMES) { n = MAX_FRAMES; }
+    if (n == 0) { return; }
+
+    for (unsigned i = total - n; i < total; i++) {
+        Frame *f = &state.frames[i % MAX_FRAMES];
+        out->time += f->duration / n;
+        if (f->duration > out->max_time) { out->max_time = f->duration; }
+        for (int j = 0; j < f->zone_count; j++) {
+            add_stat(out->zones, &out->zone_count, f->zones[j].name, f->zones[j].value / n, false);
+        }
+    }
+
+    Frame *last = &state.frames[(total - 1) % MAX_FRAMES];
+    memcpy(out->counters, last->counters, sizeof(out->counters));
+    out->counter_count = last->counter_count;
+}
+
+static void write_string(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// Writes the spans and counter samples still in the rings, times in
+// microseconds since the first zone.
+bool profiler_save_trace(const char *filename) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) { return false; }
+    init();
+
+    fputs("{\"traceEvents\":[\n", fp);
+    bool first = true;
+
+    unsigned total = state.span_total;
+    unsigned start = total > MAX_SPANS ? total - MAX_SPANS : 0;
+    for (unsigned i = start; i < total; i++) {
+        Span *s = &state.spans[i % MAX_SPANS];
+        fputs(first ? "" : ",\n", fp);
+        first = false;
+        fputs("{\"name\":", fp);
+        write_string(fp, s->name);
+        fprintf(fp, ",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+            (s->start - state.epoch) * 1e6, s->duration * 1e6);
+    }
+
+    total = state.sample_total;
+    start = total > MAX_SAMPLES ? total - MAX_SAMPLES : 0;
+    for (unsigned i = start; i < total; i++) {
+        Sample *s = &state.samples[i % MAX_SAMPLES];
+        fputs(first ? "" : ",\n", fp);
+        first = false;
+        fputs("{\"name\":", fp);
+        write_string(fp, s->name);
+        fprintf(fp, ",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"value\":%.17g}}",
+            (s->time - state.epoch) * 1e6, s->value);
+    }
+
+    fputs("\n],\"displayTimeUnit\":\"ms\"}\n", fp);
+    bool ok = !ferror(fp);
+    return (fclose(fp) == 0) && ok;
+}
@@ -0,0 +1,52 @@
+// Frame profiler. Zones are named spans of time opened and closed on the
+// main thread, nested inside the frame that contains them. Counters are
+// values sampled once per frame (instances, atlas uploads, GC...). Both
+// are kept in ring buffers holding the last few thousand frames, which
+// can be written out as a Chrome trace (chrome://tracing, Perfetto), and
+// every frame is summed up per zone name for the debug overlay.
+//
+// Zone and counter names are not copied, they must be string literals
+// or come from profiler_intern().
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdbool.h>
+
+#define PROFILER_MAX_STATS 48
+
+typedef struct
+{
+    const char *name;
+    double value;
+} ProfilerStat;
+
+typedef struct
+{
+    // frame duration in seconds
+    double time;
+    double max_time;
+    // seconds spent in each zone, summed over the frame
+    ProfilerStat zones[PROFILER_MAX_STATS];
+    int zone_count;
+    ProfilerStat counters[PROFILER_MAX_STATS];
+    int counter_count;
+} ProfilerStats;
+
+const char* profiler_intern(const char *name);
+
+void profiler_begin_frame(void);
+void profiler_end_frame(void);
+void profiler_begin(const char *name);
+void profiler_end(void);
+// Sets the counter's value for the current frame.
+void profiler_counter(const char *name, double value);
+// Adds to the counter's value for the current frame.
+void profiler_count(const char *name, double value);
+
+// Averages the stats of the last `frames` frames. Counters take their
+// value in the last frame.
+void profiler_get_stats(int frames, ProfilerStats *out);
+bool profiler_save_trace(const char *filename);
+
+#endif
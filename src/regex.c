@@ -0,0 +1,972 @@
+#include "regex.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+// Bounds the program, and with it the depth of the pike VM's recursion.
+#define MAX_INSTS 5000
+#define MAX_REPEAT 1000
+// Bounds the parser's recursion, and the compiler's with the node count.
+#define MAX_DEPTH 1000
+#define MAX_NODES (MAX_INSTS * 4)
+
+// States kept by the lazy DFA, past it they are all dropped. Past that
+// many flushes the DFA is given up for the pike VM.
+#define DFA_MAX_STATES 2048
+#define DFA_MAX_FLUSHES 8
+
+// Lines are read from the buffer about this many bytes at a time.
+#define SCAN_CHUNK (4 * 1024 * 1024)
+
+typedef enum
+{
+    OP_SET,
+    OP_MATCH,
+    OP_JMP,
+    OP_SPLIT,
+    OP_SAVE,
+    OP_BOL,
+    OP_EOL,
+    OP_WORD,
+    OP_NOT_WORD,
+} Op;
+
+// SET: x is the set; JMP: x is the target; SPLIT: x is tried before y;
+// SAVE: x is the capture slot.
+typedef struct
+{
+    Op op;
+    int x, y;
+} Inst;
+
+typedef struct
+{
+    uint32_t bits[8];
+} ByteSet;
+
+typedef enum
+{
+    NODE_EMPTY,
+    NODE_SET,
+    NODE_CAT,
+    NODE_ALT,
+    NODE_REPEAT,
+    NODE_GROUP,
+    NODE_ASSERT,
+} NodeType;
+
+typedef struct
+{
+    NodeType type;
+    // children
+    int a, b;
+    // repeat: max is -1 when unbounded
+    int min, max;
+    bool greedy;
+    // set index, capturing group (0 if not), or assertion op
+    int value;
+} Node;
+
+typedef struct
+{
+    const char *p;
+    const char *end;
+    bool no_case;
+    Node *nodes;
+    int count;
+    int capacity;
+    ByteSet *sets;
+    int sets_count;
+    int sets_capacity;
+    int groups;
+    int depth;
+    const char *error;
+} Parser;
+
+typedef struct
+{
+    int *pcs;
+    int count;
+    bool bol;
+    bool match;
+    // a match once the end of the line is seen
+    bool eol_match;
+    unsigned hash;
+} DState;
+
+typedef struct
+{
+    int *pcs;
+    ptrdiff_t *caps;
+    unsigned *mark;
+    unsigned gen;
+    int count;
+} List;
+
+struct Regex
+{
+    Inst *prog;
+    int len;
+    ByteSet *sets;
+    int groups;
+    int ncap;
+    bool dfa_ok;
+    // some set holds "\n", a match may then span lines
+    bool consumes_nl;
+
+    // bytes no set tells apart share a class, "\n" has its own
+    uint8_t classmap[256];
+    uint8_t reps[256];
+    int nclasses;
+
+    DState *states;
+    int states_count;
+    int *next;
+    int *table;
+    int start_state[2];
+    int flushes;
+
+    unsigned *mark;
+    unsigned gen;
+    int *stack;
+    int *tmp;
+    int *tmp2;
+
+    List lists[2];
+    ptrdiff_t *init_caps;
+
+    char *scratch;
+    size_t scratch_size;
+    size_t *starts;
+    int starts_capacity;
+};
+
+static inline bool set_has(const ByteSet *s, unsigned char c) {
+    return s->bits[c >> 5] & (1u << (c & 31));
+}
+
+static inline void set_add(ByteSet *s, unsigned char c) {
+    s->bits[c >> 5] |= 1u << (c & 31);
+}
+
+static void set_add_range(ByteSet *s, int lo, int hi) {
+    for (int c = lo; c <= hi; c++) { set_add(s, c); }
+}
+
+static inline bool is_word(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+/*
+** Parser
+*/
+
+static int new_node(Parser *P, NodeType type, int a, int b) {
+    if (P->count == P->capacity) {
+        P->capacity = P->capacity ? P->capacity * 2 : 64;
+        P->nodes = xrealloc(P->nodes, P->capacity * sizeof(Node));
+    }
+    Node *n = &P->nodes[P->count];
+    memset(n, 0, sizeof(Node));
+    n->type = type;
+    n->a = a;
+    n->b = b;
+    return P->count++;
+}
+
+// Adds the other case of the letters in the set.
+static void fold_case(ByteSet *set) {
+    for (int c = 'a'; c <= 'z'; c++) {
+        if (set_has(set, c) || set_has(set, c - 32)) {
+            set_add(set, c);
+            set_add(set, c - 32);
+        }
+    }
+}
+
+static int new_set(Parser *P, ByteSet *set) {
+    if (P->no_case) { fold_case(set); }
+    if (P->sets_count == P->sets_capacity) {
+        P->sets_capacity = P->sets_capacity ? P->sets_capacity * 2 : 16;
+        P->sets = xrealloc(P->sets, P->sets_capacity * sizeof(ByteSet));
+    }
+    P->sets[P->sets_count] = *set;
+    int n = new_node(P, NODE_SET, 0, 0);
+    P->nodes[n].value = P->sets_count++;
+    return n;
+}
+
+static int fail(Parser *P, const char *error) {
+    if (!P->error) { P->error = error; }
+    return -1;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') { return c - '0'; }
+    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+    if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+    return -1;
+}
+
+// Adds the set of a \d \w \s class escape, returns false if `c` isn't one.
+static bool class_escape(ByteSet *set, char c) {
+    ByteSet s = { { 0 } };
+    switch (c | 0x20) {
+    case 'd': set_add_range(&s, '0', '9'); break;
+    case 'w': set_add_range(&s, 'a', 'z'); set_add_range(&s, 'A', 'Z');
+              set_add_range(&s, '0', '9'); set_add(&s, '_'); break;
+    // no "\n", matches stay within a line unless they spell it out
+    case 's': set_add(&s, ' '); set_add(&s, '\t'); set_add_range(&s, '\v', '\r'); break;
+    default: return false;
+    }
+    bool negated = c >= 'A' && c <= 'Z';
+    for (int i = 0; i < 8; i++) {
+        set->bits[i] |= negated ? ~s.bits[i] : s.bits[i];
+    }
+    if (negated) { set->bits['\n' >> 5] &= ~(1u << ('\n' & 31)); }
+    return true;
+}
+
+// Reads the byte an escape stands for, after the '\'. Returns -1 on an
+// unknown escape.
+static int char_escape(Parser *P) {
+    char c = *P->p++;
+    switch (c) {
+    case 'n': return '\n';
+    case 't': return '\t';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    case '0': return '\0';
+    case 'x': {
+        int hi = P->p < P->end ? hex_digit(P->p[0]) : -1;
+        int lo = P->p + 1 < P->end ? hex_digit(P->p[1]) : -1;
+        if (hi < 0 || lo < 0) { return fail(P, "bad \\x escape"); }
+        P->p += 2;
+        return hi * 16 + lo;
+    }
+    }
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '1' && c <= '9')) {
+        return fail(P, "unknown escape");
+    }
+    return (unsigned char)c;
+}
+
+static int parse_class(Parser *P) {
+    ByteSet set = { { 0 } };
+    bool negated = P->p < P->end && *P->p == '^';
+    if (negated) { P->p++; }
+    bool first = true;
+    while (P->p < P->end && (*P->p != ']' || first)) {
+        first = false;
+        int lo;
+        if (*P->p == '\\') {
+            P->p++;
+            if (P->p == P->end) { break; }
+            if (class_escape(&set, *P->p)) {
+                P->p++;
+                continue;
+            }
+            if ((lo = char_escape(P)) < 0) { return -1; }
+        } else {
+            lo = (unsigned char)*P->p++;
+        }
+        int hi = lo;
+        if (P->end - P->p >= 2 && P->p[0] == '-' && P->p[1] != ']') {
+            P->p++;
+            if (*P->p == '\\') {
+                P->p++;
+                if (P->p == P->end) { break; }
+                if ((hi = char_escape(P)) < 0) { return -1; }
+            } else {
+                hi = (unsigned char)*P->p++;
+            }
+            if (hi < lo) { return fail(P, "bad class range"); }
+        }
+        set_add_range(&set, lo, hi);
+    }
+    if (P->p == P->end) { return fail(P, "missing ]"); }
+    P->p++;
+    if (negated) {
+        // [^a] leaves out both cases
+        if (P->no_case) { fold_case(&set); }
+        for (int i = 0; i < 8; i++) { set.bits[i] = ~set.bits[i]; }
+        set.bits['\n' >> 5] &= ~(1u << ('\n' & 31));
+    }
+    return new_set(P, &set);
+}
+
+static int parse_alt(Parser *P);
+
+static int parse_atom(Parser *P) {
+    char c = *P->p++;
+    ByteSet set = { { 0 } };
+    switch (c) {
+    case '(': {
+        int group = 0;
+        if (P->end - P->p >= 2 && P->p[0] == '?' && P->p[1] == ':') {
+            P->p += 2;
+        } else if (++P->groups <= REGEX_MAX_GROUPS) {
+            group = P->groups;
+        }
+        if (++P->depth > MAX_DEPTH) { return fail(P, "pattern too deeply nested"); }
+        int inner = parse_alt(P);
+        P->depth--;
+        if (inner < 0) { return -1; }
+        if (P->p == P->end || *P->p != ')') { return fail(P, "missing )"); }
+        P->p++;
+        int n = new_node(P, NODE_GROUP, inner, 0);
+        P->nodes[n].value = group;
+        return n;
+    }
+    case '[':
+        return parse_class(P);
+    case '.':
+        set_add_range(&set, 0, 255);
+        set.bits['\n' >> 5] &= ~(1u << ('\n' & 31));
+        return new_set(P, &set);
+    case '^':
+    case '$': {
+        int n = new_node(P, NODE_ASSERT, 0, 0);
+        P->nodes[n].value = c == '^' ? OP_BOL : OP_EOL;
+        return n;
+    }
+    case '*':
+    case '+':
+    case '?':
+        return fail(P, "nothing to repeat");
+    case '\\': {
+        if (P->p == P->end) { return fail(P, "trailing \\"); }
+        if (*P->p == 'b' || *P->p == 'B') {
+            int n = new_node(P, NODE_ASSERT, 0, 0);
+            P->nodes[n].value = *P->p++ == 'b' ? OP_WORD : OP_NOT_WORD;
+            return n;
+        }
+        if (class_escape(&set, *P->p)) {
+            P->p++;
+            return new_set(P, &set);
+        }
+        int byte = char_escape(P);
+        if (byte < 0) { return -1; }
+        set_add(&set, byte);
+        return new_set(P, &set);
+    }
+    }
+    set_add(&set, (unsigned char)c);
+    return new_set(P, &set);
+}
+
+static bool parse_number(Parser *P, int *n) {
+    if (P->p == P->end || *P->p < '0' || *P->p > '9') { return false; }
+    *n = 0;
+    while (P->p < P->end && *P->p >= '0' && *P->p <= '9') {
+        if (*n <= MAX_REPEAT) { *n = *n * 10 + (*P->p - '0'); }
+        P->p++;
+    }
+    return true;
+}
+
+// Reads a {n}, {n,} or {n,m} quantifier. Anything else is left to be
+// read as literal text.
+static bool parse_braces(Parser *P, int *min, int *max) {
+    const char *start = P->p;
+    P->p++;
+    if (parse_number(P, min)) {
+        *max = *min;
+        if (P->p < P->end && *P->p == ',') {
+            P->p++;
+            if (!parse_number(P, max)) { *max = -1; }
+        }
+        if (P->p < P->end && *P->p == '}') {
+            P->p++;
+            return true;
+        }
+    }
+    P->p = start;
+    return false;
+}
+
+static int parse_repeat(Parser *P) {
+    int atom = parse_atom(P);
+    while (atom >= 0 && P->p < P->end && P->count < MAX_NODES) {
+        int min, max;
+        char c = *P->p;
+        if (c == '*') { min = 0; max = -1; P->p++; }
+        else if (c == '+') { min = 1; max = -1; P->p++; }
+        else if (c == '?') { min = 0; max = 1; P->p++; }
+        else if (c == '{' && parse_braces(P, &min, &max)) {
+            if (min > MAX_REPEAT || max > MAX_REPEAT) { return fail(P, "repeat count too big"); }
+            if (max >= 0 && max < min) { return fail(P, "bad repeat range"); }
+        } else {
+            break;
+        }
+        bool greedy = true;
+        if (P->p < P->end && *P->p == '?') {
+            greedy = false;
+            P->p++;
+        }
+        atom = new_node(P, NODE_REPEAT, atom, 0);
+        P->nodes[atom].min = min;
+        P->nodes[atom].max = max;
+        P->nodes[atom].greedy = greedy;
+    }
+    return atom;
+}
+
+static int parse_concat(Parser *P) {
+    int node = -1;
+    while (P->p < P->end && *P->p != '|' && *P->p != ')') {
+        int n = parse_repeat(P);
+        if (n < 0) { return -1; }
+        if (P->count >= MAX_NODES) { return fail(P, "pattern too big"); }
+        node = node < 0 ? n : new_node(P, NODE_CAT, node, n);
+    }
+    return node < 0 ? new_node(P, NODE_EMPTY, 0, 0) : node;
+}
+
+static int parse_alt(Parser *P) {
+    int node = parse_concat(P);
+    while (node >= 0 && P->p < P->end && *P->p == '|') {
+        P->p++;
+        int n = parse_concat(P);
+        if (n < 0) { return -1; }
+        if (P->count >= MAX_NODES) { return fail(P, "pattern too big"); }
+        node = new_node(P, NODE_ALT, node, n);
+    }
+    return node;
+}
+
+/*
+** Compiler
+*/
+
+static int emit(Regex *re, Op op, int x, int y) {
+    if (re->len == MAX_INSTS) { return -1; }
+    re->prog[re->len] = (Inst) { op, x, y };
+    return re->len++;
+}
+
+static bool compile(Regex *re, Parser *P, int node);
+
+static bool compile_star(Regex *re, Parser *P, int node, bool greedy) {
+    int split = emit(re, OP_SPLIT, 0, 0);
+    if (split < 0 || !compile(re, P, node) || emit(re, OP_JMP, split, 0) < 0) { return false; }
+    re->prog[split].x = greedy ? split + 1 : re->len;
+    re->prog[split].y = greedy ? re->len : split + 1;
+    return true;
+}
+
+static bool compile(Regex *re, Parser *P, int node) {
+    Node *n = &P->nodes[node];
+    switch (n->type) {
+    case NODE_EMPTY:
+        return true;
+    case NODE_SET:
+        return emit(re, OP_SET, n->value, 0) >= 0;
+    case NODE_ASSERT:
+        return emit(re, n->value, 0, 0) >= 0;
+    case NODE_CAT:
+        return compile(re, P, n->a) && compile(re, P, n->b);
+    case NODE_GROUP:
+        if (!n->value) { return compile(re, P, n->a); }
+        return emit(re, OP_SAVE, n->value * 2, 0) >= 0
+            && compile(re, P, n->a)
+            && emit(re, OP_SAVE, n->value * 2 + 1, 0) >= 0;
+    case NODE_ALT: {
+        int split = emit(re, OP_SPLIT, 0, 0);
+        if (split < 0 || !compile(re, P, n->a)) { return false; }
+        int jmp = emit(re, OP_JMP, 0, 0);
+        if (jmp < 0 || !compile(re, P, n->b)) { return false; }
+        re->prog[split].x = split + 1;
+        re->prog[split].y = jmp + 1;
+        re->prog[jmp].x = re->len;
+        return true;
+    }
+    case NODE_REPEAT: {
+        int a = n->a, min = n->min, max = n->max;
+        bool greedy = n->greedy;
+        for (int i = 0; i < min; i++) {
+            if (!compile(re, P, a)) { return false; }
+        }
+        if (max < 0) { return compile_star(re, P, a, greedy); }
+        // x{0,3} is (x(x(x)?)?)?, every split skips to the end
+        int first = re->len;
+        for (int i = min; i < max; i++) {
+            if (emit(re, OP_SPLIT, 0, -1) < 0 || !compile(re, P, a)) { return false; }
+        }
+        for (int pc = first; pc < re->len; pc++) {
+            Inst *in = &re->prog[pc];
+            if (in->op == OP_SPLIT && in->y == -1) {
+                in->x = greedy ? pc + 1 : re->len;
+                in->y = greedy ? re->len : pc + 1;
+            }
+        }
+        return true;
+    }
+    }
+    return false;
+}
+
+static void init_classes(Regex *re, int sets_count) {
+    bool boundary[257] = { false };
+    boundary['\n'] = boundary['\n' + 1] = true;
+    for (int i = 0; i < sets_count; i++) {
+        for (int c = 1; c < 256; c++) {
+            if (set_has(&re->sets[i], c) != set_has(&re->sets[i], c - 1)) { boundary[c] = true; }
+        }
+    }
+    int cls = -1;
+    for (int c = 0; c < 256; c++) {
+        if (c == 0 || boundary[c]) {
+            re->reps[++cls] = c;
+        }
+        re->classmap[c] = cls;
+    }
+    re->nclasses = cls + 1;
+}
+
+Regex* regex_new(const char *pattern, size_t len, int flags, const char **error) {
+    Parser P = { 0 };
+    P.p = pattern;
+    P.end = pattern + len;
+    P.no_case = flags & REGEX_NO_CASE;
+    int root = parse_alt(&P);
+    if (root >= 0 && P.p < P.end) { root = fail(&P, "unmatched )"); }
+    if (root < 0) {
+        *error = P.error;
+        free(P.nodes);
+        free(P.sets);
+        return NULL;
+    }
+
+    Regex *re = xrealloc(NULL, sizeof(Regex));
+    memset(re, 0, sizeof(Regex));
+    re->prog = xrealloc(NULL, MAX_INSTS * sizeof(Inst));
+    re->sets = P.sets;
+    re->groups = P.groups < REGEX_MAX_GROUPS ? P.groups : REGEX_MAX_GROUPS;
+    re->ncap = (re->groups + 1) * 2;
+    bool ok = emit(re, OP_SAVE, 0, 0) >= 0
+           && compile(re, &P, root)
+           && emit(re, OP_SAVE, 1, 0) >= 0
+           && emit(re, OP_MATCH, 0, 0) >= 0;
+    free(P.nodes);
+    if (!ok) {
+        *error = "pattern too big";
+        free(re->prog);
+        free(re->sets);
+        free(re);
+        return NULL;
+    }
+
+    re->dfa_ok = true;
+    for (int pc = 0; pc < re->len; pc++) {
+        Op op = re->prog[pc].op;
+        if (op == OP_WORD || op == OP_NOT_WORD) { re->dfa_ok = false; }
+        if (op == OP_SET && set_has(&re->sets[re->prog[pc].x], '\n')) { re->consumes_nl = true; }
+    }
+    init_classes(re, P.sets_count);
+    re->start_state[0] = re->start_state[1] = -1;
+
+    re->mark = xrealloc(NULL, re->len * sizeof(unsigned));
+    memset(re->mark, 0, re->len * sizeof(unsigned));
+    re->stack = xrealloc(NULL, (re->len * 2 + 2) * sizeof(int));
+    re->tmp = xrealloc(NULL, re->len * sizeof(int));
+    re->tmp2 = xrealloc(NULL, re->len * sizeof(int));
+    re->init_caps = xrealloc(NULL, re->ncap * sizeof(ptrdiff_t));
+    for (int i = 0; i < re->ncap; i++) { re->init_caps[i] = -1; }
+    return re;
+}
+
+static void free_states(Regex *re) {
+    for (int i = 0; i < re->states_count; i++) { free(re->states[i].pcs); }
+    re->states_count = 0;
+    re->start_state[0] = re->start_state[1] = -1;
+    if (re->table) { memset(re->table, 0, DFA_MAX_STATES * 2 * sizeof(int)); }
+}
+
+void regex_free(Regex *re) {
+    free_states(re);
+    free(re->states);
+    free(re->next);
+    free(re->table);
+    for (int i = 0; i < 2; i++) {
+        free(re->lists[i].pcs);
+        free(re->lists[i].caps);
+        free(re->lists[i].mark);
+    }
+    free(re->prog);
+    free(re->sets);
+    free(re->mark);
+    free(re->stack);
+    free(re->tmp);
+    free(re->tmp2);
+    free(re->init_caps);
+    free(re->scratch);
+    free(re->starts);
+    free(re);
+}
+
+int regex_get_group_count(Regex *re) {
+    return re->groups;
+}
+
+/*
+** Lazy DFA
+*/
+
+static void next_gen(unsigned *gen, unsigned *mark, int len) {
+    if (++*gen == 0) {
+        memset(mark, 0, len * sizeof(unsigned));
+        *gen = 1;
+    }
+}
+
+// Adds the threads `pc` leads to without reading a byte to `out`. The
+// ones waiting on $ are added as they are unless `eol`.
+static void closure(Regex *re, int pc, bool bol, bool eol, int *out, int *count) {
+    int sp = 0;
+    re->stack[sp++] = pc;
+    while (sp > 0) {
+        pc = re->stack[--sp];
+        if (re->mark[pc] == re->gen) { continue; }
+        re->mark[pc] = re->gen;
+        Inst *in = &re->prog[pc];
+        switch (in->op) {
+        case OP_JMP: re->stack[sp++] = in->x; break;
+        case OP_SPLIT: re->stack[sp++] = in->y; re->stack[sp++] = in->x; break;
+        case OP_SAVE: re->stack[sp++] = pc + 1; break;
+        case OP_BOL: if (bol) { re->stack[sp++] = pc + 1; } break;
+        case OP_EOL:
+            if (eol) { re->stack[sp++] = pc + 1; }
+            else { out[(*count)++] = pc; }
+            break;
+        default: out[(*count)++] = pc; break;
+        }
+    }
+}
+
+static int compare_ints(const void *a, const void *b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+static unsigned hash_state(const int *pcs, int count, bool bol) {
+    unsigned h = bol ? 2166136261u : 16777619u;
+    for (int i = 0; i < count; i++) { h = (h ^ (unsigned)pcs[i]) * 16777619u; }
+    return h;
+}
+
+// Returns the state of the sorted `pcs`, made if new. Returns -1 once
+// the DFA is given up.
+static int get_state(Regex *re, const int *pcs, int count, bool bol) {
+    if (!re->states) {
+        re->states = xrealloc(NULL, DFA_MAX_STATES * sizeof(DState));
+        re->next = xrealloc(NULL, (size_t)DFA_MAX_STATES * re->nclasses * sizeof(int));
+        re->table = xrealloc(NULL, DFA_MAX_STATES * 2 * sizeof(int));
+        memset(re->table, 0, DFA_MAX_STATES * 2 * sizeof(int));
+    }
+    unsigned h = hash_state(pcs, count, bol);
+    unsigned mask = DFA_MAX_STATES * 2 - 1;
+    for (unsigned i = h & mask; re->table[i]; i = (i + 1) & mask) {
+        DState *s = &re->states[re->table[i] - 1];
+        if (s->hash == h && s->bol == bol && s->count == count
+            && memcmp(s->pcs, pcs, count * sizeof(int)) == 0) {
+            return re->table[i] - 1;
+        }
+    }
+
+    if (re->states_count == DFA_MAX_STATES) {
+        if (++re->flushes > DFA_MAX_FLUSHES) {
+            re->dfa_ok = false;
+            return -1;
+        }
+        free_states(re);
+    }
+    int idx = re->states_count++;
+    DState *s = &re->states[idx];
+    s->pcs = memcpy(xrealloc(NULL, count * sizeof(int)), pcs, count * sizeof(int));
+    s->count = count;
+    s->bol = bol;
+    s->hash = h;
+    s->match = s->eol_match = false;
+    for (int i = 0; i < count; i++) {
+        if (re->prog[pcs[i]].op == OP_MATCH) { s->match = s->eol_match = true; }
+    }
+    if (!s->match) {
+        next_gen(&re->gen, re->mark, re->len);
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            if (re->prog[pcs[i]].op == OP_EOL) { closure(re, pcs[i], bol, true, re->tmp2, &n); }
+        }
+        for (int i = 0; i < n && !s->eol_match; i++) {
+            s->eol_match = re->prog[re->tmp2[i]].op == OP_MATCH;
+        }
+    }
+    for (int i = 0; i < re->nclasses; i++) { re->next[(size_t)idx * re->nclasses + i] = -1; }
+    unsigned i = h & mask;
+    while (re->table[i]) { i = (i + 1) & mask; }
+    re->table[i] = idx + 1;
+    return idx;
+}
+
+static int get_start_state(Regex *re, bool bol) {
+    if (re->start_state[bol] < 0) {
+        next_gen(&re->gen, re->mark, re->len);
+        int n = 0;
+        closure(re, 0, bol, false, re->tmp, &n);
+        qsort(re->tmp, n, sizeof(int), compare_ints);
+        int idx = get_state(re, re->tmp, n, bol);
+        if (idx < 0) { return -1; }
+        re->start_state[bol] = idx;
+    }
+    return re->start_state[bol];
+}
+
+// The state after reading a byte of class `cls` in state `from`. A new
+// match may start after any byte, the search is unanchored.
+static int step(Regex *re, int from, int cls) {
+    DState *s = &re->states[from];
+    unsigned char byte = re->reps[cls];
+    bool nl = byte == '\n';
+    const int *src = s->pcs;
+    int src_count = s->count;
+    if (nl) {
+        // the threads waiting on $ go on before the "\n"
+        next_gen(&re->gen, re->mark, re->len);
+        src_count = 0;
+        for (int i = 0; i < s->count; i++) { closure(re, s->pcs[i], s->bol, true, re->tmp2, &src_count); }
+        src = re->tmp2;
+    }
+    next_gen(&re->gen, re->mark, re->len);
+    int n = 0;
+    for (int i = 0; i < src_count; i++) {
+        Inst *in = &re->prog[src[i]];
+        if (in->op == OP_SET && set_has(&re->sets[in->x], byte)) {
+            closure(re, src[i] + 1, nl, false, re->tmp, &n);
+        }
+    }
+    closure(re, 0, nl, false, re->tmp, &n);
+    qsort(re->tmp, n, sizeof(int), compare_ints);
+
+    int flushes = re->flushes;
+    int to = get_state(re, re->tmp, n, nl);
+    // a flush dropped the state it came from
+    if (to >= 0 && flushes == re->flushes) {
+        re->next[(size_t)from * re->nclasses + cls] = to;
+    }
+    return to;
+}
+
+// Returns where the earliest match ends, -1 if there is none, -2 if the
+// DFA was given up.
+static ptrdiff_t dfa_find(Regex *re, const char *text, size_t len, size_t start) {
+    int s = get_start_state(re, start == 0 || text[start - 1] == '\n');
+    if (s < 0) { return -2; }
+    for (size_t i = start;; i++) {
+        DState *st = &re->states[s];
+        if (st->match) { return i; }
+        if (i == len) { return st->eol_match ? (ptrdiff_t)len : -1; }
+        unsigned char c = text[i];
+        if (c == '\n' && st->eol_match) { return i; }
+        int cls = re->classmap[c];
+        int n = re->next[(size_t)s * re->nclasses + cls];
+        if (n < 0 && (n = step(re, s, cls)) < 0) { return -2; }
+        s = n;
+    }
+}
+
+/*
+** Pike VM
+*/
+
+static void add_thread(Regex *re, List *l, int pc, ptrdiff_t *caps,
+                       const char *text, size_t len, size_t pos) {
+    if (l->mark[pc] == l->gen) { return; }
+    l->mark[pc] = l->gen;
+    Inst *in = &re->prog[pc];
+    switch (in->op) {
+    case OP_JMP:
+        add_thread(re, l, in->x, caps, text, len, pos);
+        return;
+    case OP_SPLIT:
+        add_thread(re, l, in->x, caps, text, len, pos);
+        add_thread(re, l, in->y, caps, text, len, pos);
+        return;
+    case OP_SAVE: {
+        ptrdiff_t old = caps[in->x];
+        caps[in->x] = pos;
+        add_thread(re, l, pc + 1, caps, text, len, pos);
+        caps[in->x] = old;
+        return;
+    }
+    case OP_BOL:
+        if (pos == 0 || text[pos - 1] == '\n') { add_thread(re, l, pc + 1, caps, text, len, pos); }
+        return;
+    case OP_EOL:
+        if (pos == len || text[pos] == '\n') { add_thread(re, l, pc + 1, caps, text, len, pos); }
+        return;
+    case OP_WORD:
+    case OP_NOT_WORD: {
+        bool before = pos > 0 && is_word(text[pos - 1]);
+        bool after = pos < len && is_word(text[pos]);
+        if ((before != after) == (in->op == OP_WORD)) { add_thread(re, l, pc + 1, caps, text, len, pos); }
+        return;
+    }
+    default:
+        l->pcs[l->count] = pc;
+        memcpy(&l->caps[(size_t)l->count * re->ncap], caps, re->ncap * sizeof(ptrdiff_t));
+        l->count++;
+    }
+}
+
+static void clear_list(Regex *re, List *l) {
+    if (!l->pcs) {
+        l->pcs = xrealloc(NULL, re->len * sizeof(int));
+        l->caps = xrealloc(NULL, (size_t)re->len * re->ncap * sizeof(ptrdiff_t));
+        l->mark = xrealloc(NULL, re->len * sizeof(unsigned));
+        memset(l->mark, 0, re->len * sizeof(unsigned));
+    }
+    next_gen(&l->gen, l->mark, re->len);
+    l->count = 0;
+}
+
+// Runs the threads in step over the text, the first thread to match is
+// the leftmost-first match.
+static bool pike_find(Regex *re, const char *text, size_t len, size_t start, ptrdiff_t *caps) {
+    List *cl = &re->lists[0], *nl = &re->lists[1];
+    clear_list(re, cl);
+    bool matched = false;
+    for (size_t pos = start;; pos++) {
+        if (!matched) { add_thread(re, cl, 0, re->init_caps, text, len, pos); }
+        clear_list(re, nl);
+        for (int i = 0; i < cl->count; i++) {
+            Inst *in = &re->prog[cl->pcs[i]];
+            ptrdiff_t *tc = &cl->caps[(size_t)i * re->ncap];
+            if (in->op == OP_MATCH) {
+                memcpy(caps, tc, re->ncap * sizeof(ptrdiff_t));
+                matched = true;
+                // the threads after it have a lower priority
+                break;
+            }
+            if (pos < len && set_has(&re->sets[in->x], text[pos])) {
+                add_thread(re, nl, cl->pcs[i] + 1, tc, text, len, pos + 1);
+            }
+        }
+        List *t = cl; cl = nl; nl = t;
+        if (pos >= len || (matched && cl->count == 0)) { break; }
+    }
+    return matched;
+}
+
+bool regex_find(Regex *re, const char *text, size_t len, size_t start, ptrdiff_t *caps) {
+    if (start > len) { return false; }
+    size_t from = start;
+    if (re->dfa_ok) {
+        ptrdiff_t end = dfa_find(re, text, len, start);
+        if (end == -1) { return false; }
+        // without "\n" in the match it starts on the line it ends on
+        if (end >= 0 && !re->consumes_nl) {
+            for (size_t i = end; i > start; i--) {
+                if (text[i - 1] == '\n') {
+                    from = i;
+                    break;
+                }
+            }
+        }
+    }
+    return pike_find(re, text, len, from, caps);
+}
+
+/*
+** Buffer lines
+*/
+
+// Reads lines `first` to `last` into the scratch buffer, the 0-based
+// offset of each line is put in `starts`, followed by the end.
+static const char* read_lines(Regex *re, Buffer *buf, int first, int last) {
+    size_t offset = buffer_get_line_offset(buf, first);
+    size_t len = buffer_get_line_offset(buf, last + 1) - offset;
+    if (len + 1 > re->scratch_size) {
+        re->scratch_size = (len + 1) * 2;
+        re->scratch = xrealloc(re->scratch, re->scratch_size);
+    }
+    buffer_read(buf, offset, len, re->scratch);
+    int count = last - first + 2;
+    if (count > re->starts_capacity) {
+        re->starts_capacity = count * 2;
+        re->starts = xrealloc(re->starts, re->starts_capacity * sizeof(size_t));
+    }
+    const char *p = re->scratch;
+    for (int i = 0; i < count - 1; i++) {
+        re->starts[i] = p - re->scratch;
+        const char *nl = memchr(p, '\n', re->scratch + len - p);
+        p = nl ? nl + 1 : re->scratch + len;
+    }
+    re->starts[count - 1] = len;
+    return re->scratch;
+}
+
+// The length of a line read by read_lines(), without its "\n".
+static size_t line_length(Regex *re, const char *text, int i) {
+    size_t len = re->starts[i + 1] - re->starts[i];
+    return (len > 0 && text[re->starts[i + 1] - 1] == '\n') ? len - 1 : len;
+}
+
+bool regex_find_lines(Regex *re, Buffer *buf, int line, int col, bool reverse,
+                      int *out_line, int *out_col1, int *out_col2) {
+    int count = (int)buffer_get_line_count(buf);
+    ptrdiff_t caps[(REGEX_MAX_GROUPS + 1) * 2];
+    if (line > count) {
+        line = count;
+        col = -1;
+    }
+    if (line < 1) { return false; }
+
+    if (!reverse) {
+        size_t from = col > 1 ? col - 1 : 0;
+        while (line <= count) {
+            size_t offset = buffer_get_line_offset(buf, line);
+            int last = (int)buffer_get_offset_line(buf, offset + SCAN_CHUNK);
+            if (last > count) { last = count; }
+            if (last < line) { last = line; }
+            const char *text = read_lines(re, buf, line, last);
+            for (int i = 0; i <= last - line; i++, from = 0) {
+                size_t len = line_length(re, text, i);
+                if (from <= len && regex_find(re, text + re->starts[i], len, from, caps)) {
+                    *out_line = line + i;
+                    *out_col1 = caps[0] + 1;
+                    *out_col2 = caps[1] + 1;
+                    return true;
+                }
+            }
+            line = last + 1;
+        }
+        return false;
+    }
+
+    // the last match starting before the column, matches may overlap
+    size_t limit = col >= 1 ? (size_t)col - 1 : SIZE_MAX;
+    while (line >= 1) {
+        size_t offset = buffer_get_line_offset(buf, line);
+        int first = offset > SCAN_CHUNK ? (int)buffer_get_offset_line(buf, offset - SCAN_CHUNK) : 1;
+        if (first > line) { first = line; }
+        const char *text = read_lines(re, buf, first, line);
+        for (int i = line - first; i >= 0; i--, limit = SIZE_MAX) {
+            size_t len = line_length(re, text, i);
+            bool found = false;
+            for (size_t pos = 0; pos <= len && pos < limit
+                 && regex_find(re, text + re->starts[i], len, pos, caps)
+                 && (size_t)caps[0] < limit; pos = caps[0] + 1) {
+                *out_line = first + i;
+                *out_col1 = caps[0] + 1;
+                *out_col2 = caps[1] + 1;
+                found = true;
+            }
+            if (found) { return true; }
+        }
+        line = first - 1;
+    }
+    return false;
+}
@@ -0,0 +1,45 @@
+// Regular expressions matched in linear time. A pattern is compiled to a
+// Thompson NFA; a lazy DFA built from it, a state at a time as the text
+// needs them and flushed past a size, finds where the earliest match
+// ends, then a pike VM runs over the line it's in for the leftmost
+// match and its groups. Patterns with \b or \B, and those flushing the
+// DFA too often, only run the pike VM.
+//
+// The syntax is the usual one: . [] [^] ^ $ \b \B \d \w \s (and their
+// upper case) * + ? {n} {n,} {n,m}, lazy quantifiers with a trailing ?,
+// | () and (?:). Only an explicit \n matches "\n", not `.`, \s or a
+// negated class, and `^` and `$` match at line starts and ends.
+
+#ifndef REGEX_H
+#define REGEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "buffer.h"
+
+#define REGEX_NO_CASE 1
+// groups past it don't capture
+#define REGEX_MAX_GROUPS 9
+
+typedef struct Regex Regex;
+
+// Returns NULL and sets `error` to a static message on a bad pattern.
+Regex* regex_new(const char *pattern, size_t len, int flags, const char **error);
+void regex_free(Regex *re);
+// Number of capturing groups, not counting the whole match.
+int regex_get_group_count(Regex *re);
+
+// Finds the leftmost match in `text` starting at or after `start`, the
+// text before it is looked at by ^ and \b. Sets `caps` to the start and
+// end offset of the match and of every group, -1 for the groups that
+// took no part in it.
+bool regex_find(Regex *re, const char *text, size_t len, size_t start, ptrdiff_t *caps);
+
+// Finds the first match at or after `line, col` in the lines of `buf`,
+// or the last one starting before it when `reverse`, each line searched
+// on its own. Sets the line and the columns it starts and ends at.
+bool regex_find_lines(Regex *re, Buffer *buf, int line, int col, bool reverse,
+                      int *out_line, int *out_col1, int *out_col2);
+
+#endif
@@ -1,29 +1,261 @@
 #include "renderer.h"
+#include "profiler.h"
+#include "atlas.h"
+#include "thread.h"
 
 #define SOKOL_GFX_IMPL
 #include <sokol_gfx.h>
 
-#define SOKOL_GL_IMPL
-#include <sokol_gl.h>
-
 #define FONTSTASH_IMPLEMENTATION
 #include <fontstash.h>
-#define SOKOL_FONTSTASH_IMPL
-#include <sokol_fontstash.h>
 
 #include <sokol_app.h>
 #include <sokol_log.h>
 #include <sokol_glue.h>
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+// Draw commands are recorded during the frame and hashed into a grid
+// of cells, just like the rencache of the original lite. Only the
+// cells whose hash changed since the last frame are redrawn into the
+// offscreen target, which is then copied to the swapchain.
+#define CELL_SIZE 96
+#define HASH_INITIAL 2166136261
+
+// Glyphs are drawn from 1024x1024 pages of 8-bit coverage, 1MB each,
+// the atlas recycles pages once it holds 8 of them.
+#define ATLAS_PAGE_SIZE 1024
+#define ATLAS_MAX_PAGES 8
+
+// The printable ASCII of every font loaded is rasterized ahead of time.
+#define WARM_FIRST 32
+#define WARM_LAST 126
+
+// A frame the swapchain already shows on every one of its images, up to
+// triple buffering, isn't presented again.
+#define SWAPCHAIN_IMAGES 3
+
+// Marks the texture coordinates of a solid rect.
+#define SOLID 0xffff
+
+enum { CMD_SET_CLIP, CMD_DRAW_RECT, CMD_DRAW_TEXT, CMD_DRAW_TOKENS };
+
+typedef struct
+{
+    int type;
+    int size;
+    RenRect rect;
+    RenColor color;
+    RenFont *font;
+    char text[];
+} Command;
+
+// A glyph rasterized like fons__getGlyph does it, with the 2 pixel
+// empty border that lets the quads be inset for filtering.
+typedef struct
+{
+    unsigned codepoint;
+    int index;
+    short xoff, yoff, xadv;
+    short width, height;
+    unsigned char *pixels;
+} GlyphBitmap;
+
+// The ASCII of a font at a size, rasterized by a worker thread and
+// moved into the atlas by the main thread once done. stb_truetype
+// allocates from the fontstash context set as the font's userdata, so
+// the worker rasterizes with a copy of the font pointing to a context
+// of its own, only used for its scratch buffer.
+typedef struct WarmJob
+{
+    Thread thread;
+    int font_id;
+    short isize;
+    FONSttFontImpl font;
+    FONScontext scratch;
+    GlyphBitmap glyphs[WARM_LAST - WARM_FIRST + 1];
+    bool done;
+    struct WarmJob *next;
+} WarmJob;
+
+// Everything is drawn as instances of a quad, clipped on the CPU so a
+// clip change never breaks a draw call. Texture coordinates are in
+// texels and map 1:1 to pixels.
+typedef struct
+{
+    int16_t x0, y0, x1, y1;
+    uint16_t s0, t0, s1, t1;
+    uint32_t color;
+} Instance;
+
+enum { PASS_TARGET, PASS_SWAPCHAIN };
+// Glyph coverage in the red channel, or the colors of the image.
+enum { MODE_COVERAGE, MODE_IMAGE };
+
+// A run of instances drawn with a single call from the same texture.
+// Until a glyph is added the batch has no texture and takes any.
+typedef struct
+{
+    int pass;
+    int mode;
+    sg_view view;
+    int texture_width;
+    int texture_height;
+    int first;
+    int count;
+} Batch;
+
+// The corners of the quad come from the vertex index of a 4 vertex
+// triangle strip. Solid rects keep their color as is, glyphs are
+// premultiplied by their coverage, both blended with ONE.
+#if defined(SOKOL_GLCORE)
+static const char *vs_source =
+    "#version 410\n"
+    "uniform vec4 vs_params[2];\n"
+    "in ivec4 rect;\n"
+    "in uvec4 texrect;\n"
+    "in vec4 color0;\n"
+    "out vec2 uv;\n"
+    "flat out int mode;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "    vec2 corner = vec2(float(gl_VertexID & 1), float(gl_VertexID >> 1));\n"
+    "    vec2 pos = mix(vec2(rect.xy), vec2(rect.zw), corner);\n"
+    "    gl_Position = vec4(pos * vs_params[0].xy + vec2(-1.0, 1.0), 0.0, 1.0);\n"
+    "    uv = mix(vec2(texrect.xy), vec2(texrect.zw), corner) * vs_params[0].zw;\n"
+    "    mode = texrect.x == 65535u ? 2 : int(vs_params[1].x);\n"
+    "    color = color0;\n"
+    "}\n";
+static const char *fs_source =
+    "#version 410\n"
+    "uniform sampler2D tex_smp;\n"
+    "in vec2 uv;\n"
+    "flat in int mode;\n"
+    "in vec4 color;\n"
+    "out vec4 frag_color;\n"
+    "void main() {\n"
+    "    if (mode == 2) {\n"
+    "        frag_color = color;\n"
+    "    } else if (mode == 1) {\n"
+    "        frag_color = texture(tex_smp, uv) * color;\n"
+    "    } else {\n"
+    "        float a = color.a * texture(tex_smp, uv).r;\n"
+    "        frag_color = vec4(color.rgb * a, a);\n"
+    "    }\n"
+    "}\n";
+#elif defined(SOKOL_D3D11)
+static const char *vs_source =
+    "cbuffer vs_params : register(b0) { float4 vs_params[2]; };\n"
+    "struct vs_in {\n"
+    "    int4 rect : TEXCOORD0;\n"
+    "    uint4 texrect : TEXCOORD1;\n"
+    "    float4 color : TEXCOORD2;\n"
+    "    uint vertex : SV_VertexID;\n"
+    "};\n"
+    "struct vs_out {\n"
+    "    float2 uv : TEXCOORD0;\n"
+    "    nointerpolation int mode : TEXCOORD1;\n"
+    "    float4 color : TEXCOORD2;\n"
+    "    float4 pos : SV_Position;\n"
+    "};\n"
+    "vs_out main(vs_in inp) {\n"
+    "    vs_out outp;\n"
+    "    float2 corner = float2(inp.vertex & 1, inp.vertex >> 1);\n"
+    "    float2 pos = lerp(float2(inp.rect.xy), float2(inp.rect.zw), corner);\n"
+    "    outp.pos = float4(pos * vs_params[0].xy + float2(-1.0, 1.0), 0.0, 1.0);\n"
+    "    outp.uv = lerp(float2(inp.texrect.xy), float2(inp.texrect.zw), corner) * vs_params[0].zw;\n"
+    "    outp.mode = inp.texrect.x == 65535 ? 2 : int(vs_params[1].x);\n"
+    "    outp.color = inp.color;\n"
+    "    return outp;\n"
+    "}\n";
+static const char *fs_source =
+    "Texture2D<float4> tex : register(t0);\n"
+    "SamplerState smp : register(s0);\n"
+    "struct ps_in {\n"
+    "    float2 uv : TEXCOORD0;\n"
+    "    nointerpolation int mode : TEXCOORD1;\n"
+    "    float4 color : TEXCOORD2;\n"
+    "};\n"
+    "float4 main(ps_in inp) : SV_Target0 {\n"
+    "    if (inp.mode == 2) {\n"
+    "        return inp.color;\n"
+    "    } else if (inp.mode == 1) {\n"
+    "        return tex.Sample(smp, inp.uv) * inp.color;\n"
+    "    }\n"
+    "    float a = inp.color.a * tex.Sample(smp, inp.uv).r;\n"
+    "    return float4(inp.color.rgb * a, a);\n"
+    "}\n";
+#else
+static const char *vs_source = NULL;
+static const char *fs_source = NULL;
+#endif
 
 static struct
 {
     FONScontext* fs;
     sg_pass_action pass_action;
+    sg_pass_action load_action;
     sg_sampler sampler;
-    sgl_pipeline pip;
+    sg_shader shader;
+    sg_pipeline pip;
+    // bound to batches of solid rects only
+    sg_image blank;
+    sg_view blank_view;
+
+    // Offscreen copy of the last frame.
+    sg_image target;
+    sg_image target_depth;
+    sg_view target_color_view;
+    sg_view target_depth_view;
+    sg_view target_texture_view;
+    int target_width;
+    int target_height;
+
+    char *commands;
+    int commands_size;
+    int commands_capacity;
+    RenRect clip;
+
+    unsigned *cells;
+    unsigned *cells_prev;
+    int cells_x;
+    int cells_y;
+    RenRect *rects;
+    bool invalid;
+    bool frame_drawn;
+    int presented_images;
+
+    bool show_debug;
+
+    // The instances of the frame, in a buffer updated once per frame.
+    Instance *instances;
+    int instances_count;
+    int instances_capacity;
+    Batch *batches;
+    int batches_count;
+    int batches_capacity;
+    int pass;
+    sg_buffer instance_buffer;
+    int instance_buffer_capacity;
+
+    // The glyphs drawn, sokol allows a single update of each page
+    // texture per frame.
+    GlyphAtlas *atlas;
+    sg_image pages[ATLAS_MAX_PAGES];
+    sg_view page_views[ATLAS_MAX_PAGES];
+    bool pages_uploaded[ATLAS_MAX_PAGES];
+
+    // The files loaded into fontstash, indexed by font id. A file
+    // loaded at several sizes shares the font, the atlas keys glyphs
+    // by size.
+    char **faces;
+    int faces_count;
+
+    WarmJob *warm_jobs;
+    Mutex warm_mutex;
 }
 state;
 
@@ -33,13 +265,16 @@ void ren_init(void) {
         .logger.func = slog_func,
     });
 
-    sgl_setup(&(sgl_desc_t){0});
-
-    sfons_desc_t fons_desc = {
-        .width = 512,
-        .height = 512,
+    // fontstash only keeps the fonts, the glyphs go to the atlas
+    // pages, so its own atlas stays tiny.
+    FONSparams fons_params = {
+        .width = 64,
+        .height = 64,
+        .flags = FONS_ZERO_TOPLEFT,
     };
-    state.fs = sfons_create(&fons_desc);
+    state.fs = fonsCreateInternal(&fons_params);
+    state.atlas = atlas_new(ATLAS_PAGE_SIZE, ATLAS_MAX_PAGES);
+    mutex_init(&state.warm_mutex);
 
     sg_sampler_desc smp_desc = {
         .min_filter = SG_FILTER_NEAREST,
@@ -52,9 +287,58 @@ void ren_init(void) {
     state.pass_action = (sg_pass_action) {
         .colors[0] = { .load_action = SG_LOADACTION_CLEAR, .clear_value = {0.0f, 0.0f, 0.0f, 1.0f} }
     };
+    state.load_action = (sg_pass_action) {
+        .colors[0] = { .load_action = SG_LOADACTION_LOAD },
+        .depth = { .load_action = SG_LOADACTION_DONTCARE },
+        .stencil = { .load_action = SG_LOADACTION_DONTCARE },
+    };
+
+    state.shader = sg_make_shader(&(sg_shader_desc){
+        .vertex_func.source = vs_source,
+        .fragment_func.source = fs_source,
+        .attrs = {
+            [0] = { .base_type = SG_SHADERATTRBASETYPE_SINT, .glsl_name = "rect", .hlsl_sem_name = "TEXCOORD", .hlsl_sem_index = 0 },
+            [1] = { .base_type = SG_SHADERATTRBASETYPE_UINT, .glsl_name = "texrect", .hlsl_sem_name = "TEXCOORD", .hlsl_sem_index = 1 },
+            [2] = { .base_type = SG_SHADERATTRBASETYPE_FLOAT, .glsl_name = "color0", .hlsl_sem_name = "TEXCOORD", .hlsl_sem_index = 2 },
+        },
+        .uniform_blocks[0] = {
+            .stage = SG_SHADERSTAGE_VERTEX,
+            .size = sizeof(float) * 8,
+            .hlsl_register_b_n = 0,
+            .glsl_uniforms[0] = { .glsl_name = "vs_params", .type = SG_UNIFORMTYPE_FLOAT4, .array_count = 2 },
+        },
+        .views[0].texture = {
+            .stage = SG_SHADERSTAGE_FRAGMENT,
+            .image_type = SG_IMAGETYPE_2D,
+            .sample_type = SG_IMAGESAMPLETYPE_FLOAT,
+            .hlsl_register_t_n = 0,
+        },
+        .samplers[0] = {
+            .stage = SG_SHADERSTAGE_FRAGMENT,
+            .sampler_type = SG_SAMPLERTYPE_FILTERING,
+            .hlsl_register_s_n = 0,
+        },
+        .texture_sampler_pairs[0] = {
+            .stage = SG_SHADERSTAGE_FRAGMENT,
+            .view_slot = 0,
+            .sampler_slot = 0,
+            .glsl_name = "tex_smp",
+        },
+        .label = "quad-shader",
+    });
 
     // Enable blend (alpha colors)
-    state.pip = sgl_make_pipeline(&(sg_pipeline_desc){
+    state.pip = sg_make_pipeline(&(sg_pipeline_desc){
+        .shader = state.shader,
+        .layout = {
+            .buffers[0] = { .stride = sizeof(Instance), .step_func = SG_VERTEXSTEP_PER_INSTANCE },
+            .attrs = {
+                [0] = { .offset = offsetof(Instance, x0), .format = SG_VERTEXFORMAT_SHORT4 },
+                [1] = { .offset = offsetof(Instance, s0), .format = SG_VERTEXFORMAT_USHORT4 },
+                [2] = { .offset = offsetof(Instance, color), .format = SG_VERTEXFORMAT_UBYTE4N },
+            },
+        },
+        .primitive_type = SG_PRIMITIVETYPE_TRIANGLE_STRIP,
         .colors[0] = {
             .blend = {
                 .enabled = true,
@@ -68,37 +352,720 @@ void ren_init(void) {
         },
         .label = "pipeline-with-blending"
     });
+
+    state.blank = sg_make_image(&(sg_image_desc){
+        .width = 1,
+        .height = 1,
+        .pixel_format = SG_PIXELFORMAT_R8,
+        .data.subimage[0][0] = { (const uint8_t[]){ 255 }, 1 },
+        .label = "blank",
+    });
+    state.blank_view = sg_make_view(&(sg_view_desc){ .texture.image = state.blank });
+}
+
+static void destroy_target(void) {
+    if (state.target.id == SG_INVALID_ID) return;
+    sg_destroy_view(state.target_texture_view);
+    sg_destroy_view(state.target_depth_view);
+    sg_destroy_view(state.target_color_view);
+    sg_destroy_image(state.target_depth);
+    sg_destroy_image(state.target);
+    state.target.id = SG_INVALID_ID;
+}
+
+// The target uses the environment's default formats so the quad
+// pipeline works on it the same as on the swapchain.
+static void create_target(int w, int h) {
+    destroy_target();
+    sg_environment env = sglue_environment();
+    state.target = sg_make_image(&(sg_image_desc){
+        .usage.color_attachment = true,
+        .width = w,
+        .height = h,
+        .pixel_format = env.defaults.color_format,
+        .sample_count = env.defaults.sample_count,
+        .label = "frame-cache",
+    });
+    state.target_depth = sg_make_image(&(sg_image_desc){
+        .usage.depth_stencil_attachment = true,
+        .width = w,
+        .height = h,
+        .pixel_format = env.defaults.depth_format,
+        .sample_count = env.defaults.sample_count,
+        .label = "frame-cache-depth",
+    });
+    state.target_color_view = sg_make_view(&(sg_view_desc){ .color_attachment.image = state.target });
+    state.target_depth_view = sg_make_view(&(sg_view_desc){ .depth_stencil_attachment.image = state.target_depth });
+    state.target_texture_view = sg_make_view(&(sg_view_desc){ .texture.image = state.target });
+    state.target_width = w;
+    state.target_height = h;
+
+    free(state.cells);
+    free(state.cells_prev);
+    free(state.rects);
+    state.cells_x = w / CELL_SIZE + 1;
+    state.cells_y = h / CELL_SIZE + 1;
+    int n = state.cells_x * state.cells_y;
+    state.cells = calloc(n, sizeof(unsigned));
+    state.cells_prev = calloc(n, sizeof(unsigned));
+    state.rects = malloc(n * sizeof(RenRect));
+    state.invalid = true;
+}
+
+// Rasterizes the glyph with the metrics of fons__getGlyph, so its quad
+// comes out as it would from fontstash.
+static void rasterize_glyph(FONSttFontImpl *font, short isize, unsigned codepoint, GlyphBitmap *dst) {
+    int pad = 2, advance, lsb, x0, y0, x1, y1;
+    float scale = fons__tt_getPixelHeightScale(font, isize / 10.0f);
+    int index = fons__tt_getGlyphIndex(font, codepoint);
+    fons__tt_buildGlyphBitmap(font, index, isize / 10.0f, scale, &advance, &lsb, &x0, &y0, &x1, &y1);
+    int w = x1 - x0 + pad * 2;
+    int h = y1 - y0 + pad * 2;
+    dst->codepoint = codepoint;
+    dst->index = index;
+    dst->xoff = (short)(x0 - pad);
+    dst->yoff = (short)(y0 - pad);
+    dst->xadv = (short)(scale * advance * 10.0f);
+    dst->width = (short)w;
+    dst->height = (short)h;
+    dst->pixels = calloc(w * h, 1);
+    if (!dst->pixels) { return; }
+    ((FONScontext*)font->font.userdata)->nscratch = 0;
+    fons__tt_renderGlyphBitmap(font, dst->pixels + pad + pad * w, w - pad * 2, h - pad * 2, w, scale, scale, index);
+}
+
+// Copies the bitmap into the atlas, returns NULL if there's no room.
+static AtlasGlyph* add_glyph(int font_id, short isize, const GlyphBitmap *bmp) {
+    AtlasGlyph *g = atlas_add(state.atlas, atlas_key(font_id, isize, bmp->codepoint), bmp->width, bmp->height);
+    if (!g) { return NULL; }
+    g->index = bmp->index;
+    g->xoff = bmp->xoff;
+    g->yoff = bmp->yoff;
+    g->xadv = bmp->xadv;
+    // the place is still zeroed when the bitmap couldn't be allocated
+    if (bmp->pixels) {
+        unsigned char *dst = atlas_get_pixels(state.atlas, g->page) + g->x + g->y * ATLAS_PAGE_SIZE;
+        for (int y = 0; y < bmp->height; y++) {
+            memcpy(dst + y * ATLAS_PAGE_SIZE, bmp->pixels + y * bmp->width, bmp->width);
+        }
+    }
+    return g;
+}
+
+// Returns the glyph from the atlas, rasterizing it on a miss. A font
+// whose ASCII is still being warmed up is rasterized here as well,
+// the worker's copy is dropped when adopted.
+static AtlasGlyph* find_atlas_glyph(int font_id, short isize, unsigned codepoint) {
+    AtlasGlyph *g = atlas_get(state.atlas, atlas_key(font_id, isize, codepoint));
+    if (g) { return g; }
+    GlyphBitmap bmp;
+    rasterize_glyph(&state.fs->fonts[font_id]->font, isize, codepoint, &bmp);
+    g = add_glyph(font_id, isize, &bmp);
+    free(bmp.pixels);
+    profiler_count("glyphs rasterized", 1);
+    return g;
+}
+
+static void warm_thread(void *arg) {
+    WarmJob *job = arg;
+    for (int i = 0; i <= WARM_LAST - WARM_FIRST; i++) {
+        rasterize_glyph(&job->font, job->isize, WARM_FIRST + i, &job->glyphs[i]);
+    }
+    mutex_lock(&state.warm_mutex);
+    job->done = true;
+    mutex_unlock(&state.warm_mutex);
+}
+
+static void start_warm_job(int font_id, short isize) {
+    for (WarmJob *job = state.warm_jobs; job; job = job->next) {
+        if (job->font_id == font_id && job->isize == isize) { return; }
+    }
+    WarmJob *job = calloc(1, sizeof(WarmJob));
+    if (!job) { return; }
+    job->font_id = font_id;
+    job->isize = isize;
+    job->font = state.fs->fonts[font_id]->font;
+    job->font.font.userdata = &job->scratch;
+    job->scratch.scratch = malloc(FONS_SCRATCH_BUF_SIZE);
+    if (!job->scratch.scratch || !thread_create(&job->thread, warm_thread, job)) {
+        free(job->scratch.scratch);
+        free(job);
+        return;
+    }
+    job->next = state.warm_jobs;
+    state.warm_jobs = job;
+}
+
+// Moves the glyphs of the finished jobs into the atlas, skipping the
+// ones rasterized meanwhile. With `discard` every job is waited for and
+// dropped.
+static void finish_warm_jobs(bool discard) {
+    WarmJob **link = &state.warm_jobs;
+    while (*link) {
+        WarmJob *job = *link;
+        mutex_lock(&state.warm_mutex);
+        bool done = job->done;
+        mutex_unlock(&state.warm_mutex);
+        if (!done && !discard) {
+            link = &job->next;
+            continue;
+        }
+        thread_join(job->thread);
+        for (int i = 0; i <= WARM_LAST - WARM_FIRST; i++) {
+            GlyphBitmap *bmp = &job->glyphs[i];
+            uint64_t key = atlas_key(job->font_id, job->isize, bmp->codepoint);
+            if (!discard && !atlas_get(state.atlas, key)) {
+                add_glyph(job->font_id, job->isize, bmp);
+            }
+            free(bmp->pixels);
+        }
+        *link = job->next;
+        free(job->scratch.scratch);
+        free(job);
+    }
+}
+
+// Page textures are made as the atlas grows.
+static sg_view get_page_view(int page) {
+    if (state.pages[page].id == SG_INVALID_ID) {
+        state.pages[page] = sg_make_image(&(sg_image_desc){
+            .usage.dynamic_update = true,
+            .width = ATLAS_PAGE_SIZE,
+            .height = ATLAS_PAGE_SIZE,
+            .pixel_format = SG_PIXELFORMAT_R8,
+            .label = "glyph-atlas-page",
+        });
+        state.page_views[page] = sg_make_view(&(sg_view_desc){ .texture.image = state.pages[page] });
+    }
+    return state.page_views[page];
+}
+
+// Uploads the pages changed since their last upload. A page already
+// updated this frame waits for the next one.
+static void flush_atlas(void) {
+    int count = atlas_get_page_count(state.atlas);
+    for (int i = 0; i < count; i++) {
+        get_page_view(i);
+        if (state.pages_uploaded[i] || !atlas_take_dirty(state.atlas, i)) { continue; }
+        sg_update_image(state.pages[i], &(sg_image_data){
+            .subimage[0][0] = { atlas_get_pixels(state.atlas, i), ATLAS_PAGE_SIZE * ATLAS_PAGE_SIZE },
+        });
+        state.pages_uploaded[i] = true;
+        profiler_count("atlas uploads", 1);
+        profiler_count("atlas bytes", ATLAS_PAGE_SIZE * ATLAS_PAGE_SIZE);
+    }
+    profiler_counter("atlas pages", count);
+    profiler_counter("atlas glyphs", atlas_get_glyph_count(state.atlas));
 }
 
 void ren_shutdown(void) {
-    sfons_destroy(state.fs);
+    finish_warm_jobs(true);
+    mutex_destroy(&state.warm_mutex);
+    for (int i = 0; i < ATLAS_MAX_PAGES; i++) {
+        if (state.pages[i].id == SG_INVALID_ID) { continue; }
+        sg_destroy_view(state.page_views[i]);
+        sg_destroy_image(state.pages[i]);
+    }
+    atlas_free(state.atlas);
+    for (int i = 0; i < state.faces_count; i++) {
+        free(state.faces[i]);
+    }
+    free(state.faces);
+    destroy_target();
+    free(state.cells);
+    free(state.cells_prev);
+    free(state.rects);
+    free(state.commands);
+    free(state.instances);
+    free(state.batches);
+    fonsDeleteInternal(state.fs);
+    if (state.instance_buffer.id != SG_INVALID_ID) {
+        sg_destroy_buffer(state.instance_buffer);
+    }
+    sg_destroy_view(state.blank_view);
+    sg_destroy_image(state.blank);
+    sg_destroy_pipeline(state.pip);
+    sg_destroy_shader(state.shader);
     sg_destroy_sampler(state.sampler);
-    sgl_shutdown();
     sg_shutdown();
 }
 
-void ren_begin_frame(void) {
-    int w = sapp_width();
-    int h = sapp_height();
-    sgl_viewport(0, 0, w, h, true);
-    sgl_defaults();
-    sgl_matrix_mode_projection();
-    sgl_ortho(0.0f, (float)w, (float)h, 0.0f, -1.0f, 1.0f);
-    sgl_push_pipeline();
-    sgl_load_pipeline(state.pip);
+static inline int min(int a, int b) { return a < b ? a : b; }
+static inline int max(int a, int b) { return a > b ? a : b; }
+
+static void hash(unsigned *h, const void *data, int size) {
+    const unsigned char *p = data;
+    while (size--) {
+        *h = (*h ^ *p++) * 16777619;
+    }
 }
 
-void ren_end_frame(void) {
-    sgl_pop_pipeline();
+static RenRect intersect_rects(RenRect a, RenRect b) {
+    int x1 = max(a.x, b.x);
+    int y1 = max(a.y, b.y);
+    int x2 = min(a.x + a.width, b.x + b.width);
+    int y2 = min(a.y + a.height, b.y + b.height);
+    return (RenRect) { x1, y1, max(0, x2 - x1), max(0, y2 - y1) };
+}
+
+static RenRect merge_rects(RenRect a, RenRect b) {
+    int x1 = min(a.x, b.x);
+    int y1 = min(a.y, b.y);
+    int x2 = max(a.x + a.width, b.x + b.width);
+    int y2 = max(a.y + a.height, b.y + b.height);
+    return (RenRect) { x1, y1, x2 - x1, y2 - y1 };
+}
+
+static bool rects_overlap(RenRect a, RenRect b) {
+    return b.x + b.width  > a.x && b.x < a.x + a.width
+        && b.y + b.height > a.y && b.y < a.y + a.height;
+}
+
+static Command* push_command(int type, int size) {
+    size = (sizeof(Command) + size + 7) & ~7;
+    if (state.commands_size + size > state.commands_capacity) {
+        int capacity = max(state.commands_capacity * 2, state.commands_size + size);
+        char *commands = realloc(state.commands, capacity);
+        if (!commands) return NULL;
+        state.commands = commands;
+        state.commands_capacity = capacity;
+    }
+    Command *cmd = (Command*)(state.commands + state.commands_size);
+    // Zeroed so the padding bytes hash the same every frame.
+    memset(cmd, 0, size);
+    cmd->type = type;
+    cmd->size = size;
+    state.commands_size += size;
+    return cmd;
+}
+
+static bool next_command(Command **prev) {
+    if (*prev == NULL) {
+        *prev = (Command*)state.commands;
+    } else {
+        *prev = (Command*)(((char*)*prev) + (*prev)->size);
+    }
+    return (char*)*prev < state.commands + state.commands_size;
+}
+
+static void update_overlapping_cells(RenRect r, unsigned h) {
+    int x1 = max(r.x / CELL_SIZE, 0);
+    int y1 = max(r.y / CELL_SIZE, 0);
+    int x2 = min((r.x + r.width) / CELL_SIZE, state.cells_x - 1);
+    int y2 = min((r.y + r.height) / CELL_SIZE, state.cells_y - 1);
+    for (int y = y1; y <= y2; y++) {
+        for (int x = x1; x <= x2; x++) {
+            hash(&state.cells[x + y * state.cells_x], &h, sizeof(h));
+        }
+    }
+}
+
+static void push_rect(RenRect r, int *count) {
+    // Try to merge with an existing rectangle
+    for (int i = *count - 1; i >= 0; i--) {
+        RenRect *rp = &state.rects[i];
+        if (rects_overlap(*rp, r)) {
+            *rp = merge_rects(*rp, r);
+            return;
+        }
+    }
+    state.rects[(*count)++] = r;
+}
+
+static uint32_t pack_color(RenColor c) {
+    return (uint32_t)c.r | ((uint32_t)c.g << 8) | ((uint32_t)c.b << 16) | ((uint32_t)c.a << 24);
+}
+
+// Continues the last batch of the pass when it can draw from `view`,
+// an invalid view stands for a solid rect, which any batch can draw.
+static bool use_texture(int mode, sg_view view, int width, int height) {
+    Batch *b = state.batches_count > 0 ? &state.batches[state.batches_count - 1] : NULL;
+    if (b && b->pass == state.pass && b->mode == mode) {
+        if (view.id == SG_INVALID_ID || view.id == b->view.id) { return true; }
+        if (b->view.id == SG_INVALID_ID || b->count == 0) {
+            b->view = view;
+            b->texture_width = width;
+            b->texture_height = height;
+            return true;
+        }
+    }
+    if (state.batches_count == state.batches_capacity) {
+        int capacity = max(state.batches_capacity * 2, 64);
+        Batch *batches = realloc(state.batches, capacity * sizeof(Batch));
+        if (!batches) { return false; }
+        state.batches = batches;
+        state.batches_capacity = capacity;
+    }
+    state.batches[state.batches_count++] = (Batch) {
+        state.pass, mode, view, width, height, state.instances_count, 0
+    };
+    return true;
+}
+
+// Adds the quad, clipped to `clip`, to the last batch. The texture
+// rect is cut along with it, `s0` is SOLID for a solid rect.
+static void push_quad(RenRect clip, int x0, int y0, int x1, int y1,
+                      int s0, int t0, int s1, int t1, uint32_t color) {
+    int cx0 = max(x0, clip.x);
+    int cy0 = max(y0, clip.y);
+    int cx1 = min(x1, clip.x + clip.width);
+    int cy1 = min(y1, clip.y + clip.height);
+    if (cx0 >= cx1 || cy0 >= cy1) { return; }
+    if (s0 != SOLID) {
+        s0 += cx0 - x0;
+        t0 += cy0 - y0;
+        s1 -= x1 - cx1;
+        t1 -= y1 - cy1;
+    }
+    if (state.instances_count == state.instances_capacity) {
+        int capacity = max(state.instances_capacity * 2, 4096);
+        Instance *instances = realloc(state.instances, capacity * sizeof(Instance));
+        if (!instances) { return; }
+        state.instances = instances;
+        state.instances_capacity = capacity;
+    }
+    state.instances[state.instances_count++] = (Instance) {
+        (int16_t)cx0, (int16_t)cy0, (int16_t)cx1, (int16_t)cy1,
+        (uint16_t)s0, (uint16_t)t0, (uint16_t)s1, (uint16_t)t1, color
+    };
+    state.batches[state.batches_count - 1].count++;
+}
+
+static void draw_rect_now(RenRect rect, RenColor color, RenRect clip) {
+    if (!use_texture(MODE_COVERAGE, (sg_view){ SG_INVALID_ID }, 0, 0)) { return; }
+    push_quad(clip, rect.x, rect.y, rect.x + rect.width, rect.y + rect.height,
+              SOLID, SOLID, SOLID, SOLID, pack_color(color));
+}
+
+// Draws the glyphs of `text` on the baseline `y`, kerned like
+// measure_text, and moves `x` past them. `prev` carries the last glyph
+// across calls. Consecutive glyphs of a page share the batch, a glyph
+// of another page starts a new one.
+static void draw_glyphs(int font_id, short isize, const char *text, int len, uint32_t color,
+                        float *x, float y, int *prev, RenRect clip) {
+    FONSfont *fnt = state.fs->fonts[font_id];
+    FONSstate *fstate = fons__getState(state.fs);
+    float scale = fons__tt_getPixelHeightScale(&fnt->font, isize / 10.0f);
+    unsigned utf8state = 0, codepoint;
+
+    y += fons__getVertAlign(state.fs, fnt, fstate->align, isize);
+    for (int i = 0; i < len; i++) {
+        if (fons__decutf8(&utf8state, &codepoint, (unsigned char)text[i])) {
+            continue;
+        }
+        AtlasGlyph *g = find_atlas_glyph(font_id, isize, codepoint);
+        if (!g) {
+            // every page holds glyphs of this frame, the next one
+            // redraws everything once pages can be recycled again
+            state.invalid = true;
+            *prev = -1;
+            continue;
+        }
+        if (*prev != -1) {
+            float adv = fons__tt_getGlyphKernAdvance(&fnt->font, *prev, g->index) * scale;
+            *x += (int)(adv + fstate->spacing + 0.5f);
+        }
+        // inset by a pixel of the border, like fons__getQuad
+        int x0 = (int)(*x + g->xoff + 1);
+        int y0 = (int)(y + g->yoff + 1);
+        if (use_texture(MODE_COVERAGE, get_page_view(g->page), ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE)) {
+            push_quad(clip, x0, y0, x0 + g->width - 2, y0 + g->height - 2,
+                      g->x + 1, g->y + 1, g->x + g->width - 1, g->y + g->height - 1, color);
+        }
+        *x += (int)(g->xadv / 10.0f + 0.5f);
+        *prev = g->index;
+    }
+}
+
+static void draw_text_now(RenFont *font, const char *text, int x, int y, RenColor color, RenRect clip) {
+    float fx = (float)x;
+    int prev = -1;
+    draw_glyphs(font->font_id, (short)(font->size*10.0f), text, strlen(text), pack_color(color),
+                &fx, (float)y + font->size/1.25, &prev, clip);
+}
+
+// A tokens command stores `count` followed by a (color, len, text)
+// record per token. Every glyph of the line is kerned across token
+// boundaries like measure_text.
+static void draw_tokens_now(RenFont *font, const char *data, int x, int y, RenRect clip) {
+    short isize = (short)(font->size*10.0f);
+    float fx = (float)x;
+    float fy = (float)y + font->size/1.25;
+    int prev = -1, count;
+
+    memcpy(&count, data, sizeof(count));
+    data += sizeof(count);
+
+    for (int i = 0; i < count; i++) {
+        RenColor color;
+        int len;
+        memcpy(&color, data, sizeof(color));
+        memcpy(&len, data + sizeof(color), sizeof(len));
+        const char *text = data + sizeof(color) + sizeof(len);
+        data = text + len;
+        draw_glyphs(font->font_id, isize, text, len, pack_color(color), &fx, fy, &prev, clip);
+    }
+}
+
+static int compare_stats(const void *a, const void *b) {
+    double va = ((const ProfilerStat*)a)->value;
+    double vb = ((const ProfilerStat*)b)->value;
+    return (va < vb) - (va > vb);
+}
+
+// Draws the profiler stats of the last second in the top right corner,
+// with the first font loaded.
+static void draw_debug_overlay(int w, int h) {
+    if (state.fs->nfonts == 0) return;
+
+    ProfilerStats stats;
+    profiler_get_stats(60, &stats);
+    qsort(stats.zones, stats.zone_count, sizeof(ProfilerStat), compare_stats);
+
+    char lines[48][64];
+    int count = 0;
+    snprintf(lines[count++], 64, "frame %7.2f ms  max %7.2f ms", stats.time * 1000, stats.max_time * 1000);
+    for (int i = 0; i < stats.zone_count && count < 32; i++) {
+        snprintf(lines[count++], 64, "%-22.22s %7.2f ms", stats.zones[i].name, stats.zones[i].value * 1000);
+    }
+    for (int i = 0; i < stats.counter_count && count < 48; i++) {
+        snprintf(lines[count++], 64, "%-22.22s %10.0f", stats.counters[i].name, stats.counters[i].value);
+    }
+
+    RenRect screen = { 0, 0, w, h };
+    float size = 14.0f;
+    float line_height = size * 1.2f;
+    int width = (int)(size * 20);
+    int height = (int)(line_height * count + size);
+    draw_rect_now((RenRect) { w - width, 0, width, height }, (RenColor) { 0, 0, 0, 200 }, screen);
+
+    for (int i = 0; i < count; i++) {
+        float x = w - width + size / 2;
+        int prev = -1;
+        draw_glyphs(0, (short)(size*10.0f), lines[i], strlen(lines[i]), pack_color((RenColor) { 255, 255, 255, 255 }),
+                    &x, size / 2 + line_height * (i + 1) - size / 4, &prev, screen);
+    }
+}
+
+void ren_show_debug(bool show) {
+    state.show_debug = show;
+}
+
+// Copies the instances of the frame to the GPU, sokol allows a single
+// update of the buffer per frame, so it's grown before it is used.
+static void upload_instances(void) {
+    if (state.instances_count == 0) return;
+    if (state.instances_count > state.instance_buffer_capacity) {
+        if (state.instance_buffer.id != SG_INVALID_ID) {
+            sg_destroy_buffer(state.instance_buffer);
+        }
+        state.instance_buffer_capacity = max(state.instances_count, state.instance_buffer_capacity * 2);
+        state.instance_buffer = sg_make_buffer(&(sg_buffer_desc){
+            .usage.stream_update = true,
+            .size = state.instance_buffer_capacity * sizeof(Instance),
+            .label = "instances",
+        });
+    }
+    sg_update_buffer(state.instance_buffer, &(sg_range){
+        state.instances, state.instances_count * sizeof(Instance)
+    });
+    profiler_count("instances", state.instances_count);
+}
+
+static void draw_batches(int pass, int w, int h) {
+    sg_apply_pipeline(state.pip);
+    for (int i = 0; i < state.batches_count; i++) {
+        Batch *b = &state.batches[i];
+        if (b->pass != pass || b->count == 0) { continue; }
+        bool blank = b->view.id == SG_INVALID_ID;
+        float params[8] = {
+            2.0f / w, -2.0f / h,
+            blank ? 1.0f : 1.0f / b->texture_width, blank ? 1.0f : 1.0f / b->texture_height,
+            (float)b->mode,
+        };
+        sg_apply_bindings(&(sg_bindings){
+            .vertex_buffers[0] = state.instance_buffer,
+            .vertex_buffer_offsets[0] = b->first * (int)sizeof(Instance),
+            .views[0] = blank ? state.blank_view : b->view,
+            .samplers[0] = state.sampler,
+        });
+        sg_apply_uniforms(0, &SG_RANGE(params));
+        sg_draw(0, 4, b->count);
+        profiler_count("draw calls", 1);
+    }
+}
+
+// Copies the offscreen target to the swapchain and submits the frame,
+// render targets are stored upside-down on backends with a bottom-left
+// origin.
+static void present_target(void) {
+    int w = state.target_width;
+    int h = state.target_height;
+    // nothing was redrawn into the target and every swapchain image
+    // holds it already, skip the pass and the commit
+    bool same_size = w == sapp_width() && h == sapp_height();
+    if (state.instances_count == 0 && !state.show_debug && same_size
+        && state.presented_images >= SWAPCHAIN_IMAGES) {
+        profiler_count("skipped frames", 1);
+        return;
+    }
+    bool flip = !sg_query_features().origin_top_left;
+    state.pass = PASS_SWAPCHAIN;
+    if (use_texture(MODE_IMAGE, state.target_texture_view, w, h)) {
+        push_quad((RenRect) { 0, 0, w, h }, 0, 0, w, h, 0, flip ? h : 0, w, flip ? 0 : h, 0xffffffff);
+    }
+
+    if (state.show_debug) {
+        draw_debug_overlay(w, h);
+    }
+
+    profiler_begin("commit");
+    flush_atlas();
+    upload_instances();
+    bool redraw = false;
+    for (int i = 0; i < state.batches_count; i++) {
+        if (state.batches[i].pass == PASS_TARGET) { redraw = true; }
+    }
+    if (redraw) {
+        sg_begin_pass(&(sg_pass){
+            .action = state.load_action,
+            .attachments = {
+                .colors[0] = state.target_color_view,
+                .depth_stencil = state.target_depth_view,
+            },
+        });
+        draw_batches(PASS_TARGET, w, h);
+        sg_end_pass();
+    }
     sg_begin_pass(&(sg_pass){ .action = state.pass_action, .swapchain = sglue_swapchain() });
-    sgl_draw();
-    sfons_flush(state.fs);
+    draw_batches(PASS_SWAPCHAIN, w, h);
     sg_end_pass();
     sg_commit();
+    profiler_end();
+    // the debug overlay is drawn on the swapchain images themselves
+    if (state.show_debug || !same_size) {
+        state.presented_images = 0;
+    } else {
+        state.presented_images = redraw ? 1 : state.presented_images + 1;
+    }
+    memset(state.pages_uploaded, 0, sizeof(state.pages_uploaded));
+    state.instances_count = 0;
+    state.batches_count = 0;
+}
+
+void ren_invalidate(void) {
+    state.invalid = true;
+}
+
+void ren_begin_frame(void) {
+    int w = max(sapp_width(), 1);
+    int h = max(sapp_height(), 1);
+    if (w != state.target_width || h != state.target_height) {
+        create_target(w, h);
+    }
+    state.commands_size = 0;
+    state.clip = (RenRect) { 0, 0, w, h };
+    atlas_next_frame(state.atlas);
+    finish_warm_jobs(false);
+}
+
+void ren_end_frame(void) {
+    profiler_begin("render");
+    int w = state.target_width;
+    int h = state.target_height;
+    RenRect screen = { 0, 0, w, h };
+
+    // hash every command into the cells it overlaps
+    Command *cmd = NULL;
+    RenRect clip = screen;
+    while (next_command(&cmd)) {
+        if (cmd->type == CMD_SET_CLIP) { clip = cmd->rect; }
+        RenRect r = intersect_rects(cmd->rect, clip);
+        if (r.width == 0 || r.height == 0) { continue; }
+        unsigned cmd_hash = HASH_INITIAL;
+        hash(&cmd_hash, cmd, cmd->size);
+        hash(&cmd_hash, &r, sizeof(r));
+        update_overlapping_cells(r, cmd_hash);
+    }
+
+    // push rects for the cells that changed since the last frame
+    int rect_count = 0;
+    int max_x = w / CELL_SIZE + 1;
+    int max_y = h / CELL_SIZE + 1;
+    for (int y = 0; y < max_y; y++) {
+        for (int x = 0; x < max_x; x++) {
+            int idx = x + y * state.cells_x;
+            if (state.invalid || state.cells[idx] != state.cells_prev[idx]) {
+                push_rect((RenRect) { x, y, 1, 1 }, &rect_count);
+            }
+            state.cells_prev[idx] = HASH_INITIAL;
+        }
+    }
+    state.invalid = false;
+
+    // redraw the changed rects into the offscreen target, clipped on
+    // the CPU to the rect and to the clip of the commands
+    state.pass = PASS_TARGET;
+    for (int i = 0; i < rect_count; i++) {
+        RenRect r = state.rects[i];
+        r.x *= CELL_SIZE;
+        r.y *= CELL_SIZE;
+        r.width *= CELL_SIZE;
+        r.height *= CELL_SIZE;
+        r = intersect_rects(r, screen);
+
+        draw_rect_now(r, (RenColor) { 0, 0, 0, 255 }, r);
+        clip = r;
+
+        cmd = NULL;
+        while (next_command(&cmd)) {
+            switch (cmd->type) {
+            case CMD_SET_CLIP:
+                clip = intersect_rects(cmd->rect, r);
+                break;
+            case CMD_DRAW_RECT:
+                if (rects_overlap(cmd->rect, clip)) {
+                    draw_rect_now(cmd->rect, cmd->color, clip);
+                }
+                break;
+            case CMD_DRAW_TEXT:
+                if (rects_overlap(cmd->rect, clip)) {
+                    draw_text_now(cmd->font, cmd->text, cmd->rect.x, cmd->rect.y, cmd->color, clip);
+                }
+                break;
+            case CMD_DRAW_TOKENS:
+                if (rects_overlap(cmd->rect, clip)) {
+                    draw_tokens_now(cmd->font, cmd->text, cmd->rect.x, cmd->rect.y, clip);
+                }
+                break;
+            }
+        }
+    }
+
+    // swap cell buffers; the previous buffer was reset above
+    unsigned *tmp = state.cells;
+    state.cells = state.cells_prev;
+    state.cells_prev = tmp;
+
+    profiler_end();
+    present_target();
+    state.frame_drawn = true;
+}
+
+void ren_present(void) {
+    // sokol_app presents after every frame callback, so a frame in which
+    // nothing was drawn still needs the last one copied to the swapchain
+    // until each of its images holds it
+    if (!state.frame_drawn && state.target.id != SG_INVALID_ID) {
+        present_target();
+    }
+    state.frame_drawn = false;
 }
 
 void ren_set_clip_rect(RenRect rect) {
-    sgl_scissor_rect(rect.x, rect.y, rect.width, rect.height, true);
+    Command *cmd = push_command(CMD_SET_CLIP, 0);
+    if (cmd) { cmd->rect = intersect_rects(rect, (RenRect) { 0, 0, state.target_width, state.target_height }); }
+    state.clip = rect;
 }
 
 void ren_get_size(int *x, int *y) {
@@ -119,15 +1086,21 @@ void ren_free_image(RenImage *image) {
     // It should handle NULL pointers gracefully.
 }
 
-RenFont* ren_load_font(const char *filename, float size) {
-    RenFont* font = malloc(sizeof(RenFont));
-    if (!font) return NULL;
-    font->fons_context = state.fs;
+// Returns the fontstash font of the file, loading it the first time.
+static int load_face(const char *filename) {
+    for (int i = 0; i < state.faces_count; i++) {
+        if (strcmp(state.faces[i], filename) == 0) { return i; }
+    }
+    char **faces = realloc(state.faces, (state.faces_count + 1) * sizeof(char*));
+    if (!faces) return FONS_INVALID;
+    state.faces = faces;
+    char *name = malloc(strlen(filename) + 1);
+    if (!name) return FONS_INVALID;
 
     FILE* fp = fopen(filename, "rb");
     if (!fp) {
-        free(font);
-        return NULL;
+        free(name);
+        return FONS_INVALID;
     }
     fseek(fp, 0, SEEK_END);
     long file_size = ftell(fp);
@@ -135,23 +1108,46 @@ RenFont* ren_load_font(const char *filename, float size) {
     unsigned char* data = malloc(file_size);
     if (!data) {
         fclose(fp);
-        free(font);
-        return NULL;
+        free(name);
+        return FONS_INVALID;
     }
     fread(data, 1, file_size, fp);
     fclose(fp);
 
-    font->font_id = fonsAddFontMem(state.fs, "default", data, (int)file_size, 1);
+    // font ids are handed out in order, so they index `faces`
+    int font_id = fonsAddFontMem(state.fs, "default", data, (int)file_size, 1);
+    if (font_id == FONS_INVALID) {
+        free(name);
+        return FONS_INVALID;
+    }
+    strcpy(name, filename);
+    state.faces[state.faces_count++] = name;
+    return font_id;
+}
+
+RenFont* ren_load_font(const char *filename, float size) {
+    RenFont* font = malloc(sizeof(RenFont));
+    if (!font) return NULL;
+    font->fons_context = state.fs;
+    font->font_id = load_face(filename);
     if (font->font_id == FONS_INVALID) {
         free(font);
         return NULL;
     }
     font->size = size;
     font->tab_width = 4;
+    for (int i = 0; i < 128; i++) {
+        font->ascii[i].advance = -1;
+    }
+    font->glyphs = NULL;
+    font->glyphs_count = 0;
+    font->glyphs_capacity = 0;
+    start_warm_job(font->font_id, (short)(size*10.0f));
     return font;
 }
 
 void ren_free_font(RenFont *font) {
+    free(font->glyphs);
     free(font);
 }
 
@@ -163,10 +1159,135 @@ int ren_get_font_tab_width(RenFont *font) {
     return font->tab_width;
 }
 
+// Rounds the advance the same way as fons__getGlyph and draw_glyphs,
+// so the cached advance is exactly what the drawing code will use.
+// Only the metrics are read, the glyph is rasterized once drawn.
+static void load_glyph(RenFont *font, unsigned codepoint, RenGlyph *dst) {
+    FONSfont *fnt = state.fs->fonts[font->font_id];
+    float scale = fons__tt_getPixelHeightScale(&fnt->font, (short)(font->size*10.0f) / 10.0f);
+    int advance, lsb;
+    dst->codepoint = codepoint;
+    dst->index = fons__tt_getGlyphIndex(&fnt->font, codepoint);
+    stbtt_GetGlyphHMetrics(&fnt->font.font, dst->index, &advance, &lsb);
+    dst->advance = (int)((short)(scale * advance * 10.0f) / 10.0f + 0.5f);
+}
+
+static RenGlyph* find_glyph(RenGlyph *glyphs, int capacity, unsigned codepoint) {
+    unsigned mask = capacity - 1;
+    unsigned i = fons__hashint(codepoint) & mask;
+    while (glyphs[i].advance >= 0 && glyphs[i].codepoint != codepoint) {
+        i = (i + 1) & mask;
+    }
+    return &glyphs[i];
+}
+
+static void grow_glyphs(RenFont *font) {
+    int capacity = font->glyphs_capacity ? font->glyphs_capacity * 2 : 256;
+    RenGlyph *glyphs = malloc(capacity * sizeof(RenGlyph));
+    if (!glyphs) { return; }
+    for (int i = 0; i < capacity; i++) {
+        glyphs[i].advance = -1;
+    }
+    for (int i = 0; i < font->glyphs_capacity; i++) {
+        RenGlyph *g = &font->glyphs[i];
+        if (g->advance >= 0) {
+            *find_glyph(glyphs, capacity, g->codepoint) = *g;
+        }
+    }
+    free(font->glyphs);
+    font->glyphs = glyphs;
+    font->glyphs_capacity = capacity;
+}
+
+static RenGlyph* get_glyph(RenFont *font, unsigned codepoint) {
+    static RenGlyph missing = { 0, -1, 0 };
+    RenGlyph *g;
+    if (codepoint < 128) {
+        g = &font->ascii[codepoint];
+    } else {
+        if (font->glyphs_count * 2 >= font->glyphs_capacity) {
+            grow_glyphs(font);
+            if (!font->glyphs) { return &missing; }
+        }
+        g = find_glyph(font->glyphs, font->glyphs_capacity, codepoint);
+    }
+    if (g->advance < 0) {
+        load_glyph(font, codepoint, g);
+        if (codepoint >= 128) { font->glyphs_count++; }
+    }
+    return g;
+}
+
+// Walks the text like fonsTextBounds, including the kerning between
+// glyphs, but taking the advances from the font cache. When `offsets`
+// is given it receives the x of every byte, bytes inside a multibyte
+// character share the x of the character start.
+// `prev` carries the last glyph between calls, so consecutive tokens
+// are kerned as a single run of text.
+static int measure_text(RenFont *font, const char *text, int len, int *prev_glyph, int *offsets) {
+    FONSfont *fnt = state.fs->fonts[font->font_id];
+    float scale = fons__tt_getPixelHeightScale(&fnt->font, (short)(font->size*10.0f) / 10.0f);
+    unsigned utf8state = 0, codepoint;
+    int prev = prev_glyph ? *prev_glyph : -1, x = 0, start = 0;
+
+    for (int i = 0; i < len; i++) {
+        if (offsets) { offsets[i] = x; }
+        if (utf8state == 0) { start = i; }
+        if (fons__decutf8(&utf8state, &codepoint, (unsigned char)text[i])) {
+            continue;
+        }
+        RenGlyph *g = get_glyph(font, codepoint);
+        if (g->index < 0) {
+            prev = -1;
+            continue;
+        }
+        if (prev != -1) {
+            float adv = fons__tt_getGlyphKernAdvance(&fnt->font, prev, g->index) * scale;
+            x += (int)(adv + fons__getState(state.fs)->spacing + 0.5f);
+        }
+        if (offsets) {
+            for (int j = start; j <= i; j++) { offsets[j] = x; }
+        }
+        x += g->advance;
+        prev = g->index;
+    }
+    if (offsets) { offsets[len] = x; }
+    if (prev_glyph) { *prev_glyph = prev; }
+    return x;
+}
+
 int ren_get_font_width(RenFont *font, const char *text) {
-    fonsSetFont(state.fs, font->font_id);
-    fonsSetSize(state.fs, font->size);
-    return (int)fonsTextBounds(state.fs, 0, 0, text, NULL, NULL);
+    return measure_text(font, text, strlen(text), NULL, NULL);
+}
+
+void ren_get_font_offsets(RenFont *font, const char *text, int len, int *offsets) {
+    measure_text(font, text, len, NULL, offsets);
+}
+
+// Same rule as the old DocView:get_x_offset_col, returns the 1-based
+// column closest to `x`, or `len` when `x` is past the end of the text.
+int ren_get_font_col(RenFont *font, const char *text, int len, float x) {
+    int *offsets = malloc((len + 1) * sizeof(int));
+    if (!offsets) { return len; }
+    measure_text(font, text, len, NULL, offsets);
+
+    int last_i = 0, i = 0;
+    while (i < len) {
+        int next = i + 1;
+        while (next < len && ((unsigned char)text[next] & 0xc0) == 0x80) {
+            next++;
+        }
+        if (offsets[i] >= x) {
+            int w = offsets[next] - offsets[i];
+            int col = (offsets[i] - x > w / 2.0) ? last_i : i;
+            free(offsets);
+            return col + 1;
+        }
+        last_i = i;
+        i = next;
+    }
+    free(offsets);
+    return len;
 }
 
 int ren_get_font_height(RenFont *font) {
@@ -178,13 +1299,12 @@ int ren_get_font_height(RenFont *font) {
 }
 
 void ren_draw_rect(RenRect rect, RenColor color) {
-    sgl_begin_quads();
-    sgl_c4b(color.r, color.g, color.b, color.a);
-    sgl_v2f((float)rect.x, (float)rect.y);
-    sgl_v2f((float)rect.x + rect.width, (float)rect.y);
-    sgl_v2f((float)rect.x + rect.width, (float)rect.y + rect.height);
-    sgl_v2f((float)rect.x, (float)rect.y + rect.height);
-    sgl_end();
+    if (color.a == 0 || !rects_overlap(state.clip, rect)) { return; }
+    Command *cmd = push_command(CMD_DRAW_RECT, 0);
+    if (cmd) {
+        cmd->rect = rect;
+        cmd->color = color;
+    }
 }
 
 void ren_draw_image(RenImage *image, RenRect *sub, int x, int y, RenColor color) {
@@ -193,9 +1313,55 @@ void ren_draw_image(RenImage *image, RenRect *sub, int x, int y, RenColor color)
 }
 
 int ren_draw_text(RenFont *font, const char *text, int x, int y, RenColor color) {
-    fonsSetFont(state.fs, font->font_id);
-    fonsSetSize(state.fs, font->size);
-    fonsSetColor(state.fs, sfons_rgba(color.r, color.g, color.b, color.a));
+    RenRect rect;
+    rect.x = x;
+    rect.y = y;
+    rect.width = ren_get_font_width(font, text);
+    rect.height = ren_get_font_height(font);
+
+    if (color.a != 0 && rects_overlap(state.clip, rect)) {
+        int len = strlen(text);
+        Command *cmd = push_command(CMD_DRAW_TEXT, len + 1);
+        if (cmd) {
+            memcpy(cmd->text, text, len);
+            cmd->color = color;
+            cmd->font = font;
+            cmd->rect = rect;
+        }
+    }
+
+    return x + rect.width;
+}
+
+int ren_draw_tokens(RenFont *font, const RenToken *tokens, int count, int x, int y) {
+    RenRect rect;
+    int size = sizeof(count), prev = -1;
+    rect.x = x;
+    rect.y = y;
+    rect.width = 0;
+    rect.height = ren_get_font_height(font);
+    for (int i = 0; i < count; i++) {
+        rect.width += measure_text(font, tokens[i].text, tokens[i].len, &prev, NULL);
+        size += sizeof(RenColor) + sizeof(int) + tokens[i].len;
+    }
+
+    if (count > 0 && rects_overlap(state.clip, rect)) {
+        Command *cmd = push_command(CMD_DRAW_TOKENS, size);
+        if (cmd) {
+            char *data = cmd->text;
+            memcpy(data, &count, sizeof(count));
+            data += sizeof(count);
+            for (int i = 0; i < count; i++) {
+                memcpy(data, &tokens[i].color, sizeof(RenColor));
+                memcpy(data + sizeof(RenColor), &tokens[i].len, sizeof(int));
+                data += sizeof(RenColor) + sizeof(int);
+                memcpy(data, tokens[i].text, tokens[i].len);
+                data += tokens[i].len;
+            }
+            cmd->font = font;
+            cmd->rect = rect;
+        }
+    }
 
-    return (int)fonsDrawText(state.fs, (float)x, (float)y + font->size/1.25, text, NULL);
+    return x + rect.width;
 }
\ No newline at end of file
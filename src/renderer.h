@@ -6,12 +6,13 @@
 #define RENDERER_H
 
 #include <sokol_gfx.h>
-#include <sokol_gl.h>
 #include <fontstash.h>
 
 typedef struct { uint8_t b, g, r, a; } RenColor;
 typedef struct { int x, y, width, height; } RenRect;
 
+typedef struct { const char *text; int len; RenColor color; } RenToken;
+
 typedef struct RenImage
 {
     sg_image image;
@@ -19,12 +20,26 @@ typedef struct RenImage
     int height;
 } RenImage;
 
+typedef struct RenGlyph
+{
+    unsigned codepoint;
+    int index;
+    int advance;
+} RenGlyph;
+
 typedef struct RenFont
 {
     FONScontext* fons_context;
     int font_id;
     float size;
     int tab_width;
+
+    // Advance cache, ASCII is looked up directly and every
+    // other codepoint goes to an open addressing table.
+    RenGlyph ascii[128];
+    RenGlyph *glyphs;
+    int glyphs_count;
+    int glyphs_capacity;
 } RenFont;
 
 
@@ -32,6 +47,9 @@ void ren_init(void);
 void ren_shutdown(void);
 void ren_begin_frame(void);
 void ren_end_frame(void);
+void ren_present(void);
+void ren_invalidate(void);
+void ren_show_debug(bool show);
 
 void ren_set_clip_rect(RenRect rect);
 void ren_get_size(int *x, int *y);
@@ -44,10 +62,13 @@ void ren_free_font(RenFont *font);
 void ren_set_font_tab_width(RenFont *font, int n);
 int ren_get_font_tab_width(RenFont *font);
 int ren_get_font_width(RenFont *font, const char *text);
+void ren_get_font_offsets(RenFont *font, const char *text, int len, int *offsets);
+int ren_get_font_col(RenFont *font, const char *text, int len, float x);
 int ren_get_font_height(RenFont *font);
 
 void ren_draw_rect(RenRect rect, RenColor color);
 void ren_draw_image(RenImage *image, RenRect *sub, int x, int y, RenColor color);
 int ren_draw_text(RenFont *font, const char *text, int x, int y, RenColor color);
+int ren_draw_tokens(RenFont *font, const RenToken *tokens, int count, int x, int y);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,342 @@
+#include "save.h"
+#include "thread.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#endif
+
+// Bytes written between progress updates, and the size of the staging
+// buffer of "\r\n" saves.
+#define CHUNK_SIZE (1024 * 1024)
+
+// Spans per writev() call.
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define MAX_IOV IOV_MAX
+#else
+#define MAX_IOV 1024
+#endif
+
+struct SaveJob
+{
+    BufferSnapshot *snap;
+    const BufferSpan *spans;
+    int span_count;
+    bool crlf;
+    // the file written and the one it's renamed to, or NULL when the
+    // target is written in place
+    char *path;
+    char *target;
+    int fd;
+    Thread thread;
+    bool joined;
+
+    // protected by the mutex
+    Mutex mutex;
+    size_t written;
+    size_t total;
+    bool done;
+    char *error;
+};
+
+static char* format_error(const char *filename, int err) {
+    const char *msg = strerror(err);
+    char *res = xrealloc(NULL, strlen(filename) + strlen(msg) + 3);
+    sprintf(res, "%s: %s", filename, msg);
+    return res;
+}
+
+static void add_progress(SaveJob *job, size_t len) {
+    mutex_lock(&job->mutex);
+    job->written += len;
+    mutex_unlock(&job->mutex);
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+#ifdef _WIN32
+        int n = _write(fd, data, len > CHUNK_SIZE ? CHUNK_SIZE : (unsigned)len);
+#else
+        ssize_t n = write(fd, data, len);
+#endif
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return false; }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Writes the spans as they are, up to MAX_IOV of them or CHUNK_SIZE bytes
+// per call.
+static bool write_spans(SaveJob *job) {
+#ifdef _WIN32
+    for (int i = 0; i < job->span_count; i++) {
+        const BufferSpan *s = &job->spans[i];
+        for (size_t at = 0; at < s->len; at += CHUNK_SIZE) {
+            size_t len = s->len - at < CHUNK_SIZE ? s->len - at : CHUNK_SIZE;
+            if (!write_all(job->fd, s->text + at, len)) { return false; }
+            add_progress(job, len);
+        }
+    }
+    return true;
+#else
+    struct iovec iov[MAX_IOV];
+    int span = 0;
+    size_t at = 0;
+    while (span < job->span_count) {
+        int count = 0;
+        size_t len = 0;
+        while (span < job->span_count && count < MAX_IOV && len < CHUNK_SIZE) {
+            const BufferSpan *s = &job->spans[span];
+            size_t n = s->len - at;
+            if (n > CHUNK_SIZE - len) { n = CHUNK_SIZE - len; }
+            iov[count].iov_base = (char*)s->text + at;
+            iov[count].iov_len = n;
+            count++;
+            len += n;
+            at += n;
+            if (at == s->len) {
+                span++;
+                at = 0;
+            }
+        }
+
+        // writev() may write less than asked, the rest is written from
+        // where it stopped
+        struct iovec *v = iov;
+        size_t left = len;
+        while (left > 0) {
+            ssize_t n = writev(job->fd, v, count);
+            if (n < 0 && errno == EINTR) { continue; }
+            if (n <= 0) { return false; }
+            left -= n;
+            while (count > 0 && (size_t)n >= v->iov_len) {
+                n -= v->iov_len;
+                v++;
+                count--;
+            }
+            if (count > 0) {
+                v->iov_base = (char*)v->iov_base + n;
+                v->iov_len -= n;
+            }
+        }
+        add_progress(job, len);
+    }
+    return true;
+#endif
+}
+
+// Writes the spans with every "\n" as "\r\n", the staging buffer is
+// flushed whenever full.
+static bool write_spans_crlf(SaveJob *job) {
+    char *stage = xrealloc(NULL, CHUNK_SIZE);
+    size_t used = 0;
+    size_t pending = 0;
+    bool ok = true;
+    for (int i = 0; i < job->span_count && ok; i++) {
+        const char *p = job->spans[i].text;
+        const char *end = p + job->spans[i].len;
+        while (p < end) {
+            // a line, or as much as fits, leaving room for its "\r\n"
+            size_t room = CHUNK_SIZE - used - 2;
+            size_t len = end - p < (ptrdiff_t)room ? (size_t)(end - p) : room;
+            const char *lf = memchr(p, '\n', len);
+            if (lf) { len = lf - p; }
+            memcpy(stage + used, p, len);
+            used += len;
+            pending += len;
+            p += len;
+            if (lf) {
+                stage[used++] = '\r';
+                stage[used++] = '\n';
+                pending++;
+                p++;
+            }
+            if (used > CHUNK_SIZE - 2 - 64) {
+                ok = write_all(job->fd, stage, used);
+                if (!ok) { break; }
+                add_progress(job, pending);
+                used = pending = 0;
+            }
+        }
+    }
+    if (ok && used > 0) {
+        ok = write_all(job->fd, stage, used);
+        add_progress(job, pending);
+    }
+    free(stage);
+    return ok;
+}
+
+#ifndef _WIN32
+// Makes the rename itself durable, a failure only loses that.
+static void sync_dir(const char *path) {
+    char *dir = xstrdup(path);
+    char *sep = strrchr(dir, '/');
+    if (sep) {
+        sep[sep == dir ? 1 : 0] = '\0';
+    }
+    int fd = open(sep ? dir : ".", O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+#endif
+
+static void worker(void *arg) {
+    SaveJob *job = arg;
+    bool ok = job->crlf ? write_spans_crlf(job) : write_spans(job);
+    int err = ok ? 0 : errno;
+#ifdef _WIN32
+    if (ok && _commit(job->fd) < 0) { err = errno; }
+    if (_close(job->fd) < 0 && !err) { err = errno; }
+    if (!err && job->target &&
+        !MoveFileExA(job->path, job->target, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        err = EACCES;
+    }
+#else
+    if (ok && fsync(job->fd) < 0) { err = errno; }
+    if (close(job->fd) < 0 && !err) { err = errno; }
+    if (!err && job->target) {
+        if (rename(job->path, job->target) < 0) {
+            err = errno;
+        } else {
+            sync_dir(job->target);
+        }
+    }
+#endif
+    if (err && job->target) { remove(job->path); }
+
+    mutex_lock(&job->mutex);
+    job->done = true;
+    if (err) { job->error = format_error(job->target ? job->target : job->path, err); }
+    mutex_unlock(&job->mutex);
+}
+
+// Opens a new file next to `target`, with its mode and owner when it
+// exists. Returns the file or -1.
+static int open_temp(SaveJob *job) {
+#ifdef _WIN32
+    char *path = xrealloc(NULL, strlen(job->target) + 32);
+    int fd = -1;
+    for (int i = 0; i < 16 && fd < 0; i++) {
+        sprintf(path, "%s.%lu.%d.tmp", job->target, GetCurrentProcessId(), i);
+        fd = _open(path, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+        if (fd < 0 && errno != EEXIST) { break; }
+    }
+#else
+    const char *sep = strrchr(job->target, '/');
+    size_t dir_len = sep ? (size_t)(sep - job->target) + 1 : 0;
+    char *path = xrealloc(NULL, strlen(job->target) + 16);
+    sprintf(path, "%.*s.%s.XXXXXX", (int)dir_len, job->target, job->target + dir_len);
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        struct stat st;
+        if (stat(job->target, &st) == 0) {
+            // keeping the owner needs privileges, without them it's ours
+            if (fchown(fd, st.st_uid, st.st_gid) < 0) { errno = 0; }
+            fchmod(fd, st.st_mode & 07777);
+        } else {
+            mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0666 & ~mask);
+        }
+    }
+#endif
+    if (fd < 0) {
+        free(path);
+        return -1;
+    }
+    job->path = path;
+    return fd;
+}
+
+SaveJob* save_job_new(Buffer *buf, const char *filename, bool crlf, const char **error) {
+    SaveJob *job = xrealloc(NULL, sizeof(SaveJob));
+    memset(job, 0, sizeof(SaveJob));
+    job->crlf = crlf;
+    mutex_init(&job->mutex);
+
+    // the rename replaces the file a symlink points to, not the link
+#ifdef _WIN32
+    job->target = xstrdup(filename);
+#else
+    job->target = realpath(filename, NULL);
+    if (!job->target) { job->target = xstrdup(filename); }
+#endif
+
+    job->fd = open_temp(job);
+    if (job->fd < 0) {
+        // a directory we can't create files in, the target is truncated
+        // and written over
+        free(job->target);
+        job->target = NULL;
+        job->path = xstrdup(filename);
+#ifdef _WIN32
+        job->fd = _open(filename, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        job->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#endif
+        if (job->fd < 0) {
+            static char msg[512];
+            snprintf(msg, sizeof(msg), "%s: %s", filename, strerror(errno));
+            *error = msg;
+            free(job->path);
+            mutex_destroy(&job->mutex);
+            free(job);
+            return NULL;
+        }
+    }
+
+    job->snap = buffer_snapshot_new(buf);
+    job->spans = buffer_snapshot_get_spans(job->snap, &job->span_count);
+    job->total = buffer_get_size(buf);
+    if (!thread_create(&job->thread, worker, job)) {
+        // no thread to spare, saved right away
+        worker(job);
+        job->joined = true;
+    }
+    return job;
+}
+
+bool save_job_poll(SaveJob *job, size_t *written, size_t *total, const char **error) {
+    mutex_lock(&job->mutex);
+    bool done = job->done;
+    *written = job->written;
+    *total = job->total;
+    *error = job->error;
+    mutex_unlock(&job->mutex);
+    return done;
+}
+
+const char* save_job_wait(SaveJob *job) {
+    if (!job->joined) {
+        thread_join(job->thread);
+        job->joined = true;
+    }
+    return job->error;
+}
+
+void save_job_free(SaveJob *job) {
+    save_job_wait(job);
+    buffer_snapshot_free(job->snap);
+    mutex_destroy(&job->mutex);
+    free(job->error);
+    free(job->path);
+    free(job->target);
+    free(job);
+}
@@ -0,0 +1,29 @@
+// Saves a buffer on a worker thread. The text is written from a snapshot
+// of the buffer, so the doc can be edited meanwhile: as it is with
+// writev(), or with its "\n" turned to "\r\n" through a staging buffer
+// in a single pass. It goes to a temp file next to the target, which is
+// synced and renamed over it once complete, so the file is either the
+// old one or the new one, never a part of it. When no temp file can be
+// made there, the target is written in place.
+
+#ifndef SAVE_H
+#define SAVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "buffer.h"
+
+typedef struct SaveJob SaveJob;
+
+// Returns NULL and sets `error` if the file can't be written.
+SaveJob* save_job_new(Buffer *buf, const char *filename, bool crlf, const char **error);
+void save_job_free(SaveJob *job);
+
+// Returns true once done. `written` and `total` are in bytes of the
+// buffer, `error` is set when done if the save failed.
+bool save_job_poll(SaveJob *job, size_t *written, size_t *total, const char **error);
+// Waits until done, returns the error if the save failed.
+const char* save_job_wait(SaveJob *job);
+
+#endif
@@ -0,0 +1,706 @@
+#include "scanner.h"
+#include "thread.h"
+#include "tokenizer.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR)
+#endif
+
+#ifdef _WIN32
+#define PATHSEP '\\'
+#else
+#define PATHSEP '/'
+#endif
+
+// Without inotify the stop flag is checked this often between walks.
+#define SLEEP_STEP 0.1
+
+typedef struct
+{
+    ScanEntry *items;
+    int count;
+    int capacity;
+} Entries;
+
+typedef struct
+{
+    ScanChange *items;
+    int count;
+    int capacity;
+} Changes;
+
+typedef struct
+{
+    char *name;
+    struct stat st;
+} Item;
+
+typedef struct
+{
+    Item *items;
+    int count;
+    int capacity;
+} Items;
+
+// Directories being walked, to not follow a symlink into one of its
+// own parents forever.
+typedef struct Parent
+{
+    dev_t dev;
+    ino_t ino;
+    struct Parent *up;
+} Parent;
+
+struct Scanner
+{
+    char *root;
+    char **ignore;
+    int ignore_count;
+    double rate;
+    Thread thread;
+    bool started;
+
+    // only the worker writes the list, under the mutex
+    Mutex mutex;
+    bool stop;
+    bool scanned;
+    bool reset;
+    Entries entries;
+    Changes changes;
+
+#ifdef __linux__
+    int inotify;
+    int wake[2];
+    // path of every watch descriptor
+    char **watches;
+    int watches_capacity;
+    // readable while there are changes to poll, `signaled` is protected
+    // by the mutex
+    int ready[2];
+    bool signaled;
+    bool watched;
+    Scanner *next;
+#endif
+};
+
+#ifdef __linux__
+static Scanner *scanners;
+#endif
+
+// Joins a path relative to the root with a name, "" is the root itself.
+static char* join(const char *path, const char *name) {
+    size_t a = strlen(path);
+    size_t b = strlen(name);
+    char *res = xrealloc(NULL, a + b + 2);
+    if (a) {
+        memcpy(res, path, a);
+        res[a++] = PATHSEP;
+    }
+    memcpy(res + a, name, b + 1);
+    return res;
+}
+
+static char* full_path(Scanner *sc, const char *path) {
+    if (strcmp(sc->root, ".") == 0) {
+        return xstrdup(*path ? path : ".");
+    }
+    return join(sc->root, path);
+}
+
+static void push_entry(Entries *list, const char *filename, const struct stat *st) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 256;
+        list->items = xrealloc(list->items, list->capacity * sizeof(ScanEntry));
+    }
+    ScanEntry *e = &list->items[list->count++];
+    e->filename = xstrdup(filename);
+    e->dir = S_ISDIR(st->st_mode);
+    e->modified = (double)st->st_mtime;
+    e->size = (double)st->st_size;
+}
+
+static void free_entries(Entries *list) {
+    for (int i = 0; i < list->count; i++) { free(list->items[i].filename); }
+    free(list->items);
+    list->items = NULL;
+    list->count = list->capacity = 0;
+}
+
+static void free_changes(ScanChange *changes, int count) {
+    for (int i = 0; i < count; i++) { free(changes[i].entry.filename); }
+    free(changes);
+}
+
+static bool is_ignored(Scanner *sc, const char *name) {
+    const char *error;
+    for (int i = 0; i < sc->ignore_count; i++) {
+        if (tokenizer_find_pattern(sc->ignore[i], name, strlen(name), &error)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int compare_items(const void *a, const void *b) {
+    return strcmp(((const Item*)a)->name, ((const Item*)b)->name);
+}
+
+// Orders two paths the way the walk lists them.
+static int compare_paths(const char *a, bool a_dir, const char *b, bool b_dir) {
+    for (;;) {
+        const char *ea = strchr(a, PATHSEP);
+        const char *eb = strchr(b, PATHSEP);
+        size_t la = ea ? (size_t)(ea - a) : strlen(a);
+        size_t lb = eb ? (size_t)(eb - b) : strlen(b);
+        if (la == lb && memcmp(a, b, la) == 0) {
+            if (!ea && !eb) { return 0; }
+            // a directory goes before its contents
+            if (!ea) { return -1; }
+            if (!eb) { return 1; }
+            a = ea + 1;
+            b = eb + 1;
+            continue;
+        }
+        bool da = ea || a_dir;
+        bool db = eb || b_dir;
+        if (da != db) { return da ? -1 : 1; }
+        int res = memcmp(a, b, la < lb ? la : lb);
+        if (res) { return res; }
+        return la < lb ? -1 : 1;
+    }
+}
+
+// Index of the first entry not ordered before the path.
+static int lower_bound(Entries *list, const char *path, bool dir) {
+    int lo = 0;
+    int hi = list->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        ScanEntry *e = &list->items[mid];
+        if (compare_paths(e->filename, e->dir, path, dir) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int find_entry(Entries *list, const char *path) {
+    // the path can be listed as either type, try both
+    for (int dir = 0; dir < 2; dir++) {
+        int i = lower_bound(list, path, dir);
+        if (i < list->count && strcmp(list->items[i].filename, path) == 0) { return i; }
+    }
+    return -1;
+}
+
+// Number of entries inside of the directory at `index`.
+static int subtree_count(Entries *list, int index) {
+    const char *path = list->items[index].filename;
+    size_t len = strlen(path);
+    int i = index + 1;
+    while (i < list->count && strncmp(list->items[i].filename, path, len) == 0
+           && list->items[i].filename[len] == PATHSEP) {
+        i++;
+    }
+    return i - index - 1;
+}
+
+#ifdef __linux__
+static void add_watch(Scanner *sc, const char *path) {
+    if (sc->inotify < 0) return;
+    char *full = full_path(sc, path);
+    int wd = inotify_add_watch(sc->inotify, full, WATCH_MASK);
+    free(full);
+    if (wd < 0) {
+        // out of watches, fall back to walking the tree again
+        if (errno == ENOSPC) {
+            close(sc->inotify);
+            sc->inotify = -1;
+        }
+        return;
+    }
+    if (wd >= sc->watches_capacity) {
+        int capacity = sc->watches_capacity ? sc->watches_capacity : 64;
+        while (capacity <= wd) { capacity *= 2; }
+        sc->watches = xrealloc(sc->watches, capacity * sizeof(char*));
+        memset(sc->watches + sc->watches_capacity, 0, (capacity - sc->watches_capacity) * sizeof(char*));
+        sc->watches_capacity = capacity;
+    }
+    free(sc->watches[wd]);
+    sc->watches[wd] = xstrdup(path);
+}
+
+static void remove_watches(Scanner *sc, const char *path) {
+    size_t len = strlen(path);
+    for (int wd = 0; wd < sc->watches_capacity; wd++) {
+        const char *w = sc->watches[wd];
+        if (w && strncmp(w, path, len) == 0 && (w[len] == '\0' || w[len] == PATHSEP)) {
+            inotify_rm_watch(sc->inotify, wd);
+        }
+    }
+}
+
+static void reset_watches(Scanner *sc) {
+    if (sc->inotify >= 0) { close(sc->inotify); }
+    for (int i = 0; i < sc->watches_capacity; i++) { free(sc->watches[i]); }
+    free(sc->watches);
+    sc->watches = NULL;
+    sc->watches_capacity = 0;
+    sc->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+#endif
+
+static bool is_stopped(Scanner *sc) {
+    mutex_lock(&sc->mutex);
+    bool stop = sc->stop;
+    mutex_unlock(&sc->mutex);
+    return stop;
+}
+
+// Called with the mutex held once there are changes to poll.
+static void signal_ready(Scanner *sc) {
+#ifdef __linux__
+    if (!sc->signaled && sc->ready[1] >= 0) {
+        ssize_t res = write(sc->ready[1], "", 1);
+        (void)res;
+        sc->signaled = true;
+    }
+#else
+    (void)sc;
+#endif
+}
+
+// Appends the contents of a directory to `out`, in listing order.
+static void scan_dir(Scanner *sc, const char *path, Entries *out, Parent *up) {
+    if (is_stopped(sc)) return;
+    Items dirs = { 0 };
+    Items files = { 0 };
+    char *full = full_path(sc, path);
+#ifdef _WIN32
+    DIR *dir = opendir(full);
+#else
+    int fd = open(full, O_RDONLY | O_DIRECTORY);
+    DIR *dir = (fd < 0) ? NULL : fdopendir(fd);
+    if (!dir && fd >= 0) { close(fd); }
+#endif
+    if (!dir) {
+        free(full);
+        return;
+    }
+#ifdef __linux__
+    add_watch(sc, path);
+#endif
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        if (is_ignored(sc, name)) continue;
+#ifdef DT_UNKNOWN
+        // sockets, pipes and devices are never listed, skip their stat
+        unsigned char type = entry->d_type;
+        if (type != DT_UNKNOWN && type != DT_DIR && type != DT_REG && type != DT_LNK) continue;
+#endif
+        struct stat st;
+#ifdef _WIN32
+        char *file = join(full, name);
+        int res = stat(file, &st);
+        free(file);
+#else
+        int res = fstatat(dirfd(dir), name, &st, 0);
+#endif
+        if (res < 0) continue;
+        Items *items = S_ISDIR(st.st_mode) ? &dirs : S_ISREG(st.st_mode) ? &files : NULL;
+        if (!items) continue;
+        if (items->count == items->capacity) {
+            items->capacity = items->capacity ? items->capacity * 2 : 32;
+            items->items = xrealloc(items->items, items->capacity * sizeof(Item));
+        }
+        items->items[items->count].name = xstrdup(name);
+        items->items[items->count].st = st;
+        items->count++;
+    }
+    closedir(dir);
+    free(full);
+
+    qsort(dirs.items, dirs.count, sizeof(Item), compare_items);
+    qsort(files.items, files.count, sizeof(Item), compare_items);
+
+    for (int i = 0; i < dirs.count; i++) {
+        char *sub = join(path, dirs.items[i].name);
+        push_entry(out, sub, &dirs.items[i].st);
+        bool loop = false;
+#ifndef _WIN32
+        for (Parent *p = up; p; p = p->up) {
+            loop = loop || (p->dev == dirs.items[i].st.st_dev && p->ino == dirs.items[i].st.st_ino);
+        }
+#endif
+        if (!loop) {
+            Parent parent = { dirs.items[i].st.st_dev, dirs.items[i].st.st_ino, up };
+            scan_dir(sc, sub, out, &parent);
+        }
+        free(sub);
+        free(dirs.items[i].name);
+    }
+    for (int i = 0; i < files.count; i++) {
+        char *sub = join(path, files.items[i].name);
+        push_entry(out, sub, &files.items[i].st);
+        free(sub);
+        free(files.items[i].name);
+    }
+    free(dirs.items);
+    free(files.items);
+}
+
+static bool same_entries(Entries *a, Entries *b) {
+    if (a->count != b->count) { return false; }
+    for (int i = 0; i < a->count; i++) {
+        ScanEntry *x = &a->items[i];
+        ScanEntry *y = &b->items[i];
+        if (x->dir != y->dir || x->modified != y->modified || x->size != y->size
+            || strcmp(x->filename, y->filename) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Walks the whole tree and replaces the list if anything changed.
+static void scan(Scanner *sc) {
+    Entries list = { 0 };
+    char *root = full_path(sc, "");
+    struct stat st;
+    if (stat(root, &st) == 0) {
+        Parent parent = { st.st_dev, st.st_ino, NULL };
+        scan_dir(sc, "", &list, &parent);
+    }
+    free(root);
+
+    mutex_lock(&sc->mutex);
+    if (!sc->scanned || !same_entries(&sc->entries, &list)) {
+        free_entries(&sc->entries);
+        sc->entries = list;
+        free_changes(sc->changes.items, sc->changes.count);
+        memset(&sc->changes, 0, sizeof(Changes));
+        sc->scanned = true;
+        sc->reset = true;
+        signal_ready(sc);
+    } else {
+        free_entries(&list);
+    }
+    mutex_unlock(&sc->mutex);
+}
+
+#ifdef __linux__
+// Called with the mutex held.
+static void push_change(Scanner *sc, ScanOp op, int index, int count, ScanEntry *entry) {
+    Changes *c = &sc->changes;
+    if (c->count == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 64;
+        c->items = xrealloc(c->items, c->capacity * sizeof(ScanChange));
+    }
+    ScanChange *change = &c->items[c->count++];
+    memset(change, 0, sizeof(ScanChange));
+    change->op = op;
+    change->index = index;
+    change->count = count;
+    if (entry) {
+        change->entry = *entry;
+        change->entry.filename = xstrdup(entry->filename);
+    }
+    signal_ready(sc);
+}
+
+static void remove_path(Scanner *sc, const char *path) {
+    int i = find_entry(&sc->entries, path);
+    if (i < 0) return;
+    int count = 1;
+    if (sc->entries.items[i].dir) {
+        count += subtree_count(&sc->entries, i);
+        remove_watches(sc, path);
+    }
+    mutex_lock(&sc->mutex);
+    for (int k = i; k < i + count; k++) { free(sc->entries.items[k].filename); }
+    memmove(sc->entries.items + i, sc->entries.items + i + count,
+            (sc->entries.count - i - count) * sizeof(ScanEntry));
+    sc->entries.count -= count;
+    push_change(sc, SCAN_REMOVE, i, count, NULL);
+    mutex_unlock(&sc->mutex);
+}
+
+static void add_path(Scanner *sc, const char *path) {
+    char *full = full_path(sc, path);
+    struct stat st;
+    int res = stat(full, &st);
+    free(full);
+    if (res < 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) return;
+
+    int i = find_entry(&sc->entries, path);
+    if (i >= 0) {
+        ScanEntry *e = &sc->entries.items[i];
+        if (e->dir == (bool)S_ISDIR(st.st_mode)) {
+            if (e->modified != (double)st.st_mtime || e->size != (double)st.st_size) {
+                mutex_lock(&sc->mutex);
+                e->modified = st.st_mtime;
+                e->size = st.st_size;
+                push_change(sc, SCAN_UPDATE, i, 1, e);
+                mutex_unlock(&sc->mutex);
+            }
+            return;
+        }
+        // replaced by an entry of the other type
+        remove_path(sc, path);
+    }
+
+    Entries added = { 0 };
+    push_entry(&added, path, &st);
+    if (S_ISDIR(st.st_mode)) {
+        Parent parent = { st.st_dev, st.st_ino, NULL };
+        scan_dir(sc, path, &added, &parent);
+    }
+
+    mutex_lock(&sc->mutex);
+    Entries *list = &sc->entries;
+    i = lower_bound(list, path, S_ISDIR(st.st_mode));
+    if (list->count + added.count > list->capacity) {
+        list->capacity = (list->count + added.count) * 2;
+        list->items = xrealloc(list->items, list->capacity * sizeof(ScanEntry));
+    }
+    memmove(list->items + i + added.count, list->items + i, (list->count - i) * sizeof(ScanEntry));
+    memcpy(list->items + i, added.items, added.count * sizeof(ScanEntry));
+    list->count += added.count;
+    for (int k = 0; k < added.count; k++) {
+        push_change(sc, SCAN_INSERT, i + k, 1, &added.items[k]);
+    }
+    mutex_unlock(&sc->mutex);
+    free(added.items);
+}
+
+static void handle_event(Scanner *sc, struct inotify_event *ev) {
+    if (ev->mask & IN_IGNORED) {
+        if (ev->wd < sc->watches_capacity) {
+            free(sc->watches[ev->wd]);
+            sc->watches[ev->wd] = NULL;
+        }
+        return;
+    }
+    if (ev->len == 0 || ev->wd >= sc->watches_capacity || !sc->watches[ev->wd]) return;
+    if (is_ignored(sc, ev->name)) return;
+
+    const char *dir = sc->watches[ev->wd];
+    char *path = join(dir, ev->name);
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        remove_path(sc, path);
+    } else {
+        add_path(sc, path);
+    }
+    free(path);
+
+    // the directory's own modified time changes with its contents
+    if (*dir && (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+        path = xstrdup(dir);
+        add_path(sc, path);
+        free(path);
+    }
+}
+
+// Applies the inotify events to the list until the worker is stopped,
+// returns false if the tree has to be walked again.
+static bool watch_events(Scanner *sc) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        if (sc->inotify < 0) { return false; }
+        struct pollfd fds[2] = {
+            { .fd = sc->inotify, .events = POLLIN },
+            { .fd = sc->wake[0], .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (fds[1].revents) { return true; }
+
+        ssize_t n = read(sc->inotify, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            return false;
+        }
+        for (char *p = buf; p < buf + n;) {
+            struct inotify_event *ev = (struct inotify_event*)p;
+            if (ev->mask & IN_Q_OVERFLOW) { return false; }
+            handle_event(sc, ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+#endif
+
+static void worker(void *arg) {
+    Scanner *sc = arg;
+    while (!is_stopped(sc)) {
+#ifdef __linux__
+        reset_watches(sc);
+#endif
+        scan(sc);
+#ifdef __linux__
+        if (sc->inotify >= 0) {
+            if (watch_events(sc)) break;
+            continue;
+        }
+#endif
+        for (double t = 0; t < sc->rate && !is_stopped(sc); t += SLEEP_STEP) {
+            thread_sleep(SLEEP_STEP);
+        }
+    }
+}
+
+Scanner* scanner_new(const char *root, const char **ignore, int ignore_count, double rate) {
+    Scanner *sc = xrealloc(NULL, sizeof(Scanner));
+    memset(sc, 0, sizeof(Scanner));
+    sc->root = xstrdup(root);
+    sc->ignore = xrealloc(NULL, ignore_count * sizeof(char*));
+    for (int i = 0; i < ignore_count; i++) { sc->ignore[i] = xstrdup(ignore[i]); }
+    sc->ignore_count = ignore_count;
+    sc->rate = rate;
+    mutex_init(&sc->mutex);
+#ifdef __linux__
+    sc->inotify = -1;
+    if (pipe(sc->wake) < 0) {
+        sc->wake[0] = sc->wake[1] = -1;
+    }
+    if (pipe(sc->ready) < 0) {
+        sc->ready[0] = sc->ready[1] = -1;
+    } else {
+        fcntl(sc->ready[0], F_SETFD, FD_CLOEXEC);
+        fcntl(sc->ready[1], F_SETFD, FD_CLOEXEC);
+        fcntl(sc->ready[0], F_SETFL, fcntl(sc->ready[0], F_GETFL) | O_NONBLOCK);
+    }
+    sc->next = scanners;
+    scanners = sc;
+#endif
+    sc->started = thread_create(&sc->thread, worker, sc);
+    if (!sc->started) {
+        // walk once on the calling thread, the list just won't update
+        scan(sc);
+    }
+    return sc;
+}
+
+void scanner_free(Scanner *sc) {
+    mutex_lock(&sc->mutex);
+    sc->stop = true;
+    mutex_unlock(&sc->mutex);
+#ifdef __linux__
+    if (sc->wake[1] >= 0) {
+        ssize_t res = write(sc->wake[1], "", 1);
+        (void)res;
+    }
+#endif
+    if (sc->started) { thread_join(sc->thread); }
+#ifdef __linux__
+    Scanner **link = &scanners;
+    while (*link != sc) { link = &(*link)->next; }
+    *link = sc->next;
+    if (sc->inotify >= 0) { close(sc->inotify); }
+    for (int i = 0; i < sc->watches_capacity; i++) { free(sc->watches[i]); }
+    free(sc->watches);
+    if (sc->wake[0] >= 0) {
+        close(sc->wake[0]);
+        close(sc->wake[1]);
+    }
+    if (sc->ready[0] >= 0) {
+        close(sc->ready[0]);
+        close(sc->ready[1]);
+    }
+#endif
+    mutex_destroy(&sc->mutex);
+    free_entries(&sc->entries);
+    free_changes(sc->changes.items, sc->changes.count);
+    for (int i = 0; i < sc->ignore_count; i++) { free(sc->ignore[i]); }
+    free(sc->ignore);
+    free(sc->root);
+    free(sc);
+}
+
+bool scanner_poll(Scanner *sc, int max_changes, ScanUpdate *out) {
+    memset(out, 0, sizeof(ScanUpdate));
+    mutex_lock(&sc->mutex);
+    bool changed = sc->reset || sc->changes.count > 0;
+    if (sc->reset || sc->changes.count > max_changes) {
+        out->snapshot = xrealloc(NULL, sc->entries.count * sizeof(ScanEntry));
+        out->snapshot_count = sc->entries.count;
+        for (int i = 0; i < sc->entries.count; i++) {
+            out->snapshot[i] = sc->entries.items[i];
+            out->snapshot[i].filename = xstrdup(sc->entries.items[i].filename);
+        }
+        free_changes(sc->changes.items, sc->changes.count);
+    } else {
+        out->changes = sc->changes.items;
+        out->count = sc->changes.count;
+    }
+    memset(&sc->changes, 0, sizeof(Changes));
+    sc->reset = false;
+#ifdef __linux__
+    if (sc->signaled) {
+        char buf[16];
+        while (read(sc->ready[0], buf, sizeof(buf)) > 0) {}
+        sc->signaled = false;
+    }
+    sc->watched = false;
+#endif
+    mutex_unlock(&sc->mutex);
+    return changed;
+}
+
+bool scanner_is_native(Scanner *sc) {
+#ifdef __linux__
+    return sc->ready[0] >= 0;
+#else
+    (void)sc;
+    return false;
+#endif
+}
+
+bool scanner_ready(Scanner *sc) {
+    mutex_lock(&sc->mutex);
+    bool ready = sc->reset || sc->changes.count > 0;
+    mutex_unlock(&sc->mutex);
+#ifdef __linux__
+    sc->watched = !ready;
+#endif
+    return ready;
+}
+
+#ifdef __linux__
+int scanner_get_watched(int *fds, int max) {
+    int count = 0;
+    for (Scanner *sc = scanners; sc && count < max; sc = sc->next) {
+        if (sc->watched) { fds[count++] = sc->ready[0]; }
+    }
+    return count;
+}
+#endif
+
+void scan_update_free(ScanUpdate *update) {
+    for (int i = 0; i < update->snapshot_count; i++) { free(update->snapshot[i].filename); }
+    free(update->snapshot);
+    free_changes(update->changes, update->count);
+}
@@ -0,0 +1,74 @@
+// Project file scanner. Walks the project directory on a worker thread
+// and keeps the list of its files in the order lite shows them: every
+// directory is followed by its contents, directories go before files
+// and names are sorted. On Linux the list is kept up to date with
+// inotify after the first walk, elsewhere the directory is walked again
+// every `rate` seconds. On Linux the scanners waited on by
+// scanner_ready() are reported by scanner_get_watched(), so the main
+// loop can sleep until the list changes.
+
+#ifndef SCANNER_H
+#define SCANNER_H
+
+#include <stdbool.h>
+
+typedef struct Scanner Scanner;
+
+typedef struct
+{
+    char *filename;
+    bool dir;
+    double modified;
+    double size;
+} ScanEntry;
+
+typedef enum
+{
+    SCAN_INSERT,
+    SCAN_REMOVE,
+    SCAN_UPDATE,
+} ScanOp;
+
+// Changes apply in order, `index` is 0-based and counts the earlier
+// changes in.
+typedef struct
+{
+    ScanOp op;
+    int index;
+    // number of entries removed
+    int count;
+    // inserted or updated entry
+    ScanEntry entry;
+} ScanChange;
+
+typedef struct
+{
+    // set when the whole list has to be replaced
+    ScanEntry *snapshot;
+    int snapshot_count;
+    ScanChange *changes;
+    int count;
+} ScanUpdate;
+
+// Entries whose name matches one of the `ignore` Lua patterns are left
+// out, along with their contents.
+Scanner* scanner_new(const char *root, const char **ignore, int ignore_count, double rate);
+void scanner_free(Scanner *sc);
+
+// Takes what changed since the last poll, returns false if nothing did.
+// More than `max_changes` changes come as a snapshot instead.
+bool scanner_poll(Scanner *sc, int max_changes, ScanUpdate *out);
+void scan_update_free(ScanUpdate *update);
+// False when the main loop can't wait for the scanner, its changes are
+// only seen by polling.
+bool scanner_is_native(Scanner *sc);
+// True when there are changes to poll. Until then the scanner is watched.
+bool scanner_ready(Scanner *sc);
+
+#ifdef __linux__
+// Fills `fds` with the descriptors of the watched scanners, readable
+// once they have changes, returns how many there are.
+int scanner_get_watched(int *fds, int max);
+#endif
+
+#endif
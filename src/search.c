@@ -0,0 +1,327 @@
+#include "search.h"
+#include "thread.h"
+#include "regex.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_WORKERS 16
+
+// Files are read this many bytes at a time, a cancelled job stops
+// between two reads.
+#define READ_CHUNK (1024 * 1024)
+
+// Lines are searched whole, a longer one grows the buffer of its worker
+// up to this size for the file. Files with longer lines are skipped.
+#define MAX_LINE_LENGTH (16 * 1024 * 1024)
+
+// A file with a '\0' in its first bytes is taken as binary, like git
+// and grep do.
+#define BINARY_CHECK_SIZE 8000
+
+typedef struct
+{
+    SearchMatch *items;
+    int count;
+    int capacity;
+} Matches;
+
+// The lines of the file being searched, each worker reuses its own.
+typedef struct
+{
+    char *data;
+    size_t capacity;
+} FileText;
+
+struct SearchJob
+{
+    char **files;
+    int files_count;
+    char *query;
+    size_t query_len;
+    bool no_case;
+    bool regex;
+    Thread threads[MAX_WORKERS];
+    int thread_count;
+
+    // protected by the mutex
+    Mutex mutex;
+    int next_file;
+    int files_done;
+    int workers_done;
+    bool cancelled;
+    Matches matches;
+    int matches_head;
+};
+
+static char* xstrndup(const char *text, size_t len) {
+    char *res = xrealloc(NULL, len + 1);
+    memcpy(res, text, len);
+    res[len] = '\0';
+    return res;
+}
+
+static void push_match(Matches *m, SearchMatch match) {
+    if (m->count == m->capacity) {
+        m->capacity = m->capacity ? m->capacity * 2 : 64;
+        m->items = xrealloc(m->items, m->capacity * sizeof(SearchMatch));
+    }
+    m->items[m->count++] = match;
+}
+
+static void free_matches(Matches *m, int from) {
+    for (int i = from; i < m->count; i++) { free(m->items[i].text); }
+    free(m->items);
+    m->items = NULL;
+    m->count = m->capacity = 0;
+}
+
+static bool is_cancelled(SearchJob *job) {
+    mutex_lock(&job->mutex);
+    bool cancelled = job->cancelled;
+    mutex_unlock(&job->mutex);
+    return cancelled;
+}
+
+static inline char lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static bool equal_no_case(const char *a, const char *b, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (lower(a[i]) != b[i]) { return false; }
+    }
+    return true;
+}
+
+// Finds the query between `s` and `end`. Case insensitive queries are
+// lowercased and their first byte looked for in both cases.
+static const char* find(SearchJob *job, const char *s, const char *end) {
+    const char *q = job->query;
+    size_t len = job->query_len;
+    char first = q[0];
+    char upper = (job->no_case && first >= 'a' && first <= 'z') ? first - ('a' - 'A') : first;
+    if ((size_t)(end - s) < len) { return NULL; }
+    const char *last = end - len + 1;
+    // keep the next position of each case, so no byte is scanned twice,
+    // `last` stands for no position left
+    const char *a = NULL;
+    const char *b = (upper == first) ? last : NULL;
+
+    while (s < last) {
+        if (!a || a < s) {
+            a = memchr(s, first, last - s);
+            if (!a) { a = last; }
+        }
+        if (!b || b < s) {
+            b = memchr(s, upper, last - s);
+            if (!b) { b = last; }
+        }
+        const char *p = a < b ? a : b;
+        if (p == last) { return NULL; }
+        if (job->no_case ? equal_no_case(p + 1, q + 1, len - 1) : memcmp(p + 1, q + 1, len - 1) == 0) {
+            return p;
+        }
+        s = p + 1;
+    }
+    return NULL;
+}
+
+// Finds the first match at or after `p`. A regex is searched for by
+// `re`, each worker has its own as it caches its DFA states.
+static const char* find_match(SearchJob *job, Regex *re, const char *data, const char *p,
+                              const char *end) {
+    if (!re) { return find(job, p, end); }
+    ptrdiff_t caps[(REGEX_MAX_GROUPS + 1) * 2];
+    if (!regex_find(re, data, end - data, p - data, caps)) { return NULL; }
+    return data + caps[0];
+}
+
+// Searches `len` bytes of whole lines, the first of them being line
+// `*line`, which is moved past them.
+static void search_lines(SearchJob *job, Regex *re, int file, const char *data, size_t len,
+                         int *line, Matches *out) {
+    const char *end = data + len;
+    const char *line_start = data;
+    const char *p = data;
+    while ((p = find_match(job, re, data, p, end))) {
+        // count the lines up to the match
+        const char *nl;
+        while ((nl = memchr(line_start, '\n', p - line_start))) {
+            line_start = nl + 1;
+            (*line)++;
+        }
+        const char *line_end = memchr(p, '\n', end - p);
+        if (!line_end) { line_end = end; }
+        SearchMatch match = {
+            .file = file,
+            .line = *line,
+            .col = (int)(p - line_start) + 1,
+            .text = xstrndup(line_start, line_end - line_start),
+            .len = line_end - line_start,
+        };
+        push_match(out, match);
+        if (line_end == end || line_end + 1 == end) {
+            line_start = end;
+            (*line)++;
+            return;
+        }
+        // only the first match of a line is reported
+        p = line_start = line_end + 1;
+        (*line)++;
+    }
+    const char *nl;
+    while ((nl = memchr(line_start, '\n', end - line_start))) {
+        line_start = nl + 1;
+        (*line)++;
+    }
+}
+
+// Reads the file READ_CHUNK bytes at a time and searches the lines
+// read whole, the partial line at the end is kept for the next read.
+// The file is copied rather than mapped, one truncated meanwhile would
+// fault.
+static void search_file(SearchJob *job, Regex *re, int file, FileText *text, Matches *out) {
+    FILE *fp = fopen(job->files[file], "rb");
+    if (!fp) return;
+    if (text->capacity < READ_CHUNK) {
+        text->capacity = READ_CHUNK;
+        text->data = xrealloc(text->data, text->capacity);
+    }
+    int line = 1;
+    size_t used = 0;
+    bool first = true;
+    for (;;) {
+        size_t n = fread(text->data + used, 1, text->capacity - used, fp);
+        size_t size = used + n;
+        bool eof = used + n < text->capacity;
+        if (first && memchr(text->data, '\0', size < BINARY_CHECK_SIZE ? size : BINARY_CHECK_SIZE)) break;
+        first = false;
+
+        size_t len = size;
+        if (!eof) {
+            while (len > 0 && text->data[len - 1] != '\n') { len--; }
+            if (len == 0) {
+                // a line longer than the buffer
+                if (text->capacity >= MAX_LINE_LENGTH) break;
+                text->capacity *= 2;
+                text->data = xrealloc(text->data, text->capacity);
+                used = size;
+                continue;
+            }
+        }
+        search_lines(job, re, file, text->data, len, &line, out);
+        if (eof || is_cancelled(job)) break;
+        memmove(text->data, text->data + len, size - len);
+        used = size - len;
+    }
+    fclose(fp);
+
+    // the buffer only stays as big as the chunks
+    if (text->capacity > READ_CHUNK) {
+        free(text->data);
+        text->capacity = READ_CHUNK;
+        text->data = xrealloc(NULL, text->capacity);
+    }
+}
+
+static void worker(void *arg) {
+    SearchJob *job = arg;
+    Matches local = { 0 };
+    FileText text = { 0 };
+    const char *error;
+    Regex *re = job->regex
+        ? regex_new(job->query, job->query_len, job->no_case ? REGEX_NO_CASE : 0, &error)
+        : NULL;
+
+    mutex_lock(&job->mutex);
+    while (!job->cancelled && job->next_file < job->files_count) {
+        int file = job->next_file++;
+        mutex_unlock(&job->mutex);
+
+        local.count = 0;
+        search_file(job, re, file, &text, &local);
+
+        mutex_lock(&job->mutex);
+        if (job->cancelled) {
+            for (int i = 0; i < local.count; i++) { free(local.items[i].text); }
+            break;
+        }
+        for (int i = 0; i < local.count; i++) { push_match(&job->matches, local.items[i]); }
+        job->files_done++;
+    }
+    job->workers_done++;
+    mutex_unlock(&job->mutex);
+    free(local.items);
+    free(text.data);
+    if (re) { regex_free(re); }
+}
+
+SearchJob* search_job_new(const char **files, int count, const char *query, size_t len, int flags) {
+    SearchJob *job = xrealloc(NULL, sizeof(SearchJob));
+    memset(job, 0, sizeof(SearchJob));
+    job->files = xrealloc(NULL, count * sizeof(char*));
+    for (int i = 0; i < count; i++) {
+        job->files[i] = xstrndup(files[i], strlen(files[i]));
+    }
+    job->files_count = count;
+    job->no_case = flags & SEARCH_NO_CASE;
+    job->regex = flags & SEARCH_REGEX;
+    job->query = xstrndup(query, len);
+    job->query_len = len;
+    if (job->no_case && !job->regex) {
+        for (size_t i = 0; i < len; i++) { job->query[i] = lower(job->query[i]); }
+    }
+    mutex_init(&job->mutex);
+
+    // an empty query has nothing to look for
+    if (len == 0) { count = 0; }
+    int n = thread_cpu_count();
+    if (n > MAX_WORKERS) { n = MAX_WORKERS; }
+    if (n > count) { n = count; }
+    for (int i = 0; i < n; i++) {
+        if (thread_create(&job->threads[job->thread_count], worker, job)) {
+            job->thread_count++;
+        }
+    }
+    if (job->thread_count == 0) {
+        job->files_done = job->files_count;
+    }
+    return job;
+}
+
+void search_job_cancel(SearchJob *job) {
+    mutex_lock(&job->mutex);
+    job->cancelled = true;
+    mutex_unlock(&job->mutex);
+}
+
+void search_job_free(SearchJob *job) {
+    search_job_cancel(job);
+    // workers stop reading the file they are on at the next chunk
+    for (int i = 0; i < job->thread_count; i++) { thread_join(job->threads[i]); }
+    mutex_destroy(&job->mutex);
+    free_matches(&job->matches, job->matches_head);
+    for (int i = 0; i < job->files_count; i++) { free(job->files[i]); }
+    free(job->files);
+    free(job->query);
+    free(job);
+}
+
+int search_job_poll(SearchJob *job, SearchMatch *out, int max, int *files_done, bool *done) {
+    mutex_lock(&job->mutex);
+    Matches *m = &job->matches;
+    int n = m->count - job->matches_head;
+    if (n > max) { n = max; }
+    memcpy(out, m->items + job->matches_head, n * sizeof(SearchMatch));
+    job->matches_head += n;
+    if (job->matches_head == m->count) {
+        job->matches_head = m->count = 0;
+    }
+    *files_done = job->files_done;
+    *done = m->count == 0 && (job->cancelled || job->workers_done == job->thread_count);
+    mutex_unlock(&job->mutex);
+    return n;
+}
@@ -0,0 +1,41 @@
+// Project-wide text search. A job searches a list of files for a
+// literal string, or a regular expression, on its own worker threads.
+// Each worker reads its files into a buffer of its own a chunk of lines
+// at a time and scans them with memchr or the regex's DFA, binary files
+// are skipped. Matches are posted back per file, in the order the files
+// finish.
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SEARCH_NO_CASE 1
+// the query is a regex, it must compile
+#define SEARCH_REGEX 2
+
+typedef struct SearchJob SearchJob;
+
+// One match per line, `col` is the 1-based byte column of the first
+// match and `text` the line without its "\n", owned by the caller once
+// polled.
+typedef struct
+{
+    int file;
+    int line;
+    int col;
+    char *text;
+    size_t len;
+} SearchMatch;
+
+SearchJob* search_job_new(const char **files, int count, const char *query, size_t len, int flags);
+void search_job_cancel(SearchJob *job);
+void search_job_free(SearchJob *job);
+
+// Takes up to `max` matches, returns how many were taken. `files_done`
+// is set to the number of files searched so far and `done` once every
+// file was searched and every match taken.
+int search_job_poll(SearchJob *job, SearchMatch *out, int max, int *files_done, bool *done);
+
+#endif
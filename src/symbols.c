@@ -0,0 +1,344 @@
+#include "symbols.h"
+#include "fuzzy.h"
+#include "tokenizer.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    char *text;
+    size_t len;
+    uint64_t mask;
+    unsigned hash;
+    // occurrences in the docs, the symbol is removed at 0
+    int refs;
+    // next symbol of the bucket, or of the free list
+    int next;
+} Symbol;
+
+typedef struct
+{
+    int *ids;
+    // -1 until the line is scanned
+    int count;
+} Line;
+
+typedef struct
+{
+    int id;
+    int score;
+} Candidate;
+
+struct SymbolIndex
+{
+    char *pattern;
+    unsigned char first[32];
+    // the owner's reference and one per doc
+    int refs;
+
+    Symbol *symbols;
+    int symbols_count;
+    int symbols_capacity;
+    int free_list;
+    int live;
+
+    // chained hash table of the live symbols
+    int *buckets;
+    int bucket_count;
+
+    Candidate *candidates;
+    int candidates_capacity;
+};
+
+struct SymbolDoc
+{
+    SymbolIndex *index;
+    Line *lines;
+    int count;
+    int capacity;
+    // the lines before it are all scanned
+    int scanned;
+
+    char *scratch;
+    size_t scratch_size;
+    int *ids;
+    int ids_capacity;
+};
+
+static unsigned hash_text(const char *text, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)text[i]) * 16777619;
+    }
+    return h;
+}
+
+SymbolIndex* symbol_index_new(const char *pattern) {
+    SymbolIndex *index = xrealloc(NULL, sizeof(SymbolIndex));
+    memset(index, 0, sizeof(SymbolIndex));
+    size_t len = strlen(pattern);
+    index->pattern = memcpy(xrealloc(NULL, len + 1), pattern, len + 1);
+    tokenizer_get_first_bytes(pattern, index->first);
+    index->refs = 1;
+    index->free_list = -1;
+    index->bucket_count = 256;
+    index->buckets = xrealloc(NULL, index->bucket_count * sizeof(int));
+    memset(index->buckets, 0xff, index->bucket_count * sizeof(int));
+    return index;
+}
+
+void symbol_index_free(SymbolIndex *index) {
+    if (--index->refs > 0) { return; }
+    for (int i = 0; i < index->symbols_count; i++) {
+        free(index->symbols[i].text);
+    }
+    free(index->symbols);
+    free(index->buckets);
+    free(index->candidates);
+    free(index->pattern);
+    free(index);
+}
+
+int symbol_index_get_count(SymbolIndex *index) {
+    return index->live;
+}
+
+static void rehash(SymbolIndex *index) {
+    index->bucket_count *= 2;
+    index->buckets = xrealloc(index->buckets, index->bucket_count * sizeof(int));
+    memset(index->buckets, 0xff, index->bucket_count * sizeof(int));
+    for (int i = 0; i < index->symbols_count; i++) {
+        Symbol *s = &index->symbols[i];
+        if (s->refs == 0) { continue; }
+        int *bucket = &index->buckets[s->hash & (index->bucket_count - 1)];
+        s->next = *bucket;
+        *bucket = i;
+    }
+}
+
+// Adds a reference to the symbol, returns its id.
+static int retain_symbol(SymbolIndex *index, const char *text, size_t len) {
+    unsigned hash = hash_text(text, len);
+    int *bucket = &index->buckets[hash & (index->bucket_count - 1)];
+    for (int id = *bucket; id >= 0; id = index->symbols[id].next) {
+        Symbol *s = &index->symbols[id];
+        if (s->hash == hash && s->len == len && memcmp(s->text, text, len) == 0) {
+            s->refs++;
+            return id;
+        }
+    }
+
+    int id = index->free_list;
+    if (id >= 0) {
+        index->free_list = index->symbols[id].next;
+    } else {
+        if (index->symbols_count == index->symbols_capacity) {
+            index->symbols_capacity = index->symbols_capacity ? index->symbols_capacity * 2 : 256;
+            index->symbols = xrealloc(index->symbols, index->symbols_capacity * sizeof(Symbol));
+        }
+        id = index->symbols_count++;
+    }
+    Symbol *s = &index->symbols[id];
+    s->text = memcpy(xrealloc(NULL, len), text, len);
+    s->len = len;
+    s->mask = fuzzy_mask(text, len);
+    s->hash = hash;
+    s->refs = 1;
+    s->next = *bucket;
+    *bucket = id;
+    if (++index->live > index->bucket_count) { rehash(index); }
+    return id;
+}
+
+static void release_symbol(SymbolIndex *index, int id) {
+    Symbol *s = &index->symbols[id];
+    if (--s->refs > 0) { return; }
+    int *link = &index->buckets[s->hash & (index->bucket_count - 1)];
+    while (*link != id) { link = &index->symbols[*link].next; }
+    *link = s->next;
+    free(s->text);
+    s->text = NULL;
+    s->next = index->free_list;
+    index->free_list = id;
+    index->live--;
+}
+
+static bool better(SymbolIndex *index, const Candidate *a, const Candidate *b) {
+    if (a->score != b->score) { return a->score > b->score; }
+    Symbol *sa = &index->symbols[a->id];
+    Symbol *sb = &index->symbols[b->id];
+    if (sa->len != sb->len) { return sa->len < sb->len; }
+    return memcmp(sa->text, sb->text, sa->len) < 0;
+}
+
+int symbol_index_match(SymbolIndex *index, const char *needle, size_t len, bool prefix,
+                       int k, const char **out, size_t *lens, int *scores) {
+    if (k > index->live) { k = index->live; }
+    if (k <= 0) { return 0; }
+    if (k > index->candidates_capacity) {
+        index->candidates_capacity = k;
+        index->candidates = xrealloc(index->candidates, k * sizeof(Candidate));
+    }
+    uint64_t mask = fuzzy_mask(needle, len) & ~fuzzy_mask(" ", 1);
+
+    // the best `k` so far, best first
+    Candidate *best = index->candidates;
+    int count = 0;
+    for (int id = 0; id < index->symbols_count; id++) {
+        Symbol *s = &index->symbols[id];
+        if (s->refs == 0) { continue; }
+        Candidate c = { id, 0 };
+        if (prefix) {
+            if (s->len < len || memcmp(s->text, needle, len) != 0) { continue; }
+        } else {
+            if (mask & ~s->mask) { continue; }
+            if (!fuzzy_score(s->text, s->len, needle, len, &c.score)) { continue; }
+        }
+        if (count == k && !better(index, &c, &best[k - 1])) { continue; }
+        int lo = 0, hi = count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (better(index, &best[mid], &c)) { lo = mid + 1; } else { hi = mid; }
+        }
+        if (count < k) { count++; }
+        memmove(best + lo + 1, best + lo, (count - lo - 1) * sizeof(Candidate));
+        best[lo] = c;
+    }
+
+    for (int i = 0; i < count; i++) {
+        Symbol *s = &index->symbols[best[i].id];
+        out[i] = s->text;
+        lens[i] = s->len;
+        scores[i] = best[i].score;
+    }
+    return count;
+}
+
+SymbolDoc* symbol_doc_new(SymbolIndex *index) {
+    SymbolDoc *doc = xrealloc(NULL, sizeof(SymbolDoc));
+    memset(doc, 0, sizeof(SymbolDoc));
+    doc->index = index;
+    index->refs++;
+    return doc;
+}
+
+static void release_lines(SymbolDoc *doc, int start, int count) {
+    for (int i = start; i < start + count; i++) {
+        Line *line = &doc->lines[i];
+        // lines not scanned yet have a count of -1
+        for (int j = 0; j < line->count; j++) {
+            release_symbol(doc->index, line->ids[j]);
+        }
+        free(line->ids);
+    }
+}
+
+void symbol_doc_free(SymbolDoc *doc) {
+    release_lines(doc, 0, doc->count);
+    symbol_index_free(doc->index);
+    free(doc->lines);
+    free(doc->scratch);
+    free(doc->ids);
+    free(doc);
+}
+
+static void scan_line(SymbolDoc *doc, Line *line, const char *text, size_t len) {
+    const char *pattern = doc->index->pattern;
+    const unsigned char *first = doc->index->first;
+    const char *error;
+    int count = 0;
+    size_t init = 0, s, e;
+    while (init <= len && tokenizer_match_pattern(pattern, first, text, len, init, &s, &e, &error)) {
+        if (e > s) {
+            if (count == doc->ids_capacity) {
+                doc->ids_capacity = doc->ids_capacity ? doc->ids_capacity * 2 : 64;
+                doc->ids = xrealloc(doc->ids, doc->ids_capacity * sizeof(int));
+            }
+            doc->ids[count++] = retain_symbol(doc->index, text + s, e - s);
+        }
+        init = e > s ? e : s + 1;
+    }
+    line->count = count;
+    line->ids = count ? memcpy(xrealloc(NULL, count * sizeof(int)), doc->ids, count * sizeof(int)) : NULL;
+}
+
+// Scans `count` lines starting at the 0-based `start`, reading them from
+// `buf` in one go.
+static void scan_lines(SymbolDoc *doc, Buffer *buf, int start, int count) {
+    if (count == 0) { return; }
+    size_t offset = buffer_get_line_offset(buf, start + 1);
+    int last = start + count;
+    size_t len = buffer_get_line_offset(buf, last) + buffer_get_line_length(buf, last) - offset;
+    if (len + 1 > doc->scratch_size) {
+        doc->scratch_size = (len + 1) * 2;
+        doc->scratch = xrealloc(doc->scratch, doc->scratch_size);
+    }
+    buffer_read(buf, offset, len, doc->scratch);
+    doc->scratch[len] = '\0';
+
+    char *text = doc->scratch;
+    char *end = text + len;
+    for (int i = start; i < start + count; i++) {
+        char *nl = memchr(text, '\n', end - text);
+        char *line_end = nl ? nl : end;
+        *line_end = '\0';
+        scan_line(doc, &doc->lines[i], text, line_end - text);
+        text = nl ? nl + 1 : end;
+    }
+}
+
+// Replaces `removed` lines at `start` with `added` lines not scanned yet.
+static void splice(SymbolDoc *doc, int start, int removed, int added) {
+    release_lines(doc, start, removed);
+    int count = doc->count - removed + added;
+    if (count > doc->capacity) {
+        doc->capacity = count * 2;
+        doc->lines = xrealloc(doc->lines, doc->capacity * sizeof(Line));
+    }
+    memmove(doc->lines + start + added, doc->lines + start + removed,
+            (doc->count - start - removed) * sizeof(Line));
+    for (int i = start; i < start + added; i++) {
+        doc->lines[i] = (Line) { NULL, -1 };
+    }
+    doc->count = count;
+    if (start < doc->scanned) { doc->scanned = start; }
+}
+
+void symbol_doc_update(SymbolDoc *doc, Buffer *buf, int line, int removed, int added) {
+    int start = line - 1;
+    if (start < 0) { start = 0; }
+    if (start > doc->count) { start = doc->count; }
+    if (removed > doc->count - start) { removed = doc->count - start; }
+    int buf_count = (int)buffer_get_line_count(buf);
+    if (added > buf_count - start) { added = buf_count - start; }
+    if (removed < 0) { removed = 0; }
+    if (added < 0) { added = 0; }
+
+    splice(doc, start, removed, added);
+    scan_lines(doc, buf, start, added);
+}
+
+void symbol_doc_reset(SymbolDoc *doc, Buffer *buf) {
+    splice(doc, 0, doc->count, (int)buffer_get_line_count(buf));
+}
+
+bool symbol_doc_scan(SymbolDoc *doc, Buffer *buf, int max_lines) {
+    while (max_lines > 0) {
+        while (doc->scanned < doc->count && doc->lines[doc->scanned].count >= 0) {
+            doc->scanned++;
+        }
+        int start = doc->scanned;
+        int end = start;
+        while (end < doc->count && end - start < max_lines && doc->lines[end].count < 0) {
+            end++;
+        }
+        if (end == start) { return true; }
+        scan_lines(doc, buf, start, end - start);
+        max_lines -= end - start;
+    }
+    return doc->scanned == doc->count;
+}
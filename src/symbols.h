@@ -0,0 +1,45 @@
+// Symbol index for autocompletion. A SymbolIndex is the set of symbols
+// found in a group of documents, each one counting how many times it
+// occurs in them. A SymbolDoc keeps the symbols of every line of one
+// document, so an edit only rescans the lines it replaced and moves the
+// counts of what they held. Queries go through every symbol, skipping
+// the ones missing a needle character by their fuzzy_mask(). Symbols
+// are what a Lua pattern matches, as string.gmatch finds them.
+
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include "buffer.h"
+
+typedef struct SymbolIndex SymbolIndex;
+typedef struct SymbolDoc SymbolDoc;
+
+SymbolIndex* symbol_index_new(const char *pattern);
+// The index is freed once its docs are freed too.
+void symbol_index_free(SymbolIndex *index);
+// Number of different symbols in the docs.
+int symbol_index_get_count(SymbolIndex *index);
+
+// Fills `out` and `scores` with the best `k` symbols for the needle,
+// best first, and returns how many there are. Fuzzy matches are scored
+// like fuzzy_score(). Prefix matches all score 0 and are sorted by
+// length. Equal scores go to the shorter symbol, then to the first one
+// in byte order. The strings are valid until the next update.
+int symbol_index_match(SymbolIndex *index, const char *needle, size_t len, bool prefix,
+                       int k, const char **out, size_t *lens, int *scores);
+
+SymbolDoc* symbol_doc_new(SymbolIndex *index);
+// Removes the doc's symbols from its index.
+void symbol_doc_free(SymbolDoc *doc);
+// Lines `line` to `line + removed - 1` were replaced by `added` lines of
+// `buf` starting at `line`. Lines are 1-based, like the Buffer's.
+void symbol_doc_update(SymbolDoc *doc, Buffer *buf, int line, int removed, int added);
+// Drops the doc's symbols and takes the lines of `buf` as not scanned
+// yet, symbol_doc_scan() then goes through them a few at a time. The
+// lines added by updates are scanned right away.
+void symbol_doc_reset(SymbolDoc *doc, Buffer *buf);
+// Scans up to `max_lines` of the lines not scanned yet, returns true
+// once every line is.
+bool symbol_doc_scan(SymbolDoc *doc, Buffer *buf, int max_lines);
+
+#endif
@@ -0,0 +1,112 @@
+#include "thread.h"
+
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <time.h>
+#endif
+
+typedef struct
+{
+    void (*fn)(void *arg);
+    void *arg;
+} Start;
+
+#ifdef _WIN32
+
+static DWORD WINAPI thread_start(LPVOID ptr) {
+    Start start = *(Start*)ptr;
+    free(ptr);
+    start.fn(start.arg);
+    return 0;
+}
+
+bool thread_create(Thread *thread, void (*fn)(void *arg), void *arg) {
+    Start *start = malloc(sizeof(Start));
+    if (!start) { return false; }
+    start->fn = fn;
+    start->arg = arg;
+    *thread = CreateThread(NULL, 0, thread_start, start, 0, NULL);
+    if (!*thread) {
+        free(start);
+        return false;
+    }
+    return true;
+}
+
+void thread_join(Thread thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+int thread_cpu_count(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+void thread_sleep(double seconds) {
+    Sleep((DWORD)(seconds * 1000));
+}
+
+void mutex_init(Mutex *mutex) { InitializeCriticalSection(mutex); }
+void mutex_destroy(Mutex *mutex) { DeleteCriticalSection(mutex); }
+void mutex_lock(Mutex *mutex) { EnterCriticalSection(mutex); }
+void mutex_unlock(Mutex *mutex) { LeaveCriticalSection(mutex); }
+
+void cond_init(Cond *cond) { InitializeConditionVariable(cond); }
+void cond_destroy(Cond *cond) { (void)cond; }
+void cond_wait(Cond *cond, Mutex *mutex) { SleepConditionVariableCS(cond, mutex, INFINITE); }
+void cond_signal(Cond *cond) { WakeConditionVariable(cond); }
+void cond_broadcast(Cond *cond) { WakeAllConditionVariable(cond); }
+
+#else
+
+static void* thread_start(void *ptr) {
+    Start start = *(Start*)ptr;
+    free(ptr);
+    start.fn(start.arg);
+    return NULL;
+}
+
+bool thread_create(Thread *thread, void (*fn)(void *arg), void *arg) {
+    Start *start = malloc(sizeof(Start));
+    if (!start) { return false; }
+    start->fn = fn;
+    start->arg = arg;
+    if (pthread_create(thread, NULL, thread_start, start) != 0) {
+        free(start);
+        return false;
+    }
+    return true;
+}
+
+void thread_join(Thread thread) {
+    pthread_join(thread, NULL);
+}
+
+int thread_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+void thread_sleep(double seconds) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+void mutex_init(Mutex *mutex) { pthread_mutex_init(mutex, NULL); }
+void mutex_destroy(Mutex *mutex) { pthread_mutex_destroy(mutex); }
+void mutex_lock(Mutex *mutex) { pthread_mutex_lock(mutex); }
+void mutex_unlock(Mutex *mutex) { pthread_mutex_unlock(mutex); }
+
+void cond_init(Cond *cond) { pthread_cond_init(cond, NULL); }
+void cond_destroy(Cond *cond) { pthread_cond_destroy(cond); }
+void cond_wait(Cond *cond, Mutex *mutex) { pthread_cond_wait(cond, mutex); }
+void cond_signal(Cond *cond) { pthread_cond_signal(cond); }
+void cond_broadcast(Cond *cond) { pthread_cond_broadcast(cond); }
+
+#endif
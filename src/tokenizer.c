@@ -0,0 +1,690 @@
+#include "tokenizer.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <setjmp.h>
+
+#define MAX_CAPTURES 32
+#define MAX_CALLS 200
+#define CAP_UNFINISHED (-1)
+#define CAP_POSITION (-2)
+#define L_ESC '%'
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+typedef struct
+{
+    char *open;
+    const char *open_end;
+    char *close;
+    const char *close_end;
+    char escape;
+    int type;
+    // bytes an unanchored search for the end pattern can start at
+    unsigned char close_first[32];
+    bool close_nullable;
+} Pattern;
+
+typedef struct
+{
+    char *text;
+    size_t len;
+    int type;
+} Symbol;
+
+struct Tokenizer
+{
+    Pattern *patterns;
+    int count;
+
+    // Patterns that can match at a position starting with a given
+    // byte, in the order they were declared; `first[c]` up to
+    // `first[c + 1]` indexes `candidates`.
+    int first[257];
+    int *candidates;
+
+    Symbol *symbols;
+    int symbols_count;
+    int symbols_capacity;
+    int refs;
+};
+
+static char* copy_pattern(const char *p, size_t len, const char **end) {
+    char *res = xrealloc(NULL, len + 1);
+    memcpy(res, p, len);
+    res[len] = '\0';
+    *end = res + len;
+    return res;
+}
+
+// Pattern matching, adapted from lstrlib.c of Lua 5.2. Errors jump
+// back to tokenizer_tokenize instead of going through lua_error.
+
+typedef struct
+{
+    int matchdepth;
+    const char *src_init;
+    const char *src_end;
+    const char *p_end;
+    int level;
+    struct {
+        const char *init;
+        ptrdiff_t len;
+    } capture[MAX_CAPTURES];
+    jmp_buf *jmp;
+    const char **error;
+} MatchState;
+
+static const char* match(MatchState *ms, const char *s, const char *p);
+
+static void match_error(MatchState *ms, const char *msg) {
+    *ms->error = msg;
+    longjmp(*ms->jmp, 1);
+}
+
+static int check_capture(MatchState *ms, int l) {
+    l -= '1';
+    if (l < 0 || l >= ms->level || ms->capture[l].len == CAP_UNFINISHED) {
+        match_error(ms, "invalid capture index");
+    }
+    return l;
+}
+
+static int capture_to_close(MatchState *ms) {
+    int level = ms->level;
+    for (level--; level >= 0; level--) {
+        if (ms->capture[level].len == CAP_UNFINISHED) { return level; }
+    }
+    match_error(ms, "invalid pattern capture");
+    return 0;
+}
+
+static const char* classend(MatchState *ms, const char *p) {
+    switch (*p++) {
+    case L_ESC:
+        if (p == ms->p_end) { match_error(ms, "malformed pattern (ends with '%')"); }
+        return p + 1;
+    case '[':
+        if (*p == '^') { p++; }
+        do {
+            if (p == ms->p_end) { match_error(ms, "malformed pattern (missing ']')"); }
+            if (*(p++) == L_ESC && p < ms->p_end) { p++; }
+        } while (*p != ']');
+        return p + 1;
+    default:
+        return p;
+    }
+}
+
+static int match_class(int c, int cl) {
+    int res;
+    switch (tolower(cl)) {
+    case 'a': res = isalpha(c); break;
+    case 'c': res = iscntrl(c); break;
+    case 'd': res = isdigit(c); break;
+    case 'g': res = isgraph(c); break;
+    case 'l': res = islower(c); break;
+    case 'p': res = ispunct(c); break;
+    case 's': res = isspace(c); break;
+    case 'u': res = isupper(c); break;
+    case 'w': res = isalnum(c); break;
+    case 'x': res = isxdigit(c); break;
+    case 'z': res = (c == 0); break;
+    default: return (cl == c);
+    }
+    return (islower(cl) ? res : !res);
+}
+
+static int matchbracketclass(int c, const char *p, const char *ec) {
+    int sig = 1;
+    if (*(p + 1) == '^') {
+        sig = 0;
+        p++;
+    }
+    while (++p < ec) {
+        if (*p == L_ESC) {
+            p++;
+            if (match_class(c, (unsigned char)*p)) { return sig; }
+        } else if (*(p + 1) == '-' && p + 2 < ec) {
+            p += 2;
+            if ((unsigned char)*(p - 2) <= c && c <= (unsigned char)*p) { return sig; }
+        } else if ((unsigned char)*p == c) {
+            return sig;
+        }
+    }
+    return !sig;
+}
+
+static int singlebyte(int c, const char *p, const char *ep) {
+    switch (*p) {
+    case '.': return 1;
+    case L_ESC: return match_class(c, (unsigned char)*(p + 1));
+    case '[': return matchbracketclass(c, p, ep - 1);
+    default: return ((unsigned char)*p == c);
+    }
+}
+
+static int singlematch(MatchState *ms, const char *s, const char *p, const char *ep) {
+    if (s >= ms->src_end) { return 0; }
+    return singlebyte((unsigned char)*s, p, ep);
+}
+
+static const char* matchbalance(MatchState *ms, const char *s, const char *p) {
+    if (p >= ms->p_end - 1) {
+        match_error(ms, "malformed pattern (missing arguments to '%b')");
+    }
+    if (*s != *p) { return NULL; }
+    int b = *p;
+    int e = *(p + 1);
+    int cont = 1;
+    while (++s < ms->src_end) {
+        if (*s == e) {
+            if (--cont == 0) { return s + 1; }
+        } else if (*s == b) {
+            cont++;
+        }
+    }
+    return NULL;
+}
+
+static const char* max_expand(MatchState *ms, const char *s, const char *p, const char *ep) {
+    ptrdiff_t i = 0;
+    while (singlematch(ms, s + i, p, ep)) { i++; }
+    while (i >= 0) {
+        const char *res = match(ms, s + i, ep + 1);
+        if (res) { return res; }
+        i--;
+    }
+    return NULL;
+}
+
+static const char* min_expand(MatchState *ms, const char *s, const char *p, const char *ep) {
+    for (;;) {
+        const char *res = match(ms, s, ep + 1);
+        if (res != NULL) {
+            return res;
+        } else if (singlematch(ms, s, p, ep)) {
+            s++;
+        } else {
+            return NULL;
+        }
+    }
+}
+
+static const char* start_capture(MatchState *ms, const char *s, const char *p, int what) {
+    const char *res;
+    int level = ms->level;
+    if (level >= MAX_CAPTURES) { match_error(ms, "too many captures"); }
+    ms->capture[level].init = s;
+    ms->capture[level].len = what;
+    ms->level = level + 1;
+    if ((res = match(ms, s, p)) == NULL) { ms->level--; }
+    return res;
+}
+
+static const char* end_capture(MatchState *ms, const char *s, const char *p) {
+    int l = capture_to_close(ms);
+    const char *res;
+    ms->capture[l].len = s - ms->capture[l].init;
+    if ((res = match(ms, s, p)) == NULL) { ms->capture[l].len = CAP_UNFINISHED; }
+    return res;
+}
+
+static const char* match_capture(MatchState *ms, const char *s, int l) {
+    size_t len;
+    l = check_capture(ms, l);
+    len = ms->capture[l].len;
+    if ((size_t)(ms->src_end - s) >= len && memcmp(ms->capture[l].init, s, len) == 0) {
+        return s + len;
+    }
+    return NULL;
+}
+
+static const char* match(MatchState *ms, const char *s, const char *p) {
+    if (ms->matchdepth-- == 0) { match_error(ms, "pattern too complex"); }
+init:
+    if (p != ms->p_end) {
+        switch (*p) {
+        case '(':
+            if (*(p + 1) == ')') {
+                s = start_capture(ms, s, p + 2, CAP_POSITION);
+            } else {
+                s = start_capture(ms, s, p + 1, CAP_UNFINISHED);
+            }
+            break;
+        case ')':
+            s = end_capture(ms, s, p + 1);
+            break;
+        case '$':
+            if (p + 1 != ms->p_end) { goto dflt; }
+            s = (s == ms->src_end) ? s : NULL;
+            break;
+        case L_ESC:
+            switch (*(p + 1)) {
+            case 'b':
+                s = matchbalance(ms, s, p + 2);
+                if (s != NULL) {
+                    p += 4;
+                    goto init;
+                }
+                break;
+            case 'f': {
+                const char *ep;
+                char previous;
+                p += 2;
+                if (*p != '[') { match_error(ms, "missing '[' after '%f' in pattern"); }
+                ep = classend(ms, p);
+                previous = (s == ms->src_init) ? '\0' : *(s - 1);
+                if (!matchbracketclass((unsigned char)previous, p, ep - 1) &&
+                    matchbracketclass((unsigned char)*s, p, ep - 1)) {
+                    p = ep;
+                    goto init;
+                }
+                s = NULL;
+                break;
+            }
+            case '0': case '1': case '2': case '3': case '4':
+            case '5': case '6': case '7': case '8': case '9':
+                s = match_capture(ms, s, (unsigned char)*(p + 1));
+                if (s != NULL) {
+                    p += 2;
+                    goto init;
+                }
+                break;
+            default:
+                goto dflt;
+            }
+            break;
+        default: dflt: {
+            const char *ep = classend(ms, p);
+            if (!singlematch(ms, s, p, ep)) {
+                if (*ep == '*' || *ep == '?' || *ep == '-') {
+                    p = ep + 1;
+                    goto init;
+                }
+                s = NULL;
+            } else {
+                switch (*ep) {
+                case '?': {
+                    const char *res;
+                    if ((res = match(ms, s + 1, ep + 1)) != NULL) {
+                        s = res;
+                    } else {
+                        p = ep + 1;
+                        goto init;
+                    }
+                    break;
+                }
+                case '+':
+                    s++;
+                    // fallthrough
+                case '*':
+                    s = max_expand(ms, s, p, ep);
+                    break;
+                case '-':
+                    s = min_expand(ms, s, p, ep);
+                    break;
+                default:
+                    s++;
+                    p = ep;
+                    goto init;
+                }
+            }
+            break;
+        }
+        }
+    }
+    ms->matchdepth++;
+    return s;
+}
+
+// Finds the bytes a match of `p` can start with. Anything that can
+// match the empty string, or that is too hard to tell (frontiers,
+// back references, malformed patterns), can start anywhere.
+static bool first_bytes(const char *p, const char *p_end, unsigned char *set) {
+    while (p != p_end) {
+        switch (*p) {
+        case '(':
+            p += (*(p + 1) == ')') ? 2 : 1;
+            continue;
+        case ')':
+            p++;
+            continue;
+        case '$':
+            if (p + 1 == p_end) { return true; }
+            break;
+        case L_ESC:
+            if (p + 1 == p_end) { return true; }
+            if (*(p + 1) == 'b') {
+                if (p + 3 >= p_end) { return true; }
+                unsigned char c = *(p + 2);
+                set[c >> 3] |= 1 << (c & 7);
+                return false;
+            }
+            if (*(p + 1) == 'f' || isdigit((unsigned char)*(p + 1))) { return true; }
+            break;
+        }
+
+        // single char class, same bounds checks as classend
+        const char *ep = p + 1;
+        if (*p == L_ESC) {
+            ep++;
+        } else if (*p == '[') {
+            if (*ep == '^') { ep++; }
+            do {
+                if (ep == p_end) { return true; }
+                if (*(ep++) == L_ESC && ep < p_end) { ep++; }
+            } while (*ep != ']');
+            ep++;
+        }
+        for (int c = 0; c < 256; c++) {
+            if (singlebyte(c, p, ep)) { set[c >> 3] |= 1 << (c & 7); }
+        }
+        if (*ep != '*' && *ep != '?' && *ep != '-') { return false; }
+        p = ep + 1;
+    }
+    return true;
+}
+
+static bool has_byte(const unsigned char *set, unsigned char c) {
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+Tokenizer* tokenizer_new(const TokenizerPattern *patterns, int count) {
+    Tokenizer *tk = xrealloc(NULL, sizeof(Tokenizer));
+    memset(tk, 0, sizeof(Tokenizer));
+    tk->patterns = xrealloc(NULL, count * sizeof(Pattern));
+    tk->count = count;
+    tk->refs = 1;
+
+    unsigned char (*sets)[32] = xrealloc(NULL, count * 32);
+    memset(sets, 0, count * 32);
+    for (int i = 0; i < count; i++) {
+        const TokenizerPattern *src = &patterns[i];
+        Pattern *p = &tk->patterns[i];
+        p->open = copy_pattern(src->open, src->open_len, &p->open_end);
+        if (first_bytes(p->open, p->open_end, sets[i])) {
+            memset(sets[i], 0xff, 32);
+        }
+        p->close = NULL;
+        if (src->close) {
+            p->close = copy_pattern(src->close, src->close_len, &p->close_end);
+            memset(p->close_first, 0, 32);
+            const char *c = p->close;
+            // an anchored end pattern is only tried at the start
+            if (*c == '^') { c++; }
+            p->close_nullable = first_bytes(c, p->close_end, p->close_first);
+            if (p->close_nullable) { memset(p->close_first, 0xff, 32); }
+        }
+        p->escape = src->escape;
+        p->type = src->type;
+    }
+
+    int n = 0;
+    for (int c = 0; c < 256; c++) {
+        for (int i = 0; i < count; i++) { n += has_byte(sets[i], c); }
+    }
+    tk->candidates = xrealloc(NULL, n * sizeof(int));
+    n = 0;
+    for (int c = 0; c < 256; c++) {
+        tk->first[c] = n;
+        for (int i = 0; i < count; i++) {
+            if (has_byte(sets[i], c)) { tk->candidates[n++] = i; }
+        }
+    }
+    tk->first[256] = n;
+    free(sets);
+    return tk;
+}
+
+Tokenizer* tokenizer_retain(Tokenizer *tk) {
+    __atomic_add_fetch(&tk->refs, 1, __ATOMIC_RELAXED);
+    return tk;
+}
+
+void tokenizer_free(Tokenizer *tk) {
+    if (__atomic_sub_fetch(&tk->refs, 1, __ATOMIC_ACQ_REL) > 0) { return; }
+    for (int i = 0; i < tk->count; i++) {
+        free(tk->patterns[i].open);
+        free(tk->patterns[i].close);
+    }
+    for (int i = 0; i < tk->symbols_capacity; i++) {
+        free(tk->symbols[i].text);
+    }
+    free(tk->patterns);
+    free(tk->candidates);
+    free(tk->symbols);
+    free(tk);
+}
+
+static unsigned hash_text(const char *text, size_t len) {
+    unsigned h = 2166136261u;
+    while (len--) { h = (h ^ (unsigned char)*text++) * 16777619; }
+    return h;
+}
+
+static Symbol* find_symbol(Symbol *symbols, int capacity, const char *text, size_t len) {
+    unsigned mask = capacity - 1;
+    unsigned i = hash_text(text, len) & mask;
+    while (symbols[i].text) {
+        if (symbols[i].len == len && memcmp(symbols[i].text, text, len) == 0) { break; }
+        i = (i + 1) & mask;
+    }
+    return &symbols[i];
+}
+
+void tokenizer_add_symbol(Tokenizer *tk, const char *text, size_t len, int type) {
+    if ((tk->symbols_count + 1) * 2 > tk->symbols_capacity) {
+        int capacity = tk->symbols_capacity ? tk->symbols_capacity * 2 : 64;
+        Symbol *symbols = xrealloc(NULL, capacity * sizeof(Symbol));
+        memset(symbols, 0, capacity * sizeof(Symbol));
+        for (int i = 0; i < tk->symbols_capacity; i++) {
+            Symbol *s = &tk->symbols[i];
+            if (s->text) { *find_symbol(symbols, capacity, s->text, s->len) = *s; }
+        }
+        free(tk->symbols);
+        tk->symbols = symbols;
+        tk->symbols_capacity = capacity;
+    }
+    Symbol *s = find_symbol(tk->symbols, tk->symbols_capacity, text, len);
+    if (!s->text) {
+        s->text = xrealloc(NULL, len);
+        memcpy(s->text, text, len);
+        s->len = len;
+        tk->symbols_count++;
+    }
+    s->type = type;
+}
+
+static int symbol_type(Tokenizer *tk, const char *text, size_t len, int type) {
+    if (tk->symbols_count == 0) { return type; }
+    Symbol *s = find_symbol(tk->symbols, tk->symbols_capacity, text, len);
+    return s->text ? s->type : type;
+}
+
+static bool is_blank(const char *text, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!isspace((unsigned char)text[i])) { return false; }
+    }
+    return true;
+}
+
+// Same merging rule as lite's push_token: a token of the same type as
+// the previous one, or following one that is only whitespace, extends
+// it. Tokens always cover consecutive ranges of the line, so merging
+// is only a matter of growing the length.
+static void push_token(TokenList *out, const char *text, int type, size_t offset, size_t len) {
+    if (out->count > 0) {
+        Token *prev = &out->tokens[out->count - 1];
+        if (prev->type == type || is_blank(text + prev->offset, prev->len)) {
+            prev->type = type;
+            prev->len += len;
+            return;
+        }
+    }
+    if (out->count == out->capacity) {
+        out->capacity = out->capacity ? out->capacity * 2 : 16;
+        out->tokens = xrealloc(out->tokens, out->capacity * sizeof(Token));
+    }
+    out->tokens[out->count++] = (Token) { type, offset, len };
+}
+
+static bool is_escaped(const char *text, size_t idx, char esc) {
+    size_t count = 0;
+    while (idx > 0 && text[idx - 1] == esc) {
+        count++;
+        idx--;
+    }
+    return count % 2 == 1;
+}
+
+// text:find(close, offset) skipping escaped matches; `e` is exclusive.
+static bool find_close(MatchState *ms, Pattern *p, size_t offset, size_t *s, size_t *e) {
+    const char *text = ms->src_init;
+    size_t len = ms->src_end - text;
+    const char *pat = p->close;
+    bool anchor = (*pat == '^');
+    if (anchor) { pat++; }
+    ms->p_end = p->close_end;
+
+    while (offset <= len) {
+        const char *res = NULL;
+        size_t i = offset;
+        for (;;) {
+            bool try = (i < len) ? has_byte(p->close_first, text[i]) : p->close_nullable;
+            if (try || anchor) {
+                ms->level = 0;
+                res = match(ms, text + i, pat);
+                if (res) { break; }
+            }
+            if (anchor || i++ >= len) { break; }
+        }
+        if (!res) { return false; }
+        if (p->escape && is_escaped(text, i, p->escape)) {
+            // an escaped empty match would make lite's loop spin forever
+            offset = MAX((size_t)(res - text), i + 1);
+            continue;
+        }
+        *s = i;
+        *e = res - text;
+        return true;
+    }
+    return false;
+}
+
+int tokenizer_tokenize(Tokenizer *tk, const char *text, size_t len, int state,
+                       TokenList *out, const char **error) {
+    out->count = 0;
+    if (tk->count == 0) {
+        push_token(out, text, 0, 0, len);
+        return 0;
+    }
+
+    jmp_buf jmp;
+    MatchState ms;
+    ms.matchdepth = MAX_CALLS;
+    ms.src_init = text;
+    ms.src_end = text + len;
+    ms.jmp = &jmp;
+    ms.error = error;
+    if (setjmp(jmp)) { return -1; }
+
+    if (state < 0 || state > tk->count || (state > 0 && !tk->patterns[state - 1].close)) { state = 0; }
+
+    size_t i = 0;
+    while (i < len) {
+        // continue trying to match the end pattern of a pair if we have a state set
+        if (state) {
+            Pattern *p = &tk->patterns[state - 1];
+            size_t s, e;
+            if (find_close(&ms, p, i, &s, &e)) {
+                push_token(out, text, p->type, i, e - i);
+                state = 0;
+                i = e;
+            } else {
+                push_token(out, text, p->type, i, len - i);
+                break;
+            }
+        }
+
+        // find matching pattern, at the end of the text any pattern may
+        // still match the empty string
+        int to = tk->count;
+        const int *candidates = NULL;
+        if (i < len) {
+            unsigned char c = text[i];
+            candidates = &tk->candidates[tk->first[c]];
+            to = tk->first[c + 1] - tk->first[c];
+        }
+        bool matched = false;
+        for (int k = 0; k < to; k++) {
+            int n = candidates ? candidates[k] : k;
+            Pattern *p = &tk->patterns[n];
+            ms.p_end = p->open_end;
+            ms.level = 0;
+            const char *res = match(&ms, text + i, p->open);
+            if (res) {
+                size_t e = res - text;
+                push_token(out, text, symbol_type(tk, text + i, e - i, p->type), i, e - i);
+                if (p->close) { state = n + 1; }
+                i = e;
+                matched = true;
+                break;
+            }
+        }
+
+        // consume character if we didn't match
+        if (!matched) {
+            push_token(out, text, 0, i, (i < len) ? 1 : 0);
+            i++;
+        }
+    }
+
+    return state;
+}
+
+void tokenizer_get_first_bytes(const char *pattern, unsigned char *set) {
+    memset(set, 0, 32);
+    if (*pattern == '^') { pattern++; }
+    if (first_bytes(pattern, pattern + strlen(pattern), set)) {
+        memset(set, 0xff, 32);
+    }
+}
+
+bool tokenizer_match_pattern(const char *pattern, const unsigned char *first,
+                             const char *text, size_t len, size_t init,
+                             size_t *s, size_t *e, const char **error) {
+    bool anchor = (*pattern == '^');
+    const char *p = anchor ? pattern + 1 : pattern;
+    jmp_buf jmp;
+    MatchState ms;
+    ms.src_init = text;
+    ms.src_end = text + len;
+    ms.p_end = p + strlen(p);
+    ms.jmp = &jmp;
+    ms.error = error;
+    *error = NULL;
+    if (setjmp(jmp)) { return false; }
+
+    for (size_t i = init; i <= len; i++) {
+        if (first && !anchor && i < len && !has_byte(first, text[i])) { continue; }
+        ms.matchdepth = MAX_CALLS;
+        ms.level = 0;
+        const char *res = match(&ms, text + i, p);
+        if (res) {
+            *s = i;
+            *e = res - text;
+            return true;
+        }
+        if (anchor) { break; }
+    }
+    return false;
+}
+
+bool tokenizer_find_pattern(const char *pattern, const char *text, size_t len, const char **error) {
+    size_t s, e;
+    return tokenizer_match_pattern(pattern, NULL, text, len, 0, &s, &e, error);
+}
@@ -0,0 +1,68 @@
+// Syntax tokenizer. A Tokenizer holds the patterns of one syntax,
+// compiled once, and produces the same token stream and state as the
+// original Lua tokenizer of lite. Patterns use the Lua pattern syntax,
+// the matcher is the one from lstrlib.c without the Lua state, so it
+// can also run outside of the main thread.
+
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct Tokenizer Tokenizer;
+
+typedef struct
+{
+    const char *open;
+    size_t open_len;
+    // end pattern of a start/end pair, NULL for single patterns
+    const char *close;
+    size_t close_len;
+    char escape;
+    int type;
+} TokenizerPattern;
+
+typedef struct
+{
+    int type;
+    size_t offset;
+    size_t len;
+} Token;
+
+typedef struct
+{
+    Token *tokens;
+    int count;
+    int capacity;
+} TokenList;
+
+// Type 0 is the "normal" type, used for the text no pattern matched.
+// Tokenizers are reference counted so background jobs can keep using
+// them, tokenizer_free drops a reference.
+Tokenizer* tokenizer_new(const TokenizerPattern *patterns, int count);
+Tokenizer* tokenizer_retain(Tokenizer *tk);
+void tokenizer_free(Tokenizer *tk);
+void tokenizer_add_symbol(Tokenizer *tk, const char *text, size_t len, int type);
+
+// `text` must be followed by a '\0', like Lua strings are, and `state`
+// is 0 or the 1-based index of the pair whose end is being looked for.
+// Returns the state for the next line, or -1 with `error` set when a
+// pattern is malformed. Symbols must not be added while tokenizing.
+int tokenizer_tokenize(Tokenizer *tk, const char *text, size_t len, int state,
+                       TokenList *out, const char **error);
+
+// Same as string.find(text, pattern) ~= nil, for the code that needs
+// Lua patterns off the main thread. Malformed patterns match nothing.
+bool tokenizer_find_pattern(const char *pattern, const char *text, size_t len, const char **error);
+// Fills the 32 bytes bitset `set` with the bytes a match of the pattern
+// can start with, all of them if it can match the empty string.
+void tokenizer_get_first_bytes(const char *pattern, unsigned char *set);
+// Same as string.find(text, pattern, init + 1), the match going from
+// `s` to `e - 1`. Only the positions holding a byte of `first`, the
+// pattern's first bytes or NULL, are tried.
+bool tokenizer_match_pattern(const char *pattern, const unsigned char *first,
+                             const char *text, size_t len, size_t init,
+                             size_t *s, size_t *e, const char **error);
+
+#endif
@@ -0,0 +1,309 @@
+#include "undo.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// The dead text at the start of the spill file is dropped once there is
+// at least this much of it, and as much as live text after it.
+#define SPILL_COMPACT_MIN (64 * 1024)
+
+typedef struct
+{
+    UndoRecord record;
+    // offset of the text in the spill file, -1 while it is in memory
+    long offset;
+    // set by undo_set_change_id(), the record then stays as it is
+    bool sealed;
+} Entry;
+
+struct UndoStack
+{
+    // ring of the records, oldest first from `head`
+    Entry *entries;
+    int head;
+    int count;
+    int capacity;
+    int max_records;
+
+    size_t memory;
+    size_t memory_limit;
+    double merge_timeout;
+
+    // the records before it have their text in the spill file, from
+    // `spill_start`, the text of the records dropped is before it
+    int spilled;
+    FILE *spill;
+    long spill_start;
+    long spill_size;
+    bool spill_failed;
+};
+
+static unsigned last_change_id;
+
+static unsigned new_change_id(void) {
+    if (++last_change_id == 0) { last_change_id = 1; }
+    return last_change_id;
+}
+
+static Entry* get_entry(UndoStack *stack, int i) {
+    return &stack->entries[(stack->head + i) % stack->capacity];
+}
+
+UndoStack* undo_new(int max_records, size_t memory_limit, double merge_timeout) {
+    UndoStack *stack = xrealloc(NULL, sizeof(UndoStack));
+    memset(stack, 0, sizeof(UndoStack));
+    // an edit pushes its selection and itself
+    stack->max_records = max_records < 2 ? 2 : max_records;
+    stack->memory_limit = memory_limit;
+    stack->merge_timeout = merge_timeout;
+    return stack;
+}
+
+void undo_clear(UndoStack *stack) {
+    for (int i = 0; i < stack->count; i++) {
+        free(get_entry(stack, i)->record.text);
+    }
+    stack->head = 0;
+    stack->count = 0;
+    stack->memory = 0;
+    stack->spilled = 0;
+    stack->spill_start = 0;
+    stack->spill_size = 0;
+}
+
+void undo_free(UndoStack *stack) {
+    undo_clear(stack);
+    if (stack->spill) { fclose(stack->spill); }
+    free(stack->entries);
+    free(stack);
+}
+
+static void truncate_spill(UndoStack *stack, long size) {
+    fflush(stack->spill);
+#ifdef _WIN32
+    (void)_chsize(_fileno(stack->spill), size);
+#else
+    (void)ftruncate(fileno(stack->spill), size);
+#endif
+}
+
+// Moves the live text to the start of the spill file. It's only done once
+// the dead text is larger, so the copy never overwrites live text, and
+// the file stays within twice the text it keeps.
+static void compact_spill(UndoStack *stack) {
+    long dead = stack->spill_start;
+    long live = stack->spill_size - stack->spill_start;
+    if (dead < SPILL_COMPACT_MIN || dead < live) { return; }
+    char buf[16 * 1024];
+    for (long done = 0; done < live;) {
+        size_t n = live - done < (long)sizeof(buf) ? (size_t)(live - done) : sizeof(buf);
+        if (fseek(stack->spill, dead + done, SEEK_SET) != 0
+            || fread(buf, 1, n, stack->spill) != n
+            || fseek(stack->spill, done, SEEK_SET) != 0
+            || fwrite(buf, 1, n, stack->spill) != n) {
+            // only dead text was written over, it stays as it was
+            return;
+        }
+        done += (long)n;
+    }
+    for (int i = 0; i < stack->spilled; i++) {
+        Entry *e = get_entry(stack, i);
+        if (e->offset >= 0) { e->offset -= dead; }
+    }
+    stack->spill_start = 0;
+    stack->spill_size = live;
+    truncate_spill(stack, live);
+}
+
+static void drop_oldest(UndoStack *stack) {
+    Entry *e = get_entry(stack, 0);
+    if (e->record.text) {
+        stack->memory -= e->record.len;
+        free(e->record.text);
+    }
+    // the records' text is in the file in their order, the next one's
+    // starts where this one's ends
+    if (e->offset >= 0) { stack->spill_start = e->offset + (long)e->record.len; }
+    stack->head = (stack->head + 1) % stack->capacity;
+    stack->count--;
+    if (stack->spilled > 0) { stack->spilled--; }
+    if (!stack->spill) { return; }
+    if (stack->spill_start == stack->spill_size) {
+        // nothing left in the file, write it over from the start
+        if (stack->spill_size > 0) { truncate_spill(stack, 0); }
+        stack->spill_start = 0;
+        stack->spill_size = 0;
+    } else {
+        compact_spill(stack);
+    }
+}
+
+static bool spill_text(UndoStack *stack, Entry *e) {
+    if (!stack->spill) {
+        if (stack->spill_failed) { return false; }
+        stack->spill = tmpfile();
+        if (!stack->spill) {
+            stack->spill_failed = true;
+            return false;
+        }
+    }
+    UndoRecord *r = &e->record;
+    if (fseek(stack->spill, stack->spill_size, SEEK_SET) != 0
+        || fwrite(r->text, 1, r->len, stack->spill) != r->len) {
+        return false;
+    }
+    e->offset = stack->spill_size;
+    stack->spill_size += (long)r->len;
+    stack->memory -= r->len;
+    free(r->text);
+    r->text = NULL;
+    return true;
+}
+
+// Moves the text of the oldest records to the spill file until the rest
+// fits in the budget. Without a spill file the oldest records are dropped.
+static void enforce_budget(UndoStack *stack) {
+    while (stack->memory > stack->memory_limit && stack->spilled < stack->count) {
+        Entry *e = get_entry(stack, stack->spilled);
+        if (e->record.text && !spill_text(stack, e)) { break; }
+        stack->spilled++;
+    }
+    while (stack->memory > stack->memory_limit && stack->count > 0) {
+        drop_oldest(stack);
+    }
+}
+
+// Merges the record in the last one when it continues it: a character
+// typed after the text the last one removes, or deleted next to the text
+// the last one inserts back. The selection pushed between them goes, the
+// one before the last record is the one undoing both restores anyway.
+static bool merge(UndoStack *stack, const UndoRecord *r) {
+    if (stack->count < 2) { return false; }
+    Entry *sel = get_entry(stack, stack->count - 1);
+    Entry *last = get_entry(stack, stack->count - 2);
+    UndoRecord *l = &last->record;
+    if (last->sealed || sel->record.type != UNDO_SELECTION || l->type != r->type) { return false; }
+    if (fabs(r->time - l->end_time) >= stack->merge_timeout) { return false; }
+
+    if (r->type == UNDO_REMOVE) {
+        if (r->line1 != l->line2 || r->col1 != l->col2) { return false; }
+        l->line2 = r->line2;
+        l->col2 = r->col2;
+
+    } else if (r->type == UNDO_INSERT) {
+        if (!l->text || r->line1 != l->line1) { return false; }
+        bool backspace = !memchr(r->text, '\n', r->len) && r->col1 + (int)r->len == l->col1;
+        bool forward = r->col1 == l->col1;
+        if (!backspace && !forward) { return false; }
+        l->text = xrealloc(l->text, l->len + r->len);
+        if (backspace) {
+            memmove(l->text + r->len, l->text, l->len);
+            memcpy(l->text, r->text, r->len);
+            l->col1 = r->col1;
+        } else {
+            memcpy(l->text + l->len, r->text, r->len);
+        }
+        l->len += r->len;
+        stack->memory += r->len;
+
+    } else {
+        return false;
+    }
+
+    l->end_time = r->time;
+    l->change_id = new_change_id();
+    stack->count--;
+    if (stack->spilled > stack->count) { stack->spilled = stack->count; }
+    return true;
+}
+
+static void grow(UndoStack *stack) {
+    int capacity = stack->capacity ? stack->capacity * 2 : 64;
+    if (capacity > stack->max_records) { capacity = stack->max_records; }
+    Entry *entries = xrealloc(NULL, capacity * sizeof(Entry));
+    for (int i = 0; i < stack->count; i++) {
+        entries[i] = *get_entry(stack, i);
+    }
+    free(stack->entries);
+    stack->entries = entries;
+    stack->capacity = capacity;
+    stack->head = 0;
+}
+
+void undo_push(UndoStack *stack, const UndoRecord *record) {
+    if (!merge(stack, record)) {
+        if (stack->count == stack->max_records) { drop_oldest(stack); }
+        if (stack->count == stack->capacity) { grow(stack); }
+        Entry *e = get_entry(stack, stack->count++);
+        e->record = *record;
+        e->record.end_time = record->time;
+        e->record.change_id = new_change_id();
+        e->offset = -1;
+        e->sealed = false;
+        if (record->type == UNDO_INSERT) {
+            e->record.text = memcpy(xrealloc(NULL, record->len ? record->len : 1), record->text, record->len);
+            stack->memory += record->len;
+        } else {
+            e->record.text = NULL;
+            e->record.len = 0;
+        }
+    }
+    enforce_budget(stack);
+}
+
+bool undo_pop(UndoStack *stack, UndoRecord *out) {
+    if (stack->count == 0) { return false; }
+    Entry *e = get_entry(stack, stack->count - 1);
+    *out = e->record;
+    if (out->text) {
+        stack->memory -= out->len;
+    } else if (e->offset >= 0) {
+        out->text = xrealloc(NULL, out->len ? out->len : 1);
+        if (fseek(stack->spill, e->offset, SEEK_SET) != 0
+            || fread(out->text, 1, out->len, stack->spill) != out->len) {
+            // the history is lost from there on
+            fprintf(stderr, "Error: could not read the undo history back\n");
+            free(out->text);
+            undo_clear(stack);
+            return false;
+        }
+        stack->spill_size = e->offset;
+        if (stack->spill_size == stack->spill_start) {
+            stack->spill_start = 0;
+            stack->spill_size = 0;
+        }
+    }
+    stack->count--;
+    if (stack->spilled > stack->count) { stack->spilled = stack->count; }
+    return true;
+}
+
+double undo_get_end_time(UndoStack *stack) {
+    return stack->count ? get_entry(stack, stack->count - 1)->record.end_time : -1;
+}
+
+unsigned undo_get_change_id(UndoStack *stack) {
+    return stack->count ? get_entry(stack, stack->count - 1)->record.change_id : 0;
+}
+
+void undo_set_change_id(UndoStack *stack, unsigned change_id) {
+    if (stack->count == 0) { return; }
+    Entry *e = get_entry(stack, stack->count - 1);
+    e->record.change_id = change_id;
+    e->sealed = true;
+}
+
+void undo_get_stats(UndoStack *stack, int *records, size_t *memory, size_t *spilled) {
+    *records = stack->count;
+    *memory = stack->memory;
+    *spilled = (size_t)(stack->spill_size - stack->spill_start);
+}
@@ -0,0 +1,59 @@
+// Undo journal of a Doc. Each record is one undo step: text to insert
+// back, a range to remove, or a selection to restore. Only inserts hold
+// text, the removed text of the edit they undo. Typing and deleting one
+// character at a time within the merge timeout extend the last record
+// rather than adding one. The text of the records is kept in memory up
+// to a byte budget; past it, the oldest is written to a temp file and
+// read back when its record is undone.
+
+#ifndef UNDO_H
+#define UNDO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum
+{
+    UNDO_INSERT,
+    UNDO_REMOVE,
+    UNDO_SELECTION,
+} UndoType;
+
+typedef struct
+{
+    UndoType type;
+    // time of the first and last edits merged in the record
+    double time, end_time;
+    // insert: line, col; remove and selection: line1, col1, line2, col2
+    int line1, col1, line2, col2;
+    unsigned change_id;
+    // insert only, allocated by undo_pop(), to be freed by the caller
+    char *text;
+    size_t len;
+} UndoRecord;
+
+typedef struct UndoStack UndoStack;
+
+// Keeps at most `max_records` records and `memory_limit` bytes of text
+// in memory, records within `merge_timeout` seconds may be merged.
+UndoStack* undo_new(int max_records, size_t memory_limit, double merge_timeout);
+void undo_free(UndoStack *stack);
+void undo_clear(UndoStack *stack);
+
+// Pushes a copy of the record, its `change_id` is set by the stack.
+void undo_push(UndoStack *stack, const UndoRecord *record);
+// Pops the last record into `out`, returns false if there is none.
+bool undo_pop(UndoStack *stack, UndoRecord *out);
+// Time of the last edit of the last record, negative if there is none.
+double undo_get_end_time(UndoStack *stack);
+
+// Id of the last record, it changes with every push and comes back to
+// what it was when the records after it are popped. 0 when empty.
+unsigned undo_get_change_id(UndoStack *stack);
+// Gives the last record the id of the one it undoes or redoes, the record
+// is then never merged with the next.
+void undo_set_change_id(UndoStack *stack, unsigned change_id);
+
+void undo_get_stats(UndoStack *stack, int *records, size_t *memory, size_t *spilled);
+
+#endif
@@ -0,0 +1,39 @@
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+void* xrealloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size ? size : 1);
+    if (!ptr) {
+        fprintf(stderr, "Fatal error: out of memory\n");
+        abort();
+    }
+    return ptr;
+}
+
+char* xstrdup(const char *text) {
+    size_t len = strlen(text);
+    return memcpy(xrealloc(NULL, len + 1), text, len + 1);
+}
+
+double time_now(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+    if (freq.QuadPart == 0) { QueryPerformanceFrequency(&freq); }
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+    // monotonic wall time, clock() stops counting while the main loop sleeps
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
@@ -0,0 +1,18 @@
+// Helpers shared by the native engines and the api.
+
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stddef.h>
+
+// realloc that aborts on failure, a `size` of 0 still returns a valid
+// block rather than freeing `ptr`. Neither returns NULL, running out of
+// memory aborts.
+void* xrealloc(void *ptr, size_t size);
+char* xstrdup(const char *text);
+
+// Seconds on a monotonic clock, the loop, its timers and the profiler
+// all read this one.
+double time_now(void);
+
+#endif
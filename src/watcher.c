@@ -0,0 +1,253 @@
+#include "watcher.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#endif
+
+typedef struct
+{
+    char *path;
+    char *dir;
+    // points in `path`
+    const char *name;
+    int refs;
+    bool changed;
+#ifdef __linux__
+    int wd;
+#endif
+    double modified;
+    double size;
+} File;
+
+struct Watcher
+{
+    File *files;
+    int count;
+    int capacity;
+#ifdef __linux__
+    int inotify;
+    bool watched;
+    Watcher *next;
+#endif
+};
+
+#ifdef __linux__
+static Watcher *watchers;
+#endif
+
+static void stat_file(File *f, double *modified, double *size) {
+    struct stat st;
+    if (stat(f->path, &st) < 0) {
+        *modified = *size = -1;
+        return;
+    }
+    *modified = st.st_mtime;
+    *size = st.st_size;
+}
+
+Watcher* watcher_new(void) {
+    Watcher *w = xrealloc(NULL, sizeof(Watcher));
+    memset(w, 0, sizeof(Watcher));
+#ifdef __linux__
+    w->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    w->next = watchers;
+    watchers = w;
+#endif
+    return w;
+}
+
+void watcher_free(Watcher *w) {
+#ifdef __linux__
+    Watcher **link = &watchers;
+    while (*link != w) { link = &(*link)->next; }
+    *link = w->next;
+    if (w->inotify >= 0) { close(w->inotify); }
+#endif
+    for (int i = 0; i < w->count; i++) {
+        free(w->files[i].path);
+        free(w->files[i].dir);
+    }
+    free(w->files);
+    free(w);
+}
+
+bool watcher_is_native(Watcher *w) {
+#ifdef __linux__
+    return w->inotify >= 0;
+#else
+    (void)w;
+    return false;
+#endif
+}
+
+static int find_file(Watcher *w, const char *path) {
+    for (int i = 0; i < w->count; i++) {
+        if (strcmp(w->files[i].path, path) == 0) { return i; }
+    }
+    return -1;
+}
+
+#ifdef __linux__
+// Files of the same directory share its watch descriptor.
+static void add_watch(Watcher *w, File *f) {
+    f->wd = w->inotify < 0 ? -1 : inotify_add_watch(w->inotify, f->dir, WATCH_MASK);
+}
+#endif
+
+void watcher_add(Watcher *w, const char *path) {
+    int i = find_file(w, path);
+    if (i >= 0) {
+        w->files[i].refs++;
+        return;
+    }
+    if (w->count == w->capacity) {
+        w->capacity = w->capacity ? w->capacity * 2 : 16;
+        w->files = xrealloc(w->files, w->capacity * sizeof(File));
+    }
+    File *f = &w->files[w->count++];
+    memset(f, 0, sizeof(File));
+    f->path = xstrdup(path);
+    const char *sep = strrchr(path, '/');
+#ifdef _WIN32
+    const char *bsep = strrchr(path, '\\');
+    if (bsep > sep) { sep = bsep; }
+#endif
+    if (sep) {
+        f->dir = xrealloc(NULL, sep - path + 2);
+        // the root directory keeps its separator
+        size_t len = sep == path ? 1 : (size_t)(sep - path);
+        memcpy(f->dir, path, len);
+        f->dir[len] = '\0';
+        f->name = f->path + (sep - path) + 1;
+    } else {
+        f->dir = xstrdup(".");
+        f->name = f->path;
+    }
+    f->refs = 1;
+    stat_file(f, &f->modified, &f->size);
+#ifdef __linux__
+    add_watch(w, f);
+#endif
+}
+
+void watcher_remove(Watcher *w, const char *path) {
+    int i = find_file(w, path);
+    if (i < 0 || --w->files[i].refs > 0) { return; }
+    File *f = &w->files[i];
+#ifdef __linux__
+    bool shared = false;
+    for (int j = 0; j < w->count; j++) {
+        shared = shared || (j != i && w->files[j].wd == f->wd);
+    }
+    if (f->wd >= 0 && !shared) { inotify_rm_watch(w->inotify, f->wd); }
+#endif
+    free(f->path);
+    free(f->dir);
+    w->files[i] = w->files[--w->count];
+}
+
+#ifdef __linux__
+static void mark_changed(Watcher *w, int wd, const char *name) {
+    for (int i = 0; i < w->count; i++) {
+        File *f = &w->files[i];
+        if (f->wd == wd && (!name || strcmp(f->name, name) == 0)) {
+            f->changed = true;
+        }
+    }
+}
+
+static void read_events(Watcher *w) {
+    char buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(w->inotify, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { break; }
+        for (char *p = buf; p < buf + n;) {
+            struct inotify_event *ev = (struct inotify_event*)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                for (int i = 0; i < w->count; i++) { w->files[i].changed = true; }
+            } else if (ev->mask & IN_IGNORED) {
+                // the directory is gone, its files are checked and
+                // watched again once it's back
+                mark_changed(w, ev->wd, NULL);
+                for (int i = 0; i < w->count; i++) {
+                    if (w->files[i].wd == ev->wd) { w->files[i].wd = -1; }
+                }
+            } else if (ev->len > 0) {
+                mark_changed(w, ev->wd, ev->name);
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    for (int i = 0; i < w->count; i++) {
+        if (w->files[i].wd < 0) { add_watch(w, &w->files[i]); }
+    }
+}
+#endif
+
+int watcher_poll(Watcher *w, const char **out, int max) {
+#ifdef __linux__
+    if (w->inotify >= 0) {
+        read_events(w);
+        w->watched = false;
+    } else
+#endif
+    {
+        for (int i = 0; i < w->count; i++) {
+            File *f = &w->files[i];
+            double modified, size;
+            stat_file(f, &modified, &size);
+            if (modified != f->modified || size != f->size) {
+                f->modified = modified;
+                f->size = size;
+                f->changed = true;
+            }
+        }
+    }
+
+    int count = 0;
+    for (int i = 0; i < w->count && count < max; i++) {
+        if (w->files[i].changed) {
+            w->files[i].changed = false;
+            out[count++] = w->files[i].path;
+        }
+    }
+    return count;
+}
+
+bool watcher_ready(Watcher *w) {
+#ifdef __linux__
+    if (w->inotify < 0) { return true; }
+    struct pollfd fd = { .fd = w->inotify, .events = POLLIN };
+    bool ready = poll(&fd, 1, 0) > 0;
+    for (int i = 0; i < w->count && !ready; i++) {
+        ready = w->files[i].changed;
+    }
+    w->watched = !ready;
+    return ready;
+#else
+    (void)w;
+    return true;
+#endif
+}
+
+#ifdef __linux__
+int watcher_get_watched(int *fds, int max) {
+    int count = 0;
+    for (Watcher *w = watchers; w && count < max; w = w->next) {
+        if (w->watched) { fds[count++] = w->inotify; }
+    }
+    return count;
+}
+#endif
@@ -0,0 +1,38 @@
+// Watches a set of files for changes. On Linux it's an inotify watch on
+// the directory of each file, so files replaced by a rename are followed
+// too, and watcher_ready() tells if there are events without reading
+// them. The watchers waited on by watcher_ready() are reported by
+// watcher_get_watched(), so the main loop can sleep until a file
+// changes. Elsewhere watcher_poll() compares the modified time and size
+// of every file with the ones it saw last.
+
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <stdbool.h>
+
+typedef struct Watcher Watcher;
+
+Watcher* watcher_new(void);
+void watcher_free(Watcher *w);
+// False when files are only checked by watcher_poll().
+bool watcher_is_native(Watcher *w);
+
+// Files are counted, a file added twice must be removed twice.
+void watcher_add(Watcher *w, const char *path);
+void watcher_remove(Watcher *w, const char *path);
+
+// Fills `out` with up to `max` files that changed since the last poll
+// and returns how many there are. The strings are valid until the file
+// is removed.
+int watcher_poll(Watcher *w, const char **out, int max);
+// True when there are events to poll. Until then the watcher is watched.
+bool watcher_ready(Watcher *w);
+
+#ifdef __linux__
+// Fills `fds` with the inotify descriptors of the watched watchers,
+// returns how many there are.
+int watcher_get_watched(int *fds, int max);
+#endif
+
+#endif
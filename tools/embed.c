@@ -0,0 +1,131 @@
+// Compiles Lua sources to bytecode and writes them out as a C file
+// defining the table of src/embedded.h. Run by the Makefile from the
+// root of the repository:
+//
+//     embed src/embedded_modules.c data/core/init.lua data/plugins/macro.lua ...
+//
+// Module names are the paths under data/ as require sees them, so
+// data/core/doc/init.lua is core.doc. The bytecode keeps its debug
+// info, errors and tracebacks point at the source files.
+
+#include "../src/util.h"
+
+#include <lua/lua.h>
+#include <lua/lauxlib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    char *name;
+    const char *filename;
+} Module;
+
+typedef struct
+{
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+} Dump;
+
+// data/core/doc/init.lua -> core.doc
+static char* module_name(const char *filename) {
+    const char *prefix = "data/";
+    size_t len = strlen(filename);
+    if (strncmp(filename, prefix, strlen(prefix)) != 0 || len < 4 || strcmp(filename + len - 4, ".lua") != 0) {
+        fprintf(stderr, "embed: %s is not a Lua file under %s\n", filename, prefix);
+        exit(1);
+    }
+    filename += strlen(prefix);
+    len -= strlen(prefix) + 4;
+    if (len > 5 && strncmp(filename + len - 5, "/init", 5) == 0) { len -= 5; }
+    char *name = xrealloc(NULL, len + 1);
+    for (size_t i = 0; i < len; i++) {
+        name[i] = filename[i] == '/' || filename[i] == '\\' ? '.' : filename[i];
+    }
+    name[len] = '\0';
+    return name;
+}
+
+static int compare_modules(const void *a, const void *b) {
+    return strcmp(((const Module*)a)->name, ((const Module*)b)->name);
+}
+
+static int writer(lua_State *L, const void *p, size_t size, void *ud) {
+    (void)L;
+    Dump *dump = ud;
+    if (dump->size + size > dump->capacity) {
+        dump->capacity = (dump->size + size) * 2;
+        dump->data = xrealloc(dump->data, dump->capacity);
+    }
+    memcpy(dump->data + dump->size, p, size);
+    dump->size += size;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: embed OUT.c FILE.lua...\n");
+        return 1;
+    }
+    int count = argc - 2;
+    Module *modules = xrealloc(NULL, count * sizeof(Module));
+    for (int i = 0; i < count; i++) {
+        modules[i].filename = argv[i + 2];
+        modules[i].name = module_name(argv[i + 2]);
+    }
+    qsort(modules, count, sizeof(Module), compare_modules);
+    for (int i = 1; i < count; i++) {
+        if (strcmp(modules[i - 1].name, modules[i].name) == 0) {
+            fprintf(stderr, "embed: %s and %s are both module %s\n",
+                    modules[i - 1].filename, modules[i].filename, modules[i].name);
+            return 1;
+        }
+    }
+
+    FILE *fp = fopen(argv[1], "w");
+    if (!fp) {
+        fprintf(stderr, "embed: can't write %s\n", argv[1]);
+        return 1;
+    }
+    fprintf(fp, "// Generated by tools/embed.c from the Lua sources, do not edit.\n\n");
+    fprintf(fp, "#include \"embedded.h\"\n\n");
+
+    lua_State *L = luaL_newstate();
+    Dump dump = { NULL, 0, 0 };
+    for (int i = 0; i < count; i++) {
+        if (luaL_loadfile(L, modules[i].filename) != LUA_OK) {
+            fprintf(stderr, "embed: %s\n", lua_tostring(L, -1));
+            fclose(fp);
+            remove(argv[1]);
+            return 1;
+        }
+        dump.size = 0;
+        lua_dump(L, writer, &dump);
+        lua_pop(L, 1);
+
+        fprintf(fp, "static const unsigned char module_%d[] = {", i);
+        for (size_t j = 0; j < dump.size; j++) {
+            fprintf(fp, "%s%u,", j % 20 == 0 ? "\n    " : "", dump.data[j]);
+        }
+        fprintf(fp, "\n};\n\n");
+    }
+    lua_close(L);
+
+    fprintf(fp, "const EmbeddedModule embedded_modules[] = {\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(fp, "    { \"%s\", \"%s\", module_%d, sizeof(module_%d) },\n",
+                modules[i].name, modules[i].filename, i, i);
+    }
+    if (count == 0) { fprintf(fp, "    { 0 },\n"); }
+    fprintf(fp, "};\n\n");
+    fprintf(fp, "const int embedded_modules_count = %d;\n", count);
+    fclose(fp);
+
+    for (int i = 0; i < count; i++) { free(modules[i].name); }
+    free(modules);
+    free(dump.data);
+    return 0;
+}